@@ -21,6 +21,7 @@
 #include "logging.h"
 #include "psiclient.h"
 #include "authenticated_data_package.h"
+#include "signed_data_package.h"
 #include "embeddedvalues.h"
 #include "utilities.h"
 
@@ -28,178 +29,201 @@
 #pragma warning(disable: 4244)
 #include "cryptlib.h"
 #include "rsa.h"
-#include "base64.h"
-#include "gzip.h"
-#include "zlib.h"
 #pragma warning(pop)
 
 
-// signedDataPackage may be binary, so we also need the length.
-bool verifySignedDataPackage(
-    const char* signaturePublicKey,
-    const char* signedDataPackage,
-    const size_t signedDataPackageLen,
-    bool gzipped,
-    string& authenticDataPackage)
+bool LinesDataPackageSink::Write(const char* data, size_t length)
 {
-    const int SANITY_CHECK_SIZE = 100 * 1024 * 1024;
-
-    authenticDataPackage.clear();
+    const char* end = data + length;
 
-    string jsonString;
-
-    // The package is compressed with either gzip or zip.
-    if (gzipped)
+    while (data < end)
     {
-        // See https://www.cryptopp.com/wiki/Gunzip#Decompress_to_String_using_Put.2FGet
-        CryptoPP::Gunzip unzipper;
-        try {
-            (void)unzipper.Put((const byte*)signedDataPackage, signedDataPackageLen);
-            (void)unzipper.MessageEnd();
-
-            auto jsonSize = unzipper.MaxRetrievable();
-            if (jsonSize == 0)
-            {
-                my_print(NOT_SENSITIVE, false, _T("%s: unzipper.MaxRetrievable returned 0 (%d)"), __TFUNCTION__, GetLastError());
-                return false;
-            }
-            else if (jsonSize > SANITY_CHECK_SIZE)
-            {
-                my_print(NOT_SENSITIVE, false, _T("%s: Gunzip overflow (%d)"), __TFUNCTION__, GetLastError());
-                return false;
-            }
-
-            jsonString.resize((size_t)jsonSize);
-
-            unzipper.Get((byte*)&jsonString[0], jsonString.size());
+        const char* newline = (const char*)memchr(data, '\n', end - data);
+        if (!newline)
+        {
+            m_partialLine.append(data, end);
+            break;
         }
-        catch (exception& e) {
-            my_print(NOT_SENSITIVE, false, _T("%s: Gunzip exception: %S"), __TFUNCTION__, e.what());
-            return false;
+
+        if (!m_partialLine.empty())
+        {
+            m_partialLine.append(data, newline);
+            m_lines.push_back(string());
+            m_lines.back().swap(m_partialLine);
         }
-    }
-    else // zip compressed
-    {
-        const int CHUNK_SIZE = 1024;
-        int ret;
-        z_stream stream;
-        char out[CHUNK_SIZE + 1];
-
-        stream.zalloc = Z_NULL;
-        stream.zfree = Z_NULL;
-        stream.opaque = Z_NULL;
-        stream.avail_in = signedDataPackageLen;
-        stream.next_in = (unsigned char*)signedDataPackage;
-
-        if (Z_OK != inflateInit(&stream))
+        else if (newline > data)
         {
-            my_print(NOT_SENSITIVE, false, _T("%s: inflateInit failed (%d)"), __TFUNCTION__, GetLastError());
-            return false;
+            m_lines.push_back(string(data, newline));
         }
 
-        auto cleanup = finally([&]() { inflateEnd(&stream); });
-
-        do
-        {
-            stream.avail_out = CHUNK_SIZE;
-            stream.next_out = (unsigned char*)out;
-            ret = inflate(&stream, Z_NO_FLUSH);
-            if (ret != Z_OK && ret != Z_STREAM_END)
-            {
-                my_print(NOT_SENSITIVE, false, _T("%s: inflate failed (%d)"), __TFUNCTION__, GetLastError());
-                return false;
-            }
-
-            out[CHUNK_SIZE - stream.avail_out] = '\0';
-
-            jsonString += out;
-
-            if (jsonString.length() > SANITY_CHECK_SIZE)
-            {
-                my_print(NOT_SENSITIVE, false, _T("%s: inflate overflow (%d)"), __TFUNCTION__, GetLastError());
-                return false;
-            }
-
-        } while (ret != Z_STREAM_END);
+        data = newline + 1;
     }
 
-    // Read the values out of the JSON-formatted jsonData
-    // See psi_ops_server_entry_auth.py for details
+    return true;
+}
 
-    Json::Value json_entry;
-    Json::Reader reader;
-    bool parsingSuccessful = reader.parse(jsonString, json_entry);
-    if (!parsingSuccessful)
+bool LinesDataPackageSink::End()
+{
+    if (!m_partialLine.empty())
     {
-        string fail = reader.getFormattedErrorMessages();
-        my_print(NOT_SENSITIVE, false, _T("%s: JSON parse failed: %S"), __TFUNCTION__, fail.c_str());
-        return false;
+        m_lines.push_back(string());
+        m_lines.back().swap(m_partialLine);
     }
+    return true;
+}
 
-    string data;
-    string base64Signature;
-    string signingPublicKeyDigest;
 
-    try
+// Passes the data on to the real sink and to the signature verifier.
+class VerifyingDataPackageSink : public IDataPackageSink
+{
+public:
+    VerifyingDataPackageSink(IDataPackageSink& sink, CryptoPP::PK_MessageAccumulator& accumulator)
+        : m_sink(sink), m_accumulator(accumulator) {}
+
+    virtual void Reserve(size_t length) { m_sink.Reserve(length); }
+
+    virtual bool Write(const char* data, size_t length)
     {
-        data = json_entry.get("data", 0).asString();
-        base64Signature = json_entry.get("signature", 0).asString();
-        signingPublicKeyDigest = json_entry.get("signingPublicKeyDigest", 0).asString();
+        m_accumulator.Update((const byte*)data, length);
+        return m_sink.Write(data, length);
     }
-    catch (exception& e)
+
+    virtual bool End() { return m_sink.End(); }
+
+private:
+    IDataPackageSink& m_sink;
+    CryptoPP::PK_MessageAccumulator& m_accumulator;
+};
+
+
+/*
+Signature verifiers
+
+Only a few public keys are ever used (one each for the remote server list,
+upgrades, etc.), but packages are verified many times over a session. The
+verifier for each key, along with the key's digest, is built once and kept
+for the life of the process. The verifiers are only used through their
+const methods, with a separate accumulator for each verification, so one
+can be used by several threads at once.
+*/
+
+typedef CryptoPP::RSASS<CryptoPP::PKCS1v15, CryptoPP::SHA256>::Verifier SignatureVerifier;
+
+struct CachedSignatureVerifier
+{
+    // As it appears in packages signed with the key: Base64 of its SHA-256.
+    string publicKeyDigest;
+    unique_ptr<SignatureVerifier> verifier;
+};
+
+static map<string, shared_ptr<const CachedSignatureVerifier>> g_signatureVerifierCache;
+static HANDLE g_signatureVerifierCacheMutex = CreateMutex(NULL, FALSE, 0);
+
+// Throws if signaturePublicKey isn't a valid key.
+static shared_ptr<const CachedSignatureVerifier> GetSignatureVerifier(const char* signaturePublicKey)
+{
+    AutoMUTEX lock(g_signatureVerifierCacheMutex);
+
+    auto cached = g_signatureVerifierCache.find(signaturePublicKey);
+    if (cached != g_signatureVerifierCache.end())
     {
-        my_print(NOT_SENSITIVE, false, _T("%s: JSON parse exception: %S"), __TFUNCTION__, e.what());
-        return false;
+        return cached->second;
     }
 
-    // Match the presented public key digest against the embedded public key
+    shared_ptr<CachedSignatureVerifier> entry = make_shared<CachedSignatureVerifier>();
 
-    string expectedPublicKeyDigest;
+    string publicKeyDigest;
     CryptoPP::SHA256 hash;
     CryptoPP::StringSource(
         signaturePublicKey,
         true,
-        new CryptoPP::HashFilter(hash,
-            new CryptoPP::Base64Encoder(new CryptoPP::StringSink(expectedPublicKeyDigest), false)));
-    if (0 != expectedPublicKeyDigest.compare(signingPublicKeyDigest))
-    {
-        my_print(NOT_SENSITIVE, false, _T("%s: public key mismatch.  This build must be too old."), __TFUNCTION__);
-        return false;
-    }
-
-    // Verify the signature of the data and output the data
+        new CryptoPP::HashFilter(hash, new CryptoPP::StringSink(publicKeyDigest)));
+    entry->publicKeyDigest = Base64Encode((const unsigned char*)publicKeyDigest.data(), publicKeyDigest.length());
 
 #pragma warning(push, 0)
 #pragma warning(disable: 4239)
-    CryptoPP::RSASS<CryptoPP::PKCS1v15, CryptoPP::SHA256>::Verifier verifier(
+    entry->verifier.reset(new SignatureVerifier(
         CryptoPP::StringSource(
-            signaturePublicKey,
-            true,
-            new CryptoPP::Base64Decoder()));
+            Base64Decode(signaturePublicKey),
+            true)));
 #pragma warning(pop)
 
-    bool result = false;
+    g_signatureVerifierCache[signaturePublicKey] = entry;
+    return entry;
+}
 
-    string signature;
 
-    CryptoPP::StringSource(
-        base64Signature,
-        true,
-        new CryptoPP::Base64Decoder(new CryptoPP::StringSink(signature)));
+// signedDataPackage may be binary, so we also need the length.
+bool verifySignedDataPackage(
+    const char* signaturePublicKey,
+    const char* signedDataPackage,
+    const size_t signedDataPackageLen,
+    bool gzipped,
+    IDataPackageSink& authenticDataSink)
+{
+    shared_ptr<const CachedSignatureVerifier> cachedVerifier = GetSignatureVerifier(signaturePublicKey);
+    const SignatureVerifier& verifier = *cachedVerifier->verifier;
+
+    unique_ptr<CryptoPP::PK_MessageAccumulator> accumulator(verifier.NewVerificationAccumulator());
+    VerifyingDataPackageSink verifyingSink(authenticDataSink, *accumulator);
+
+    string encodedSignature, signingPublicKeyDigest;
+    if (!InflateSignedDataPackage(
+            signedDataPackage,
+            signedDataPackageLen,
+            gzipped,
+            verifyingSink,
+            encodedSignature,
+            signingPublicKeyDigest))
+    {
+        return false;
+    }
 
-    CryptoPP::StringSource(
-        string(data) + signature,
-        true,
-        new CryptoPP::SignatureVerificationFilter(
-            verifier,
-            new CryptoPP::ArraySink((byte*)&result, sizeof(result)),
-            CryptoPP::SignatureVerificationFilter::PUT_RESULT |
-            CryptoPP::SignatureVerificationFilter::SIGNATURE_AT_END));
+    // Match the presented public key digest against the embedded public key
+
+    if (0 != cachedVerifier->publicKeyDigest.compare(signingPublicKeyDigest))
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: public key mismatch.  This build must be too old."), __TFUNCTION__);
+        return false;
+    }
+
+    // Verify the signature of the data
+
+    string signature = Base64Decode(encodedSignature);
+    if (signature.length() != verifier.SignatureLength())
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: bad signature length"), __TFUNCTION__);
+        return false;
+    }
 
-    if (result)
+    try
+    {
+        verifier.InputSignature(*accumulator, (const byte*)signature.data(), signature.length());
+        return verifier.VerifyAndRestart(*accumulator);
+    }
+    catch (exception& e)
     {
-        authenticDataPackage = data;
+        my_print(NOT_SENSITIVE, false, _T("%s: signature verification exception: %S"), __TFUNCTION__, e.what());
+        return false;
+    }
+}
+
+
+bool verifySignedDataPackage(
+    const char* signaturePublicKey,
+    const char* signedDataPackage,
+    const size_t signedDataPackageLen,
+    bool gzipped,
+    string& authenticDataPackage)
+{
+    authenticDataPackage.clear();
+
+    StringDataPackageSink sink(authenticDataPackage);
+    if (!verifySignedDataPackage(signaturePublicKey, signedDataPackage, signedDataPackageLen, gzipped, sink))
+    {
+        authenticDataPackage.clear();
+        return false;
     }
 
-    return result;
+    return true;
 }
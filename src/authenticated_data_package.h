@@ -20,7 +20,84 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include "base64_codec.h"
 
+
+// Receives the data of a signed data package as it's verified.
+class IDataPackageSink
+{
+public:
+    virtual ~IDataPackageSink() {}
+
+    // Called before any Write if the length of the package is known (it's
+    // an upper bound on the length of the data). Unverified, but no more than
+    // verification would allow anyway.
+    virtual void Reserve(size_t /*length*/) {}
+
+    // Returning false aborts verification.
+    virtual bool Write(const char* data, size_t length) = 0;
+
+    // Called after the last Write, if the package was well-formed.
+    virtual bool End() { return true; }
+};
+
+// Appends the data to a string.
+class StringDataPackageSink : public IDataPackageSink
+{
+public:
+    StringDataPackageSink(string& output) : m_output(output) {}
+    virtual void Reserve(size_t length) { m_output.reserve(m_output.length() + length); }
+    virtual bool Write(const char* data, size_t length) { m_output.append(data, length); return true; }
+
+private:
+    string& m_output;
+};
+
+// For packages whose data is Base64 encoded (such as upgrades): decodes the
+// data, appending it to a string.
+class Base64DataPackageSink : public IDataPackageSink
+{
+public:
+    Base64DataPackageSink(string& output) : m_output(output) {}
+    virtual void Reserve(size_t length) { m_output.reserve(m_output.length() + length / 4 * 3); }
+    virtual bool Write(const char* data, size_t length) { return m_decoder.Update(data, length, m_output); }
+    virtual bool End() { return m_decoder.Final(m_output); }
+
+private:
+    Base64Decoder m_decoder;
+    string& m_output;
+};
+
+// For packages whose data is lines of text (such as server lists): splits
+// the data into lines, skipping empty ones.
+class LinesDataPackageSink : public IDataPackageSink
+{
+public:
+    LinesDataPackageSink(vector<string>& lines) : m_lines(lines) {}
+    virtual bool Write(const char* data, size_t length);
+    virtual bool End();
+
+private:
+    vector<string>& m_lines;
+    string m_partialLine;
+};
+
+// Verifies a signed data package and outputs its data.
+//
+// The package is decompressed, parsed and hashed a chunk at a time, and the
+// data is written to the sink as it's decoded; the package is never held
+// in memory whole. So the data written to the sink is only authentic if
+// this returns true. If it returns false, the caller must discard it.
+bool verifySignedDataPackage(
+    const char* signaturePublicKey,
+    const char* signedDataPackage,
+    const size_t signedDataPackageLen,
+    bool gzipped,
+    IDataPackageSink& authenticDataSink);
+
+// As above, storing the data in authenticDataPackage. authenticDataPackage is
+// left empty if verification fails.
 bool verifySignedDataPackage(
     const char* signaturePublicKey,
     const char* signedDataPackage,
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "base64_codec.h"
+#include "cpu_features.h"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+static const char* const BASE64_ALPHABET =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Values in the decode table other than sextets (0-63)
+static const unsigned char BASE64_WHITESPACE = 0x40;
+static const unsigned char BASE64_PADDING = 0x41;
+static const unsigned char BASE64_INVALID = 0xFF;
+
+// Set in the group tables for characters that aren't sextets
+static const uint32_t BASE64_GROUP_INVALID = 0x80000000;
+
+
+/***********************************************
+Scalar implementation
+*/
+
+struct Base64Tables
+{
+    Base64Tables()
+    {
+        memset(decode, BASE64_INVALID, sizeof(decode));
+        for (int i = 0; i < 64; i++)
+        {
+            decode[(unsigned char)BASE64_ALPHABET[i]] = (unsigned char)i;
+        }
+        decode[(unsigned char)' '] = BASE64_WHITESPACE;
+        decode[(unsigned char)'\t'] = BASE64_WHITESPACE;
+        decode[(unsigned char)'\r'] = BASE64_WHITESPACE;
+        decode[(unsigned char)'\n'] = BASE64_WHITESPACE;
+        decode[(unsigned char)'='] = BASE64_PADDING;
+
+        // Each table holds a character's sextet already shifted into its
+        // place in a group of four, so a group decodes with four lookups.
+        for (int c = 0; c < 256; c++)
+        {
+            for (int position = 0; position < 4; position++)
+            {
+                group[position][c] = decode[c] < 64
+                    ? (uint32_t)decode[c] << (6 * (3 - position))
+                    : BASE64_GROUP_INVALID;
+            }
+        }
+    }
+
+    unsigned char decode[256];
+    uint32_t group[4][256];
+};
+
+static const Base64Tables& GetBase64Tables()
+{
+    static const Base64Tables tables;
+    return tables;
+}
+
+static void Base64EncodeScalar(const unsigned char* input, size_t inputLength, char* output)
+{
+    size_t i = 0;
+    for (; i + 3 <= inputLength; i += 3)
+    {
+        uint32_t group = ((uint32_t)input[i] << 16) | ((uint32_t)input[i + 1] << 8) | input[i + 2];
+        *output++ = BASE64_ALPHABET[(group >> 18) & 0x3F];
+        *output++ = BASE64_ALPHABET[(group >> 12) & 0x3F];
+        *output++ = BASE64_ALPHABET[(group >> 6) & 0x3F];
+        *output++ = BASE64_ALPHABET[group & 0x3F];
+    }
+
+    if (i < inputLength)
+    {
+        uint32_t group = (uint32_t)input[i] << 16;
+        if (i + 1 < inputLength)
+        {
+            group |= (uint32_t)input[i + 1] << 8;
+        }
+
+        *output++ = BASE64_ALPHABET[(group >> 18) & 0x3F];
+        *output++ = BASE64_ALPHABET[(group >> 12) & 0x3F];
+        *output++ = i + 1 < inputLength ? BASE64_ALPHABET[(group >> 6) & 0x3F] : '=';
+        *output++ = '=';
+    }
+}
+
+// Decodes whole groups of four sextet characters, stopping at the first group
+// that contains anything else (whitespace, padding or an invalid character).
+static void Base64DecodeGroupsScalar(const char*& input, const char* end, unsigned char*& output)
+{
+    const Base64Tables& tables = GetBase64Tables();
+
+    while (end - input >= 4)
+    {
+        uint32_t group =
+            tables.group[0][(unsigned char)input[0]] |
+            tables.group[1][(unsigned char)input[1]] |
+            tables.group[2][(unsigned char)input[2]] |
+            tables.group[3][(unsigned char)input[3]];
+        if (group & BASE64_GROUP_INVALID)
+        {
+            return;
+        }
+
+        output[0] = (unsigned char)(group >> 16);
+        output[1] = (unsigned char)(group >> 8);
+        output[2] = (unsigned char)group;
+        input += 4;
+        output += 3;
+    }
+}
+
+
+#ifdef SIMD_X86
+
+/***********************************************
+AVX2 implementation
+
+After Wojciech Mula and Daniel Lemire, "Faster Base64 Encoding and Decoding
+Using AVX2 Instructions" (2018).
+*/
+
+// Encodes 24 bytes to 32 characters. Reads 28 bytes of input.
+SIMD_TARGET_AVX2 static inline void Base64EncodeBlockAVX2(const unsigned char* input, char* output)
+{
+    // Put bytes 0-11 in the low lane and 12-23 in the high lane, then spread
+    // each 3 bytes over a 32-bit word (in the order the shifts below need)
+    __m128i low = _mm_loadu_si128((const __m128i*)input);
+    __m128i high = _mm_loadu_si128((const __m128i*)(input + 12));
+    __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+    in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+
+    // Move each sextet into its own byte
+    __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00));
+    __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0));
+    __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    __m256i sextets = _mm256_or_si256(t1, t3);
+
+    // Map each sextet to the offset from it to its character, by range:
+    // 0-25 'A', 26-51 'a', 52-61 '0', 62 '+', 63 '/'
+    __m256i range = _mm256_subs_epu8(sextets, _mm256_set1_epi8(51));
+    __m256i isUpper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), sextets);
+    range = _mm256_or_si256(range, _mm256_and_si256(isUpper, _mm256_set1_epi8(13)));
+    const __m256i offsets = _mm256_setr_epi8(
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    __m256i characters = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), sextets);
+
+    _mm256_storeu_si256((__m256i*)output, characters);
+}
+
+// Decodes 32 characters to 24 bytes, writing 32 bytes of output. Returns
+// false, without writing, if any of the characters aren't sextets.
+SIMD_TARGET_AVX2 static inline bool Base64DecodeBlockAVX2(const char* input, unsigned char* output)
+{
+    __m256i in = _mm256_loadu_si256((const __m256i*)input);
+
+    // Classify each character by its high and low nibbles; a character is
+    // valid if its two classes have no bits in common
+    const __m256i lowClasses = _mm256_setr_epi8(
+            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i highClasses = _mm256_setr_epi8(
+            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i mask2F = _mm256_set1_epi8(0x2F);
+
+    __m256i highNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask2F);
+    __m256i lowNibbles = _mm256_and_si256(in, mask2F);
+    __m256i high = _mm256_shuffle_epi8(highClasses, highNibbles);
+    __m256i low = _mm256_shuffle_epi8(lowClasses, lowNibbles);
+    if (!_mm256_testz_si256(low, high))
+    {
+        return false;
+    }
+
+    // Map each character to its sextet by adding an offset chosen by its
+    // high nibble ('/' shares its high nibble with '+', so is special-cased)
+    const __m256i offsets = _mm256_setr_epi8(
+            0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i isSlash = _mm256_cmpeq_epi8(in, mask2F);
+    __m256i sextets = _mm256_add_epi8(in, _mm256_shuffle_epi8(offsets, _mm256_add_epi8(isSlash, highNibbles)));
+
+    // Pack each 4 sextets into 3 bytes, then the bytes of both lanes together
+    __m256i packed = _mm256_maddubs_epi16(sextets, _mm256_set1_epi32(0x01400140));
+    packed = _mm256_madd_epi16(packed, _mm256_set1_epi32(0x00011000));
+    packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+
+    _mm256_storeu_si256((__m256i*)output, packed);
+    return true;
+}
+
+SIMD_TARGET_AVX2 static void Base64EncodeAVX2(const unsigned char* input, size_t inputLength, char* output)
+{
+    size_t i = 0;
+    for (; i + 28 <= inputLength; i += 24)
+    {
+        Base64EncodeBlockAVX2(input + i, output);
+        output += 32;
+    }
+    _mm256_zeroupper();
+
+    Base64EncodeScalar(input + i, inputLength - i, output);
+}
+
+// As Base64DecodeGroupsScalar. Output must have room for 8 bytes more than
+// the decoded input.
+SIMD_TARGET_AVX2 static void Base64DecodeGroupsAVX2(const char*& input, const char* end, unsigned char*& output)
+{
+    while (end - input >= 32 && Base64DecodeBlockAVX2(input, output))
+    {
+        input += 32;
+        output += 24;
+    }
+    _mm256_zeroupper();
+
+    Base64DecodeGroupsScalar(input, end, output);
+}
+
+#endif // SIMD_X86
+
+
+/***********************************************
+Public interface
+*/
+
+size_t Base64EncodedLength(size_t inputLength)
+{
+    return (inputLength + 2) / 3 * 4;
+}
+
+void Base64EncodeInto(const unsigned char* input, size_t inputLength, char* output)
+{
+#ifdef SIMD_X86
+    if (GetSimdInstructionSet() == SIMD_AVX2)
+    {
+        Base64EncodeAVX2(input, inputLength, output);
+        return;
+    }
+#endif
+
+    Base64EncodeScalar(input, inputLength, output);
+}
+
+Base64Encoder::Base64Encoder()
+    : m_pendingLength(0)
+{
+}
+
+void Base64Encoder::Update(const unsigned char* input, size_t inputLength, string& output)
+{
+    // Complete the group that the last chunk started
+    while (m_pendingLength > 0 && m_pendingLength < 3 && inputLength > 0)
+    {
+        m_pending[m_pendingLength++] = *input++;
+        inputLength--;
+    }
+    if (m_pendingLength == 3)
+    {
+        Final(output);
+    }
+
+    size_t wholeLength = inputLength / 3 * 3;
+    if (wholeLength > 0)
+    {
+        size_t outputStart = output.length();
+        output.resize(outputStart + Base64EncodedLength(wholeLength));
+        Base64EncodeInto(input, wholeLength, &output[outputStart]);
+    }
+
+    for (size_t i = wholeLength; i < inputLength; i++)
+    {
+        m_pending[m_pendingLength++] = input[i];
+    }
+}
+
+void Base64Encoder::Final(string& output)
+{
+    if (m_pendingLength > 0)
+    {
+        size_t outputStart = output.length();
+        output.resize(outputStart + Base64EncodedLength(m_pendingLength));
+        Base64EncodeScalar(m_pending, m_pendingLength, &output[outputStart]);
+        m_pendingLength = 0;
+    }
+}
+
+Base64Decoder::Base64Decoder()
+    : m_bits(0),
+      m_count(0),
+      m_padding(0),
+      m_failed(false)
+{
+}
+
+bool Base64Decoder::Update(const char* input, size_t inputLength, string& output)
+{
+    if (m_failed)
+    {
+        return false;
+    }
+
+    // Decode directly into the output, sized for the most this chunk can
+    // produce (plus slack for the AVX2 stores), and trim it afterwards
+    size_t outputStart = output.length();
+    output.resize(outputStart + (inputLength / 4 + 1) * 3 + 8);
+    unsigned char* const outputBegin = (unsigned char*)&output[0];
+    unsigned char* out = outputBegin + outputStart;
+
+    const char* end = input + inputLength;
+    while (input < end)
+    {
+        // Whole groups take the fast path; anything else, and any group
+        // that's split by whitespace or across chunks, goes one character
+        // at a time
+        if (m_count == 0 && m_padding == 0)
+        {
+#ifdef SIMD_X86
+            if (GetSimdInstructionSet() == SIMD_AVX2)
+            {
+                Base64DecodeGroupsAVX2(input, end, out);
+            }
+            else
+#endif
+            {
+                Base64DecodeGroupsScalar(input, end, out);
+            }
+
+            if (input == end)
+            {
+                break;
+            }
+        }
+
+        if (!DecodeCharacter(*input++, out))
+        {
+            m_failed = true;
+            break;
+        }
+    }
+
+    output.resize(out - outputBegin);
+    return !m_failed;
+}
+
+bool Base64Decoder::DecodeCharacter(char c, unsigned char*& output)
+{
+    unsigned char value = GetBase64Tables().decode[(unsigned char)c];
+
+    if (value < 64)
+    {
+        // No data may follow padding
+        if (m_padding > 0)
+        {
+            return false;
+        }
+
+        m_bits = (m_bits << 6) | value;
+        if (++m_count == 4)
+        {
+            *output++ = (unsigned char)(m_bits >> 16);
+            *output++ = (unsigned char)(m_bits >> 8);
+            *output++ = (unsigned char)m_bits;
+            m_bits = 0;
+            m_count = 0;
+        }
+        return true;
+    }
+    else if (value == BASE64_PADDING)
+    {
+        // Padding only completes a group of two or three sextets
+        if (m_count < 2 || m_count + m_padding >= 4)
+        {
+            return false;
+        }
+        m_padding++;
+        return true;
+    }
+
+    return value == BASE64_WHITESPACE;
+}
+
+bool Base64Decoder::Final(string& output)
+{
+    if (m_failed || m_count == 1 || (m_padding > 0 && m_count + m_padding != 4))
+    {
+        m_failed = true;
+        return false;
+    }
+
+    // Any trailing partial group holds one or two bytes
+    if (m_count == 2)
+    {
+        output.push_back((char)(m_bits >> 4));
+    }
+    else if (m_count == 3)
+    {
+        output.push_back((char)(m_bits >> 10));
+        output.push_back((char)(m_bits >> 2));
+    }
+
+    m_bits = 0;
+    m_count = 0;
+    m_padding = 0;
+    return true;
+}
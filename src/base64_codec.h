@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+
+/*
+Base64 (RFC 4648, standard alphabet) encoding and decoding.
+
+These are the primitives behind Base64Encode and Base64Decode (see
+utilities.h). Encoded output is padded and has no line breaks. Decoding
+ignores whitespace, so line-wrapped (e.g., PEM) input is accepted, as is
+input with or without padding; anything else outside the alphabet is an
+error. Long runs of input are processed with AVX2 where the CPU supports it.
+*/
+
+// The length of the encoding of inputLength bytes.
+size_t Base64EncodedLength(size_t inputLength);
+
+// Writes exactly Base64EncodedLength(inputLength) characters, not
+// NUL-terminated, to output.
+void Base64EncodeInto(const unsigned char* input, size_t inputLength, char* output);
+
+// Encodes input that's produced in pieces, such as a compressor's output,
+// as if it were encoded whole.
+class Base64Encoder
+{
+public:
+    Base64Encoder();
+
+    // Encodes the next chunk of input, appending the encoding to output.
+    // Up to two bytes that don't make a whole group are held back until the
+    // next chunk.
+    void Update(const unsigned char* input, size_t inputLength, string& output);
+
+    // Call after the last chunk: appends the encoding, with padding, of any
+    // bytes held back.
+    void Final(string& output);
+
+private:
+    unsigned char m_pending[3];
+    size_t m_pendingLength;
+};
+
+// Decodes input that may arrive in pieces, such as a download.
+class Base64Decoder
+{
+public:
+    Base64Decoder();
+
+    // Decodes the next chunk of input, appending the decoded bytes to output.
+    // Chunks may split the input anywhere. Returns false if the input is
+    // invalid, after which the decoder stays failed.
+    bool Update(const char* input, size_t inputLength, string& output);
+
+    // Call after the last chunk. Returns false if the input is invalid or
+    // ends part way through a byte.
+    bool Final(string& output);
+
+private:
+    bool DecodeCharacter(char c, unsigned char*& output);
+
+    uint32_t m_bits;    // The sextets of the current, incomplete group
+    int m_count;        // How many sextets are in m_bits
+    int m_padding;      // How many '=' have been seen
+    bool m_failed;
+};
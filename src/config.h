@@ -49,3 +49,13 @@ static const int HTTPS_REQUEST_RECEIVE_TIMEOUT_MS = 30000;
 static const int TERMINATE_PROCESS_WAIT_MS = 5000;
 static const char* UNTUNNELED_WEB_REQUEST_CAPABILITY = "handshake";
 static const int TEMPORARY_TUNNEL_TIMEOUT_SECONDS = 20;
+
+// Whether feedback uploads are gzip compressed (see WriteFeedbackJSON), unless
+// the CompressFeedback registry setting says otherwise. The feedback server
+// must be able to decode them before this is turned on.
+static const bool COMPRESS_FEEDBACK = false;
+
+// Whether servers that respond to the reachability check are ordered by the
+// ranking model (see server_ranking.h), rather than shuffled, unless the
+// RankServers registry setting says otherwise.
+static const bool RANK_SERVERS = false;
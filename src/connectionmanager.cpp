@@ -48,11 +48,28 @@
 extern HWND g_hWnd;
 
 
+static void LogTaskExecutorMetrics()
+{
+    const TCHAR* PRIORITY_NAMES[TASK_PRIORITY_COUNT] = { _T("UI"), _T("background") };
+
+    TaskExecutorMetrics metrics = TaskExecutor::Instance().GetMetrics();
+
+    my_print(NOT_SENSITIVE, true, _T("Task executor: %d workers, %d tasks stolen"),
+        (int)metrics.workers, (int)metrics.stolen);
+
+    for (int p = 0; p < TASK_PRIORITY_COUNT; p++)
+    {
+        const TaskExecutorMetrics::Priority& priority = metrics.priorities[p];
+        my_print(NOT_SENSITIVE, true, _T("Task executor: %s: %d queued, %d completed, %d cancelled, start latency mean %.1fms max %.1fms"),
+            PRIORITY_NAMES[p], (int)priority.queueDepth, (int)priority.completed, (int)priority.cancelled,
+            priority.meanLatencyMilliseconds, priority.maxLatencyMilliseconds);
+    }
+}
+
+
 ConnectionManager::ConnectionManager(void) :
     m_state(CONNECTION_MANAGER_STATE_STOPPED),
     m_thread(0),
-    m_upgradeThread(0),
-    m_feedbackThread(0),
     m_transport(0),
     m_upgradePending(false),
     m_startSplitTunnel(false),
@@ -68,12 +85,12 @@ ConnectionManager::~ConnectionManager(void)
 {
     Stop(STOP_REASON_NONE);
 
-    if (m_feedbackThread)
+    if (m_feedbackTask.IsValid())
     {
-        my_print(NOT_SENSITIVE, true, _T("%s: Waiting for feedback thread to die"), __TFUNCTION__);
-        WaitForSingleObject(m_feedbackThread, INFINITE);
-        my_print(NOT_SENSITIVE, true, _T("%s: Feedback thread died"), __TFUNCTION__);
-        m_feedbackThread = 0;
+        my_print(NOT_SENSITIVE, true, _T("%s: Waiting for feedback task to finish"), __TFUNCTION__);
+        m_feedbackTask.Wait(INFINITE);
+        my_print(NOT_SENSITIVE, true, _T("%s: Feedback task finished"), __TFUNCTION__);
+        m_feedbackTask.Reset();
     }
 
     CloseHandle(m_mutex);
@@ -184,17 +201,19 @@ void ConnectionManager::Stop(DWORD reason)
         m_thread = 0;
     }
 
-    if (m_upgradeThread)
+    if (m_upgradeTask.IsValid())
     {
-        my_print(NOT_SENSITIVE, true, _T("%s: Waiting for upgrade thread to die"), __TFUNCTION__);
-        WaitForSingleObject(m_upgradeThread, INFINITE);
-        my_print(NOT_SENSITIVE, true, _T("%s: Upgrade thread died"), __TFUNCTION__);
-        m_upgradeThread = 0;
+        my_print(NOT_SENSITIVE, true, _T("%s: Waiting for upgrade task to finish"), __TFUNCTION__);
+        m_upgradeTask.Wait(INFINITE);
+        my_print(NOT_SENSITIVE, true, _T("%s: Upgrade task finished"), __TFUNCTION__);
+        m_upgradeTask.Reset();
     }
 
-    // The feedback thread (m_feedbackThread) is not stopped here because it
+    // The feedback task (m_feedbackTask) is not stopped here because it
     // manages its own lifecycle between connection state changes.
 
+    LogTaskExecutorMetrics();
+
     delete m_transport;
     m_transport = 0;
 
@@ -357,19 +376,19 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
             manager->UpdateCurrentSessionInfo(sessionInfo);
 
             //
-            // If handshake notified of new version, start the upgrade in a (background) thread
+            // If handshake notified of new version, start the upgrade in a background task
             //
 
             if (manager->RequireUpgrade())
             {
-                if (!manager->m_upgradeThread ||
-                    WAIT_OBJECT_0 == WaitForSingleObject(manager->m_upgradeThread, 0))
+                if (manager->m_upgradeTask.IsDone())
                 {
-                    manager->m_upgradeThread = CreateThread(0, 0, ConnectionManagerUpgradeThread, manager, 0, 0);
-                    if (!manager->m_upgradeThread)
-                    {
-                        my_print(NOT_SENSITIVE, false, _T("Upgrade: CreateThread failed (%d)"), GetLastError());
-                    }
+                    manager->m_upgradeTask = TaskExecutor::Instance().Submit(
+                        TASK_PRIORITY_BACKGROUND,
+                        [manager](const CancellationToken&) {
+                            ConnectionManagerUpgradeTask(manager);
+                        },
+                        StopInfo(&GlobalStopSignal::Instance(), STOP_REASON_ANY_STOP_TUNNEL));
                 }
             }
 
@@ -486,7 +505,8 @@ DWORD WINAPI ConnectionManager::ConnectionManagerStartThread(void* object)
         // in for now as clients blocked on both protocols would otherwise
         // still spam handshakes. The delay is *after* SSH fail over so as
         // not to delay that attempt (on the same server).
-        Sleep(1000 + rand()%1000);
+        // A stop during the delay ends it; the next iteration handles it.
+        (void)GlobalStopSignal::Instance().WaitForSignal(STOP_REASON_ANY_STOP_TUNNEL, 1000 + rand()%1000);
     }
 
     my_print(NOT_SENSITIVE, true, _T("%s: exiting thread"), __TFUNCTION__);
@@ -821,7 +841,7 @@ void ConnectionManager::FetchRemoteServerList()
             my_print(NOT_SENSITIVE, false, _T("Fetch remote server list failed"));
             return;
         }
-        response = httpsResponse.body;
+        response.swap(httpsResponse.body);
     }
     catch (StopSignal::StopException&)
     {
@@ -831,29 +851,20 @@ void ConnectionManager::FetchRemoteServerList()
 
     m_nextFetchRemoteServerListAttempt = time(0) + SECONDS_BETWEEN_SUCCESSFUL_REMOTE_SERVER_LIST_FETCH;
 
-    string serverEntryList;
+    // The list is split into server entries, one per line, as it's verified.
+    vector<string> newServerEntryVector;
+    LinesDataPackageSink sink(newServerEntryVector);
     if (!verifySignedDataPackage(
             REMOTE_SERVER_LIST_SIGNATURE_PUBLIC_KEY,
             response.c_str(),
             response.length(),
             false, // zipped, not gzipped
-            serverEntryList))
+            sink))
     {
         my_print(NOT_SENSITIVE, false, _T("Verify remote server list failed"));
         return;
     }
 
-    vector<string> newServerEntryVector;
-    istringstream serverEntryListStream(serverEntryList);
-    string line;
-    while (getline(serverEntryListStream, line))
-    {
-        if (!line.empty())
-        {
-            newServerEntryVector.push_back(line);
-        }
-    }
-
     try
     {
         // This adds the new server entries to all transports' server lists.
@@ -875,14 +886,12 @@ bool ConnectionManager::RequireUpgrade(void)
     return !m_upgradePending && m_currentSessionInfo.GetUpgradeVersion().size() > 0;
 }
 
-DWORD WINAPI ConnectionManager::ConnectionManagerUpgradeThread(void* object)
+void ConnectionManager::ConnectionManagerUpgradeTask(ConnectionManager* manager)
 {
     my_print(NOT_SENSITIVE, true, _T("%s: enter"), __TFUNCTION__);
 
     my_print(NOT_SENSITIVE, false, _T("Downloading new version..."));
 
-    ConnectionManager* manager = (ConnectionManager*)object;
-
     try
     {
         SessionInfo sessionInfo;
@@ -926,16 +935,16 @@ DWORD WINAPI ConnectionManager::ConnectionManagerUpgradeThread(void* object)
 
             string upgradeData;
 
+            // Data in the package is Base64 encoded
+            Base64DataPackageSink sink(upgradeData);
+
             if (verifySignedDataPackage(
                     UPGRADE_SIGNATURE_PUBLIC_KEY,
                     httpsResponse.body.c_str(),
                     httpsResponse.body.length(),
                     true, // gzip compressed
-                    upgradeData))
+                    sink))
             {
-                // Data in the package is Base64 encoded
-                upgradeData = Base64Decode(upgradeData);
-
                 if (upgradeData.length() > 0)
                 {
                     manager->PaveUpgrade(upgradeData);
@@ -953,8 +962,7 @@ DWORD WINAPI ConnectionManager::ConnectionManagerUpgradeThread(void* object)
         // do nothing, just exit
     }
 
-    my_print(NOT_SENSITIVE, true, _T("%s: exiting thread"), __TFUNCTION__);
-    return 0;
+    my_print(NOT_SENSITIVE, true, _T("%s: exiting task"), __TFUNCTION__);
 }
 
 void ConnectionManager::PaveUpgrade(const string& download)
@@ -1112,43 +1120,27 @@ void ConnectionManager::UpdateCurrentSessionInfo(const SessionInfo& sessionInfo)
     }
 }
 
-struct FeedbackThreadData
-{
-    ConnectionManager* connectionManager;
-    string feedbackJSON;
-} g_feedbackThreadData;
-
 void ConnectionManager::SendFeedback(const string& utf8FeedbackJSON)
 {
-    g_feedbackThreadData.connectionManager = this;
-    g_feedbackThreadData.feedbackJSON = utf8FeedbackJSON;
-
-    if (!m_feedbackThread ||
-        WAIT_OBJECT_0 == WaitForSingleObject(m_feedbackThread, 0))
+    // Only one feedback upload at a time
+    if (m_feedbackTask.IsDone())
     {
-        m_feedbackThread = CreateThread(
-            0,
-            0,
-            ConnectionManager::ConnectionManagerFeedbackThread,
-            (void*)&g_feedbackThreadData, 0, 0);
-        if (!m_feedbackThread)
-        {
-            my_print(NOT_SENSITIVE, false, _T("%s: CreateThread failed (%d)"), __TFUNCTION__, GetLastError());
-            PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_FAILED, 0, 0);
-            return;
-        }
+        ConnectionManager* manager = this;
+        m_feedbackTask = TaskExecutor::Instance().Submit(
+            TASK_PRIORITY_BACKGROUND,
+            [manager, utf8FeedbackJSON](const CancellationToken&) {
+                ConnectionManagerFeedbackTask(manager, utf8FeedbackJSON);
+            });
     }
 }
 
-DWORD WINAPI ConnectionManager::ConnectionManagerFeedbackThread(void* object)
+void ConnectionManager::ConnectionManagerFeedbackTask(ConnectionManager* manager, const string& feedbackJSON)
 {
     my_print(NOT_SENSITIVE, true, _T("%s: enter"), __TFUNCTION__);
 
-    FeedbackThreadData* data = (FeedbackThreadData*)object;
-
     try
     {
-        if (data->connectionManager->DoSendFeedback(data->feedbackJSON))
+        if (manager->DoSendFeedback(feedbackJSON))
         {
             PostMessage(g_hWnd, WM_PSIPHON_FEEDBACK_SUCCESS, 0, 0);
         }
@@ -1163,7 +1155,6 @@ DWORD WINAPI ConnectionManager::ConnectionManagerFeedbackThread(void* object)
     }
 
     my_print(NOT_SENSITIVE, true, _T("%s: exit"), __TFUNCTION__);
-    return 0;
 }
 
 bool ConnectionManager::DoSendFeedback(const string& feedbackJSON)
@@ -1198,7 +1189,7 @@ bool ConnectionManager::DoSendFeedback(const string& feedbackJSON)
     // Upload diagnostic info
     if (!feedback.empty() || !surveyJSON.empty() || sendDiagnosticInfo)
     {
-        string diagnosticData = GenerateFeedbackJSON(
+        FeedbackData feedbackData(
                     feedback,
                     email,
                     surveyJSON,
@@ -1206,7 +1197,14 @@ bool ConnectionManager::DoSendFeedback(const string& feedbackJSON)
 
         unique_ptr<FeedbackUploadWorker> feedbackUpload;
 
-        // Kick off the feedback upload and poll for it to complete. Interrupt
+        // Every connection state change is signalled, so this wakes the loop
+        // below to start, or restart, the upload as soon as the state allows.
+        StopSignalEvent stateChangeEvent(StopInfo(
+            &GlobalStopSignal::Instance(),
+            STOP_REASON_CONNECTING | STOP_REASON_CONNECTED | STOP_REASON_DISCONNECTING | STOP_REASON_DISCONNECTED |
+            STOP_REASON_ANY_STOP_TUNNEL));
+
+        // Kick off the feedback upload and wait for it to complete. Interrupt
         // the operation if the VPN is connecting or disconnecting, and retry
         // when it is connected or disconnected again.
         // TODO: cancel the upload if the connection state is flapping?
@@ -1230,7 +1228,7 @@ bool ConnectionManager::DoSendFeedback(const string& feedbackJSON)
                 string upstreamProxyAddress = GetUpstreamProxyAddress();
                 StopInfo stopInfo = StopInfo(&GlobalStopSignal::Instance(),
                     STOP_REASON_ANY_ABORT_FEEDBACK_UPLOAD_VPN_MODE_STARTED);
-                feedbackUpload = make_unique<FeedbackUploadWorker>(diagnosticData, vpnModeStarted, upstreamProxyAddress, stopInfo);
+                feedbackUpload = make_unique<FeedbackUploadWorker>(feedbackData, vpnModeStarted, upstreamProxyAddress, stopInfo);
                 try {
                     feedbackUpload->StartUpload();
                 }
@@ -1259,7 +1257,7 @@ bool ConnectionManager::DoSendFeedback(const string& feedbackJSON)
                         STOP_REASON_ANY_ABORT_FEEDBACK_UPLOAD_NONVPN_MODE_NOT_CONNECTED);
                 }
 
-                feedbackUpload = make_unique<FeedbackUploadWorker>(diagnosticData, vpnModeStarted, upstreamProxyAddress, stopInfo);
+                feedbackUpload = make_unique<FeedbackUploadWorker>(feedbackData, vpnModeStarted, upstreamProxyAddress, stopInfo);
                 try {
                     feedbackUpload->StartUpload();
                 }
@@ -1288,7 +1286,19 @@ bool ConnectionManager::DoSendFeedback(const string& feedbackJSON)
                 }
             }
 
-            Sleep(100);
+            // Wait for the upload worker to stop or for the connection state
+            // to change. The timeout is only a backstop.
+            HANDLE waitHandles[] = { stateChangeEvent.Get(), NULL };
+            DWORD waitHandlesCount = 1;
+            if (feedbackUpload != NULL)
+            {
+                waitHandles[waitHandlesCount++] = feedbackUpload->StoppedEvent();
+            }
+            if (stateChangeEvent.Get() == NULL ||
+                WAIT_FAILED == WaitForMultipleObjects(waitHandlesCount, waitHandles, FALSE, 1000))
+            {
+                Sleep(100);
+            }
         }
     }
 
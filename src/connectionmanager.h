@@ -24,6 +24,7 @@
 #include "psiclient.h"
 #include "local_proxy.h"
 #include "transport.h"
+#include "task_executor.h"
 
 
 class ITransport;
@@ -103,7 +104,7 @@ public:
 
 private:
     static DWORD WINAPI ConnectionManagerStartThread(void* object);
-    static DWORD WINAPI ConnectionManagerUpgradeThread(void* object);
+    static void ConnectionManagerUpgradeTask(ConnectionManager* manager);
 
     // Exception classes to help with the ConnectionManagerStartThread control flow
     class Abort { };
@@ -126,15 +127,15 @@ private:
 
     // May throw StopSignal::StopException
     bool DoSendFeedback(const string& feedbackJSON);
-    static DWORD WINAPI ConnectionManagerFeedbackThread(void* object);
+    static void ConnectionManagerFeedbackTask(ConnectionManager* manager, const string& feedbackJSON);
 
 private:
     HANDLE m_mutex;
     ConnectionManagerState m_state;
     SessionInfo m_currentSessionInfo;
     HANDLE m_thread;
-    HANDLE m_upgradeThread;
-    HANDLE m_feedbackThread;
+    TaskHandle m_upgradeTask;
+    TaskHandle m_feedbackTask;
     ITransport* m_transport;
     bool m_upgradePending;
     bool m_startSplitTunnel;
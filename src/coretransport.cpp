@@ -20,6 +20,7 @@
 #include "stdafx.h"
 #include <shlwapi.h>
 #pragma comment(lib,"shlwapi.lib")
+#include <unordered_map>
 
 #include "logging.h"
 #include "coretransport.h"
@@ -299,7 +300,14 @@ void CoreTransport::TransportConnectHelper()
             break;
         }
 
-        Sleep(100);
+        // Wake as soon as the core writes output (such as the notice that
+        // it's connected) or exits, or there's a stop, rather than polling
+        // for any of them.
+        HANDLE waitHandles[] = { m_wakeEvent, m_psiphonTunnelCore->OutputEvent(), m_psiphonTunnelCore->Process() };
+        if (WAIT_FAILED == WaitForMultipleObjects(3, waitHandles, FALSE, INFINITE))
+        {
+            Sleep(100);
+        }
     }
 
     m_systemProxySettings->SetSocksProxyPort(m_localSocksProxyPort);
@@ -450,7 +458,7 @@ bool CoreTransport::ValidateAndPaveUpgrade(const tstring& clientUpgradeFilename)
     }
     else {
         DWORD dwFileSize = GetFileSize(hFile, NULL);
-        unique_ptr<BYTE> inBuffer(new BYTE[dwFileSize]);
+        unique_ptr<BYTE[]> inBuffer(new BYTE[dwFileSize]);
         if (!inBuffer) {
             processingSuccessful = false;
             my_print(NOT_SENSITIVE, false, _T("%s: Could not allocate an input buffer."), __TFUNCTION__);
@@ -462,16 +470,16 @@ bool CoreTransport::ValidateAndPaveUpgrade(const tstring& clientUpgradeFilename)
             string downloadFileString;
 
             if (TRUE == ReadFile(hFile, inBuffer.get(), dwBytesToRead, &dwBytesRead, NULL)) {
+                // Data in the package is Base64 encoded
+                Base64DataPackageSink sink(downloadFileString);
+
                 if (verifySignedDataPackage(
                     UPGRADE_SIGNATURE_PUBLIC_KEY,
                     (const char *)inBuffer.get(),
                     dwFileSize,
                     true, // gzip compressed
-                    downloadFileString))
+                    sink))
                 {
-                    // Data in the package is Base64 encoded
-                    downloadFileString = Base64Decode(downloadFileString);
-
                     if (downloadFileString.length() > 0) {
                         m_upgradePaver->PaveUpgrade(downloadFileString);
                     }
@@ -503,9 +511,55 @@ bool CoreTransport::ValidateAndPaveUpgrade(const tstring& clientUpgradeFilename)
 }
 
 
+// The core notices that CoreTransport acts on. Others are only logged (see
+// PsiphonTunnelCore::HandleSubprocessOutputLine).
+enum HandledCoreNoticeType
+{
+    CORE_NOTICE_TUNNELS,
+    CORE_NOTICE_CLIENT_UPGRADE_DOWNLOADED,
+    CORE_NOTICE_HOMEPAGE,
+    CORE_NOTICE_LISTENING_SOCKS_PROXY_PORT,
+    CORE_NOTICE_LISTENING_HTTP_PROXY_PORT,
+    CORE_NOTICE_SOCKS_PROXY_PORT_IN_USE,
+    CORE_NOTICE_HTTP_PROXY_PORT_IN_USE,
+    CORE_NOTICE_UNTUNNELED,
+    CORE_NOTICE_UPSTREAM_PROXY_ERROR,
+    CORE_NOTICE_AVAILABLE_EGRESS_REGIONS,
+    CORE_NOTICE_ACTIVE_AUTHORIZATION_IDS,
+    CORE_NOTICE_CLIENT_REGION,
+    CORE_NOTICE_SPLIT_TUNNEL_REGIONS,
+    CORE_NOTICE_TRAFFIC_RATE_LIMITS,
+};
+
+static const unordered_map<string, HandledCoreNoticeType> HANDLED_CORE_NOTICE_TYPES = {
+    { "Tunnels", CORE_NOTICE_TUNNELS },
+    { "ClientUpgradeDownloaded", CORE_NOTICE_CLIENT_UPGRADE_DOWNLOADED },
+    { "Homepage", CORE_NOTICE_HOMEPAGE },
+    { "ListeningSocksProxyPort", CORE_NOTICE_LISTENING_SOCKS_PROXY_PORT },
+    { "ListeningHttpProxyPort", CORE_NOTICE_LISTENING_HTTP_PROXY_PORT },
+    { "SocksProxyPortInUse", CORE_NOTICE_SOCKS_PROXY_PORT_IN_USE },
+    { "HttpProxyPortInUse", CORE_NOTICE_HTTP_PROXY_PORT_IN_USE },
+    { "Untunneled", CORE_NOTICE_UNTUNNELED },
+    { "UpstreamProxyError", CORE_NOTICE_UPSTREAM_PROXY_ERROR },
+    { "AvailableEgressRegions", CORE_NOTICE_AVAILABLE_EGRESS_REGIONS },
+    { "ActiveAuthorizationIDs", CORE_NOTICE_ACTIVE_AUTHORIZATION_IDS },
+    { "ClientRegion", CORE_NOTICE_CLIENT_REGION },
+    { "SplitTunnelRegions", CORE_NOTICE_SPLIT_TUNNEL_REGIONS },
+    { "TrafficRateLimits", CORE_NOTICE_TRAFFIC_RATE_LIMITS },
+};
+
+
 void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, const string& timestamp, const Json::Value& data)
 {
-    if (noticeType == "Tunnels")
+    auto handledNoticeType = HANDLED_CORE_NOTICE_TYPES.find(noticeType);
+    if (handledNoticeType == HANDLED_CORE_NOTICE_TYPES.end())
+    {
+        return;
+    }
+
+    switch (handledNoticeType->second)
+    {
+    case CORE_NOTICE_TUNNELS:
     {
         // This notice is received when tunnels are connected and disconnected.
         int count = data["count"].asInt();
@@ -526,8 +580,15 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
             m_isConnected = true;
             m_hasEverConnected = true;
         }
+        break;
     }
-    else if (noticeType == "ClientUpgradeDownloaded" && m_upgradePaver != NULL && m_clientUpgradeDownloadHandled == false) {
+    case CORE_NOTICE_CLIENT_UPGRADE_DOWNLOADED:
+    {
+        if (m_upgradePaver == NULL || m_clientUpgradeDownloadHandled)
+        {
+            break;
+        }
+
         m_clientUpgradeDownloadHandled = true;
 
         my_print(NOT_SENSITIVE, false, _T("A client upgrade has been downloaded..."));
@@ -535,18 +596,21 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
             m_clientUpgradeDownloadHandled = false;
         }
         my_print(NOT_SENSITIVE, false, _T("Psiphon has been updated. The new version will launch the next time Psiphon starts."));
+        break;
     }
-    else if (noticeType == "Homepage")
+    case CORE_NOTICE_HOMEPAGE:
     {
         string url = data["url"].asString();
         m_sessionInfo.SetHomepage(url.c_str());
+        break;
     }
-    else if (noticeType == "ListeningSocksProxyPort")
+    case CORE_NOTICE_LISTENING_SOCKS_PROXY_PORT:
     {
         int port = data["port"].asInt();
         m_localSocksProxyPort = port;
+        break;
     }
-    else if (noticeType == "ListeningHttpProxyPort")
+    case CORE_NOTICE_LISTENING_HTTP_PROXY_PORT:
     {
         int port = data["port"].asInt();
         m_localHttpProxyPort = port;
@@ -559,28 +623,30 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
         {
             m_isConnected = true;
         }
+        break;
     }
-    else if (noticeType == "SocksProxyPortInUse")
+    case CORE_NOTICE_SOCKS_PROXY_PORT_IN_USE:
     {
         int port = data["port"].asInt();
         my_print(NOT_SENSITIVE, false, _T("SOCKS proxy port not available: %d"), port);
         // Don't try to reconnect with the same configuration
         throw TransportFailed(false);
     }
-    else if (noticeType == "HttpProxyPortInUse")
+    case CORE_NOTICE_HTTP_PROXY_PORT_IN_USE:
     {
         int port = data["port"].asInt();
         my_print(NOT_SENSITIVE, false, _T("HTTP proxy port not available: %d"), port);
         // Don't try to reconnect with the same configuration
         throw TransportFailed(false);
     }
-    else if (noticeType == "Untunneled")
+    case CORE_NOTICE_UNTUNNELED:
     {
         string address = data["address"].asString();
         // SENSITIVE_LOG: "address" is site user is browsing
         my_print(SENSITIVE_LOG, false, _T("Untunneled: %S"), address.c_str());
+        break;
     }
-    else if (noticeType == "UpstreamProxyError")
+    case CORE_NOTICE_UPSTREAM_PROXY_ERROR:
     {
         string message = data["message"].asString();
 
@@ -606,14 +672,16 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
         // TODO: The client should keep track of these notices and if it has not connected
         // within a certain amount of time and received many of these notices it should
         // suggest to the user that there might be a problem with the Upstream Proxy Settings.
+        break;
     }
-    else if (noticeType == "AvailableEgressRegions")
+    case CORE_NOTICE_AVAILABLE_EGRESS_REGIONS:
     {
         string regions = data["regions"].toStyledString();
         my_print(NOT_SENSITIVE, true, _T("Available egress regions: %S"), regions.c_str());
         // Processing this is left to main.js
+        break;
     }
-    else if (noticeType == "ActiveAuthorizationIDs")
+    case CORE_NOTICE_ACTIVE_AUTHORIZATION_IDS:
     {
         string authIDs = data["IDs"].toStyledString();
         my_print(NOT_SENSITIVE, true, _T("Active Authorization IDs: %S"), authIDs.c_str());
@@ -636,24 +704,35 @@ void CoreTransport::HandlePsiphonTunnelCoreNotice(const string& noticeType, cons
         if (m_authorizationsProvider) {
             m_authorizationsProvider->ActiveAuthorizationIDs(activeAuthorizationIDs, inactiveAuthorizationIDs);
         }
+        break;
     }
-    else if (noticeType == "ClientRegion")
+    case CORE_NOTICE_CLIENT_REGION:
     {
         string region = data["region"].asString();
         my_print(NOT_SENSITIVE, true, _T("Client region: %S"), region.c_str());
         psicash::Lib::_().UpdateClientRegion(region);
+        break;
     }
-    else if (noticeType == "SplitTunnelRegions")
+    case CORE_NOTICE_SPLIT_TUNNEL_REGIONS:
     {
         string regions = data["regions"].toStyledString();
         my_print(NOT_SENSITIVE, false, _T("Split Tunnel Regions: %S"), regions.c_str());
+        break;
     }
-    else if (noticeType == "TrafficRateLimits")
+    case CORE_NOTICE_TRAFFIC_RATE_LIMITS:
     {
         string speed = data["downstreamBytesPerSecond"].toStyledString();
         my_print(NOT_SENSITIVE, true, _T("Traffic rate downstream limit: %S"), speed.c_str());
         // Processing this is left to main.js
+        break;
     }
+    }
+}
+
+
+bool CoreTransport::WantsPsiphonTunnelCoreNotice(const string& noticeType)
+{
+    return HANDLED_CORE_NOTICE_TYPES.count(noticeType) > 0;
 }
 
 
@@ -700,3 +779,21 @@ bool CoreTransport::DoPeriodicCheck()
 
     return false;
 }
+
+
+void CoreTransport::GetPeriodicCheckHandles(vector<HANDLE>& handles)
+{
+    // DoPeriodicCheck only has work to do when the core writes output or
+    // exits.
+    if (m_psiphonTunnelCore)
+    {
+        handles.push_back(m_psiphonTunnelCore->OutputEvent());
+        handles.push_back(m_psiphonTunnelCore->Process());
+    }
+}
+
+
+DWORD CoreTransport::GetPeriodicCheckInterval() const
+{
+    return m_psiphonTunnelCore ? INFINITE : IWorkerThread::GetPeriodicCheckInterval();
+}
@@ -60,9 +60,12 @@ public:
 protected:
     virtual void TransportConnect();
     virtual bool DoPeriodicCheck();
+    virtual void GetPeriodicCheckHandles(vector<HANDLE>& handles);
+    virtual DWORD GetPeriodicCheckInterval() const;
 
     // IPsiphonTunnelCoreNoticeHandler
     void HandlePsiphonTunnelCoreNotice(const string& noticeType, const string& timestamp, const Json::Value& data);
+    bool WantsPsiphonTunnelCoreNotice(const string& noticeType);
 
     bool RequestingUrlProxyWithoutTunnel();
     void TransportConnectHelper();
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "cpu_features.h"
+
+#if defined(SIMD_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+
+static SimdInstructionSet DetectSimdInstructionSet()
+{
+#if defined(SIMD_X86) && defined(__GNUC__)
+    // These also check that the OS saves the YMM registers
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#elif defined(SIMD_X86)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+
+    // AVX2 also needs the OS to save the YMM registers on context switches
+    bool avx2 = false;
+    if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6)
+    {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+    }
+
+    return avx2 ? SIMD_AVX2 : sse2 ? SIMD_SSE2 : SIMD_NONE;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+static SimdInstructionSet g_simdLimit = SIMD_AVX2;
+
+SimdInstructionSet GetSimdInstructionSet()
+{
+    static const SimdInstructionSet instructionSet = DetectSimdInstructionSet();
+    return instructionSet < g_simdLimit ? instructionSet : g_simdLimit;
+}
+
+void LimitSimdInstructionSet(SimdInstructionSet limit)
+{
+    g_simdLimit = limit;
+}
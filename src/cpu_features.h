@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+// SIMD code paths are only built for x86; everything else uses the scalar code.
+// (With GCC and Clang, only for x86-64, where SSE2 is always available.)
+#if defined(_M_IX86) || defined(_M_X64) || defined(__x86_64__)
+#define SIMD_X86
+#endif
+
+// Marks a function that uses AVX2 instructions. MSVC allows them anywhere;
+// GCC and Clang need to be told, per function, since the rest of the build
+// can't assume the CPU has them.
+#if defined(SIMD_X86) && defined(__GNUC__)
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SIMD_TARGET_AVX2
+#endif
+
+
+enum SimdInstructionSet
+{
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+// Returns the widest SIMD instruction set that both the CPU and the OS
+// support. (Detected once.)
+SimdInstructionSet GetSimdInstructionSet();
+
+// Makes GetSimdInstructionSet return no more than `limit`, so tests can run
+// each implementation on a CPU that supports them all. Not for use while
+// other threads may be calling GetSimdInstructionSet.
+void LimitSimdInstructionSet(SimdInstructionSet limit);
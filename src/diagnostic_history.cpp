@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include <algorithm>
+#include "diagnostic_history.h"
+
+
+// An arena's buffer starts at this size (or its quota, if smaller) and
+// doubles as needed, up to its quota. Most categories never come close to
+// their quota, so there's no point committing it up front.
+static const size_t MIN_ARENA_BUFFER_SIZE = 4 * 1024;
+
+
+DiagnosticHistory::DiagnosticHistory(size_t defaultQuota)
+    : m_defaultQuota(defaultQuota),
+      m_nextSequence(0),
+      m_evictedRecords(0),
+      m_droppedRecords(0)
+{
+}
+
+void DiagnosticHistory::SetQuota(const string& category, size_t quota)
+{
+    Arena& arena = m_arenas[category];
+    if (arena.buffer.empty())
+    {
+        arena.quota = quota;
+    }
+}
+
+DiagnosticHistory::Arena& DiagnosticHistory::GetArena(const string& category)
+{
+    auto arena = m_arenas.find(category);
+    if (arena == m_arenas.end())
+    {
+        arena = m_arenas.insert(make_pair(category, Arena())).first;
+        arena->second.quota = m_defaultQuota;
+    }
+    return arena->second;
+}
+
+bool DiagnosticHistory::Arena::FindRoom(size_t length, size_t& o_offset) const
+{
+    // Records are kept contiguous, so one that doesn't fit before the end of
+    // the buffer goes at its start, and the gap left at the end is unused
+    // until the records before it are evicted.
+
+    if (records.empty())
+    {
+        o_offset = 0;
+        return buffer.size() >= length;
+    }
+
+    const Record& oldest = records.front();
+    const Record& newest = records.back();
+    size_t end = newest.offset + newest.length;
+
+    if (newest.offset >= oldest.offset)
+    {
+        // [oldest, newest] is one span; there's room after it and before it
+        if (buffer.size() - end >= length)
+        {
+            o_offset = end;
+            return true;
+        }
+        if (oldest.offset >= length)
+        {
+            o_offset = 0;
+            return true;
+        }
+    }
+    else if (oldest.offset - end >= length)
+    {
+        // The records wrap around; the room is between newest and oldest
+        o_offset = end;
+        return true;
+    }
+
+    return false;
+}
+
+void DiagnosticHistory::Arena::Grow(size_t minimumSize)
+{
+    size_t size = min(max(max(buffer.size() * 2, MIN_ARENA_BUFFER_SIZE), minimumSize), quota);
+
+    // The records may wrap around the end of the old buffer, so they're
+    // copied into the new one in order, from its start.
+    vector<char> grown(size);
+    size_t offset = 0;
+    for (auto record = records.begin(); record != records.end(); ++record)
+    {
+        memcpy(&grown[offset], &buffer[record->offset], record->length);
+        record->offset = offset;
+        offset += record->length;
+    }
+
+    buffer.swap(grown);
+}
+
+size_t DiagnosticHistory::Arena::Allocate(size_t length, size_t& evictedRecords)
+{
+    // Grow the buffer while it's below the quota; after that, make room by
+    // evicting the oldest records.
+    size_t offset;
+    while (!FindRoom(length, offset))
+    {
+        if (buffer.size() < quota)
+        {
+            Grow(recordBytes + length);
+            continue;
+        }
+
+        recordBytes -= records.front().length;
+        records.pop_front();
+        evictedRecords++;
+    }
+
+    return offset;
+}
+
+bool DiagnosticHistory::Add(const string& category, const char* record, size_t length)
+{
+    Arena& arena = GetArena(category);
+
+    if (length == 0 || length > arena.quota)
+    {
+        m_droppedRecords++;
+        return false;
+    }
+
+    Record header;
+    header.sequence = m_nextSequence++;
+    header.offset = arena.Allocate(length, m_evictedRecords);
+    header.length = length;
+
+    memcpy(&arena.buffer[header.offset], record, length);
+    arena.records.push_back(header);
+    arena.recordBytes += length;
+
+    return true;
+}
+
+bool DiagnosticHistory::GetRecords(
+    uint64_t& io_sequence,
+    uint64_t endSequence,
+    size_t maxBytes,
+    vector<string>& o_records) const
+{
+    o_records.clear();
+
+    // Merge the categories' records, which are each in sequence order,
+    // starting from the first in each at or after io_sequence
+
+    vector<const Arena*> arenas;
+    vector<size_t> next;
+    for (auto arena = m_arenas.begin(); arena != m_arenas.end(); ++arena)
+    {
+        const deque<Record>& records = arena->second.records;
+        auto first = lower_bound(records.begin(), records.end(), io_sequence,
+            [](const Record& record, uint64_t sequence) { return record.sequence < sequence; });
+        if (first != records.end())
+        {
+            arenas.push_back(&arena->second);
+            next.push_back(first - records.begin());
+        }
+    }
+
+    size_t bytes = 0;
+    while (bytes < maxBytes)
+    {
+        size_t oldest = arenas.size();
+        for (size_t i = 0; i < arenas.size(); i++)
+        {
+            if (next[i] < arenas[i]->records.size()
+                && (oldest == arenas.size()
+                    || arenas[i]->records[next[i]].sequence < arenas[oldest]->records[next[oldest]].sequence))
+            {
+                oldest = i;
+            }
+        }
+
+        if (oldest == arenas.size() || arenas[oldest]->records[next[oldest]].sequence >= endSequence)
+        {
+            break;
+        }
+
+        const Record& record = arenas[oldest]->records[next[oldest]++];
+        o_records.push_back(string(&arenas[oldest]->buffer[record.offset], record.length));
+        bytes += record.length;
+        io_sequence = record.sequence + 1;
+    }
+
+    return !o_records.empty();
+}
+
+DiagnosticHistoryMemoryUsage DiagnosticHistory::GetMemoryUsage() const
+{
+    DiagnosticHistoryMemoryUsage usage;
+
+    for (auto arena = m_arenas.begin(); arena != m_arenas.end(); ++arena)
+    {
+        usage.records += arena->second.records.size();
+        usage.recordBytes += arena->second.recordBytes;
+        usage.allocatedBytes += arena->second.buffer.size()
+            + arena->second.records.size() * sizeof(Record);
+    }
+
+    usage.evictedRecords = m_evictedRecords;
+    usage.droppedRecords = m_droppedRecords;
+
+    return usage;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+using namespace std;
+
+
+/*
+Diagnostic history store.
+
+Entries are kept as serialized records -- they're only needed again when
+feedback is sent -- grouped by category. Each category has a quota of bytes,
+which its records are packed into as a ring: when a new record doesn't fit,
+the category's oldest records are evicted to make room. So a chatty category
+(like tunnel core notices) can't push out the entries of a quiet one, and the
+store can't grow without limit however long the client runs.
+
+Not thread safe.
+*/
+
+struct DiagnosticHistoryMemoryUsage
+{
+    DiagnosticHistoryMemoryUsage()
+        : records(0), recordBytes(0), allocatedBytes(0), evictedRecords(0), droppedRecords(0) {}
+
+    size_t records;
+    // The size of the records currently held, and of the memory held for them.
+    size_t recordBytes;
+    size_t allocatedBytes;
+    // Records evicted to make room for newer ones, and records that were
+    // larger than their category's quota, so weren't stored.
+    size_t evictedRecords;
+    size_t droppedRecords;
+};
+
+class DiagnosticHistory
+{
+public:
+    // Categories without a quota of their own get defaultQuota bytes.
+    DiagnosticHistory(size_t defaultQuota);
+
+    // Only takes effect for a category that has had no records added.
+    void SetQuota(const string& category, size_t quota);
+
+    // Returns false if the record is larger than the category's quota.
+    bool Add(const string& category, const char* record, size_t length);
+
+    // Records are numbered in the order they're added, across categories.
+    // This is the number the next one will get.
+    uint64_t NextSequence() const { return m_nextSequence; }
+
+    // Gets the records, of all categories and oldest first, numbered from
+    // io_sequence up to but not including endSequence -- stopping after the
+    // first record that brings the total past maxBytes -- and advances
+    // io_sequence past them. Returns false if there were none.
+    // So the records can be got in batches, without holding up writers.
+    bool GetRecords(
+        uint64_t& io_sequence,
+        uint64_t endSequence,
+        size_t maxBytes,
+        vector<string>& o_records) const;
+
+    DiagnosticHistoryMemoryUsage GetMemoryUsage() const;
+
+private:
+    struct Record
+    {
+        uint64_t sequence;
+        size_t offset;
+        size_t length;
+    };
+
+    // One category's records, packed into a buffer that grows geometrically
+    // as records are added, up to the quota.
+    struct Arena
+    {
+        Arena() : quota(0), recordBytes(0) {}
+
+        // Returns the offset at which length bytes can be written, growing
+        // the buffer or evicting records as needed. length must not exceed
+        // quota.
+        size_t Allocate(size_t length, size_t& evictedRecords);
+
+        bool FindRoom(size_t length, size_t& o_offset) const;
+        void Grow(size_t minimumSize);
+
+        size_t quota;
+        vector<char> buffer;
+        deque<Record> records;
+        size_t recordBytes;
+    };
+
+    Arena& GetArena(const string& category);
+
+    size_t m_defaultQuota;
+    map<string, Arena> m_arenas;
+    uint64_t m_nextSequence;
+    size_t m_evictedRecords;
+    size_t m_droppedRecords;
+};
@@ -28,6 +28,7 @@
 #include "usersettings.h"
 #include "config.h"
 #include "psicashlib.h"
+#include "json_gzip_sink.h"
 #include <VersionHelpers.h>
 
 #pragma warning(push, 0)
@@ -36,22 +37,63 @@
 #pragma warning(pop)
 
 
+// Tunnel core notices make up most of the history, so they get most of it.
+static const size_t DIAGNOSTIC_HISTORY_DEFAULT_QUOTA = 1024 * 1024;
+static const size_t DIAGNOSTIC_HISTORY_CORE_NOTICE_QUOTA = 4 * 1024 * 1024;
+
+static DiagnosticHistory* CreateDiagnosticHistory()
+{
+    DiagnosticHistory* history = new DiagnosticHistory(DIAGNOSTIC_HISTORY_DEFAULT_QUOTA);
+    history->SetQuota("CoreNotice", DIAGNOSTIC_HISTORY_CORE_NOTICE_QUOTA);
+    return history;
+}
+
 HANDLE g_diagnosticHistoryMutex = CreateMutex(NULL, FALSE, 0);
-Json::Value g_diagnosticHistory(Json::arrayValue);
+static DiagnosticHistory* g_diagnosticHistory = CreateDiagnosticHistory();
+
 
+// Entries are stored as they'll appear in feedback:
+// {"msg":<message>,"timestamp!!timestamp":<timestamp>,"data":<JSON value>}
+static void AddDiagnosticHistoryEntry(const char* message, const char* data, size_t dataLength)
+{
+    string entry;
+    entry.reserve(64 + dataLength);
+    entry += "{\"msg\":";
+    entry += Json::valueToQuotedString(message);
+    entry += ",\"timestamp!!timestamp\":\"";
+    entry += WStringToUTF8(GetISO8601DatetimeString());
+    entry += "\",\"data\":";
+    entry.append(data, dataLength);
+    entry += "}";
+
+    OutputDebugStringA(entry.c_str());
+    OutputDebugStringA("\n");
+
+    AutoMUTEX mutex(g_diagnosticHistoryMutex);
+    g_diagnosticHistory->Add(message, entry.data(), entry.size());
+}
 
-// This is really just a non-template wrapper around AddDiagnosticInfo, to help
-// users of it recognize that they can pass a Json::Value.
 void AddDiagnosticInfoJson(const char* message, const Json::Value& jsonValue)
 {
-    AddDiagnosticInfo(message, jsonValue);
+    Json::FastWriter jsonWriter;
+    string jsonString = jsonWriter.write(jsonValue);
+
+    // FastWriter appends a newline
+    size_t length = jsonString.size();
+    while (length > 0 && jsonString[length - 1] == '\n')
+    {
+        length--;
+    }
+
+    AddDiagnosticHistoryEntry(message, jsonString.data(), length);
 }
 
 void AddDiagnosticInfoJson(const char* message, const char* jsonString)
 {
-    if (!jsonString) {
-        AddDiagnosticInfo(message, Json::nullValue);
-
+    if (!jsonString)
+    {
+        AddDiagnosticInfoJson(message, Json::Value(Json::nullValue));
+        return;
     }
 
     Json::Value json;
@@ -62,14 +104,49 @@ void AddDiagnosticInfoJson(const char* message, const char* jsonString)
         return;
     }
 
-    AddDiagnosticInfo(message, json);
+    AddDiagnosticInfoJson(message, json);
 }
 
-void GetDiagnosticHistory(Json::Value& o_json)
+void AddDiagnosticInfoValidJson(const char* message, const char* jsonString, size_t length)
+{
+    // Trailing whitespace (e.g., a carriage return) is valid, but not needed
+    while (length > 0 && isspace((unsigned char)jsonString[length - 1]))
+    {
+        length--;
+    }
+
+    AddDiagnosticHistoryEntry(message, jsonString, length);
+}
+
+// Writes the entries numbered before end; see DiagnosticHistory::NextSequence.
+static void WriteDiagnosticHistory(uint64_t end, JSONStreamWriter& writer)
+{
+    // The lock is only held while copying each batch, not while writing it
+    const size_t BATCH_SIZE = 64 * 1024;
+
+    uint64_t next = 0;
+    vector<string> entries;
+    while (true)
+    {
+        {
+            AutoMUTEX mutex(g_diagnosticHistoryMutex);
+            if (!g_diagnosticHistory->GetRecords(next, end, BATCH_SIZE, entries))
+            {
+                break;
+            }
+        }
+
+        for (auto entry = entries.begin(); entry != entries.end(); ++entry)
+        {
+            writer.RawValue(entry->data(), entry->size());
+        }
+    }
+}
+
+DiagnosticHistoryMemoryUsage GetDiagnosticHistoryMemoryUsage()
 {
-    o_json.clear();
     AutoMUTEX mutex(g_diagnosticHistoryMutex);
-    o_json = Json::Value(g_diagnosticHistory);
+    return g_diagnosticHistory->GetMemoryUsage();
 }
 
 
@@ -1347,66 +1424,155 @@ Json::Value GetPsiCashDiagnosticData() {
     return jsonValue;
 }
 
-string GenerateFeedbackJSON(
+FeedbackData::FeedbackData(
         const string& feedback,
         const string& emailAddress,
         const string& surveyJSON,
         bool sendDiagnosticInfo)
+    : feedback(feedback),
+      emailAddress(emailAddress),
+      surveyJSON(surveyJSON),
+      sendDiagnosticInfo(sendDiagnosticInfo),
+      compress(Settings::CompressFeedback())
 {
-    if (feedback.empty() && !sendDiagnosticInfo)
-    {
-        // nothing to do
-        return "";
-    }
-
     CryptoPP::AutoSeededRandomPool rng;
     const size_t randBytesLen = 8;
     byte randBytes[randBytesLen];
     rng.GenerateBlock(randBytes, randBytesLen);
-    string feedbackID = Hexlify(randBytes, randBytesLen);
+    id = Hexlify(randBytes, randBytesLen);
 
-    Json::Value outJson(Json::objectValue);
+    AutoMUTEX mutex(g_diagnosticHistoryMutex);
+    diagnosticHistoryEnd = g_diagnosticHistory->NextSequence();
+}
 
-    // Metadata
-    outJson["Metadata"] = Json::Value(Json::objectValue);
-    outJson["Metadata"]["platform"] = "windows";
-    outJson["Metadata"]["version"] = 2;
-    outJson["Metadata"]["id"] = feedbackID;
+// Writes the DiagnosticInfo and Feedback members of the feedback object.
+static void WriteFeedbackContent(const FeedbackData& feedbackData, JSONStreamWriter& writer)
+{
+    // Each section is written as soon as it's generated, and the diagnostic
+    // history -- usually the bulk of the data -- a batch of entries at a
+    // time, so only a small part of the feedback is in memory at once.
 
     // Diagnostic info
-    if (sendDiagnosticInfo)
+    if (feedbackData.sendDiagnosticInfo)
     {
-        outJson["DiagnosticInfo"] = Json::Value(Json::objectValue);
-        GetDiagnosticInfo(outJson["DiagnosticInfo"]);
+        writer.Key("DiagnosticInfo");
+        writer.BeginObject();
+
+        {
+            Json::Value diagnosticInfo(Json::objectValue);
+            GetDiagnosticInfo(diagnosticInfo);
+            for (auto member = diagnosticInfo.begin(); member != diagnosticInfo.end(); ++member)
+            {
+                writer.Key(member.name().c_str());
+                writer.Value(*member);
+            }
+        }
 
-        outJson["DiagnosticInfo"]["DiagnosticHistory"] = Json::Value(Json::arrayValue);
-        GetDiagnosticHistory(outJson["DiagnosticInfo"]["DiagnosticHistory"]);
+        writer.Key("DiagnosticHistory");
+        writer.BeginArray();
+        WriteDiagnosticHistory(feedbackData.diagnosticHistoryEnd, writer);
+        writer.EndArray();
 
-        outJson["DiagnosticInfo"]["PsiCash"] = GetPsiCashDiagnosticData();
+        DiagnosticHistoryMemoryUsage usage = GetDiagnosticHistoryMemoryUsage();
+        my_print(NOT_SENSITIVE, true, _T("%s: diagnostic history: %d entries, %d bytes (%d allocated), %d evicted, %d dropped"),
+            __TFUNCTION__, (int)usage.records, (int)usage.recordBytes, (int)usage.allocatedBytes,
+            (int)usage.evictedRecords, (int)usage.droppedRecords);
+
+        writer.Key("PsiCash");
+        writer.Value(GetPsiCashDiagnosticData());
+
+        writer.EndObject();
     }
 
     // Feedback
     // NOTE: If the user supplied an email address but no feedback, then the
     // email address is discarded.
-    if (!feedback.empty() || !surveyJSON.empty())
+    if (!feedbackData.feedback.empty() || !feedbackData.surveyJSON.empty())
     {
-        outJson["Feedback"] = Json::Value(Json::objectValue);
+        writer.Key("Feedback");
+        writer.BeginObject();
+
+        writer.Key("Message");
+        writer.BeginObject();
+        writer.Key("text");
+        writer.Value(feedbackData.feedback);
+        writer.EndObject();
 
-        outJson["Feedback"]["email"] = emailAddress;
+        writer.Key("Survey");
+        writer.BeginObject();
+        writer.Key("json");
+        writer.Value(feedbackData.surveyJSON);
+        writer.EndObject();
 
-        outJson["Feedback"]["Message"] = Json::Value(Json::objectValue);
-        outJson["Feedback"]["Message"]["text"] = feedback;
+        writer.Key("email");
+        writer.Value(feedbackData.emailAddress);
 
-        outJson["Feedback"]["Survey"] = Json::Value(Json::objectValue);
-        outJson["Feedback"]["Survey"]["json"] = surveyJSON;
+        writer.EndObject();
     }
+}
 
-    //
-    // Upload the feedback/diagnostic info
-    //
+// contentEncoding may be NULL.
+static void WriteFeedbackMetadata(const FeedbackData& feedbackData, const char* contentEncoding, JSONStreamWriter& writer)
+{
+    writer.Key("Metadata");
+    writer.BeginObject();
+    if (contentEncoding)
+    {
+        writer.Key("contentEncoding");
+        writer.Value(string(contentEncoding));
+    }
+    writer.Key("id");
+    writer.Value(feedbackData.id);
+    writer.Key("platform");
+    writer.Value(string("windows"));
+    writer.Key("version");
+    writer.Value(Json::Value(2));
+    writer.EndObject();
+}
 
-    Json::FastWriter jsonWriter;
-    string outJsonString = jsonWriter.write(outJson);
+bool WriteFeedbackJSON(const FeedbackData& feedbackData, IJSONStreamSink& sink)
+{
+    if (feedbackData.feedback.empty() && !feedbackData.sendDiagnosticInfo)
+    {
+        // nothing to do
+        return true;
+    }
+
+    JSONStreamWriter writer(sink);
+    writer.BeginObject();
+
+    if (!feedbackData.compress)
+    {
+        WriteFeedbackContent(feedbackData, writer);
+        WriteFeedbackMetadata(feedbackData, NULL, writer);
+    }
+    else
+    {
+        // The content is written, as its own object, into a gzip stream,
+        // which goes into the "Body" string as base64. Metadata, which the
+        // server needs to decode the rest, stays as it is.
+        //   {"Body":"<base64 gzip {"DiagnosticInfo":...,"Feedback":...}>",
+        //    "Metadata":{"contentEncoding":"gzip",...}}
+
+        writer.Key("Body");
+        try
+        {
+            (void)WriteGzipBase64String(writer, [&feedbackData](JSONStreamWriter& contentWriter) {
+                contentWriter.BeginObject();
+                WriteFeedbackContent(feedbackData, contentWriter);
+                contentWriter.EndObject();
+            });
+        }
+        catch (std::exception& ex)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s - feedback compression failed: %S"), __TFUNCTION__, ex.what());
+            return false;
+        }
+
+        WriteFeedbackMetadata(feedbackData, "gzip", writer);
+    }
+
+    writer.EndObject();
 
-    return outJsonString;
+    return writer.Finish();
 }
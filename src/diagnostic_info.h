@@ -19,6 +19,9 @@
 
 #pragma once
 
+#include "diagnostic_history.h"
+#include "json_stream_writer.h"
+
 
 /**
 Should be called before Psiphon has attempted to connect or made any system
@@ -27,23 +30,39 @@ network changes.
 void DoStartupDiagnosticCollection();
 
 /**
-Returns feedback data encoded as a JSON string. The returned JSON will omit
-diagnostic data if sendDiagnosticInfo is false, i.e. the user did not opt in
-to sending diagnostic data. If the user did not write any feedback, i.e the
-feedback parameter string is empty, and sendDiagnosticInfo is false, then
-the return value is an empty string.
+What's sent in a feedback upload. The JSON encoding of it is generated as it's
+written to the upload (see WriteFeedbackJSON), rather than held in memory.
+The diagnostic history is included as of when the FeedbackData was created,
+however many times it's written.
 */
-string GenerateFeedbackJSON(
+struct FeedbackData
+{
+    FeedbackData(
         const string& feedback,
         const string& emailAddress,
         const string& surveyJSON,
         bool sendDiagnosticInfo);
 
+    string id;
+    string feedback;
+    string emailAddress;
+    string surveyJSON;
+    bool sendDiagnosticInfo;
+    uint64_t diagnosticHistoryEnd;
+    // Whether the content is gzip compressed. Defaults to
+    // Settings::CompressFeedback().
+    bool compress;
+};
 
-// Forward declarations. Do not access directly. (They're only here because the
-// template function needs them.)
-extern vector<string> g_diagnosticInfo;
-void _AddDiagnosticInfoHelper(const char* entry);
+/**
+Writes feedback data encoded as JSON to the sink. The JSON will omit
+diagnostic data if sendDiagnosticInfo is false, i.e. the user did not opt in
+to sending diagnostic data. If the user did not write any feedback, i.e the
+feedback parameter string is empty, and sendDiagnosticInfo is false, then
+nothing is written.
+Returns false if writing to the sink failed.
+*/
+bool WriteFeedbackJSON(const FeedbackData& feedbackData, IJSONStreamSink& sink);
 
 
 /**
@@ -54,6 +73,12 @@ void _AddDiagnosticInfoHelper(const char* entry);
 void AddDiagnosticInfoJson(const char* message, const Json::Value& jsonValue);
 void AddDiagnosticInfoJson(const char* message, const char* jsonString);
 
+/**
+As AddDiagnosticInfoJson, for a stringified JSON value that the caller has
+already checked is valid. It's stored as is, without being parsed again.
+*/
+void AddDiagnosticInfoValidJson(const char* message, const char* jsonString, size_t length);
+
 
 /**
 `message` is the identifier for this entry.
@@ -63,21 +88,15 @@ https://open-source-parsers.github.io/jsoncpp-docs/doxygen/class_json_1_1_value.
 template<typename T>
 void AddDiagnosticInfo(const char* message, const T& entry)
 {
-    Json::Value json(Json::objectValue);
-    json["timestamp!!timestamp"] = WStringToUTF8(GetISO8601DatetimeString());
-    json["msg"] = message;
-    json["data"] = entry;
-
-    Json::FastWriter jsonWriter;
-    string jsonString = jsonWriter.write(json);
-
-    OutputDebugStringA(jsonString.c_str());
-    OutputDebugStringA("\n");
-
-    AutoMUTEX mutex(g_diagnosticHistoryMutex);
-    g_diagnosticHistory.append(json);
+    AddDiagnosticInfoJson(message, Json::Value(entry));
 }
 
+/**
+The size of the diagnostic history, which is bounded: once a kind of entry
+has used its share, the oldest entries of that kind are discarded.
+*/
+DiagnosticHistoryMemoryUsage GetDiagnosticHistoryMemoryUsage();
+
 
 //
 // Utilities
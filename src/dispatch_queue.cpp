@@ -4,37 +4,40 @@
 using namespace std;
 
 
-dispatch_queue::dispatch_queue(std::string name, size_t thread_cnt) :
-    name_(name), threads_(thread_cnt)
+dispatch_queue::dispatch_queue(std::string name, size_t thread_cnt, TaskPriority priority) :
+    name_(name), max_running_(thread_cnt), priority_(priority)
 {
     printf("Creating dispatch queue: %s\n", name.c_str());
-    printf("Dispatch threads: %zu\n", thread_cnt);
-
-    for (size_t i = 0; i < threads_.size(); i++)
-    {
-        threads_[i] = std::thread(&dispatch_queue::dispatch_thread_handler, this);
-    }
+    printf("Dispatch concurrency: %zu\n", thread_cnt);
 }
 
 dispatch_queue::~dispatch_queue()
 {
-    printf("Destructor: Destroying dispatch threads...\n");
+    printf("Destructor: Destroying dispatch queue...\n");
 
-    // Signal to dispatch threads that it's time to wrap up
+    // Signal to draining tasks that it's time to wrap up, and wait for
+    // them to finish their current op before we exit
     std::unique_lock<std::mutex> lock(lock_);
     quit_ = true;
-    lock.unlock();
-    cv_.notify_all();
+    cv_.wait(lock, [this] {
+        return running_ == 0;
+    });
+}
 
-    // Wait for threads to finish before we exit
-    for (size_t i = 0; i < threads_.size(); i++)
+// Must be called with lock_ held
+void dispatch_queue::start_drain_if_needed(void)
+{
+    if (quit_ || running_ >= max_running_ || running_ >= q_.size())
     {
-        if (threads_[i].joinable())
-        {
-            printf("Destructor: Joining thread %zu until completion\n", i);
-            threads_[i].join();
-        }
+        return;
     }
+
+    running_++;
+
+    // Submitting doesn't block, so it's fine to do with the lock held
+    (void)TaskExecutor::Instance().Submit(priority_, [this](const CancellationToken&) {
+        drain_handler();
+    });
 }
 
 bool dispatch_queue::dispatch(int op_type, const vector<int>& skip_if_op_type_queued, const fp_t& op)
@@ -50,10 +53,7 @@ bool dispatch_queue::dispatch(int op_type, const vector<int>& skip_if_op_type_qu
     }
     q_.emplace_back(op_type, op);
 
-    // Manual unlocking is done before notifying, to avoid waking up
-    // the waiting thread only to block again (see notify_one for details)
-    lock.unlock();
-    cv_.notify_all();
+    start_drain_if_needed();
 
     return true;
 }
@@ -71,36 +71,33 @@ bool dispatch_queue::dispatch(int op_type, const vector<int>& skip_if_op_type_qu
     }
     q_.emplace_back(op_type, std::move(op));
 
-    // Manual unlocking is done before notifying, to avoid waking up
-    // the waiting thread only to block again (see notify_one for details)
-    lock.unlock();
-    cv_.notify_all();
+    start_drain_if_needed();
 
     return true;
 }
 
-void dispatch_queue::dispatch_thread_handler(void)
+// Runs queued ops until there are none left, as a TaskExecutor task. There
+// are at most max_running_ of these at once.
+void dispatch_queue::drain_handler(void)
 {
     std::unique_lock<std::mutex> lock(lock_);
 
-    do {
-        //Wait until we have data or a quit signal
-        cv_.wait(lock, [this] {
-            return (q_.size() || quit_);
-        });
+    while (!quit_ && q_.size())
+    {
+        auto op = std::move(q_.front().second);
+        q_.pop_front();
+
+        //unlock now that we're done messing with the queue
+        lock.unlock();
 
-        //after wait, we own the lock
-        if (!quit_ && q_.size())
-        {
-            auto op = std::move(q_.front().second);
-            q_.pop_front();
+        op();
 
-            //unlock now that we're done messing with the queue
-            lock.unlock();
+        lock.lock();
+    }
 
-            op();
+    running_--;
 
-            lock.lock();
-        }
-    } while (!quit_);
+    // Notified with the lock still held: once it's released, the destructor
+    // may return, and this must not be touched again.
+    cv_.notify_all();
 }
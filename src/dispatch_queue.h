@@ -8,12 +8,15 @@
 #include <mutex>
 #include <vector>
 #include <deque>
+#include "task_executor.h"
 
 class dispatch_queue {
     typedef std::function<void(void)> fp_t;
 
 public:
-    dispatch_queue(std::string name, size_t thread_cnt = 1);
+    // Ops are run on the TaskExecutor, at most thread_cnt at a time. With a
+    // thread_cnt of 1, they're run one at a time, in order.
+    dispatch_queue(std::string name, size_t thread_cnt = 1, TaskPriority priority = TASK_PRIORITY_UI);
     ~dispatch_queue();
 
     // dispatch and copy
@@ -30,10 +33,13 @@ public:
 private:
     std::string name_;
     std::mutex lock_;
-    std::vector<std::thread> threads_;
+    size_t max_running_;
+    size_t running_ = 0;
+    TaskPriority priority_;
     std::deque<std::pair<int, fp_t>> q_;
     std::condition_variable cv_;
     bool quit_ = false;
 
-    void dispatch_thread_handler(void);
+    void start_drain_if_needed(void);
+    void drain_handler(void);
 };
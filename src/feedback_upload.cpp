@@ -88,11 +88,11 @@ void FeedbackUpload::DoStop(bool cleanly)
 FeedbackUpload
 ******************************************************************************/
 
-FeedbackUpload::FeedbackUpload(const string& diagnosticData,
+FeedbackUpload::FeedbackUpload(const FeedbackData& feedbackData,
                                const string& upstreamProxyAddress,
                                const StopInfo& stopInfo)
     : m_uploadStatus(FEEDBACK_UPLOAD_STATUS_IN_PROGRESS),
-      m_diagnosticData(diagnosticData),
+      m_feedbackData(feedbackData),
       m_stopInfo(stopInfo),
       m_upstreamProxyAddress(upstreamProxyAddress)
 {
@@ -155,7 +155,7 @@ void FeedbackUpload::SendFeedbackHelper()
     }
 
     // Run subprocess; it will begin uploading the feedback
-    if (!SpawnFeedbackUploadProcess(out.configFilePath, m_diagnosticData))
+    if (!SpawnFeedbackUploadProcess(out.configFilePath))
     {
         throw FeedbackUploadFailed();
     }
@@ -164,7 +164,124 @@ void FeedbackUpload::SendFeedbackHelper()
 }
 
 
-bool FeedbackUpload::SpawnFeedbackUploadProcess(const tstring& configFilename, const string& diagnosticData)
+/*
+Writes the feedback JSON to the upload subprocess's stdin as it's generated.
+A write doesn't complete while the pipe is full, until the subprocess has
+read from it, so the JSON is generated no faster than the subprocess takes
+it. The writes are overlapped, and while one is pending the subprocess's
+output is consumed as it arrives: otherwise the subprocess could block
+writing output, and never read the input we're waiting on it to read.
+A pending write is abandoned if the subprocess exits or we're stopped.
+*/
+class SubprocessInputSink : public IJSONStreamSink
+{
+public:
+    SubprocessInputSink(Subprocess& subprocess, const StopInfo& stopInfo)
+        : m_subprocess(subprocess), m_stopInfo(stopInfo), m_stopEvent(stopInfo)
+    {
+        ZeroMemory(&m_overlapped, sizeof(m_overlapped));
+        m_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL); // manual reset
+    }
+
+    ~SubprocessInputSink()
+    {
+        if (m_overlapped.hEvent != NULL)
+        {
+            CloseHandle(m_overlapped.hEvent);
+        }
+    }
+
+    bool Write(const char* data, size_t length)
+    {
+        if (m_overlapped.hEvent == NULL)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s - CreateEvent failed (%d)"), __TFUNCTION__, GetLastError());
+            return false;
+        }
+
+        HANDLE pipe = m_subprocess.ParentInputPipe();
+
+        while (length > 0)
+        {
+            if (!WriteFile(pipe, data, (DWORD)min(length, (size_t)MAXDWORD), NULL, &m_overlapped)
+                && GetLastError() != ERROR_IO_PENDING)
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s - failed to write diagnostic data to subprocess stdin (%d)"), __TFUNCTION__, GetLastError());
+                return false;
+            }
+
+            if (!WaitForWrite())
+            {
+                // The buffer must outlive the write, so wait for the
+                // cancellation to complete
+                DWORD ignored;
+                CancelIo(pipe);
+                (void)GetOverlappedResult(pipe, &m_overlapped, &ignored, TRUE);
+                return false;
+            }
+
+            DWORD numWritten = 0;
+            if (!GetOverlappedResult(pipe, &m_overlapped, &numWritten, FALSE))
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s - failed to write diagnostic data to subprocess stdin (%d)"), __TFUNCTION__, GetLastError());
+                return false;
+            }
+
+            data += numWritten;
+            length -= numWritten;
+        }
+
+        return true;
+    }
+
+private:
+    // Waits for the pending write to complete, consuming the subprocess's
+    // output meanwhile. Returns false if the subprocess exits or we're
+    // stopped first.
+    bool WaitForWrite()
+    {
+        while (true)
+        {
+            m_subprocess.ConsumeSubprocessOutput();
+
+            if (HasOverlappedIoCompleted(&m_overlapped))
+            {
+                return true;
+            }
+
+            if (m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons, false))
+            {
+                my_print(NOT_SENSITIVE, true, _T("%s - stopped writing diagnostic data to subprocess stdin"), __TFUNCTION__);
+                return false;
+            }
+
+            HANDLE waitHandles[] = { m_overlapped.hEvent, m_subprocess.OutputEvent(), m_subprocess.Process(), m_stopEvent.Get() };
+            DWORD waitHandlesCount = (m_stopEvent.Get() != NULL) ? 4 : 3;
+            // Can't wait for the stop signal without the event, so poll it
+            DWORD waitMilliseconds = (m_stopEvent.Get() != NULL) ? INFINITE : 100;
+
+            DWORD result = WaitForMultipleObjects(waitHandlesCount, waitHandles, FALSE, waitMilliseconds);
+            if (result == WAIT_FAILED)
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s - WaitForMultipleObjects failed (%d)"), __TFUNCTION__, GetLastError());
+                return false;
+            }
+            if (result == WAIT_OBJECT_0 + 2)
+            {
+                // The write event comes first, so it wasn't set
+                my_print(NOT_SENSITIVE, false, _T("%s - subprocess exited before reading diagnostic data"), __TFUNCTION__);
+                return false;
+            }
+        }
+    }
+
+    Subprocess& m_subprocess;
+    const StopInfo& m_stopInfo;
+    StopSignalEvent m_stopEvent;
+    OVERLAPPED m_overlapped;
+};
+
+bool FeedbackUpload::SpawnFeedbackUploadProcess(const tstring& configFilename)
 {
     // See CoreTransport::SpawnCoreProcess for an explanation of the filename logic
     bool startSuccess = false;
@@ -222,18 +339,9 @@ bool FeedbackUpload::SpawnFeedbackUploadProcess(const tstring& configFilename, c
 
     // Write diagnostics to stdin of the child process
 
-    DWORD totalNumWritten = 0;
-    while (totalNumWritten < diagnosticData.length()) {
-        DWORD numWritten = 0;
-        if (!WriteFile(m_psiphonTunnelCore->ParentInputPipe(), diagnosticData.c_str(), diagnosticData.length(), &numWritten, NULL)) {
-            my_print(NOT_SENSITIVE, false, _T("%s - failed to write diagnostic data to subprocess stdin (%d)"), __TFUNCTION__, GetLastError());
-            return false;
-        }
-
-        if (numWritten != diagnosticData.length()) {
-            my_print(NOT_SENSITIVE, false, _T("%s - failed to write all diagnostic data to subprocess stdin, wrote %d of %d bytes"), __TFUNCTION__, numWritten, diagnosticData.length());
-        }
-        totalNumWritten += numWritten;
+    SubprocessInputSink sink(*m_psiphonTunnelCore, m_stopInfo);
+    if (!WriteFeedbackJSON(m_feedbackData, sink)) {
+        return false;
     }
 
     if (!m_psiphonTunnelCore->CloseInputPipes()) {
@@ -308,10 +416,32 @@ bool FeedbackUpload::DoPeriodicCheck()
 }
 
 
+void FeedbackUpload::GetPeriodicCheckHandles(vector<HANDLE>& handles)
+{
+    // See CoreTransport::GetPeriodicCheckHandles
+    if (m_psiphonTunnelCore)
+    {
+        handles.push_back(m_psiphonTunnelCore->OutputEvent());
+        handles.push_back(m_psiphonTunnelCore->Process());
+    }
+}
+
+
+DWORD FeedbackUpload::GetPeriodicCheckInterval() const
+{
+    return m_psiphonTunnelCore ? INFINITE : IWorkerThread::GetPeriodicCheckInterval();
+}
+
+
 void FeedbackUpload::HandlePsiphonTunnelCoreNotice(const string& noticeType, const string& timestamp, const Json::Value& data)
 {
 }
 
+bool FeedbackUpload::WantsPsiphonTunnelCoreNotice(const string& noticeType)
+{
+    return false;
+}
+
 
 bool FeedbackUpload::UploadCompleted() const
 {
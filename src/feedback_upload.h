@@ -24,6 +24,7 @@
 #include "transport.h"
 #include "transport_registry.h"
 #include "usersettings.h"
+#include "diagnostic_info.h"
 
 
 // The feedback upload is in progress
@@ -62,7 +63,7 @@ class FeedbackUpload : public IWorkerThread, public IPsiphonTunnelCoreNoticeHand
 {
 
 public:
-    FeedbackUpload(const string& diagnosticData,
+    FeedbackUpload(const FeedbackData& feedbackData,
                    const string& upstreamProxyAddress,
                    const StopInfo& stopInfo);
     virtual ~FeedbackUpload();
@@ -102,9 +103,12 @@ protected:
     void StopImminent();
     void DoStop(bool cleanly);
     virtual bool DoPeriodicCheck();
+    virtual void GetPeriodicCheckHandles(vector<HANDLE>& handles);
+    virtual DWORD GetPeriodicCheckInterval() const;
 
     // IPsiphonTunnelCoreNoticeHandler implementation
     void HandlePsiphonTunnelCoreNotice(const string& noticeType, const string& timestamp, const Json::Value& data);
+    bool WantsPsiphonTunnelCoreNotice(const string& noticeType);
 
     virtual void SendFeedback();
 
@@ -112,13 +116,13 @@ protected:
     May throw FeedbackUploadFailed.
     */
     void SendFeedbackHelper();
-    bool SpawnFeedbackUploadProcess(const tstring& configFilename, const string& diagnosticData);
+    bool SpawnFeedbackUploadProcess(const tstring& configFilename);
 
 protected:
     tstring m_exePath;
     atomic<DWORD> m_uploadStatus;
     WorkerThreadSynch m_workerThreadSynch;
-    string m_diagnosticData;
+    FeedbackData m_feedbackData;
     string m_upstreamProxyAddress;
     StopInfo m_stopInfo;
     unique_ptr<PsiphonTunnelCore> m_psiphonTunnelCore;
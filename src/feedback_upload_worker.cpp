@@ -25,11 +25,11 @@
 #include "feedback_upload_worker.h"
 
 
-FeedbackUploadWorker::FeedbackUploadWorker(const string& diagnosticData, const bool vpnModeStarted,
+FeedbackUploadWorker::FeedbackUploadWorker(const FeedbackData& feedbackData, const bool vpnModeStarted,
                                            const string& upstreamProxyAddress, const StopInfo& stopInfo)
     : m_isVPNMode(vpnModeStarted)
 {
-    m_feedbackUpload = make_unique<FeedbackUpload>(diagnosticData, upstreamProxyAddress, stopInfo);
+    m_feedbackUpload = make_unique<FeedbackUpload>(feedbackData, upstreamProxyAddress, stopInfo);
 }
 
 
@@ -66,3 +66,9 @@ bool FeedbackUploadWorker::UploadSuccessful() const
 {
     return m_feedbackUpload->UploadStatus() == FEEDBACK_UPLOAD_STATUS_SUCCESS;
 }
+
+
+HANDLE FeedbackUploadWorker::StoppedEvent() const
+{
+    return m_feedbackUpload->GetStoppedEvent();
+}
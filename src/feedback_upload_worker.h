@@ -29,7 +29,7 @@
 class FeedbackUploadWorker
 {
 public:
-    FeedbackUploadWorker(const string& diagnosticData, const bool vpnModeStarted,
+    FeedbackUploadWorker(const FeedbackData& feedbackData, const bool vpnModeStarted,
                          const string& upstreamProxyAddress, const StopInfo& stopInfo);
     ~FeedbackUploadWorker();
 
@@ -61,6 +61,12 @@ public:
     */
     bool UploadSuccessful() const;
 
+    /**
+    Returns an event that is set when the feedback upload stops, whether it
+    completed or was stopped.
+    */
+    HANDLE StoppedEvent() const;
+
 protected:
     bool m_isVPNMode;
     unique_ptr<FeedbackUpload> m_feedbackUpload;
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "hex_codec.h"
+#include "cpu_features.h"
+#include <cstdint>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+/***********************************************
+Scalar implementation
+*/
+
+static const unsigned char INVALID_HEX_DIGIT = 0xFF;
+
+struct HexTables
+{
+    HexTables()
+    {
+        static const char* const digits = "0123456789ABCDEF";
+
+        for (int i = 0; i < 256; i++)
+        {
+            encode[i][0] = digits[i >> 4];
+            encode[i][1] = digits[i & 15];
+            decode[i] = INVALID_HEX_DIGIT;
+        }
+        for (int i = 0; i < 16; i++)
+        {
+            decode[(unsigned char)digits[i]] = (unsigned char)i;
+            decode[(unsigned char)tolower(digits[i])] = (unsigned char)i;
+        }
+    }
+
+    char encode[256][2];
+    unsigned char decode[256];
+};
+
+static const HexTables& GetHexTables()
+{
+    static const HexTables tables;
+    return tables;
+}
+
+static void HexEncodeScalar(const unsigned char* input, size_t inputLength, char* output)
+{
+    const HexTables& tables = GetHexTables();
+
+    for (size_t i = 0; i < inputLength; i++)
+    {
+        output[2 * i] = tables.encode[input[i]][0];
+        output[2 * i + 1] = tables.encode[input[i]][1];
+    }
+}
+
+// inputLength must be even
+static bool HexDecodeScalar(const char* input, size_t inputLength, unsigned char* output)
+{
+    const HexTables& tables = GetHexTables();
+
+    // Accumulate invalid digits rather than branching on each one
+    unsigned char invalid = 0;
+    for (size_t i = 0; i < inputLength; i += 2)
+    {
+        unsigned char high = tables.decode[(unsigned char)input[i]];
+        unsigned char low = tables.decode[(unsigned char)input[i + 1]];
+        invalid |= high | low;
+        output[i / 2] = (unsigned char)((high << 4) | low);
+    }
+
+    return !(invalid & 0xF0);
+}
+
+
+#ifdef SIMD_X86
+
+/***********************************************
+SSE2 implementation
+*/
+
+// Converts each byte (0-15) to its uppercase hex digit.
+static inline __m128i NibblesToHexSSE2(__m128i nibbles)
+{
+    // '0' + n, plus 7 more for n > 9 to get from ':' to 'A'
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+    return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+
+// Converts each hex digit to its value (0-15). Sets o_valid to 0xFF for
+// each byte that was a hex digit, or 0 if it wasn't.
+static inline __m128i HexToNibblesSSE2(__m128i digits, __m128i& o_valid)
+{
+    // There's no unsigned byte comparison, but x <= n iff min(x, n) == x
+    __m128i decimal = _mm_sub_epi8(digits, _mm_set1_epi8('0'));
+    __m128i isDecimal = _mm_cmpeq_epi8(_mm_min_epu8(decimal, _mm_set1_epi8(9)), decimal);
+
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(digits, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+
+    o_valid = _mm_or_si128(isDecimal, isLetter);
+    return _mm_or_si128(
+                _mm_and_si128(decimal, isDecimal),
+                _mm_and_si128(_mm_add_epi8(letter, _mm_set1_epi8(10)), isLetter));
+}
+
+// Combines each pair of nibbles (high nibble first) into one byte, in the
+// low byte of each 16-bit lane.
+static inline __m128i CombineNibblesSSE2(__m128i nibbles)
+{
+    __m128i combined = _mm_or_si128(_mm_slli_epi16(nibbles, 4), _mm_srli_epi16(nibbles, 8));
+    return _mm_and_si128(combined, _mm_set1_epi16(0x00FF));
+}
+
+static void HexEncodeSSE2(const unsigned char* input, size_t inputLength, char* output)
+{
+    size_t i = 0;
+    for (; i + 16 <= inputLength; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(input + i));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), _mm_set1_epi8(0x0F));
+        __m128i low = _mm_and_si128(bytes, _mm_set1_epi8(0x0F));
+
+        high = NibblesToHexSSE2(high);
+        low = NibblesToHexSSE2(low);
+
+        _mm_storeu_si128((__m128i*)(output + 2 * i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*)(output + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+    }
+
+    HexEncodeScalar(input + i, inputLength - i, output + 2 * i);
+}
+
+// inputLength must be even
+static bool HexDecodeSSE2(const char* input, size_t inputLength, unsigned char* output)
+{
+    __m128i allValid = _mm_set1_epi8(-1);
+
+    size_t i = 0;
+    for (; i + 32 <= inputLength; i += 32)
+    {
+        __m128i valid0, valid1;
+        __m128i nibbles0 = HexToNibblesSSE2(_mm_loadu_si128((const __m128i*)(input + i)), valid0);
+        __m128i nibbles1 = HexToNibblesSSE2(_mm_loadu_si128((const __m128i*)(input + i + 16)), valid1);
+        allValid = _mm_and_si128(allValid, _mm_and_si128(valid0, valid1));
+
+        __m128i bytes = _mm_packus_epi16(CombineNibblesSSE2(nibbles0), CombineNibblesSSE2(nibbles1));
+        _mm_storeu_si128((__m128i*)(output + i / 2), bytes);
+    }
+
+    return _mm_movemask_epi8(allValid) == 0xFFFF
+        && HexDecodeScalar(input + i, inputLength - i, output + i / 2);
+}
+
+
+/***********************************************
+AVX2 implementation
+
+The same as the SSE2 implementation, but twice as wide. AVX2 unpack and pack
+instructions work within each 128-bit lane, so results are permuted back
+into order before being stored.
+*/
+
+SIMD_TARGET_AVX2 static inline __m256i NibblesToHexAVX2(__m256i nibbles)
+{
+    __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(nibbles, _mm256_set1_epi8(9)), _mm256_set1_epi8(7));
+    return _mm256_add_epi8(_mm256_add_epi8(nibbles, _mm256_set1_epi8('0')), letters);
+}
+
+SIMD_TARGET_AVX2 static inline __m256i HexToNibblesAVX2(__m256i digits, __m256i& o_valid)
+{
+    __m256i decimal = _mm256_sub_epi8(digits, _mm256_set1_epi8('0'));
+    __m256i isDecimal = _mm256_cmpeq_epi8(_mm256_min_epu8(decimal, _mm256_set1_epi8(9)), decimal);
+
+    __m256i letter = _mm256_sub_epi8(_mm256_or_si256(digits, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i isLetter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+
+    o_valid = _mm256_or_si256(isDecimal, isLetter);
+    return _mm256_or_si256(
+                _mm256_and_si256(decimal, isDecimal),
+                _mm256_and_si256(_mm256_add_epi8(letter, _mm256_set1_epi8(10)), isLetter));
+}
+
+SIMD_TARGET_AVX2 static inline __m256i CombineNibblesAVX2(__m256i nibbles)
+{
+    __m256i combined = _mm256_or_si256(_mm256_slli_epi16(nibbles, 4), _mm256_srli_epi16(nibbles, 8));
+    return _mm256_and_si256(combined, _mm256_set1_epi16(0x00FF));
+}
+
+SIMD_TARGET_AVX2 static void HexEncodeAVX2(const unsigned char* input, size_t inputLength, char* output)
+{
+    size_t i = 0;
+    for (; i + 32 <= inputLength; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(input + i));
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), _mm256_set1_epi8(0x0F));
+        __m256i low = _mm256_and_si256(bytes, _mm256_set1_epi8(0x0F));
+
+        high = NibblesToHexAVX2(high);
+        low = NibblesToHexAVX2(low);
+
+        // Per lane: unpacklo holds input bytes 0-7 and 16-23, unpackhi 8-15 and 24-31
+        __m256i interleavedLow = _mm256_unpacklo_epi8(high, low);
+        __m256i interleavedHigh = _mm256_unpackhi_epi8(high, low);
+
+        _mm256_storeu_si256((__m256i*)(output + 2 * i), _mm256_permute2x128_si256(interleavedLow, interleavedHigh, 0x20));
+        _mm256_storeu_si256((__m256i*)(output + 2 * i + 32), _mm256_permute2x128_si256(interleavedLow, interleavedHigh, 0x31));
+    }
+
+    HexEncodeSSE2(input + i, inputLength - i, output + 2 * i);
+}
+
+SIMD_TARGET_AVX2 static bool HexDecodeAVX2(const char* input, size_t inputLength, unsigned char* output)
+{
+    __m256i allValid = _mm256_set1_epi8(-1);
+
+    size_t i = 0;
+    for (; i + 64 <= inputLength; i += 64)
+    {
+        __m256i valid0, valid1;
+        __m256i nibbles0 = HexToNibblesAVX2(_mm256_loadu_si256((const __m256i*)(input + i)), valid0);
+        __m256i nibbles1 = HexToNibblesAVX2(_mm256_loadu_si256((const __m256i*)(input + i + 32)), valid1);
+        allValid = _mm256_and_si256(allValid, _mm256_and_si256(valid0, valid1));
+
+        // Per lane, the pack interleaves the two inputs' halves; put them back in order
+        __m256i bytes = _mm256_packus_epi16(CombineNibblesAVX2(nibbles0), CombineNibblesAVX2(nibbles1));
+        bytes = _mm256_permute4x64_epi64(bytes, 0xD8);
+        _mm256_storeu_si256((__m256i*)(output + i / 2), bytes);
+    }
+
+    // Clear the upper halves of the registers before running SSE2 code
+    bool valid = _mm256_movemask_epi8(allValid) == -1;
+    _mm256_zeroupper();
+
+    return valid && HexDecodeSSE2(input + i, inputLength - i, output + i / 2);
+}
+
+#endif // SIMD_X86
+
+
+/***********************************************
+Public interface
+*/
+
+void HexEncode(const unsigned char* input, size_t inputLength, char* output)
+{
+#ifdef SIMD_X86
+    switch (GetSimdInstructionSet())
+    {
+    case SIMD_AVX2:
+        HexEncodeAVX2(input, inputLength, output);
+        return;
+    case SIMD_SSE2:
+        HexEncodeSSE2(input, inputLength, output);
+        return;
+    default:
+        break;
+    }
+#endif
+
+    HexEncodeScalar(input, inputLength, output);
+}
+
+bool HexDecode(const char* input, size_t inputLength, unsigned char* output)
+{
+    if (inputLength & 1)
+    {
+        return false;
+    }
+
+#ifdef SIMD_X86
+    switch (GetSimdInstructionSet())
+    {
+    case SIMD_AVX2:
+        return HexDecodeAVX2(input, inputLength, output);
+    case SIMD_SSE2:
+        return HexDecodeSSE2(input, inputLength, output);
+    default:
+        break;
+    }
+#endif
+
+    return HexDecodeScalar(input, inputLength, output);
+}
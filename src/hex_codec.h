@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+
+
+/*
+Hex encoding and decoding into caller-provided buffers.
+
+These are the allocation-free primitives behind Hexlify and Dehexlify (see
+utilities.h). Large inputs are processed with SSE2 or AVX2, whichever the CPU
+supports, and a table-driven scalar implementation handles the rest.
+*/
+
+// Writes the uppercase hex encoding of the input -- exactly 2*inputLength
+// characters, not NUL-terminated -- to output.
+void HexEncode(const unsigned char* input, size_t inputLength, char* output);
+
+// Decodes inputLength hex digits, of either case, into inputLength/2 bytes at
+// output. Returns false if inputLength is odd or the input contains anything
+// other than hex digits; the contents of output are then unspecified.
+bool HexDecode(const char* input, size_t inputLength, unsigned char* output);
@@ -630,13 +630,18 @@ bool HTTPSRequest::MakeRequestWithURLProxyOption(
         return false;
     }
 
-    // Wait for asynch callback to close, or timeout (to check cancel/termination)
+    // Wait for asynch callback to close, or for cancel/termination
+
+    StopSignalEvent stopEvent(stopInfo);
 
     while (true)
     {
-        DWORD result = WaitForSingleObject(m_closedEvent, 100);
+        HANDLE waitHandles[] = { m_closedEvent, stopEvent.Get() };
+        DWORD result = (stopEvent.Get() != NULL)
+                        ? WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE)
+                        : WaitForSingleObject(m_closedEvent, 100);
 
-        if (result == WAIT_TIMEOUT)
+        if (result == WAIT_TIMEOUT || result == WAIT_OBJECT_0 + 1)
         {
             if (stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons, false))
             {
@@ -708,53 +713,15 @@ bool HTTPSRequest::ValidateServerCert(PCCERT_CONTEXT pCert)
         return false;
     }
 
-    BYTE* pbBinary = NULL; //base64 decoded pem
-    DWORD cbBinary = 0; //base64 decoded pem size
-    bool bResult = false;
-
-    //Base64 decode pem string to BYTE*
-
-    //Get the expected pbBinary length
-    if (!CryptStringToBinaryA(
-            (LPCSTR)m_expectedServerCertificate.c_str(), m_expectedServerCertificate.length(),
-            CRYPT_STRING_BASE64, NULL, &cbBinary, NULL, NULL))
-    {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("HTTPSRequest::ValidateServerCert:%d - CryptStringToBinaryA failed (%d)"), __LINE__, GetLastError());
-        return false;
-    }
-
-    pbBinary = new (std::nothrow) BYTE[cbBinary];
-    if (!pbBinary)
-    {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("ValidateServerCert: memory allocation failed"));
-        return false;
-    }
-
-    //Perform base64 decode
-    if (!CryptStringToBinaryA(
-        (LPCSTR)m_expectedServerCertificate.c_str(), m_expectedServerCertificate.length(),
-        CRYPT_STRING_BASE64, pbBinary, &cbBinary, NULL, NULL))
+    //Base64 decode pem string
+    string expectedCertificate = Base64Decode(m_expectedServerCertificate);
+    if (expectedCertificate.empty())
     {
-        my_print(NOT_SENSITIVE, m_silentMode, _T("HTTPSRequest::ValidateServerCert:%d - CryptStringToBinaryA failed (%d)"), __LINE__, GetLastError());
+        my_print(NOT_SENSITIVE, m_silentMode, _T("HTTPSRequest::ValidateServerCert:%d - Base64Decode failed"), __LINE__);
         return false;
     }
 
     // Check if the certificate in pCert matches the expectedServerCertificate
-    if (pCert->cbCertEncoded == cbBinary)
-    {
-        bResult = true;
-
-        for (unsigned int i = 0; i < cbBinary; ++i)
-        {
-            if (pCert->pbCertEncoded[i] != pbBinary[i])
-            {
-                bResult = false;
-                break;
-            }
-        }
-    }
-
-    delete pbBinary;
-
-    return bResult;
+    return pCert->cbCertEncoded == expectedCertificate.length()
+        && 0 == memcmp(pCert->pbCertEncoded, expectedCertificate.data(), expectedCertificate.length());
 }
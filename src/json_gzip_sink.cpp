@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "json_gzip_sink.h"
+#include "base64_codec.h"
+#include <stdexcept>
+
+#pragma warning(push, 0)
+#pragma warning(disable: 4244)
+#include "zlib.h"
+#pragma warning(pop)
+
+
+// How much compressed output is encoded and passed on at a time.
+static const size_t DEFLATE_CHUNK_SIZE = 16 * 1024;
+
+// Gzips what's written to it, as it's written, into a base64 string value in
+// a JSONStreamWriter.
+class GzipBase64Sink : public IJSONStreamSink
+{
+public:
+    GzipBase64Sink(JSONStreamWriter& writer)
+        : m_writer(writer),
+          m_compressed(DEFLATE_CHUNK_SIZE)
+    {
+        memset(&m_stream, 0, sizeof(m_stream));
+
+        // 16 + MAX_WBITS writes a gzip wrapper rather than a zlib one.
+        if (Z_OK != deflateInit2(&m_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY))
+        {
+            throw std::runtime_error("deflateInit2 failed");
+        }
+    }
+
+    ~GzipBase64Sink()
+    {
+        deflateEnd(&m_stream);
+    }
+
+    bool Write(const char* data, size_t length)
+    {
+        Deflate(data, length, Z_NO_FLUSH);
+        return !m_writer.Failed();
+    }
+
+    void Finish()
+    {
+        Deflate(NULL, 0, Z_FINISH);
+
+        m_encoded.clear();
+        m_base64.Final(m_encoded);
+        m_writer.StringPart(m_encoded.data(), m_encoded.length());
+    }
+
+private:
+    // Compresses the data, passing all of the output that's ready on to
+    // the writer, encoded.
+    void Deflate(const char* data, size_t length, int flush)
+    {
+        m_stream.next_in = (Bytef*)data;
+        m_stream.avail_in = (uInt)length;
+
+        do
+        {
+            m_stream.next_out = &m_compressed[0];
+            m_stream.avail_out = (uInt)m_compressed.size();
+
+            int ret = deflate(&m_stream, flush);
+            if (ret == Z_STREAM_ERROR || (flush == Z_FINISH && ret != Z_STREAM_END && m_stream.avail_out != 0))
+            {
+                throw std::runtime_error("deflate failed");
+            }
+
+            m_encoded.clear();
+            m_base64.Update(&m_compressed[0], m_compressed.size() - m_stream.avail_out, m_encoded);
+            m_writer.StringPart(m_encoded.data(), m_encoded.length());
+        } while (m_stream.avail_out == 0);
+    }
+
+    JSONStreamWriter& m_writer;
+    z_stream m_stream;
+    vector<unsigned char> m_compressed;
+    Base64Encoder m_base64;
+    string m_encoded;
+};
+
+
+bool WriteGzipBase64String(JSONStreamWriter& writer, const function<void(JSONStreamWriter&)>& writeContent)
+{
+    writer.BeginString();
+    {
+        GzipBase64Sink gzipSink(writer);
+        JSONStreamWriter contentWriter(gzipSink);
+        writeContent(contentWriter);
+        if (contentWriter.Finish())
+        {
+            gzipSink.Finish();
+        }
+    }
+    writer.EndString();
+
+    return !writer.Failed();
+}
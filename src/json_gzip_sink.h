@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <functional>
+#include "json_stream_writer.h"
+
+
+/**
+Writes a string value to `writer` holding the gzip compressed, base64 encoded
+JSON that `writeContent` writes to the writer it's passed. The content is
+compressed and encoded as it's written, straight into `writer`'s output --
+base64 needs no escaping in a JSON string -- so only the compressor's window
+is held in memory, however large the content.
+
+Returns false if writing to `writer`'s sink failed. Throws
+std::runtime_error if compression fails.
+*/
+bool WriteGzipBase64String(JSONStreamWriter& writer, const function<void(JSONStreamWriter&)>& writeContent);
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "json_stream_writer.h"
+
+
+JSONStreamWriter::JSONStreamWriter(IJSONStreamSink& sink, size_t bufferSize)
+    : m_sink(sink),
+      m_buffer(bufferSize),
+      m_buffered(0),
+      m_failed(false),
+      m_afterKey(false)
+{
+}
+
+void JSONStreamWriter::Flush()
+{
+    if (m_buffered > 0 && !m_failed)
+    {
+        m_failed = !m_sink.Write(&m_buffer[0], m_buffered);
+    }
+    m_buffered = 0;
+}
+
+void JSONStreamWriter::Append(const char* data, size_t length)
+{
+    if (m_failed)
+    {
+        return;
+    }
+
+    if (m_buffered + length > m_buffer.size())
+    {
+        Flush();
+
+        // Data larger than the buffer goes straight to the sink
+        if (length > m_buffer.size())
+        {
+            m_failed = m_failed || !m_sink.Write(data, length);
+            return;
+        }
+    }
+
+    memcpy(&m_buffer[m_buffered], data, length);
+    m_buffered += length;
+}
+
+void JSONStreamWriter::BeginValue()
+{
+    if (m_afterKey)
+    {
+        m_afterKey = false;
+        return;
+    }
+
+    if (!m_hasMembers.empty())
+    {
+        if (m_hasMembers.back())
+        {
+            Append(",", 1);
+        }
+        m_hasMembers.back() = true;
+    }
+}
+
+void JSONStreamWriter::BeginObject()
+{
+    BeginValue();
+    Append("{", 1);
+    m_hasMembers.push_back(false);
+}
+
+void JSONStreamWriter::EndObject()
+{
+    m_hasMembers.pop_back();
+    Append("}", 1);
+}
+
+void JSONStreamWriter::BeginArray()
+{
+    BeginValue();
+    Append("[", 1);
+    m_hasMembers.push_back(false);
+}
+
+void JSONStreamWriter::EndArray()
+{
+    m_hasMembers.pop_back();
+    Append("]", 1);
+}
+
+void JSONStreamWriter::Key(const char* name)
+{
+    BeginValue();
+    Append(Json::valueToQuotedString(name));
+    Append(":", 1);
+    m_afterKey = true;
+}
+
+void JSONStreamWriter::Value(const Json::Value& value)
+{
+    Json::FastWriter jsonWriter;
+    string json = jsonWriter.write(value);
+
+    // FastWriter appends a newline
+    size_t length = json.size();
+    if (length > 0 && json[length - 1] == '\n')
+    {
+        length--;
+    }
+
+    RawValue(json.data(), length);
+}
+
+void JSONStreamWriter::Value(const string& value)
+{
+    BeginValue();
+    Append(Json::valueToQuotedString(value.c_str()));
+}
+
+void JSONStreamWriter::RawValue(const char* json, size_t length)
+{
+    BeginValue();
+    Append(json, length);
+}
+
+void JSONStreamWriter::BeginString()
+{
+    BeginValue();
+    Append("\"", 1);
+}
+
+void JSONStreamWriter::StringPart(const char* data, size_t length)
+{
+    Append(data, length);
+}
+
+void JSONStreamWriter::EndString()
+{
+    Append("\"", 1);
+}
+
+bool JSONStreamWriter::Finish()
+{
+    Flush();
+    return !m_failed;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <json/json.h>
+
+using namespace std;
+
+
+class IJSONStreamSink
+{
+public:
+    /**
+    Writes all of the data, blocking until it's written. Returns false if
+    it can't be, in which case nothing more is written to the sink.
+    */
+    virtual bool Write(const char* data, size_t length) = 0;
+};
+
+
+/**
+Writes a JSON document to a sink as it's built, rather than building it all
+in memory first. Output goes through a fixed size buffer, which is written
+to the sink whenever it fills, so the sink's pace -- e.g., a pipe that
+blocks until its reader catches up -- sets the writer's.
+
+The caller is responsible for the document's structure: keys only inside
+objects, and every Begin matched by an End. The writer only adds the
+separators between members.
+
+Once a write to the sink fails, everything else is discarded; Finish
+reports whether the whole document was written.
+*/
+class JSONStreamWriter
+{
+public:
+    JSONStreamWriter(IJSONStreamSink& sink, size_t bufferSize = 64 * 1024);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+
+    // Starts an object member, whose value is written next.
+    void Key(const char* name);
+
+    void Value(const Json::Value& value);
+    void Value(const string& value);
+    // A value that's already serialized JSON, written as is.
+    void RawValue(const char* json, size_t length);
+
+    // A string value written in parts -- e.g., as it's encoded. The parts
+    // are written as is, so mustn't contain anything that needs escaping.
+    void BeginString();
+    void StringPart(const char* data, size_t length);
+    void EndString();
+
+    // Whether a write to the sink has failed.
+    bool Failed() const { return m_failed; }
+
+    // Writes whatever is buffered. Returns false if anything failed to write.
+    bool Finish();
+
+private:
+    void BeginValue();
+    void Append(const char* data, size_t length);
+    void Append(const string& data) { Append(data.data(), data.size()); }
+    void Flush();
+
+    IJSONStreamSink& m_sink;
+    vector<char> m_buffer;
+    size_t m_buffered;
+    bool m_failed;
+
+    // For each open object or array, whether it has a member yet.
+    vector<bool> m_hasMembers;
+    // Set between a Key and its value.
+    bool m_afterKey;
+};
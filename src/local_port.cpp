@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "local_port.h"
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+
+#ifdef _WIN32
+
+const LocalPortSocket INVALID_LOCAL_PORT_SOCKET = INVALID_SOCKET;
+
+static bool SocketLibraryStartup()
+{
+    WSADATA wsaData;
+    return 0 == WSAStartup(MAKEWORD(2, 2), &wsaData);
+}
+
+static void SocketLibraryCleanup()
+{
+    WSACleanup();
+}
+
+static bool SetExclusive(LocalPortSocket sock)
+{
+    // Without this, Windows lets a socket bind to a port that another socket
+    // is bound to with SO_REUSEADDR, or on another address, so binding
+    // wouldn't show that the port is free. With it, the bind fails if any
+    // socket is using the port, and no socket can bind to it afterwards.
+    BOOL exclusive = TRUE;
+    return 0 == setsockopt(sock, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char*)&exclusive, sizeof(exclusive));
+}
+
+static void CloseLocalPortSocket(LocalPortSocket sock)
+{
+    closesocket(sock);
+}
+
+#else
+
+const LocalPortSocket INVALID_LOCAL_PORT_SOCKET = -1;
+
+static bool SocketLibraryStartup()
+{
+    return true;
+}
+
+static void SocketLibraryCleanup()
+{
+}
+
+static bool SetExclusive(LocalPortSocket sock)
+{
+    // Without SO_REUSEADDR, binding already fails if the port is in use.
+    return true;
+}
+
+static void CloseLocalPortSocket(LocalPortSocket sock)
+{
+    close(sock);
+}
+
+#endif
+
+
+LocalPortReservation::LocalPortReservation()
+    : m_socket(INVALID_LOCAL_PORT_SOCKET),
+      m_port(0)
+{
+}
+
+LocalPortReservation::~LocalPortReservation()
+{
+    Close();
+}
+
+bool LocalPortReservation::Reserve(int port, bool listen/*=false*/)
+{
+    Close();
+    m_port = 0;
+
+    if (port < 0 || port > 0xFFFF)
+    {
+        return false;
+    }
+
+    // Held for as long as the socket is, as WSACleanup would close it.
+    if (!SocketLibraryStartup())
+    {
+        return false;
+    }
+
+    LocalPortSocket sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)port);
+
+    socklen_t addrLength = sizeof(addr);
+
+    if (sock == INVALID_LOCAL_PORT_SOCKET
+        || !SetExclusive(sock)
+        || 0 != bind(sock, (const sockaddr*)&addr, sizeof(addr))
+        || (listen && 0 != ::listen(sock, SOMAXCONN))
+        // Learn which port the system assigned, if it was asked to
+        || 0 != getsockname(sock, (sockaddr*)&addr, &addrLength))
+    {
+        if (sock != INVALID_LOCAL_PORT_SOCKET)
+        {
+            CloseLocalPortSocket(sock);
+        }
+        SocketLibraryCleanup();
+        return false;
+    }
+
+    m_socket = sock;
+    m_port = ntohs(addr.sin_port);
+
+    return true;
+}
+
+bool LocalPortReservation::ReserveFirstFree(int firstPort, int lastPort, bool listen/*=false*/)
+{
+    // Port 0 would let the system choose
+    for (int port = max(firstPort, 1); port <= lastPort; port++)
+    {
+        if (Reserve(port, listen))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int LocalPortReservation::Port() const
+{
+    return m_port;
+}
+
+LocalPortSocket LocalPortReservation::Release()
+{
+    LocalPortSocket sock = m_socket;
+    if (sock != INVALID_LOCAL_PORT_SOCKET)
+    {
+        m_socket = INVALID_LOCAL_PORT_SOCKET;
+        // The socket library reference taken by Reserve goes with the
+        // socket, so that Winsock isn't shut down under it.
+    }
+    return sock;
+}
+
+void LocalPortReservation::Close()
+{
+    if (m_socket != INVALID_LOCAL_PORT_SOCKET)
+    {
+        CloseLocalPortSocket(m_socket);
+        m_socket = INVALID_LOCAL_PORT_SOCKET;
+        SocketLibraryCleanup();
+    }
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#ifdef _WIN32
+#include <WinSock2.h>
+typedef SOCKET LocalPortSocket;
+#else
+typedef int LocalPortSocket;
+#endif
+
+
+/**
+A localhost TCP port, held by a socket bound to it, so that nothing else can
+take it between finding that it's free and using it.
+
+Reserving either binds to the port asked for, or, if that's 0, lets the
+system assign a free one. Either way a single bind settles whether the port
+is available, however many of the ports nearby are in use. ReserveFirstFree
+instead takes the lowest free port in a range, so that the same port is
+chosen from run to run; a busy port costs it one failed bind.
+
+A consumer that can take a socket should take it with Release (listening on
+it first, with Reserve's `listen`), so that the port is never unbound. One
+that binds the port itself, by number, should be given Port, and Close called
+immediately before it starts.
+*/
+class LocalPortReservation
+{
+public:
+    LocalPortReservation();
+    ~LocalPortReservation();
+
+    /**
+    Binds a socket to 127.0.0.1:port, or to a port the system chooses if
+    `port` is 0, and listens on it if `listen` is true. Any previous
+    reservation is closed first. Returns false if the port is in use or the
+    socket couldn't be bound.
+    */
+    bool Reserve(int port, bool listen=false);
+
+    /**
+    Reserves the first port from `firstPort` to `lastPort`, inclusive, that
+    can be reserved. Returns false if none can.
+    */
+    bool ReserveFirstFree(int firstPort, int lastPort, bool listen=false);
+
+    /**
+    The reserved port, or 0 if nothing has been reserved. Remains valid after
+    Close and Release.
+    */
+    int Port() const;
+
+    /**
+    Gives up ownership of the bound socket, which the caller must close.
+    Returns the invalid socket value if there's no reservation.
+    */
+    LocalPortSocket Release();
+
+    /**
+    Closes the socket, freeing the port for the consumer to bind.
+    */
+    void Close();
+
+private:
+    // not copyable
+    LocalPortReservation(LocalPortReservation const&);
+    LocalPortReservation& operator=(LocalPortReservation const&);
+
+    LocalPortSocket m_socket;
+    int m_port;
+};
@@ -19,6 +19,7 @@
 
 #include "stdafx.h"
 #include "local_proxy.h"
+#include "local_port.h"
 #include "logging.h"
 #include "psiclient.h"
 #include "utilities.h"
@@ -31,6 +32,9 @@
 
 #define POLIPO_CONNECTION_TIMEOUT_SECONDS   20
 
+// Ends each Polipo stats entry. Polipo doesn't write a newline after them.
+#define POLIPO_STATS_ENTRY_END              "<<"
+
 
 LocalProxy::LocalProxy(
                 ILocalProxyStatsCollector* statsCollector,
@@ -41,15 +45,12 @@ LocalProxy::LocalProxy(
     : m_statsCollector(statsCollector),
       m_systemProxySettings(systemProxySettings),
       m_parentPort(parentPort),
-      m_polipoPipe(NULL),
       m_bytesTransferred(0),
       m_lastStatusSendTimeMS(0),
       m_splitTunnelingFilePath(splitTunnelingFilePath),
       m_finalStatsSent(false),
       m_serverAddress(serverAddress)
 {
-    ZeroMemory(&m_polipoProcessInfo, sizeof(m_polipoProcessInfo));
-
     m_mutex = CreateMutex(NULL, FALSE, 0);
     if (m_mutex == NULL)
     {
@@ -91,11 +92,13 @@ bool LocalProxy::DoStart()
     // Ensure we start from a disconnected/clean state
     Cleanup(false);
 
-    int localHttpProxyPort = Settings::LocalHttpProxyPort();
+    int configuredHttpProxyPort = Settings::LocalHttpProxyPort();
+    int localHttpProxyPort = 0;
 
     // See CoreTransport::SpawnCoreProcess for an explanation of the filename logic
     bool startSuccess = false;
     for (int i = -1; i < 5; i++) {
+        tstring polipoPath;
         if (i < 0) {
             filesystem::path tempPath;
             if (!GetSysTempPath(tempPath)) {
@@ -103,44 +106,50 @@ bool LocalProxy::DoStart()
                 return false;
             }
 
-            m_polipoPath = tempPath / "psiphon-local-proxy.exe";
+            polipoPath = tempPath / "psiphon-local-proxy.exe";
         }
         else {
-            if (!GetUniqueTempFilename(_T(".exe"), m_polipoPath, i)) {
+            if (!GetUniqueTempFilename(_T(".exe"), polipoPath, i)) {
                 my_print(NOT_SENSITIVE, true, _T("%s:%d - GetUniqueTempFilename failed: %d"), __TFUNCTION__, __LINE__, GetLastError());
                 // This is unlikely to be recoverable with more attempts
                 return false;
             }
         }
 
-        if (!ExtractExecutable(IDR_POLIPO_EXE, m_polipoPath))
+        if (!ExtractExecutable(IDR_POLIPO_EXE, polipoPath))
         {
             continue;
         }
 
-        if (localHttpProxyPort == 0)
+        // The Subprocess deletes the executable file on cleanup. Its output
+        // is split into stats entries, rather than lines, so that each entry
+        // is handled as soon as it's written.
+        m_polipo = make_unique<Subprocess>(polipoPath, this, true, POLIPO_STATS_ENTRY_END);
+
+        // Hold the port until Polipo is about to bind it. If no port is
+        // configured, use the first free one from 1024 up, so that it's the
+        // same from run to run for users who point other applications at it.
+        LocalPortReservation portReservation;
+        bool reserved = (configuredHttpProxyPort == 0)
+                            ? portReservation.ReserveFirstFree(1024, 1024 + 60000)
+                            : portReservation.Reserve(configuredHttpProxyPort);
+        if (!reserved)
         {
-            // Choose the port automatically
-            localHttpProxyPort = 1024;
-            if (!TestForOpenPort(localHttpProxyPort, 60000, m_stopInfo))
+            if (configuredHttpProxyPort == 0)
             {
                 my_print(NOT_SENSITIVE, false, _T("HTTP proxy could not find an available port."));
-                // This is unlikely to be recoverable with more attempts
-                return false;
             }
-        }
-        else
-        {
-            // Require the specified port
-            if (!TestForOpenPort(localHttpProxyPort, 0, m_stopInfo))
+            else
             {
-                my_print(NOT_SENSITIVE, false, _T("Port is not available for HTTP proxy to listen on: %d"), localHttpProxyPort);
-                // This is unlikely to be recoverable with more attempts
-                return false;
+                my_print(NOT_SENSITIVE, false, _T("Port is not available for HTTP proxy to listen on: %d"), configuredHttpProxyPort);
             }
+            // This is unlikely to be recoverable with more attempts
+            return false;
         }
 
-        if (!StartPolipo(localHttpProxyPort))
+        localHttpProxyPort = portReservation.Port();
+
+        if (!StartPolipo(portReservation))
         {
             // The executable file is deleted by Cleanup
             Cleanup(false);
@@ -172,40 +181,63 @@ bool LocalProxy::DoPeriodicCheck()
 {
     // Check if we've lost the Polipo process
 
-    if (m_polipoProcessInfo.hProcess != 0)
+    if (m_polipo)
     {
-        // The polipo process handle will be signalled when the process terminates
-        DWORD result = WaitForSingleObject(m_polipoProcessInfo.hProcess, 0);
-
-        if (result == WAIT_TIMEOUT)
+        try
         {
-            // Everything normal; process stats and return
+            DWORD status = m_polipo->Status();
+
+            if (status == SUBPROCESS_STATUS_RUNNING)
+            {
+                // Everything normal; process stats and return
+
+                // Output must be drained even when not collecting stats, or
+                // Polipo would block writing to a full pipe.
+                m_polipo->ConsumeSubprocessOutput();
 
-            // We don't care about the return value of ProcessStatsAndStatus
-            (void)ProcessStatsAndStatus(false);
+                // We don't care about the return value of ProcessStatsAndStatus
+                (void)ProcessStatsAndStatus(false);
 
-            return true;
+                return true;
+            }
+            else if (status == SUBPROCESS_STATUS_EXITED)
+            {
+                // Process any final output
+                m_polipo->ConsumeSubprocessOutput();
+                return false;
+            }
         }
-        else if (result == WAIT_OBJECT_0)
+        catch (Subprocess::Error& error)
         {
-            // The process has signalled -- which implies that it's died
+            my_print(NOT_SENSITIVE, false, _T("%s - caught Subprocess::Error: %s"), __TFUNCTION__, error.GetMessage().c_str());
             return false;
         }
-        else
-        {
-            std::stringstream s;
-            s << __FUNCTION__ << ": WaitForSingleObject failed (" << result << ", " << GetLastError() << ")";
-            throw Error(s.str().c_str());
-        }
     }
 
     // If we're here, then there's no Polipo process at all (which is weird, but...)
     return false;
 }
 
+void LocalProxy::GetPeriodicCheckHandles(vector<HANDLE>& handles)
+{
+    // Notice the process dying, or writing stats, right away
+    if (m_polipo)
+    {
+        handles.push_back(m_polipo->OutputEvent());
+        handles.push_back(m_polipo->Process());
+    }
+}
+
+DWORD LocalProxy::GetPeriodicCheckInterval() const
+{
+    // Stats are sent based on elapsed time, so check now and then even
+    // without any output.
+    return 1000;
+}
+
 void LocalProxy::StopImminent()
 {
-    if (m_polipoProcessInfo.hProcess != 0)
+    if (m_polipo)
     {
         // We are (probably) connected, so send a final stats message
         my_print(NOT_SENSITIVE, true, _T("%s: Stopping cleanly. Sending final stats."), __TFUNCTION__);
@@ -225,41 +257,8 @@ void LocalProxy::DoStop(bool cleanly)
 
 void LocalProxy::Cleanup(bool doStats)
 {
-    auto deleteExe = finally([=]() {
-        if (!m_polipoPath.empty() && !DeleteFile(m_polipoPath.c_str()))
-        {
-            // We sometimes see random DeleteFile failures with ERROR_ACCESS_DENIED.
-            // This may be due to ongoing virus scanning of a newly written executable.
-            // Sleeping seems effective in allowing a subsequent DeleteFile to succeed,
-            // although the exact time needed to sleep surely varies by system.
-            Sleep(1000);
-            if (!DeleteFile(m_polipoPath.c_str())) {
-                my_print(NOT_SENSITIVE, true, _T("%s:%d - DeleteFile failed: %d"), __TFUNCTION__, __LINE__, GetLastError());
-            }
-        }
-        m_polipoPath.clear();
-    });
-
-    // Give the process an opportunity for graceful shutdown, then terminate
-    if (m_polipoProcessInfo.hProcess != 0
-        && m_polipoProcessInfo.hProcess != INVALID_HANDLE_VALUE)
-    {
-        StopProcess(m_polipoProcessInfo.dwProcessId, m_polipoProcessInfo.hProcess);
-    }
-
-    if (m_polipoProcessInfo.hProcess != 0
-        && m_polipoProcessInfo.hProcess != INVALID_HANDLE_VALUE)
-    {
-        CloseHandle(m_polipoProcessInfo.hProcess);
-    }
-    ZeroMemory(&m_polipoProcessInfo, sizeof(m_polipoProcessInfo));
-
-    if (m_polipoPipe!= 0
-        && m_polipoPipe != INVALID_HANDLE_VALUE)
-    {
-        CloseHandle(m_polipoPipe);
-    }
-    m_polipoPipe = NULL;
+    // Stops the process, gracefully if possible, and deletes the executable
+    m_polipo.reset();
 
     m_lastStatusSendTimeMS = 0;
 
@@ -291,20 +290,23 @@ void LocalProxy::Cleanup(bool doStats)
 }
 
 
-bool LocalProxy::StartPolipo(int localHttpProxyPort)
+bool LocalProxy::StartPolipo(LocalPortReservation& portReservation)
 {
+    int localHttpProxyPort = portReservation.Port();
+
     // Start polipo, with no disk cache and no web admin interface
     // (same recommended settings as Tor: http://www.pps.jussieu.fr/~jch/software/polipo/tor.html
 
+    // Subprocess puts the executable path in front of these
     tstringstream polipoCommandLine;
 
-    polipoCommandLine << m_polipoPath
-                      << _T(" psiphonStats=true")
+    polipoCommandLine << _T(" psiphonStats=true")
                       << _T(" proxyPort=") << localHttpProxyPort
                       // Polipo is now built with -DNO_DISK_CACHE
                       // << _T(" diskCacheRoot=\"\"")
                       << _T(" disableLocalInterface=true")
-                      << _T(" logLevel=1");
+                      // Errors (0x1), and info (0x4) for the ready line
+                      << _T(" logLevel=5");
 
     // Use the parent proxy, if one is available for the current transport
     // also do split tunneling if there is a parent proxy
@@ -325,63 +327,34 @@ bool LocalProxy::StartPolipo(int localHttpProxyPort)
         }
     }
 
-    STARTUPINFO polipoStartupInfo;
-    ZeroMemory(&polipoStartupInfo, sizeof(polipoStartupInfo));
-    polipoStartupInfo.cb = sizeof(polipoStartupInfo);
+    // Polipo logs this, to the same pipe as its stats, once it's listening.
+    // It's seen as soon as it's read, although the stats framing won't hand
+    // it to HandleSubprocessOutputLine until the next stats entry.
+    ostringstream readyLine;
+    readyLine << "Established listening socket on port " << localHttpProxyPort << ".";
+    m_polipo->SetReadyLine(readyLine.str());
 
-    polipoStartupInfo.dwFlags = STARTF_USESTDHANDLES;
-    polipoStartupInfo.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-    if (!CreatePolipoPipe(polipoStartupInfo.hStdOutput, polipoStartupInfo.hStdError))
-    {
-        my_print(NOT_SENSITIVE, false, _T("%s - CreatePolipoPipe failed (%d)"), __TFUNCTION__, GetLastError());
-        return false;
-    }
+    // Polipo binds the port by number, so it can't be handed the reserved
+    // socket. Release the port as late as possible.
+    portReservation.Close();
 
-    if (!CreateProcess(
-            m_polipoPath.c_str(),
-            (TCHAR*)polipoCommandLine.str().c_str(),
-            NULL,
-            NULL,
-            TRUE, // bInheritHandles
-#ifdef _DEBUG
-            CREATE_NEW_PROCESS_GROUP,
-#else
-            CREATE_NEW_PROCESS_GROUP|CREATE_NO_WINDOW,
-#endif
-            NULL,
-            NULL,
-            &polipoStartupInfo,
-            &m_polipoProcessInfo))
+    if (!m_polipo->SpawnSubprocess(polipoCommandLine.str()))
     {
-        my_print(NOT_SENSITIVE, false, _T("%s - Polipo CreateProcess failed (%d)"), __TFUNCTION__, GetLastError());
+        my_print(NOT_SENSITIVE, false, _T("%s:%d - SpawnSubprocess failed"), __TFUNCTION__, __LINE__);
         return false;
     }
 
-    // Close the unneccesary handles
-    CloseHandle(m_polipoProcessInfo.hThread);
-    m_polipoProcessInfo.hThread = NULL;
-
-    // Close child pipe handle (do not continue to modify the parent).
-    // You need to make sure that no handles to the write end of the
-    // output pipe are maintained in this process or else the pipe will
-    // not close when the child process exits and the ReadFile will hang.
-    if (!CloseHandle(polipoStartupInfo.hStdOutput))
-    {
-        my_print(NOT_SENSITIVE, false, _T("%s:%d - CloseHandle failed (%d)"), __TFUNCTION__, __LINE__, GetLastError());
-        return false;
-    }
-    if (!CloseHandle(polipoStartupInfo.hStdError))
+    // Polipo doesn't read stdin
+    if (!m_polipo->CloseInputPipes())
     {
-        my_print(NOT_SENSITIVE, false, _T("%s:%d - CloseHandle failed (%d)"), __TFUNCTION__, __LINE__, GetLastError());
+        my_print(NOT_SENSITIVE, false, _T("%s:%d - CloseInputPipes failed"), __TFUNCTION__, __LINE__);
         return false;
     }
 
-    WaitForInputIdle(m_polipoProcessInfo.hProcess, 5000);
-
-    DWORD connected = WaitForConnectability(
-                        (USHORT)localHttpProxyPort,
+    // Falls back to probing the port if the ready line doesn't come
+    DWORD connected = m_polipo->WaitForReady(
                         POLIPO_CONNECTION_TIMEOUT_SECONDS*1000,
-                        m_polipoProcessInfo.hProcess,
+                        localHttpProxyPort,
                         m_stopInfo);
 
     if (ERROR_OPERATION_ABORTED == connected)
@@ -398,36 +371,23 @@ bool LocalProxy::StartPolipo(int localHttpProxyPort)
 }
 
 
-// Create the pipe that will be used to communicate between the Polipo child
-// process and this process. o_outputPipe write handle should be used as the stdout
-// of the Polipo process, and o_errorPipe as stderr.
-// (Both pipes are really the same, but duplicated.)
-// Returns true on success.
-bool LocalProxy::CreatePolipoPipe(HANDLE& o_outputPipe, HANDLE& o_errorPipe)
+// Polipo writes stats entries to stdout; see ParsePolipoStatsBuffer. Each
+// "line" is one entry, up to but not including POLIPO_STATS_ENTRY_END, with
+// whatever other output came before it.
+void LocalProxy::HandleSubprocessOutputLine(const char* line, size_t length)
 {
-    m_polipoPipe = INVALID_HANDLE_VALUE;
-    o_outputPipe = INVALID_HANDLE_VALUE;
-    o_errorPipe = INVALID_HANDLE_VALUE;
-
-    HANDLE parentInputPipe = INVALID_HANDLE_VALUE, childStdinPipe = INVALID_HANDLE_VALUE;
-
-    if (!CreateSubprocessPipes(
-            m_polipoPipe,
-            parentInputPipe,
-            childStdinPipe,
-            o_outputPipe,
-            o_errorPipe))
+    if (!m_statsCollector)
     {
-        return false;
+        // We're not collecting stats.
+        return;
     }
 
-    CloseHandle(parentInputPipe);
-    CloseHandle(childStdinPipe);
-
-    return true;
+    // ParsePolipoStatsBuffer needs a null-terminated string, with the entry
+    // end that the Subprocess split on
+    ParsePolipoStatsBuffer((string(line, length) + POLIPO_STATS_ENTRY_END).c_str());
 }
 
-// Check Polipo pipe for page view, bytes transferred, etc., info waiting to
+// Check Polipo output for page view, bytes transferred, etc., info waiting to
 // be processed; gather info; process; send to server.
 // If connected is true, the stats will only be sent to the server if certain
 // time or size limits have been exceeded; if connected is false, the stats will
@@ -451,36 +411,15 @@ bool LocalProxy::ProcessStatsAndStatus(bool final)
     static DWORD s_send_interval_ms = DEFAULT_SEND_INTERVAL_MS;
     static unsigned int s_send_max_entries = DEFAULT_SEND_MAX_ENTRIES;
 
-    DWORD bytes_avail = 0;
-
     // On the very first call, m_lastStatusSendTimeMS will be 0, but we don't
     // want to send immediately. So...
     if (m_lastStatusSendTimeMS == 0) m_lastStatusSendTimeMS = GetTickCount();
 
-    // ReadFile will block forever if there's no data to read, so we need
-    // to check if there's data available to read first.
-    if (!PeekNamedPipe(m_polipoPipe, NULL, 0, NULL, &bytes_avail, NULL))
-    {
-        my_print(NOT_SENSITIVE, false, _T("%s:%d - PeekNamedPipe failed (%d)"), __TFUNCTION__, __LINE__, GetLastError());
-        return false;
-    }
-
-    // If there's data available from the Polipo pipe, process it.
-    if (bytes_avail > 0)
+    // Update page view and traffic stats with any new output from Polipo
+    // (see HandleSubprocessOutputLine).
+    if (m_polipo)
     {
-        char* page_view_buffer = new char[bytes_avail+1];
-        DWORD num_read = 0;
-        if (!ReadFile(m_polipoPipe, page_view_buffer, bytes_avail, &num_read, NULL))
-        {
-            my_print(NOT_SENSITIVE, false, _T("%s:%d - ReadFile failed (%d)"), __TFUNCTION__, __LINE__, GetLastError());
-            return false;
-        }
-        page_view_buffer[num_read] = '\0';
-
-        // Update page view and traffic stats with the new info.
-        ParsePolipoStatsBuffer(page_view_buffer);
-
-        delete[] page_view_buffer;
+        m_polipo->ConsumeSubprocessOutput();
     }
 
     // Note: GetTickCount wraps after 49 days; small chance of a shorter timeout
@@ -625,7 +564,7 @@ void LocalProxy::ParsePolipoStatsBuffer(const char* page_view_buffer)
     const char* BYTES_TRANSFERRED_PREFIX = "PSIPHON-BYTES-TRANSFERRED:>>";
     const char* UNPROXIED_PREFIX = "PSIPHON-UNPROXIED:>>";
     const char* DEBUG_PREFIX = "PSIPHON-DEBUG:>>";
-    const char* ENTRY_END = "<<";
+    const char* ENTRY_END = POLIPO_STATS_ENTRY_END;
 
     const char* curr_pos = page_view_buffer;
     const char* end_pos = page_view_buffer + strlen(page_view_buffer);
@@ -20,10 +20,12 @@
 #pragma once
 
 #include "worker_thread.h"
+#include "subprocess.h"
 
 class SessionInfo;
 struct RegexReplace;
 class SystemProxySettings;
+class LocalPortReservation;
 
 
 class ILocalProxyStatsCollector
@@ -38,7 +40,7 @@ public:
 };
 
 
-class LocalProxy : public IWorkerThread
+class LocalProxy : public IWorkerThread, public ISubprocessOutputHandler
 {
 public:
     // If statsCollector is null, no stats will be collected. (This should only
@@ -56,17 +58,21 @@ public:
     // case we need to update the SessionInfo here.
     void UpdateSessionInfo(const SessionInfo& sessionInfo);
 
+    // ISubprocessOutputHandler implementation
+    void HandleSubprocessOutputLine(const char* line, size_t length);
+
 protected:
     // IWorkerThread implementation
     bool DoStart();
     bool DoPeriodicCheck();
+    void GetPeriodicCheckHandles(vector<HANDLE>& handles);
+    DWORD GetPeriodicCheckInterval() const;
     void StopImminent();
     void DoStop(bool cleanly);
 
     void Cleanup(bool doStats);
 
-    bool StartPolipo(int localHttpProxyPort);
-    bool CreatePolipoPipe(HANDLE& o_outputPipe, HANDLE& o_errorPipe);
+    bool StartPolipo(LocalPortReservation& portReservation);
     bool ProcessStatsAndStatus(bool final);
     void UpsertPageView(const string& entry);
     void UpsertHttpsRequest(string entry);
@@ -76,11 +82,9 @@ private:
     HANDLE m_mutex;
     ILocalProxyStatsCollector* m_statsCollector;
     int m_parentPort;
-    tstring m_polipoPath;
     tstring m_splitTunnelingFilePath;
     SystemProxySettings* m_systemProxySettings;
-    PROCESS_INFORMATION m_polipoProcessInfo;
-    HANDLE m_polipoPipe;
+    unique_ptr<Subprocess> m_polipo;
     DWORD m_lastStatusSendTimeMS;
     map<string, int> m_pageViewEntries;
     map<string, int> m_httpsRequestEntries;
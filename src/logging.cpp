@@ -21,6 +21,8 @@
 #include "utilities.h"
 #include "psiclient.h"
 #include "logging.h"
+#include "message_history.h"
+#include "message_printing.h"
 
 
 /*
@@ -51,13 +53,53 @@ extern HWND g_hWnd;
 
 //==== my_print (logging) =====================================================
 
-vector<MessageHistoryEntry> g_messageHistory;
-HANDLE g_messageHistoryMutex = CreateMutex(NULL, FALSE, 0);
+// Timestamps are kept as FILETIMEs, and only formatted when read.
+static MessageHistory g_messageHistory;
+
+static tstring FormatMessageTimestamp(uint64_t timestamp)
+{
+    FILETIME fileTime;
+    fileTime.dwLowDateTime = (DWORD)timestamp;
+    fileTime.dwHighDateTime = (DWORD)(timestamp >> 32);
+
+    SYSTEMTIME systime;
+    if (!FileTimeToSystemTime(&fileTime, &systime))
+    {
+        return _T("");
+    }
+
+    // As GetISO8601DatetimeString
+    TCHAR ret[64];
+    _sntprintf_s(
+        ret,
+        sizeof(ret) / sizeof(ret[0]),
+        _T("%04d-%02d-%02dT%02d:%02d:%02d.%03dZ"),
+        systime.wYear,
+        systime.wMonth,
+        systime.wDay,
+        systime.wHour,
+        systime.wMinute,
+        systime.wSecond,
+        systime.wMilliseconds);
+
+    return ret;
+}
 
 void GetMessageHistory(vector<MessageHistoryEntry>& history)
 {
-    AutoMUTEX mutex(g_messageHistoryMutex);
-    history = g_messageHistory;
+    vector<MessageHistoryItem> items;
+    g_messageHistory.Get(items);
+
+    history.clear();
+    history.reserve(items.size());
+    for (const MessageHistoryItem& item : items)
+    {
+        MessageHistoryEntry entry;
+        entry.message = item.message;
+        entry.timestamp = FormatMessageTimestamp(item.timestamp);
+        entry.debug = item.debug;
+        history.push_back(entry);
+    }
 }
 
 void AddMessageEntryToHistory(
@@ -66,8 +108,6 @@ void AddMessageEntryToHistory(
     const TCHAR* formatString,
     const TCHAR* finalString)
 {
-    AutoMUTEX mutex(g_messageHistoryMutex);
-
     const TCHAR* historicalMessage = NULL;
     if (sensitivity == NOT_SENSITIVE)
     {
@@ -82,64 +122,70 @@ void AddMessageEntryToHistory(
         historicalMessage = NULL;
     }
 
-    if (historicalMessage != NULL)
+    if (historicalMessage == NULL)
     {
-        MessageHistoryEntry entry;
-        entry.message = historicalMessage;
-        entry.timestamp = GetISO8601DatetimeString();
-        entry.debug = bDebugMessage;
-        g_messageHistory.push_back(entry);
+        return;
     }
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+
+    g_messageHistory.Add(
+        ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime,
+        bDebugMessage,
+        historicalMessage);
 }
 
+// A constant, so that the check for whether debug messages are displayed
+// compiles away.
 #ifdef _DEBUG
-bool g_bShowDebugMessages = true;
+static const bool SHOW_DEBUG_MESSAGES = true;
 #else
-bool g_bShowDebugMessages = false;
+static const bool SHOW_DEBUG_MESSAGES = false;
 #endif
 
-void my_print(LogSensitivity sensitivity, bool bDebugMessage, const TCHAR* format, ...)
+// Takes messages where PrintMessage sends them
+struct MessageOutput
 {
-    TCHAR* debugPrefix = _T("DEBUG: ");
-    size_t debugPrefixLength = _tcsclen(debugPrefix);
-    TCHAR* buffer = NULL;
-    va_list args;
-    va_start(args, format);
-    int length = _vsctprintf(format, args) + 1;
-    if (bDebugMessage)
+    void AddToHistory(LogSensitivity sensitivity, bool bDebugMessage, const TCHAR* format, const TCHAR* message)
     {
-        length += debugPrefixLength;
-    }
-    buffer = (TCHAR*)malloc(length * sizeof(TCHAR));
-    if (!buffer) {
-        va_end(args);
-        return;
+        AddMessageEntryToHistory(sensitivity, bDebugMessage, format, message);
     }
-    if (bDebugMessage)
-    {
-        _tcscpy_s(buffer, length, debugPrefix);
-        _vstprintf_s(buffer + debugPrefixLength, length - debugPrefixLength, format, args);
-    }
-    else
-    {
-        _vstprintf_s(buffer, length, format, args);
-    }
-    va_end(args);
 
-    AddMessageEntryToHistory(sensitivity, bDebugMessage, format, buffer);
-
-    if (!bDebugMessage || g_bShowDebugMessages)
+    void Display(bool bDebugMessage, TCHAR* message)
     {
         // NOTE:
         // Main window handles displaying the message. This avoids
         // deadlocks with SendMessage. Main window will deallocate
         // buffer.
-
-        PostMessage(g_hWnd, WM_PSIPHON_MY_PRINT, bDebugMessage ? 0 : 1, (LPARAM)buffer);
+        if (!PostMessage(g_hWnd, WM_PSIPHON_MY_PRINT, bDebugMessage ? 0 : 1, (LPARAM)message))
+        {
+            free(message);
+        }
     }
+};
+
+static void my_vprint(LogSensitivity sensitivity, bool bDebugMessage, const TCHAR* format, va_list args)
+{
+    MessageOutput output;
+    PrintMessage<SHOW_DEBUG_MESSAGES>(output, sensitivity, bDebugMessage, format, args);
+}
+
+void my_print(LogSensitivity sensitivity, bool bDebugMessage, const TCHAR* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    my_vprint(sensitivity, bDebugMessage, format, args);
+    va_end(args);
 }
 
 void my_print(LogSensitivity sensitivity, bool bDebugMessage, const string& message)
 {
+    if (sensitivity == SENSITIVE_LOG && !DisplayMessage(SHOW_DEBUG_MESSAGES, bDebugMessage))
+    {
+        // Nothing would be done with the message, so don't bother converting it
+        return;
+    }
+
     my_print(sensitivity, bDebugMessage, UTF8ToWString(message).c_str());
 }
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include <algorithm>
+#include <thread>
+#include "message_history.h"
+
+
+const size_t MessageHistory::CAPACITY;
+const size_t MessageHistory::MAX_MESSAGE_LENGTH;
+
+MessageHistory::MessageHistory()
+    : m_tickets(0)
+{
+    for (Record& record : m_records)
+    {
+        record.sequence.store(0, memory_order_relaxed);
+    }
+}
+
+void MessageHistory::Add(uint64_t timestamp, bool debug, const TCHAR* message)
+{
+    uint64_t ticket = m_tickets.fetch_add(1);
+    Record& record = m_records[ticket % CAPACITY];
+
+    // Claim the record. It will only be busy if a writer a whole ring behind
+    // us is still writing it, which is rare, so we just wait for it.
+    uint64_t sequence = record.sequence.load(memory_order_acquire);
+    while (true)
+    {
+        if (sequence >= 2 * ticket + 1)
+        {
+            // A newer message has claimed the record, so ours would have
+            // been overwritten by now anyway.
+            return;
+        }
+
+        if (sequence & 1)
+        {
+            this_thread::yield();
+            sequence = record.sequence.load(memory_order_acquire);
+        }
+        else if (record.sequence.compare_exchange_weak(sequence, 2 * ticket + 1, memory_order_acquire))
+        {
+            break;
+        }
+    }
+
+    // Readers must not see the new contents without also seeing the record
+    // marked as being written.
+    atomic_thread_fence(memory_order_release);
+
+    size_t length = 0;
+    while (length < MAX_MESSAGE_LENGTH && message[length])
+    {
+        length++;
+    }
+
+    record.timestamp = timestamp;
+    record.debug = debug;
+    record.length = length;
+    memcpy(record.message, message, length * sizeof(TCHAR));
+
+    record.sequence.store(2 * ticket + 2, memory_order_release);
+}
+
+void MessageHistory::Get(vector<MessageHistoryItem>& items) const
+{
+    items.clear();
+
+    uint64_t end = m_tickets.load(memory_order_acquire);
+    uint64_t begin = (end > CAPACITY) ? end - CAPACITY : 0;
+    items.reserve((size_t)(end - begin));
+
+    uint64_t timestamp;
+    bool debug;
+    size_t length;
+    TCHAR message[MAX_MESSAGE_LENGTH];
+
+    for (uint64_t ticket = begin; ticket < end; ticket++)
+    {
+        const Record& record = m_records[ticket % CAPACITY];
+        const uint64_t written = 2 * ticket + 2;
+
+        // Skip the record if it's being written or has been overwritten.
+        if (record.sequence.load(memory_order_acquire) != written)
+        {
+            continue;
+        }
+
+        timestamp = record.timestamp;
+        debug = record.debug;
+        length = min(record.length, MAX_MESSAGE_LENGTH);
+        memcpy(message, record.message, length * sizeof(TCHAR));
+
+        atomic_thread_fence(memory_order_acquire);
+        if (record.sequence.load(memory_order_relaxed) != written)
+        {
+            continue;
+        }
+
+        MessageHistoryItem item;
+        item.timestamp = timestamp;
+        item.debug = debug;
+        item.message.assign(message, length);
+        items.push_back(item);
+    }
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+/*
+Message history, for my_print.
+
+The history keeps the most recent messages in a fixed number of records,
+used as a ring: once it's full, each new message overwrites the oldest.
+
+my_print is called from every thread, so adding a message takes no lock.
+A writer takes a ticket from a counter, which decides the record it writes,
+and marks the record's sequence number while it writes. A reader copies a
+record and then checks that the sequence number still says the record
+holds the expected message, so reading never blocks writers -- a record
+that's being written is skipped.
+
+Timestamps are kept as given, and only formatted by whoever reads them.
+*/
+
+struct MessageHistoryItem
+{
+    uint64_t timestamp;
+    bool debug;
+    tstring message;
+};
+
+class MessageHistory
+{
+public:
+    static const size_t CAPACITY = 1024;
+
+    // Longer messages are truncated.
+    static const size_t MAX_MESSAGE_LENGTH = 500;
+
+    MessageHistory();
+
+    void Add(uint64_t timestamp, bool debug, const TCHAR* message);
+
+    // Gets the messages, oldest first.
+    void Get(vector<MessageHistoryItem>& items) const;
+
+private:
+    struct Record
+    {
+        // 2*ticket+1 while the message with that ticket is being written, and
+        // 2*ticket+2 once it has been. 0 if the record has never been written.
+        atomic<uint64_t> sequence;
+
+        uint64_t timestamp;
+        bool debug;
+        size_t length;
+        TCHAR message[MAX_MESSAGE_LENGTH];
+    };
+
+    Record m_records[CAPACITY];
+    atomic<uint64_t> m_tickets;
+};
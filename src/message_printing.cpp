@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "message_printing.h"
+
+
+static const TCHAR DEBUG_MESSAGE_PREFIX[] = _T("DEBUG: ");
+static const size_t DEBUG_MESSAGE_PREFIX_LENGTH = sizeof(DEBUG_MESSAGE_PREFIX) / sizeof(TCHAR) - 1;
+
+int FormatMessageInto(
+    TCHAR* buffer,
+    size_t bufferLength,
+    bool debug,
+    const TCHAR* format,
+    va_list args)
+{
+    size_t prefixLength = 0;
+    if (debug)
+    {
+        prefixLength = DEBUG_MESSAGE_PREFIX_LENGTH;
+        memcpy(buffer, DEBUG_MESSAGE_PREFIX, (prefixLength + 1) * sizeof(TCHAR));
+    }
+
+    // _vsntprintf_s with _TRUNCATE would report truncation as -1, not the
+    // full length, so we need _vsctprintf for that case.
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    int length = _vsntprintf_s(buffer + prefixLength, bufferLength - prefixLength, _TRUNCATE, format, args);
+    if (length < 0)
+    {
+        length = _vsctprintf(format, argsCopy);
+    }
+    va_end(argsCopy);
+
+    return (length < 0) ? -1 : length + (int)prefixLength;
+}
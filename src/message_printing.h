@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include "logging.h"
+
+
+/*
+How my_print handles a message.
+
+A message goes to up to two places: the main window, which displays it, and
+the message history. A debug message is only displayed if debug messages
+are shown, and a SENSITIVE_LOG message isn't kept in the history, so some
+messages go nowhere. The history only needs the message formatted if it's
+NOT_SENSITIVE; otherwise it keeps the format string.
+
+PrintMessage checks where a message goes before doing anything else, and only
+formats it -- and only allocates -- if it has to. A debug message that's
+neither displayed nor kept costs no more than the call.
+
+Whether debug messages are shown is a template argument, so that the check
+compiles away. Output takes the message where it goes:
+
+    // Keeps as much of the message as its sensitivity allows. message is
+    // NULL if the message wasn't formatted.
+    void AddToHistory(LogSensitivity sensitivity, bool debug, const TCHAR* format, const TCHAR* message);
+
+    // Takes ownership of message, which was allocated with malloc.
+    void Display(bool debug, TCHAR* message);
+*/
+
+inline bool DisplayMessage(bool showDebugMessages, bool debug)
+{
+    return !debug || showDebugMessages;
+}
+
+inline bool FormatMessageText(bool showDebugMessages, LogSensitivity sensitivity, bool debug)
+{
+    return DisplayMessage(showDebugMessages, debug) || sensitivity == NOT_SENSITIVE;
+}
+
+// Most messages fit, so are formatted just once.
+static const size_t MESSAGE_FORMAT_BUFFER_LENGTH = 512;
+
+// Formats the message, with the debug prefix if it's a debug message, into
+// buffer, truncating it if it doesn't fit. Returns the length that it would
+// have had if it did fit, or -1 on error.
+int FormatMessageInto(
+    TCHAR* buffer,
+    size_t bufferLength,
+    bool debug,
+    const TCHAR* format,
+    va_list args);
+
+template <bool showDebugMessages, class Output>
+void PrintMessage(
+    Output& output,
+    LogSensitivity sensitivity,
+    bool debug,
+    const TCHAR* format,
+    va_list args)
+{
+    if (!FormatMessageText(showDebugMessages, sensitivity, debug))
+    {
+        // Only the format string is kept, if anything
+        output.AddToHistory(sensitivity, debug, format, NULL);
+        return;
+    }
+
+    TCHAR message[MESSAGE_FORMAT_BUFFER_LENGTH];
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    int length = FormatMessageInto(message, MESSAGE_FORMAT_BUFFER_LENGTH, debug, format, argsCopy);
+    va_end(argsCopy);
+    if (length < 0)
+    {
+        return;
+    }
+
+    // The history truncates long messages anyway
+    output.AddToHistory(sensitivity, debug, format, message);
+
+    if (!DisplayMessage(showDebugMessages, debug))
+    {
+        return;
+    }
+
+    TCHAR* buffer = (TCHAR*)malloc((length + 1) * sizeof(TCHAR));
+    if (!buffer)
+    {
+        return;
+    }
+
+    if ((size_t)length < MESSAGE_FORMAT_BUFFER_LENGTH)
+    {
+        memcpy(buffer, message, (length + 1) * sizeof(TCHAR));
+    }
+    else if (FormatMessageInto(buffer, length + 1, debug, format, args) < 0)
+    {
+        free(buffer);
+        return;
+    }
+
+    output.Display(debug, buffer);
+}
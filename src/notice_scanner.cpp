@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "notice_scanner.h"
+
+
+static const int MAX_NOTICE_DEPTH = 64;
+
+// The Skip functions each return the position after what they skip, or NULL
+// if it's malformed.
+
+static const char* SkipWhitespace(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    {
+        p++;
+    }
+    return p;
+}
+
+static bool IsHexDigit(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// strchr would also find the terminating null
+static bool IsOneOf(char c, const char* characters)
+{
+    return c != '\0' && strchr(characters, c) != NULL;
+}
+
+// p is at the opening quote. o_escaped is set if the string contains escapes.
+static const char* SkipString(const char* p, const char* end, bool& o_escaped)
+{
+    o_escaped = false;
+    for (p++; p < end; p++)
+    {
+        if (*p == '"')
+        {
+            return p + 1;
+        }
+        if (*p != '\\')
+        {
+            continue;
+        }
+
+        o_escaped = true;
+        if (++p == end)
+        {
+            return NULL;
+        }
+        if (*p == 'u')
+        {
+            // Json::Reader requires a high surrogate to be followed by a low one
+            if (end - p < 5 || !IsHexDigit(p[1]) || !IsHexDigit(p[2]) || !IsHexDigit(p[3]) || !IsHexDigit(p[4]))
+            {
+                return NULL;
+            }
+            bool highSurrogate = (p[1] == 'd' || p[1] == 'D') && IsOneOf(p[2], "89abAB");
+            p += 4;
+            if (highSurrogate
+                && (end - p < 7 || p[1] != '\\' || p[2] != 'u' || (p[3] != 'd' && p[3] != 'D')
+                    || !IsOneOf(p[4], "cdefCDEF") || !IsHexDigit(p[5]) || !IsHexDigit(p[6])))
+            {
+                return NULL;
+            }
+        }
+        else if (!IsOneOf(*p, "\"\\/bfnrt"))
+        {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static const char* SkipDigits(const char* p, const char* end)
+{
+    const char* start = p;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        p++;
+    }
+    return (p > start) ? p : NULL;
+}
+
+static const char* SkipNumber(const char* p, const char* end)
+{
+    if (p < end && *p == '-')
+    {
+        p++;
+    }
+    if (p < end && *p == '0')
+    {
+        p++;
+    }
+    else if (!(p = SkipDigits(p, end)))
+    {
+        return NULL;
+    }
+    if (p < end && *p == '.' && !(p = SkipDigits(p + 1, end)))
+    {
+        return NULL;
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+        {
+            p++;
+        }
+        p = SkipDigits(p, end);
+    }
+    return p;
+}
+
+static const char* SkipLiteral(const char* p, const char* end, const char* literal)
+{
+    size_t length = strlen(literal);
+    return ((size_t)(end - p) >= length && 0 == memcmp(p, literal, length)) ? p + length : NULL;
+}
+
+static const char* SkipValue(const char* p, const char* end, int depth)
+{
+    bool escaped;
+
+    if (p == end || depth > MAX_NOTICE_DEPTH)
+    {
+        return NULL;
+    }
+
+    switch (*p)
+    {
+    case '"':
+        return SkipString(p, end, escaped);
+
+    case '{':
+        p = SkipWhitespace(p + 1, end);
+        if (p < end && *p == '}')
+        {
+            return p + 1;
+        }
+        while (true)
+        {
+            if (p == end || *p != '"' || !(p = SkipString(p, end, escaped)))
+            {
+                return NULL;
+            }
+            p = SkipWhitespace(p, end);
+            if (p == end || *p != ':')
+            {
+                return NULL;
+            }
+            p = SkipValue(SkipWhitespace(p + 1, end), end, depth + 1);
+            if (!p)
+            {
+                return NULL;
+            }
+            p = SkipWhitespace(p, end);
+            if (p < end && *p == '}')
+            {
+                return p + 1;
+            }
+            if (p == end || *p != ',')
+            {
+                return NULL;
+            }
+            p = SkipWhitespace(p + 1, end);
+        }
+
+    case '[':
+        p = SkipWhitespace(p + 1, end);
+        if (p < end && *p == ']')
+        {
+            return p + 1;
+        }
+        while (true)
+        {
+            p = SkipValue(p, end, depth + 1);
+            if (!p)
+            {
+                return NULL;
+            }
+            p = SkipWhitespace(p, end);
+            if (p < end && *p == ']')
+            {
+                return p + 1;
+            }
+            if (p == end || *p != ',')
+            {
+                return NULL;
+            }
+            p = SkipWhitespace(p + 1, end);
+        }
+
+    case 't':
+        return SkipLiteral(p, end, "true");
+    case 'f':
+        return SkipLiteral(p, end, "false");
+    case 'n':
+        return SkipLiteral(p, end, "null");
+
+    default:
+        return SkipNumber(p, end);
+    }
+}
+
+bool ScanNoticeType(const char* line, size_t length, const char*& o_type, size_t& o_typeLength)
+{
+    static const char NOTICE_TYPE_KEY[] = "\"noticeType\"";
+    const size_t NOTICE_TYPE_KEY_LENGTH = sizeof(NOTICE_TYPE_KEY) - 1;
+
+    const char* end = line + length;
+    const char* p = SkipWhitespace(line, end);
+    bool escaped;
+    bool found = false;
+
+    if (p == end || *p != '{')
+    {
+        return false;
+    }
+    p = SkipWhitespace(p + 1, end);
+
+    while (p < end && *p == '"')
+    {
+        const char* key = p;
+        if (!(p = SkipString(p, end, escaped)))
+        {
+            return false;
+        }
+        bool isNoticeType =
+            (size_t)(p - key) == NOTICE_TYPE_KEY_LENGTH
+            && 0 == memcmp(key, NOTICE_TYPE_KEY, NOTICE_TYPE_KEY_LENGTH);
+
+        p = SkipWhitespace(p, end);
+        if (p == end || *p != ':')
+        {
+            return false;
+        }
+        p = SkipWhitespace(p + 1, end);
+
+        if (isNoticeType)
+        {
+            if (found || p == end || *p != '"')
+            {
+                return false;
+            }
+            const char* value = p;
+            p = SkipString(p, end, escaped);
+            if (!p || escaped)
+            {
+                return false;
+            }
+            o_type = value + 1;
+            o_typeLength = p - value - 2;
+            found = true;
+        }
+        else if (!(p = SkipValue(p, end, 1)))
+        {
+            return false;
+        }
+
+        p = SkipWhitespace(p, end);
+        if (p < end && *p == '}')
+        {
+            return found && SkipWhitespace(p + 1, end) == end;
+        }
+        if (p == end || *p != ',')
+        {
+            return false;
+        }
+        p = SkipWhitespace(p + 1, end);
+    }
+
+    return false;
+}
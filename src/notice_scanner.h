@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+
+
+/*
+Notice scanning
+
+Notices are JSON objects, one per line, like:
+
+    {"data":{...},"noticeType":"Info","timestamp":"..."}
+
+To route a notice we only need its type. ScanNoticeType checks that the line
+is well-formed JSON and finds the type without building a Json::Value, or
+allocating at all. Anything it doesn't accept -- including valid JSON that's
+unusual for a notice, such as an escaped or repeated type -- is left to the
+full parse, which decides what the line is.
+*/
+
+// Returns false if the line isn't a notice that can be scanned. On success,
+// o_type points into line.
+bool ScanNoticeType(const char* line, size_t length, const char*& o_type, size_t& o_typeLength);
@@ -23,6 +23,7 @@
 
 #include "psiphon_tunnel_core.h"
 #include "diagnostic_info.h"
+#include "notice_scanner.h"
 #include "logging.h"
 #include "psiclient.h"
 #include "utilities.h"
@@ -43,23 +44,75 @@ PsiphonTunnelCore::~PsiphonTunnelCore()
 {
 }
 
-void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
+
+// Some notices are excluded from diagnostics as they may contain private user data.
+static bool NoticeMayContainPrivateData(const string& noticeType)
 {
-    // Notices are logged to diagnostics. Some notices are excluded from
-    // diagnostics if they may contain private user data.
-    bool logOutputToDiagnostics = true;
+    // "filename" field in notice data is private user data
+    return noticeType == "ClientUpgradeDownloaded"
+        // "address" field in notice data is private user data
+        || noticeType == "Untunneled"
+        // "message" field in notice data may contain private user data
+        || noticeType == "UpstreamProxyError";
+}
+
+// notice is the parsed line, or NULL if it wasn't parsed -- in which case
+// ScanNoticeType has checked that it's valid JSON.
+static void LogNotice(const char* line, size_t length, const string& noticeType, const Json::Value* notice)
+{
+    // Debug output, flag sensitive to exclude from feedback
+    my_print(SENSITIVE_LOG, true, _T("core notice: %S"), line);
+
+    // Add to diagnostics
+    if (!NoticeMayContainPrivateData(noticeType))
+    {
+        if (notice)
+        {
+            AddDiagnosticInfoJson("CoreNotice", *notice);
+        }
+        else
+        {
+            AddDiagnosticInfoValidJson("CoreNotice", line, length);
+        }
+    }
+}
+
+void PsiphonTunnelCore::HandleSubprocessOutputLine(const char* line, size_t length)
+{
+    // Most notices are only logged; the notice handler wants just a few
+    // types. So the type is scanned for first, and only notices that the
+    // handler wants are parsed.
+
+    const char* noticeType;
+    size_t noticeTypeLength;
+    if (ScanNoticeType(line, length, noticeType, noticeTypeLength))
+    {
+        m_noticeType.assign(noticeType, noticeTypeLength);
+
+        if (!m_noticeHandler->WantsPsiphonTunnelCoreNotice(m_noticeType))
+        {
+            // Let the UI know about it and decide if something needs to be shown to the user.
+            if (m_noticeType != "Info")
+            {
+                UI_Notice(string(line, length));
+            }
+
+            LogNotice(line, length, m_noticeType, NULL);
+            return;
+        }
+    }
 
     // Parse output to extract data
 
     Json::Value notice;
     Json::Reader reader;
-    if (!reader.parse(line, notice))
+    if (!reader.parse(line, line + length, notice))
     {
         // If the line contains "panic" or "fatal error", assume the core is crashing and add all further output to diagnostics
-        vector<string> PANIC_HEADERS = { "panic", "fatal error" };
+        const char* PANIC_HEADERS[] = { "panic", "fatal error" };
 
         for (const auto& panic : PANIC_HEADERS) {
-            if (line.find(panic) != string::npos) {
+            if (strstr(line, panic) != NULL) {
                 m_panicked = true;
                 break;
             }
@@ -68,8 +121,9 @@ void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
         if (m_panicked)
         {
             // We do not think that a panic will contain private data
-            my_print(NOT_SENSITIVE, false, _T("core panic: %S"), line.c_str());
-            AddDiagnosticInfoJson("CorePanic", line.c_str());
+            my_print(NOT_SENSITIVE, false, _T("core panic: %S"), line);
+            // The line isn't JSON, so it's added as a string
+            AddDiagnosticInfo("CorePanic", string(line, length));
         }
         else
         {
@@ -91,37 +145,17 @@ void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
 
     try
     {
-        string noticeType = notice["noticeType"].asString();
+        m_noticeType = notice["noticeType"].asString();
         string timestamp = notice["timestamp"].asString();
-        Json::Value data = notice["data"];
+        const Json::Value& data = notice["data"];
 
         // Let the UI know about it and decide if something needs to be shown to the user.
-        if (noticeType != "Info")
-        {
-            UI_Notice(line);
-        }
-
-        // Ensure any sensitive notices are not logged.
-        if (noticeType == "ClientUpgradeDownloaded")
+        if (m_noticeType != "Info")
         {
-            // Don't include in diagnostics as "filename" field in notice data
-            // is private user data
-            logOutputToDiagnostics = false;
-        }
-        else if (noticeType == "Untunneled")
-        {
-            // Don't include in diagnostics as "address" field in notice data
-            // is private user data
-            logOutputToDiagnostics = false;
-        }
-        else if (noticeType == "UpstreamProxyError")
-        {
-            // Don't include in diagnostics as "message" field in notice data
-            // may contain private user data
-            logOutputToDiagnostics = false;
+            UI_Notice(string(line, length));
         }
 
-        m_noticeHandler->HandlePsiphonTunnelCoreNotice(noticeType, timestamp, data);
+        m_noticeHandler->HandlePsiphonTunnelCoreNotice(m_noticeType, timestamp, data);
     }
     catch (exception& e)
     {
@@ -129,12 +163,5 @@ void PsiphonTunnelCore::HandleSubprocessOutputLine(const string& line)
         return;
     }
 
-    // Debug output, flag sensitive to exclude from feedback
-    my_print(SENSITIVE_LOG, true, _T("core notice: %S"), line.c_str());
-
-    // Add to diagnostics
-    if (logOutputToDiagnostics)
-    {
-        AddDiagnosticInfoJson("CoreNotice", line.c_str());
-    }
+    LogNotice(line, length, m_noticeType, &notice);
 }
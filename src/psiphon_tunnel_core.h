@@ -30,6 +30,13 @@ public:
     instance. See ConsumeSubprocessOutput in subprocess.h.
     */
     virtual void HandlePsiphonTunnelCoreNotice(const string& noticeType, const string& timestamp, const Json::Value& data) = 0;
+
+    /**
+    Returns true if HandlePsiphonTunnelCoreNotice should be called for
+    notices of this type. Notices of other types are still logged, but
+    aren't parsed. Called for every notice, so must be cheap.
+    */
+    virtual bool WantsPsiphonTunnelCoreNotice(const string& noticeType) = 0;
 };
 
 /**
@@ -46,10 +53,12 @@ public:
     ~PsiphonTunnelCore();
 
     // ISubprocessOutputHandler implementation
-    void HandleSubprocessOutputLine(const string& line);
+    void HandleSubprocessOutputLine(const char* line, size_t length);
 
 protected:
     IPsiphonTunnelCoreNoticeHandler *m_noticeHandler;
     bool m_panicked;
+    // The type of the notice being handled; kept to reuse its buffer.
+    string m_noticeType;
 };
 
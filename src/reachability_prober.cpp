@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include <algorithm>
+#include <chrono>
+#include "reachability_prober.h"
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+
+// How often to check the stop signal while waiting for probes.
+const int STOP_CHECK_INTERVAL_MILLISECONDS = 100;
+
+
+/*
+The few socket operations the prober needs. WSAPoll and poll take the same
+pollfd structure, so only socket creation, the connect result and closing
+differ between platforms.
+*/
+
+#ifdef _WIN32
+
+typedef SOCKET ProbeSocket;
+const ProbeSocket INVALID_PROBE_SOCKET = INVALID_SOCKET;
+
+// WSAStartup and WSACleanup are reference counted, so each run of the prober
+// can initialize Winsock independently of anyone else.
+class SocketLibrary
+{
+public:
+    SocketLibrary() { WSADATA wsaData; WSAStartup(MAKEWORD(2, 2), &wsaData); }
+    ~SocketLibrary() { WSACleanup(); }
+};
+
+static bool SetNonBlocking(ProbeSocket sock)
+{
+    u_long nonBlocking = 1;
+    return 0 == ioctlsocket(sock, FIONBIO, &nonBlocking);
+}
+
+static bool ConnectInProgress()
+{
+    return WSAEWOULDBLOCK == WSAGetLastError();
+}
+
+// NOTE: before Windows 10 2004, WSAPoll doesn't report connections that are
+// refused. Those probes aren't completed until the timeout, and are then
+// counted as not responding -- the same result, just later.
+static int PollSockets(pollfd* fds, size_t count, int timeoutMilliseconds)
+{
+    return WSAPoll(fds, (ULONG)count, timeoutMilliseconds);
+}
+
+static void CloseProbeSocket(ProbeSocket sock)
+{
+    closesocket(sock);
+}
+
+#else
+
+typedef int ProbeSocket;
+const ProbeSocket INVALID_PROBE_SOCKET = -1;
+
+class SocketLibrary
+{
+};
+
+static bool SetNonBlocking(ProbeSocket sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags != -1 && 0 == fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+static bool ConnectInProgress()
+{
+    return EINPROGRESS == errno;
+}
+
+static int PollSockets(pollfd* fds, size_t count, int timeoutMilliseconds)
+{
+    return poll(fds, (nfds_t)count, timeoutMilliseconds);
+}
+
+static void CloseProbeSocket(ProbeSocket sock)
+{
+    close(sock);
+}
+
+#endif
+
+
+enum ConnectStatus
+{
+    CONNECT_FAILED,
+    CONNECT_PENDING,
+    CONNECT_SUCCEEDED
+};
+
+// Starts a non-blocking connection to the probe's address. On success or
+// pending, o_sock is the socket, which the caller must close.
+static ConnectStatus StartConnect(const ReachabilityProbe& probe, ProbeSocket& o_sock)
+{
+    o_sock = INVALID_PROBE_SOCKET;
+
+    if (probe.port <= 0 || probe.port > 0xFFFF)
+    {
+        return CONNECT_FAILED;
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    addrinfo* address = NULL;
+    if (0 != getaddrinfo(probe.address.c_str(), to_string(probe.port).c_str(), &hints, &address))
+    {
+        return CONNECT_FAILED;
+    }
+
+    ConnectStatus status = CONNECT_FAILED;
+
+    ProbeSocket sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (sock != INVALID_PROBE_SOCKET && SetNonBlocking(sock))
+    {
+        if (0 == connect(sock, address->ai_addr, (int)address->ai_addrlen))
+        {
+            status = CONNECT_SUCCEEDED;
+        }
+        else if (ConnectInProgress())
+        {
+            status = CONNECT_PENDING;
+        }
+    }
+
+    freeaddrinfo(address);
+
+    if (status == CONNECT_FAILED)
+    {
+        if (sock != INVALID_PROBE_SOCKET)
+        {
+            CloseProbeSocket(sock);
+        }
+        return CONNECT_FAILED;
+    }
+
+    o_sock = sock;
+    return status;
+}
+
+// Returns true if the pending connection on a socket that's been reported
+// ready by poll was successful.
+static bool ConnectSucceeded(ProbeSocket sock, short revents)
+{
+    if (!(revents & POLLOUT))
+    {
+        return false;
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    return 0 == getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&error, &length) && error == 0;
+}
+
+
+void ProbeReachability(
+    vector<ReachabilityProbe>& io_probes,
+    unsigned int timeoutMilliseconds,
+    size_t maxConcurrentProbes,
+    const StopInfo& stopInfo)
+{
+    typedef chrono::steady_clock Clock;
+
+    for (vector<ReachabilityProbe>::iterator probe = io_probes.begin(); probe != io_probes.end(); ++probe)
+    {
+        probe->responded = false;
+        probe->responseTimeMilliseconds = 0;
+    }
+
+    if (maxConcurrentProbes == 0)
+    {
+        maxConcurrentProbes = 1;
+    }
+
+    SocketLibrary socketLibrary;
+
+    const Clock::time_point deadline = Clock::now() + chrono::milliseconds(timeoutMilliseconds);
+
+    // The in-flight probes. pollFds[i] is the socket for the probe
+    // io_probes[inFlight[i]], which was started at startTimes[i].
+    vector<size_t> inFlight;
+    vector<Clock::time_point> startTimes;
+    vector<pollfd> pollFds;
+
+    inFlight.reserve(min(maxConcurrentProbes, io_probes.size()));
+    startTimes.reserve(inFlight.capacity());
+    pollFds.reserve(inFlight.capacity());
+
+    size_t nextProbe = 0;
+
+    while (true)
+    {
+        // Start as many probes as the limit allows.
+
+        while (nextProbe < io_probes.size() && inFlight.size() < maxConcurrentProbes)
+        {
+            ReachabilityProbe& probe = io_probes[nextProbe];
+            Clock::time_point startTime = Clock::now();
+
+            ProbeSocket sock;
+            ConnectStatus status = StartConnect(probe, sock);
+
+            if (status == CONNECT_PENDING)
+            {
+                pollfd pollFd;
+                pollFd.fd = sock;
+                pollFd.events = POLLOUT;
+                pollFd.revents = 0;
+
+                inFlight.push_back(nextProbe);
+                startTimes.push_back(startTime);
+                pollFds.push_back(pollFd);
+            }
+            else
+            {
+                probe.responded = (status == CONNECT_SUCCEEDED);
+                probe.responseTimeMilliseconds =
+                    chrono::duration<double, milli>(Clock::now() - startTime).count();
+
+                if (status == CONNECT_SUCCEEDED)
+                {
+                    CloseProbeSocket(sock);
+                }
+            }
+
+            nextProbe++;
+        }
+
+        if (inFlight.empty())
+        {
+            // Every probe has completed
+            break;
+        }
+
+        Clock::time_point now = Clock::now();
+        if (now >= deadline
+            || stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons))
+        {
+            break;
+        }
+
+        // Round up, so that we don't spin when less than a millisecond is left.
+        long long remainingMilliseconds =
+            chrono::duration_cast<chrono::milliseconds>(deadline - now + chrono::microseconds(999)).count();
+
+        int ready = PollSockets(
+                        &pollFds[0],
+                        pollFds.size(),
+                        (int)min<long long>(remainingMilliseconds, STOP_CHECK_INTERVAL_MILLISECONDS));
+
+        if (ready < 0)
+        {
+            // Nothing more can be learned. The remaining probes are abandoned.
+            break;
+        }
+
+        if (ready == 0)
+        {
+            continue;
+        }
+
+        now = Clock::now();
+
+        // Complete the probes whose connections succeeded or failed. Removing
+        // by swapping with the last element keeps the arrays parallel.
+
+        for (size_t i = inFlight.size(); i-- > 0; )
+        {
+            if (pollFds[i].revents == 0)
+            {
+                continue;
+            }
+
+            ReachabilityProbe& probe = io_probes[inFlight[i]];
+            probe.responded = ConnectSucceeded(pollFds[i].fd, pollFds[i].revents);
+            probe.responseTimeMilliseconds =
+                chrono::duration<double, milli>(now - startTimes[i]).count();
+
+            CloseProbeSocket(pollFds[i].fd);
+
+            inFlight[i] = inFlight.back();
+            inFlight.pop_back();
+            startTimes[i] = startTimes.back();
+            startTimes.pop_back();
+            pollFds[i] = pollFds.back();
+            pollFds.pop_back();
+        }
+    }
+
+    // Abandon any probes that are still in flight.
+
+    Clock::time_point now = Clock::now();
+
+    for (size_t i = 0; i < inFlight.size(); i++)
+    {
+        io_probes[inFlight[i]].responseTimeMilliseconds =
+            chrono::duration<double, milli>(now - startTimes[i]).count();
+
+        CloseProbeSocket(pollFds[i].fd);
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "stopsignal.h"
+
+using namespace std;
+
+
+struct ReachabilityProbe
+{
+    // A numeric IPv4 or IPv6 address; host names are not resolved.
+    string address;
+    int port;
+
+    // Results
+    bool responded;
+    // How long the connection took, if it responded; otherwise how long the
+    // probe ran before it failed or was abandoned (0 if it never started).
+    double responseTimeMilliseconds;
+
+    ReachabilityProbe(const string& address, int port)
+        : address(address), port(port), responded(false), responseTimeMilliseconds(0)
+    {
+    }
+};
+
+
+// Tests whether each server is reachable, and how quickly, by making a TCP
+// connection to it.
+//
+// All of the probes are run from the calling thread: the connections are
+// made non-blocking and waited on together, with at most maxConcurrentProbes
+// of them in flight at once. Returns as soon as every probe has connected or
+// failed, timeoutMilliseconds has passed, or stopInfo is signalled --
+// whichever comes first. Probes that haven't completed by then are counted
+// as not responding.
+void ProbeReachability(
+    vector<ReachabilityProbe>& io_probes,
+    unsigned int timeoutMilliseconds,
+    size_t maxConcurrentProbes,
+    const StopInfo& stopInfo);
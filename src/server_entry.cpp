@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2011, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "logging.h"
+#include "serverlist.h"
+#include <sstream>
+#include <stdexcept>
+
+
+/***********************************************
+IndexedServerEntries members
+*/
+
+IndexedServerEntries::IndexedServerEntries(const ServerEntries& entries)
+{
+    m_index.reserve(entries.size());
+
+    for (ServerEntryIterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (m_index.find(it->serverAddress) == m_index.end())
+        {
+            m_index[it->serverAddress] = m_entries.insert(m_entries.end(), *it);
+        }
+    }
+}
+
+IndexedServerEntries::IndexedServerEntries(const IndexedServerEntries& src)
+{
+    Assign(src.m_entries);
+}
+
+IndexedServerEntries& IndexedServerEntries::operator=(const IndexedServerEntries& src)
+{
+    if (this != &src)
+    {
+        Assign(src.m_entries);
+    }
+    return *this;
+}
+
+void IndexedServerEntries::Assign(const EntryList& entries)
+{
+    // The index holds iterators into our own list, so it can't be copied
+    m_entries = entries;
+    m_index.clear();
+    m_index.reserve(m_entries.size());
+    for (EntryList::iterator it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        m_index[it->serverAddress] = it;
+    }
+}
+
+const ServerEntry* IndexedServerEntries::Find(const string& serverAddress) const
+{
+    auto entry = m_index.find(serverAddress);
+    return entry == m_index.end() ? NULL : &(*entry->second);
+}
+
+bool IndexedServerEntries::IsFirst(const string& serverAddress) const
+{
+    return !m_entries.empty() && m_entries.front().serverAddress == serverAddress;
+}
+
+// Returns the position an entry moved or inserted near the front should go.
+IndexedServerEntries::EntryList::iterator IndexedServerEntries::FrontInsertionPoint(bool veryFront)
+{
+    EntryList::iterator insertionPoint = m_entries.begin();
+    if (!veryFront && !m_entries.empty())
+    {
+        ++insertionPoint;
+    }
+    return insertionPoint;
+}
+
+bool IndexedServerEntries::Upsert(const ServerEntry& serverEntry)
+{
+    auto existing = m_index.find(serverEntry.serverAddress);
+    if (existing != m_index.end())
+    {
+        *existing->second = serverEntry;
+        return false;
+    }
+
+    m_index[serverEntry.serverAddress] = m_entries.insert(FrontInsertionPoint(false), serverEntry);
+    return true;
+}
+
+bool IndexedServerEntries::MoveToFront(const string& serverAddress, bool veryFront)
+{
+    auto existing = m_index.find(serverAddress);
+    if (existing == m_index.end())
+    {
+        return false;
+    }
+
+    // Take the node out of the list before finding the insertion point, so
+    // that moving the current head puts it second rather than first.
+    // (splice doesn't invalidate iterators, so the index stays valid.)
+    EntryList detached;
+    detached.splice(detached.begin(), m_entries, existing->second);
+    m_entries.splice(FrontInsertionPoint(veryFront), detached, existing->second);
+    return true;
+}
+
+bool IndexedServerEntries::MoveToBack(const string& serverAddress)
+{
+    auto existing = m_index.find(serverAddress);
+    if (existing == m_index.end())
+    {
+        return false;
+    }
+
+    m_entries.splice(m_entries.end(), m_entries, existing->second);
+    return true;
+}
+
+bool IndexedServerEntries::Erase(const string& serverAddress)
+{
+    auto existing = m_index.find(serverAddress);
+    if (existing == m_index.end())
+    {
+        return false;
+    }
+
+    m_entries.erase(existing->second);
+    m_index.erase(existing);
+    return true;
+}
+
+ServerEntries IndexedServerEntries::ToVector() const
+{
+    return ServerEntries(m_entries.begin(), m_entries.end());
+}
+
+
+/***********************************************
+ServerEntry members
+*/
+
+ServerEntry::ServerEntry(
+    const string& serverAddress, const string& region, int webServerPort,
+    const string& webServerSecret, const string& webServerCertificate,
+    int sshPort, const string& sshUsername, const string& sshPassword,
+    const string& sshHostKey, int sshObfuscatedPort,
+    const string& sshObfuscatedKey,
+    const string& meekObfuscatedKey, const int meekServerPort,
+    const string& meekCookieEncryptionPublicKey,
+    const string& meekFrontingDomain, const string& meekFrontingHost,
+    const string& meekFrontingAddressesRegex,
+    const vector<string>& meekFrontingAddresses,
+    const vector<string>& capabilities)
+{
+    this->serverAddress = serverAddress;
+    this->region = region;
+    this->webServerPort = webServerPort;
+    this->webServerSecret = webServerSecret;
+    this->webServerCertificate = webServerCertificate;
+    this->sshPort = sshPort;
+    this->sshUsername = sshUsername;
+    this->sshPassword = sshPassword;
+    this->sshHostKey = sshHostKey;
+    this->sshObfuscatedPort = sshObfuscatedPort;
+    this->sshObfuscatedKey = sshObfuscatedKey;
+    this->meekObfuscatedKey = meekObfuscatedKey;
+    this->meekServerPort =  meekServerPort;
+    this->meekCookieEncryptionPublicKey = meekCookieEncryptionPublicKey;
+    this->meekFrontingDomain = meekFrontingDomain;
+    this->meekFrontingHost = meekFrontingHost;
+    this->meekFrontingAddressesRegex = meekFrontingAddressesRegex;
+    this->meekFrontingAddresses = meekFrontingAddresses;
+
+    this->capabilities = capabilities;
+}
+
+void ServerEntry::Copy(const ServerEntry& src)
+{
+    *this = src;
+}
+
+string ServerEntry::ToString() const
+{
+    stringstream ss;
+
+    //
+    // Legacy values are simply space-separated strings
+    //
+
+    ss << serverAddress << " ";
+    ss << webServerPort << " ";
+    ss << webServerSecret << " ";
+    ss << webServerCertificate << " ";
+
+    //
+    // Extended values are JSON-encoded.
+    //
+
+    // Note: for legacy reasons, webServerPort is a string, not an int
+    ostringstream webServerPortString;
+    webServerPortString << webServerPort;
+
+    Json::Value entry;
+
+    entry["ipAddress"] = serverAddress;
+    entry["region"] = region;
+    entry["webServerPort"] = webServerPortString.str();
+    entry["webServerCertificate"] = webServerCertificate;
+    entry["webServerSecret"] = webServerSecret;
+    entry["sshPort"] = sshPort;
+    entry["sshUsername"] = sshUsername;
+    entry["sshPassword"] = sshPassword;
+    entry["sshHostKey"] = sshHostKey;
+    entry["sshObfuscatedPort"] = sshObfuscatedPort;
+    entry["sshObfuscatedKey"] = sshObfuscatedKey;
+    entry["meekObfuscatedKey"] = meekObfuscatedKey;
+    entry["meekServerPort"] = meekServerPort;
+    entry["meekFrontingDomain"] = meekFrontingDomain;
+    entry["meekFrontingHost"] = meekFrontingHost;
+    entry["meekCookieEncryptionPublicKey"] = meekCookieEncryptionPublicKey;
+    entry["meekFrontingAddressesRegex"] = meekFrontingAddressesRegex;
+
+    Json::Value capabilitiesJson(Json::arrayValue);
+    for (const auto& i : this->capabilities)
+    {
+        capabilitiesJson.append(i);
+    }
+    entry["capabilities"] = capabilitiesJson;
+
+    Json::Value meekFrontingAddressesJson(Json::arrayValue);
+    for (const auto& i : this->meekFrontingAddresses)
+    {
+        meekFrontingAddressesJson.append(i);
+    }
+    entry["meekFrontingAddresses"] = meekFrontingAddressesJson;
+
+    Json::FastWriter jsonWriter;
+    ss << jsonWriter.write(entry);
+
+    return ss.str();
+}
+
+void ServerEntry::FromString(const string& str)
+{
+    stringstream lineStream(str);
+    string lineItem;
+
+    //
+    // Legacy values are simply space-separated strings
+    //
+
+    if (!getline(lineStream, lineItem, ' '))
+    {
+        throw std::runtime_error("Server Entries are corrupt: can't parse Server Address");
+    }
+    serverAddress = lineItem;
+
+    if (!getline(lineStream, lineItem, ' '))
+    {
+        throw std::runtime_error("Server Entries are corrupt: can't parse Web Server Port");
+    }
+    webServerPort = (int) strtol(lineItem.c_str(), NULL, 10);
+
+    if (!getline(lineStream, lineItem, ' '))
+    {
+        throw std::runtime_error("Server Entries are corrupt: can't parse Web Server Secret");
+    }
+    webServerSecret = lineItem;
+
+    if (!getline(lineStream, lineItem, ' '))
+    {
+        throw std::runtime_error("Server Entries are corrupt: can't parse Web Server Certificate");
+    }
+    webServerCertificate = lineItem;
+
+    //
+    // Extended values are JSON-encoded.
+    //
+
+    if (!getline(lineStream, lineItem, '\0'))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: Extended JSON values not present"), __TFUNCTION__);
+
+        // Assumption: we're not reading into a ServerEntry struct that already
+        // has values set. So we're relying on the default values being set by
+        // the constructor.
+        return;
+    }
+
+    Json::Value json_entry;
+    Json::Reader reader;
+    bool parsingSuccessful = reader.parse(lineItem, json_entry);
+    if (!parsingSuccessful)
+    {
+        string fail = reader.getFormattedErrorMessages();
+        my_print(NOT_SENSITIVE, false, _T("%s: Extended JSON parse failed: %S"), __TFUNCTION__, reader.getFormattedErrorMessages().c_str());
+        throw std::runtime_error("Server Entries are corrupt: can't parse JSON");
+    }
+
+
+    // At the time of introduction of the server capabilities feature
+    // these are the default capabilities possessed by all servers.
+    Json::Value defaultCapabilities(Json::arrayValue);
+    defaultCapabilities.append("OSSH");
+    defaultCapabilities.append("SSH");
+    defaultCapabilities.append("VPN");
+    defaultCapabilities.append("handshake");
+
+    try
+    {
+        region = json_entry.get("region", "").asString();
+        sshPort = json_entry.get("sshPort", 0).asInt();
+        sshUsername = json_entry.get("sshUsername", "").asString();
+        sshPassword = json_entry.get("sshPassword", "").asString();
+        sshHostKey = json_entry.get("sshHostKey", "").asString();
+        sshObfuscatedPort = json_entry.get("sshObfuscatedPort", 0).asInt();
+        sshObfuscatedKey = json_entry.get("sshObfuscatedKey", "").asString();
+
+        Json::Value capabilitiesJson;
+        capabilitiesJson = json_entry.get("capabilities", defaultCapabilities);
+
+        this->capabilities.clear();
+        for (Json::ArrayIndex i = 0; i < capabilitiesJson.size(); i++)
+        {
+            string item = capabilitiesJson.get(i, "").asString();
+            if (!item.empty())
+            {
+                this->capabilities.push_back(item);
+            }
+        }
+
+        if (HasCapability("FRONTED-MEEK") || HasCapability("UNFRONTED-MEEK") || HasCapability("UNFRONTED-MEEK-HTTPS"))
+        {
+            meekServerPort = json_entry.get("meekServerPort", 0).asInt();
+            meekObfuscatedKey = json_entry.get("meekObfuscatedKey", "").asString();
+            meekCookieEncryptionPublicKey = json_entry.get("meekCookieEncryptionPublicKey", "").asString();
+        }
+        else
+        {
+            meekServerPort = -1;
+            meekObfuscatedKey = "";
+            meekCookieEncryptionPublicKey = "";
+        }
+
+        if (HasCapability("FRONTED-MEEK"))
+        {
+            meekFrontingDomain = json_entry.get("meekFrontingDomain", "").asString();
+            meekFrontingHost  = json_entry.get("meekFrontingHost", "").asString();
+            meekFrontingAddressesRegex = json_entry.get("meekFrontingAddressesRegex", "").asString();
+            Json::Value meekFrontingAddressesJson;
+            Json::Value emptyArray(Json::arrayValue);
+            meekFrontingAddressesJson = json_entry.get("meekFrontingAddresses", emptyArray);
+            this->meekFrontingAddresses.clear();
+            for (Json::ArrayIndex i = 0; i < meekFrontingAddressesJson.size(); i++)
+            {
+                string item = meekFrontingAddressesJson.get(i, "").asString();
+                if (!item.empty())
+                {
+                    this->meekFrontingAddresses.push_back(item);
+                }
+            }
+        }
+        else
+        {
+            meekFrontingDomain = "";
+            meekFrontingHost  = "";
+            meekFrontingAddressesRegex = "";
+            meekFrontingAddresses.clear();
+        }
+    }
+    catch (exception& e)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: Extended JSON parse exception: %S"), __TFUNCTION__, e.what());
+        throw std::runtime_error("Server Entries are corrupt: parse JSON exception");
+    }
+}
+
+bool ServerEntry::HasCapability(const string& capability) const
+{
+    for (size_t i = 0; i < this->capabilities.size(); i++)
+    {
+        if (this->capabilities[i] == capability)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int ServerEntry::GetPreferredReachablityTestPort() const
+{
+    if (HasCapability("OSSH"))
+    {
+        return sshObfuscatedPort;
+    }
+    else if (HasCapability("SSH"))
+    {
+        return sshPort;
+    }
+    else if (HasCapability("handshake"))
+    {
+        return webServerPort;
+    }
+
+    return -1;
+}
@@ -0,0 +1,592 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "server_list_encoding.h"
+#include "utilities.h"
+#include "hex_codec.h"
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+
+
+// The leading NUL can never start a legacy (hex-encoded) list.
+static const char BINARY_SERVER_LIST_MAGIC[] = { '\0', 'P', 'S', 'L' };
+static const size_t BINARY_SERVER_LIST_MAGIC_LENGTH = sizeof(BINARY_SERVER_LIST_MAGIC);
+static const unsigned char BINARY_SERVER_LIST_VERSION = 1;
+
+
+/***********************************************
+Encoding
+*/
+
+static void WriteVarint(string& out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((char)((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static void WriteSignedVarint(string& out, int64_t value)
+{
+    // zigzag, so that small negative values (like meekServerPort's -1) stay small
+    WriteVarint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+class StringTableWriter
+{
+public:
+    uint64_t Intern(const string& value)
+    {
+        auto existing = m_index.find(value);
+        if (existing != m_index.end())
+        {
+            return existing->second;
+        }
+
+        uint64_t index = m_strings.size();
+        m_strings.push_back(value);
+        m_index[value] = index;
+        return index;
+    }
+
+    void Write(string& out) const
+    {
+        WriteVarint(out, m_strings.size());
+        for (auto it = m_strings.begin(); it != m_strings.end(); ++it)
+        {
+            WriteVarint(out, it->length());
+            out.append(*it);
+        }
+    }
+
+private:
+    vector<string> m_strings;
+    unordered_map<string, uint64_t> m_index;
+};
+
+static void WriteString(string& out, StringTableWriter& strings, const string& value)
+{
+    WriteVarint(out, strings.Intern(value));
+}
+
+static void WriteStringList(string& out, StringTableWriter& strings, const vector<string>& values)
+{
+    WriteVarint(out, values.size());
+    for (auto it = values.begin(); it != values.end(); ++it)
+    {
+        WriteString(out, strings, *it);
+    }
+}
+
+// NOTE: The field order here is the format. Only append new fields (and bump
+// BINARY_SERVER_LIST_VERSION if old decoders must not skip them).
+static void WriteServerEntryRecord(string& out, StringTableWriter& strings, const ServerEntry& entry)
+{
+    string record;
+    WriteString(record, strings, entry.serverAddress);
+    WriteString(record, strings, entry.region);
+    WriteSignedVarint(record, entry.webServerPort);
+    WriteString(record, strings, entry.webServerSecret);
+    WriteString(record, strings, entry.webServerCertificate);
+    WriteSignedVarint(record, entry.sshPort);
+    WriteString(record, strings, entry.sshUsername);
+    WriteString(record, strings, entry.sshPassword);
+    WriteString(record, strings, entry.sshHostKey);
+    WriteSignedVarint(record, entry.sshObfuscatedPort);
+    WriteString(record, strings, entry.sshObfuscatedKey);
+    WriteStringList(record, strings, entry.capabilities);
+    WriteString(record, strings, entry.meekObfuscatedKey);
+    WriteSignedVarint(record, entry.meekServerPort);
+    WriteString(record, strings, entry.meekCookieEncryptionPublicKey);
+    WriteString(record, strings, entry.meekFrontingDomain);
+    WriteString(record, strings, entry.meekFrontingHost);
+    WriteString(record, strings, entry.meekFrontingAddressesRegex);
+    WriteStringList(record, strings, entry.meekFrontingAddresses);
+
+    WriteVarint(out, record.length());
+    out.append(record);
+}
+
+bool IsBinaryServerEntryList(const string& data)
+{
+    return data.length() > BINARY_SERVER_LIST_MAGIC_LENGTH &&
+           data.compare(0, BINARY_SERVER_LIST_MAGIC_LENGTH,
+                        BINARY_SERVER_LIST_MAGIC, BINARY_SERVER_LIST_MAGIC_LENGTH) == 0;
+}
+
+string EncodeBinaryServerEntryList(const ServerEntries& serverEntryList)
+{
+    // The string table must precede the records, but it's only complete once
+    // all the records have been encoded.
+    StringTableWriter strings;
+    string records;
+    for (ServerEntryIterator it = serverEntryList.begin(); it != serverEntryList.end(); ++it)
+    {
+        WriteServerEntryRecord(records, strings, *it);
+    }
+
+    string encoded(BINARY_SERVER_LIST_MAGIC, BINARY_SERVER_LIST_MAGIC_LENGTH);
+    encoded.push_back((char)BINARY_SERVER_LIST_VERSION);
+    strings.Write(encoded);
+    WriteVarint(encoded, serverEntryList.size());
+    encoded.append(records);
+
+    return encoded;
+}
+
+
+/***********************************************
+Decoding
+*/
+
+// Every read is bounds-checked; malformed input throws rather than reading
+// past the end of the data.
+class BinaryReader
+{
+public:
+    BinaryReader(const char* begin, const char* end) : m_pos(begin), m_end(end) {}
+
+    bool AtEnd() const { return m_pos == m_end; }
+    size_t Remaining() const { return m_end - m_pos; }
+
+    uint64_t ReadVarint()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (m_pos == m_end)
+            {
+                throw std::runtime_error("Server Entries are corrupt: truncated varint");
+            }
+            unsigned char byte = (unsigned char)*m_pos++;
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+            {
+                return value;
+            }
+        }
+        throw std::runtime_error("Server Entries are corrupt: varint too long");
+    }
+
+    int ReadSignedInt()
+    {
+        uint64_t value = ReadVarint();
+        return (int)(int64_t)((value >> 1) ^ (~(value & 1) + 1));
+    }
+
+    const char* ReadBytes(size_t length)
+    {
+        if (length > Remaining())
+        {
+            throw std::runtime_error("Server Entries are corrupt: truncated data");
+        }
+        const char* bytes = m_pos;
+        m_pos += length;
+        return bytes;
+    }
+
+    // Reads a count of items that each take at least one byte, so that a
+    // corrupt count can't cause a huge allocation.
+    size_t ReadCount()
+    {
+        uint64_t count = ReadVarint();
+        if (count > Remaining())
+        {
+            throw std::runtime_error("Server Entries are corrupt: bad count");
+        }
+        return (size_t)count;
+    }
+
+private:
+    const char* m_pos;
+    const char* m_end;
+};
+
+// The string table is either decoded strings, or ranges of the encoded data
+// (see ServerEntryListView).
+template <typename StringType>
+static const StringType& LookupString(const vector<StringType>& strings, uint64_t index)
+{
+    if (index >= strings.size())
+    {
+        throw std::runtime_error("Server Entries are corrupt: bad string index");
+    }
+    return strings[(size_t)index];
+}
+
+static string ToString(const string& value) { return value; }
+static string ToString(const ServerEntryListView::ByteRange& value) { return string(value.data, value.length); }
+
+template <typename StringType>
+static string ReadString(BinaryReader& reader, const vector<StringType>& strings)
+{
+    return ToString(LookupString(strings, reader.ReadVarint()));
+}
+
+template <typename StringType>
+static void ReadStringList(BinaryReader& reader, const vector<StringType>& strings, vector<string>& o_values)
+{
+    size_t count = reader.ReadCount();
+    o_values.clear();
+    o_values.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        o_values.push_back(ReadString(reader, strings));
+    }
+}
+
+template <typename StringType>
+static void ReadServerEntryRecord(BinaryReader& reader, const vector<StringType>& strings, ServerEntry& o_entry)
+{
+    o_entry.serverAddress = ReadString(reader, strings);
+    o_entry.region = ReadString(reader, strings);
+    o_entry.webServerPort = reader.ReadSignedInt();
+    o_entry.webServerSecret = ReadString(reader, strings);
+    o_entry.webServerCertificate = ReadString(reader, strings);
+    o_entry.sshPort = reader.ReadSignedInt();
+    o_entry.sshUsername = ReadString(reader, strings);
+    o_entry.sshPassword = ReadString(reader, strings);
+    o_entry.sshHostKey = ReadString(reader, strings);
+    o_entry.sshObfuscatedPort = reader.ReadSignedInt();
+    o_entry.sshObfuscatedKey = ReadString(reader, strings);
+    ReadStringList(reader, strings, o_entry.capabilities);
+    o_entry.meekObfuscatedKey = ReadString(reader, strings);
+    o_entry.meekServerPort = reader.ReadSignedInt();
+    o_entry.meekCookieEncryptionPublicKey = ReadString(reader, strings);
+    o_entry.meekFrontingDomain = ReadString(reader, strings);
+    o_entry.meekFrontingHost = ReadString(reader, strings);
+    o_entry.meekFrontingAddressesRegex = ReadString(reader, strings);
+    ReadStringList(reader, strings, o_entry.meekFrontingAddresses);
+
+    // Any remaining bytes are fields added by a newer version
+}
+
+// Returns a reader positioned at the string table.
+static BinaryReader OpenBinaryServerEntryList(const string& data)
+{
+    if (!IsBinaryServerEntryList(data))
+    {
+        throw std::runtime_error("Server Entries are corrupt: bad binary header");
+    }
+
+    BinaryReader reader(data.data() + BINARY_SERVER_LIST_MAGIC_LENGTH, data.data() + data.length());
+
+    unsigned char version = (unsigned char)*reader.ReadBytes(1);
+    if (version != BINARY_SERVER_LIST_VERSION)
+    {
+        throw std::runtime_error("Server Entries are corrupt: unknown binary version");
+    }
+
+    return reader;
+}
+
+ServerEntries DecodeBinaryServerEntryList(const string& data)
+{
+    BinaryReader reader = OpenBinaryServerEntryList(data);
+
+    size_t stringCount = reader.ReadCount();
+    vector<string> strings;
+    strings.reserve(stringCount);
+    for (size_t i = 0; i < stringCount; i++)
+    {
+        size_t length = (size_t)reader.ReadVarint();
+        const char* bytes = reader.ReadBytes(length);
+        strings.push_back(string(bytes, length));
+    }
+
+    size_t entryCount = reader.ReadCount();
+    ServerEntries serverEntryList;
+    for (size_t i = 0; i < entryCount; i++)
+    {
+        size_t recordLength = (size_t)reader.ReadVarint();
+        const char* record = reader.ReadBytes(recordLength);
+        BinaryReader recordReader(record, record + recordLength);
+
+        ServerEntry entry;
+        ReadServerEntryRecord(recordReader, strings, entry);
+        serverEntryList.push_back(entry);
+    }
+
+    if (!reader.AtEnd())
+    {
+        throw std::runtime_error("Server Entries are corrupt: trailing data");
+    }
+
+    return serverEntryList;
+}
+
+
+/***********************************************
+Lazy decoding
+*/
+
+// Decodes a hex-encoded legacy entry from its start up to `fieldLength`
+// characters into the space-separated field `fieldIndex`, without decoding
+// the (much larger) remainder. Returns the decoded prefix; the field starts
+// at o_fieldOffset.
+static string DehexlifyLegacyPrefix(
+                const ServerEntryListView::ByteRange& line,
+                int fieldIndex,
+                size_t fieldLength,
+                size_t& o_fieldOffset)
+{
+    string prefix;
+    int spaces = 0;
+    o_fieldOffset = 0;
+
+    for (size_t i = 0; i + 1 < line.length; i += 2)
+    {
+        if (spaces == fieldIndex && prefix.length() >= o_fieldOffset + fieldLength)
+        {
+            break;
+        }
+
+        unsigned char c;
+        if (!HexDecode(line.data + i, 2, &c))
+        {
+            break;
+        }
+
+        prefix.push_back((char)c);
+        if (c == ' ' && spaces < fieldIndex && ++spaces == fieldIndex)
+        {
+            o_fieldOffset = prefix.length();
+        }
+    }
+
+    if (spaces < fieldIndex)
+    {
+        throw std::runtime_error("Server Entries are corrupt: can't parse legacy fields");
+    }
+
+    return prefix;
+}
+
+ServerEntryListView::ServerEntryListView(const string& data)
+{
+    m_binary = IsBinaryServerEntryList(data);
+
+    if (m_binary)
+    {
+        BinaryReader reader = OpenBinaryServerEntryList(data);
+
+        size_t stringCount = reader.ReadCount();
+        m_strings.reserve(stringCount);
+        for (size_t i = 0; i < stringCount; i++)
+        {
+            ByteRange range;
+            range.length = (size_t)reader.ReadVarint();
+            range.data = reader.ReadBytes(range.length);
+            m_strings.push_back(range);
+        }
+
+        // Only the record boundaries are found here; their contents are read on demand
+        size_t entryCount = reader.ReadCount();
+        m_entries.reserve(entryCount);
+        for (size_t i = 0; i < entryCount; i++)
+        {
+            ByteRange range;
+            range.length = (size_t)reader.ReadVarint();
+            range.data = reader.ReadBytes(range.length);
+            m_entries.push_back(range);
+        }
+
+        if (!reader.AtEnd())
+        {
+            throw std::runtime_error("Server Entries are corrupt: trailing data");
+        }
+    }
+    else
+    {
+        // One hex-encoded ServerEntry::ToString() per line. As when fully
+        // parsing the list, entries without a web server certificate are skipped,
+        // so the leading legacy fields of every entry have to be decoded now.
+        const char* begin = data.data();
+        const char* end = begin + data.length();
+        while (begin < end)
+        {
+            const char* newline = (const char*)memchr(begin, '\n', end - begin);
+            const char* lineEnd = newline ? newline : end;
+
+            ByteRange line;
+            line.data = begin;
+            line.length = lineEnd - begin;
+
+            static const string NO_CERTIFICATE = "None";
+            size_t certificateOffset;
+            string prefix = DehexlifyLegacyPrefix(line, 3, NO_CERTIFICATE.length() + 1, certificateOffset);
+            string certificate = prefix.substr(certificateOffset);
+            if (certificate != NO_CERTIFICATE && certificate != NO_CERTIFICATE + " ")
+            {
+                m_entries.push_back(line);
+            }
+
+            begin = lineEnd + 1;
+        }
+    }
+
+    m_decoded.resize(m_entries.size());
+}
+
+ServerEntryListView::~ServerEntryListView()
+{
+    for (auto it = m_decoded.begin(); it != m_decoded.end(); ++it)
+    {
+        delete *it;
+    }
+}
+
+string ServerEntryListView::GetServerAddress(size_t index) const
+{
+    if (!m_binary)
+    {
+        size_t unused;
+        string prefix = DehexlifyLegacyPrefix(m_entries[index], 1, 0, unused);
+        return prefix.substr(0, prefix.find(' '));
+    }
+
+    // The address is the first field of the record
+    const ByteRange& record = m_entries[index];
+    BinaryReader reader(record.data, record.data + record.length);
+    return ReadString(reader, m_strings);
+}
+
+const ServerEntry& ServerEntryListView::GetEntry(size_t index) const
+{
+    if (!m_decoded[index])
+    {
+        unique_ptr<ServerEntry> entry(new ServerEntry());
+        const ByteRange& range = m_entries[index];
+
+        if (m_binary)
+        {
+            BinaryReader reader(range.data, range.data + range.length);
+            ReadServerEntryRecord(reader, m_strings, *entry);
+        }
+        else
+        {
+            entry->FromString(Dehexlify(string(range.data, range.length)));
+        }
+
+        m_decoded[index] = entry.release();
+    }
+
+    return *m_decoded[index];
+}
+
+
+/***********************************************
+Journal
+*/
+
+enum ServerListJournalOperation
+{
+    JOURNAL_UPSERT = 1,
+    JOURNAL_MOVE_TO_FRONT = 2,
+    JOURNAL_MOVE_TO_BACK = 3,
+    JOURNAL_ERASE = 4
+};
+
+static void AppendJournalRecord(string& journal, ServerListJournalOperation operation, const string& data)
+{
+    WriteVarint(journal, 1 + data.length());
+    journal.push_back((char)operation);
+    journal.append(data);
+}
+
+void AppendServerListJournalUpsert(string& journal, const ServerEntry& serverEntry)
+{
+    // A single-entry list carries its own string table, so the record stands alone
+    AppendJournalRecord(journal, JOURNAL_UPSERT, EncodeBinaryServerEntryList(ServerEntries(1, serverEntry)));
+}
+
+void AppendServerListJournalMoveToFront(string& journal, const string& serverAddress, bool veryFront)
+{
+    AppendJournalRecord(journal, JOURNAL_MOVE_TO_FRONT, string(1, veryFront ? 1 : 0) + serverAddress);
+}
+
+void AppendServerListJournalMoveToBack(string& journal, const string& serverAddress)
+{
+    AppendJournalRecord(journal, JOURNAL_MOVE_TO_BACK, serverAddress);
+}
+
+void AppendServerListJournalErase(string& journal, const string& serverAddress)
+{
+    AppendJournalRecord(journal, JOURNAL_ERASE, serverAddress);
+}
+
+bool ReplayServerListJournal(const string& journal, IndexedServerEntries& serverEntryList)
+{
+    BinaryReader reader(journal.data(), journal.data() + journal.length());
+
+    try
+    {
+        while (!reader.AtEnd())
+        {
+            size_t recordLength = (size_t)reader.ReadVarint();
+            if (recordLength < 1)
+            {
+                return false;
+            }
+
+            const char* record = reader.ReadBytes(recordLength);
+            unsigned char operation = (unsigned char)record[0];
+            string data(record + 1, recordLength - 1);
+
+            switch (operation)
+            {
+            case JOURNAL_UPSERT:
+            {
+                ServerEntries entries = DecodeBinaryServerEntryList(data);
+                if (entries.size() != 1)
+                {
+                    return false;
+                }
+                serverEntryList.Upsert(entries[0]);
+                break;
+            }
+            case JOURNAL_MOVE_TO_FRONT:
+                if (data.empty())
+                {
+                    return false;
+                }
+                serverEntryList.MoveToFront(data.substr(1), data[0] != 0);
+                break;
+            case JOURNAL_MOVE_TO_BACK:
+                serverEntryList.MoveToBack(data);
+                break;
+            case JOURNAL_ERASE:
+                serverEntryList.Erase(data);
+                break;
+            default:
+                return false;
+            }
+        }
+    }
+    catch (std::exception&)
+    {
+        return false;
+    }
+
+    return true;
+}
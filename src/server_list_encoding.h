@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include "serverlist.h"
+
+
+/*
+Compact binary encoding for persisted server entry lists.
+
+The legacy persisted format is one line per entry, each being the hex encoding
+of ServerEntry::ToString() (space-separated legacy fields followed by a JSON
+object). The binary format is several times smaller and is decoded without
+any JSON parsing. It looks like:
+
+    magic (4 bytes) | version (1 byte)
+    string count | { string length | string bytes }...
+    entry count | { record length | record fields }...
+
+All integers are LEB128 varints; signed values are zigzag-encoded. String
+fields are indexes into the string table, so values that repeat across
+entries -- capabilities, regions, fronting domains, etc. -- are stored once.
+A record's fields are in the fixed order given by the version; the record
+length lets newer versions append fields that older decoders skip.
+*/
+
+// Returns true if `data` is a binary-encoded list (rather than the legacy format).
+bool IsBinaryServerEntryList(const string& data);
+
+string EncodeBinaryServerEntryList(const ServerEntries& serverEntryList);
+
+// Throws std::exception if the data is corrupt.
+ServerEntries DecodeBinaryServerEntryList(const string& data);
+
+
+// A view of an encoded server entry list (in either encoding) that decodes
+// entries lazily.
+//
+// Fully decoding a list is costly -- especially the legacy format, which is
+// hex-encoded JSON -- but some scans, such as merging lists, only need each
+// entry's address. The view only finds the entries up front. Addresses are
+// then read straight out of the data, without decoding the rest of the entry;
+// anything else decodes the whole entry, once.
+//
+// The view refers into `data`, which must outlive it.
+class ServerEntryListView
+{
+public:
+    // Throws std::exception if the list is corrupt. Corrupt entries may only
+    // be detected, and throw, when they're accessed.
+    ServerEntryListView(const string& data);
+    ~ServerEntryListView();
+
+    size_t size() const { return m_entries.size(); }
+
+    string GetServerAddress(size_t index) const;
+
+    // The fully decoded entry. The reference is valid for the view's lifetime.
+    const ServerEntry& GetEntry(size_t index) const;
+
+    struct ByteRange
+    {
+        const char* data;
+        size_t length;
+    };
+
+private:
+    // Not copyable
+    ServerEntryListView(const ServerEntryListView&);
+    ServerEntryListView& operator=(const ServerEntryListView&);
+
+    bool m_binary;
+    vector<ByteRange> m_strings;
+    vector<ByteRange> m_entries;
+    mutable vector<ServerEntry*> m_decoded;
+};
+
+
+/*
+Server list journal records.
+
+Each record is: record length | operation (1 byte) | operation data. Records
+are appended to a journal (see server_list_store.h) as the list is mutated,
+and replayed on top of the last snapshot when the list is loaded.
+*/
+
+// Updates the entry in place, or inserts it near the front if it's new.
+// (See IndexedServerEntries::Upsert.)
+void AppendServerListJournalUpsert(string& journal, const ServerEntry& serverEntry);
+void AppendServerListJournalMoveToFront(string& journal, const string& serverAddress, bool veryFront);
+void AppendServerListJournalMoveToBack(string& journal, const string& serverAddress);
+void AppendServerListJournalErase(string& journal, const string& serverAddress);
+
+// Applies the journal records to serverEntryList. Returns false if the journal
+// ends with a truncated or corrupt record (for example, if a write was
+// interrupted); all records before that are still applied.
+bool ReplayServerListJournal(const string& journal, IndexedServerEntries& serverEntryList);
@@ -18,24 +18,24 @@
  */
 
 #include "stdafx.h"
-#include <WinSock2.h>
 #include "logging.h"
 #include "config.h"
 #include "psiclient.h"
 #include "utilities.h"
 #include "diagnostic_info.h"
 #include "server_list_reordering.h"
+#include "reachability_prober.h"
+#include "usersettings.h"
 
 
-const int MAX_WORKER_THREADS = 30;
+const size_t MAX_CHECKED_SERVERS = 30;
 const int MAX_CHECK_TIME_MILLISECONDS = 5000;
-const int RESPONSE_TIME_THRESHOLD_FACTOR = 2;
 
 void ReorderServerList(ServerList& serverList, const StopInfo& stopInfo);
 
 
 ServerListReorder::ServerListReorder()
-    : m_thread(NULL), m_serverList(0)
+    : m_serverList(0)
 {
     m_mutex = CreateMutex(NULL, FALSE, 0);
 }
@@ -63,12 +63,13 @@ void ServerListReorder::Start(ServerList* serverList)
 
     Stop(STOP_REASON_CANCEL);
 
-    m_thread = CreateThread(0, 0, ReorderServerListThread, this, 0, 0);
-    if (!m_thread)
-    {
-        my_print(NOT_SENSITIVE, false, _T("Server List Reorder: CreateThread failed (%d)"), GetLastError());
-        return;
-    }
+    // No mutex in the task. It can be cancelled by Stop().
+    m_task = TaskExecutor::Instance().Submit(
+                TASK_PRIORITY_BACKGROUND,
+                [this](const CancellationToken& token) {
+                    ReorderServerList(*m_serverList, token.GetStopInfo());
+                },
+                StopInfo(&m_stopSignal, STOP_REASON_ANY_STOP_TUNNEL));
 }
 
 
@@ -76,16 +77,16 @@ void ServerListReorder::Stop(DWORD stopReason)
 {
     AutoMUTEX lock(m_mutex);
 
-    // This signal causes the thread to terminate
+    // This signal causes the task to terminate, or never to start
     m_stopSignal.SignalStop(stopReason);
 
-    if (m_thread != NULL)
+    if (m_task.IsValid())
     {
-        WaitForSingleObject(m_thread, INFINITE);
+        m_task.Wait(INFINITE);
 
         // Reset for another run.
 
-        m_thread = NULL;
+        m_task.Reset();
     }
 
     m_stopSignal.ClearStopSignal(STOP_REASON_ANY_STOP_TUNNEL &~ STOP_REASON_EXIT);
@@ -96,110 +97,7 @@ bool ServerListReorder::IsRunning()
 {
     AutoMUTEX lock(m_mutex);
 
-    return (m_thread != NULL);
-}
-
-
-DWORD WINAPI ServerListReorder::ReorderServerListThread(void* data)
-{
-    // No mutex here.  This is the main thread of execution that can be cancelled
-    // by Stop().
-
-    ServerListReorder* object = (ServerListReorder*)data;
-
-    ReorderServerList(*(object->m_serverList), StopInfo(&object->m_stopSignal, STOP_REASON_ANY_STOP_TUNNEL));
-
-    object->m_thread = NULL;
-    return 0;
-}
-
-
-struct WorkerThreadData
-{
-    ServerEntry m_entry;
-    bool m_responded;
-    unsigned int m_responseTime;
-    StopInfo m_stopInfo;
-
-    WorkerThreadData(ServerEntry entry, StopInfo stopInfo)
-        : m_entry(entry),
-          m_responded(false),
-          m_responseTime(UINT_MAX),
-          m_stopInfo(stopInfo)
-    {
-    }
-};
-
-
-DWORD WINAPI CheckServerReachabilityThread(void* object)
-{
-    WorkerThreadData* data = (WorkerThreadData*)object;
-
-    // Test for reachability by establishing a TCP socket
-    // connection to the specified port on the target host.
-
-    DWORD start_time = GetTickCount();
-
-    bool success = true;
-
-    WSADATA wsaData;
-    WSAStartup(MAKEWORD(2, 2), &wsaData);
-    sockaddr_in serverAddr;
-    WSAEVENT connectedEvent = NULL;
-    WSANETWORKEVENTS networkEvents;
-    SOCKET sock = INVALID_SOCKET;
-
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = inet_addr(data->m_entry.serverAddress.c_str());
-    // NOTE: we've already checked for the presence of a reachability port below
-    serverAddr.sin_port = htons((unsigned short)data->m_entry.GetPreferredReachablityTestPort());
-
-    connectedEvent = WSACreateEvent();
-
-    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-    if (INVALID_SOCKET == sock ||
-        0 != WSAEventSelect(sock, connectedEvent, FD_CONNECT) ||
-        SOCKET_ERROR != connect(sock, (SOCKADDR*)&serverAddr, sizeof(serverAddr)) ||
-        WSAEWOULDBLOCK != WSAGetLastError())
-    {
-        success = false;
-    }
-
-    while (success)
-    {
-        DWORD waitResult = WSAWaitForMultipleEvents(1, &connectedEvent, TRUE, 100, FALSE);
-
-        if (WSA_WAIT_EVENT_0 == waitResult
-            && 0 == WSAEnumNetworkEvents(sock, connectedEvent, &networkEvents)
-            && (networkEvents.lNetworkEvents & FD_CONNECT)
-            && networkEvents.iErrorCode[FD_CONNECT_BIT] == 0)
-        {
-            // Successfully connected
-            break;
-        }
-
-        // Check for stop (abort) signal
-        if (data->m_stopInfo.stopSignal->CheckSignal(data->m_stopInfo.stopReasons, false))
-        {
-            success = false;
-            break;
-        }
-    }
-
-    closesocket(sock);
-    WSACloseEvent(connectedEvent);
-    WSACleanup();
-
-    DWORD end_time = GetTickCount(); // GetTickCount can wrap
-
-    data->m_responseTime = (end_time >= start_time) ?
-                           (end_time - start_time) :
-                           (0xFFFFFFFF - start_time + end_time);
-
-    data->m_responded = success;
-
-    return 0;
+    return !m_task.IsDone();
 }
 
 
@@ -208,130 +106,91 @@ void ReorderServerList(ServerList& serverList, const StopInfo& stopInfo)
     ServerEntries serverEntries = serverList.GetList();
 
     // Check response time from each server (in parallel).
-    // At most the first MAX_WORKER_THREADS servers in the
+    // At most the first MAX_CHECKED_SERVERS servers in the
     // current server list will be checked. We select the
     // first MAX/2 server from the top of the list (they
     // may be better/fresher) and then MAX/2 random servers
     // from the rest of the list (they may be underused).
 
-    // TODO: use a thread pool?
-
-    vector<HANDLE> threadHandles;
-    vector<WorkerThreadData*> threadData;
-
-    if (serverEntries.size() > MAX_WORKER_THREADS)
+    if (serverEntries.size() > MAX_CHECKED_SERVERS)
     {
-        ShuffleVector(serverEntries.begin() + MAX_WORKER_THREADS / 2, serverEntries.end());
+        ShuffleVector(serverEntries.begin() + MAX_CHECKED_SERVERS / 2, serverEntries.end());
     }
 
+    ServerEntries checkedServers;
+    vector<ReachabilityProbe> probes;
+
     for (ServerEntryIterator entry = serverEntries.begin(); entry != serverEntries.end(); ++entry)
     {
-        if (-1 != entry->GetPreferredReachablityTestPort())
+        int port = entry->GetPreferredReachablityTestPort();
+        if (-1 != port)
         {
-            WorkerThreadData* data = new WorkerThreadData(*entry, stopInfo);
-
-            HANDLE threadHandle = CreateThread(0, 0, CheckServerReachabilityThread, (void*)data, 0, 0);
-            if (!threadHandle)
-            {
-                continue;
-            }
-
-            threadHandles.push_back(threadHandle);
-            threadData.push_back(data);
+            checkedServers.push_back(*entry);
+            probes.push_back(ReachabilityProbe(entry->serverAddress, port));
 
-            if (threadHandles.size() >= MAX_WORKER_THREADS)
+            if (probes.size() >= MAX_CHECKED_SERVERS)
             {
                 break;
             }
         }
     }
 
-    // Wait for all threads to finish
-
-    // TODO: stop waiting early if all threads finish?
-
-    for (int waits = 0; waits < MAX_CHECK_TIME_MILLISECONDS/100; waits++)
-    {
-        Sleep(100);
-
-        if (stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons))
-        {
-            // Stop waiting early if exiting the app, etc.
-            // NOTE: we still process results in this case
-            break;
-        }
-    }
-    stopInfo.stopSignal->SignalStop(STOP_REASON_CANCEL);
+    // Returns as soon as all of the probes have completed, or if the app is
+    // exiting, etc.
+    // NOTE: we still process results in the stop case
 
-    for (vector<HANDLE>::iterator handle = threadHandles.begin(); handle != threadHandles.end(); ++handle)
-    {
-        WaitForSingleObject(*handle, INFINITE);
-        CloseHandle(*handle);
-    }
+    ProbeReachability(probes, MAX_CHECK_TIME_MILLISECONDS, MAX_CHECKED_SERVERS, stopInfo);
 
-    // Build a list of all servers that responded within the threshold
-    // time (+100%) of the best server. Using the best server as a base
-    // is intended to factor out local network conditions, local cpu
-    // conditions (e.g., SSL overhead) etc. We randomly shuffle the
-    // resulting list for some client-side load balancing. Any server
-    // that meets the threshold is considered equally qualified for
-    // any position towards the top of the list.
+    // If we were stopped early, servers that haven't responded may not have
+    // had the chance to, so they aren't counted as failing.
+    bool stopped = (0 != stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons));
 
-    unsigned int fastestResponseTime = UINT_MAX;
+    ServerEntries completedServers;
+    vector<ServerResponse> responses;
 
-    for (vector<WorkerThreadData*>::iterator data = threadData.begin(); data != threadData.end(); ++data)
+    for (size_t i = 0; i < probes.size(); i++)
     {
         my_print(
             SENSITIVE_LOG,
             true,
-            _T("server: %s, responded: %s, response time: %d"),
-            UTF8ToWString((*data)->m_entry.serverAddress).c_str(),
-            (*data)->m_responded ? L"yes" : L"no",
-            (*data)->m_responseTime);
+            _T("server: %s, responded: %s, response time: %.3f"),
+            UTF8ToWString(probes[i].address).c_str(),
+            probes[i].responded ? L"yes" : L"no",
+            probes[i].responseTimeMilliseconds);
 
-        if ((*data)->m_responded && (*data)->m_responseTime < fastestResponseTime)
+        if (probes[i].responded || !stopped)
         {
-            fastestResponseTime = (*data)->m_responseTime;
+            completedServers.push_back(checkedServers[i]);
+            responses.push_back(ServerResponse(probes[i].responded, probes[i].responseTimeMilliseconds));
         }
 
         Json::Value json;
-        json["ipAddress"] = (*data)->m_entry.serverAddress;
-        json["responded"] = (*data)->m_responded;
-        json["responseTime"] = (*data)->m_responseTime;
+        json["ipAddress"] = probes[i].address;
+        json["responded"] = probes[i].responded;
+        // Whole milliseconds, as before the probes were timed more precisely
+        json["responseTime"] = (Json::UInt)(probes[i].responseTimeMilliseconds + 0.5);
+        json["responseTimeMilliseconds"] = probes[i].responseTimeMilliseconds;
         AddDiagnosticInfoJson("ServerResponseCheck", json);
     }
 
-    ServerEntries respondingServers;
-
-    for (vector<WorkerThreadData*>::iterator data = threadData.begin(); data != threadData.end(); ++data)
-    {
-        if ((*data)->m_responded && (*data)->m_responseTime <=
-                fastestResponseTime*RESPONSE_TIME_THRESHOLD_FACTOR)
-        {
-            respondingServers.push_back((*data)->m_entry);
-        }
-    }
-
-    ShuffleVector(respondingServers.begin(), respondingServers.end());
-
-    // Merge back into server entry list. MoveEntriesToFront will move
-    // these servers to the top of the list in the order submitted. Any
-    // other servers, including non-responders and new servers discovered
-    // while this process ran will remain in position after the move-to-front
-    // list. By using the ConnectionManager's ServerList object we ensure
-    // there's no conflict while reading/writing the persistent server list.
-
-    if (respondingServers.size() > 0)
-    {
-        serverList.MoveEntriesToFront(respondingServers);
-
-        my_print(NOT_SENSITIVE, true, _T("Preferred servers: %d"), respondingServers.size());
-    }
-
-    // Cleanup
-
-    for (vector<WorkerThreadData*>::iterator data = threadData.begin(); data != threadData.end(); ++data)
+    // Merge back into server entry list. By default, the servers that
+    // responded within twice the fastest response time are shuffled, for
+    // some client-side load balancing, and moved to the top of the list in
+    // that order. With the RankServers setting, all of the servers that
+    // responded are instead ranked -- by their history as well as this
+    // check, trading off how likely each is to connect against how fast it
+    // is (see server_ranking.h). The ranking isn't the default because it
+    // has yet to match the shuffle's time to connect in
+    // server_ranking_simulation. Any other servers, including non-responders
+    // and new servers discovered while this process ran will remain in
+    // position after the move-to-front list. By using the
+    // ConnectionManager's ServerList object we ensure there's no conflict
+    // while reading/writing the persistent server list.
+
+    size_t preferredServers = serverList.RankCheckedEntries(completedServers, responses, Settings::RankServers());
+
+    if (preferredServers > 0)
     {
-        delete *data;
+        my_print(NOT_SENSITIVE, true, _T("Preferred servers: %d"), preferredServers);
     }
 }
@@ -21,6 +21,7 @@
 
 #include "serverlist.h"
 #include "stopsignal.h"
+#include "task_executor.h"
 
 
 class ServerListReorder
@@ -34,10 +35,8 @@ public:
     bool IsRunning();
 
 private:
-    static DWORD WINAPI ReorderServerListThread(void* data);
-
     HANDLE m_mutex;
-    HANDLE m_thread;
+    TaskHandle m_task;
     ServerList* m_serverList;
 
     // We use a custom stop signal because we only want to respond to Stop()
@@ -0,0 +1,914 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "server_list_store.h"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "utilities.h"
+
+#ifndef _WIN32
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+/***********************************************
+FileServerListStore
+*/
+
+// NOTE: This store only uses portable file I/O, so that it can be exercised
+// on non-Windows systems.
+
+static const size_t EPOCH_LENGTH = 8;
+
+static string EncodeEpoch(uint64_t epoch)
+{
+    string encoded(EPOCH_LENGTH, '\0');
+    for (size_t i = 0; i < EPOCH_LENGTH; i++)
+    {
+        encoded[i] = (char)((epoch >> (8 * i)) & 0xFF);
+    }
+    return encoded;
+}
+
+static uint64_t DecodeEpoch(const char* bytes)
+{
+    uint64_t epoch = 0;
+    for (size_t i = 0; i < EPOCH_LENGTH; i++)
+    {
+        epoch |= (uint64_t)(unsigned char)bytes[i] << (8 * i);
+    }
+    return epoch;
+}
+
+// Reads the epoch header of the file and, if o_body is non-NULL, the rest of
+// the file. Returns false if the file doesn't exist or is too short.
+static bool ReadEpochFile(const filesystem::path& path, uint64_t& o_epoch, string* o_body, uint64_t* o_bodyLength=NULL)
+{
+    ifstream file(path.c_str(), ios::in | ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    char header[EPOCH_LENGTH];
+    if (!file.read(header, EPOCH_LENGTH))
+    {
+        return false;
+    }
+    o_epoch = DecodeEpoch(header);
+
+    if (o_body)
+    {
+        o_body->assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        if (file.bad())
+        {
+            return false;
+        }
+    }
+
+    if (o_bodyLength)
+    {
+        file.seekg(0, ios::end);
+        *o_bodyLength = (uint64_t)file.tellg() - EPOCH_LENGTH;
+    }
+
+    return true;
+}
+
+static bool WriteEpochFile(const filesystem::path& path, uint64_t epoch, const string& body)
+{
+    ofstream file(path.c_str(), ios::out | ios::binary | ios::trunc);
+    string header = EncodeEpoch(epoch);
+    file.write(header.data(), header.length());
+    file.write(body.data(), body.length());
+    file.flush();
+    return file.good();
+}
+
+
+// Appending only ever grows the journal, and writing a snapshot bumps the
+// epoch, so together they identify the stored list.
+static uint64_t FileGeneration(uint64_t epoch, uint64_t journalLength)
+{
+    return (epoch << 32) + journalLength;
+}
+
+
+FileServerListStore::FileServerListStore(const filesystem::path& basePath)
+{
+    m_snapshotPath = basePath;
+    m_snapshotPath += ".snapshot";
+    m_journalPath = basePath;
+    m_journalPath += ".journal";
+}
+
+IServerListStore::LoadResult FileServerListStore::Load(string& o_snapshot, string& o_journal, uint64_t& o_generation)
+{
+    o_snapshot.clear();
+    o_journal.clear();
+    o_generation = 0;
+
+    uint64_t snapshotEpoch = 0;
+    if (!ReadEpochFile(m_snapshotPath, snapshotEpoch, &o_snapshot))
+    {
+        o_snapshot.clear();
+
+        error_code ec;
+        bool exists = filesystem::exists(m_snapshotPath, ec);
+        return (!exists && !ec) ? LOAD_NOT_FOUND : LOAD_ERROR;
+    }
+
+    // A journal from another epoch belongs to an older snapshot
+    uint64_t journalEpoch = 0;
+    if (!ReadEpochFile(m_journalPath, journalEpoch, &o_journal) || journalEpoch != snapshotEpoch)
+    {
+        o_journal.clear();
+    }
+
+    o_generation = FileGeneration(snapshotEpoch, o_journal.length());
+    return LOAD_OK;
+}
+
+bool FileServerListStore::WriteSnapshot(const string& snapshot, uint64_t& o_generation)
+{
+    uint64_t snapshotEpoch = 0, journalEpoch = 0;
+    (void)ReadEpochFile(m_snapshotPath, snapshotEpoch, NULL);
+    (void)ReadEpochFile(m_journalPath, journalEpoch, NULL);
+    uint64_t epoch = max(snapshotEpoch, journalEpoch) + 1;
+
+    // Write the new snapshot to the side and then move it into place, so a
+    // failure part way through doesn't lose the existing list.
+    filesystem::path tempPath = m_snapshotPath;
+    tempPath += ".tmp";
+    if (!WriteEpochFile(tempPath, epoch, snapshot))
+    {
+        error_code ec;
+        filesystem::remove(tempPath, ec);
+        return false;
+    }
+
+    error_code ec;
+    filesystem::rename(tempPath, m_snapshotPath, ec);
+    if (ec)
+    {
+        // Not all platforms replace an existing file when renaming
+        filesystem::remove(m_snapshotPath, ec);
+        filesystem::rename(tempPath, m_snapshotPath, ec);
+        if (ec)
+        {
+            return false;
+        }
+    }
+
+    // If this fails the old journal will be ignored anyway, as its epoch no
+    // longer matches the snapshot's.
+    (void)WriteEpochFile(m_journalPath, epoch, string());
+
+    o_generation = FileGeneration(epoch, 0);
+    return true;
+}
+
+bool FileServerListStore::AppendJournal(const string& records, uint64_t& o_generation)
+{
+    uint64_t snapshotEpoch = 0;
+    if (!ReadEpochFile(m_snapshotPath, snapshotEpoch, NULL))
+    {
+        // There's nothing for the journal to apply to
+        return false;
+    }
+
+    uint64_t journalEpoch = 0, journalLength = 0;
+    if (!ReadEpochFile(m_journalPath, journalEpoch, NULL, &journalLength) || journalEpoch != snapshotEpoch)
+    {
+        if (!WriteEpochFile(m_journalPath, snapshotEpoch, string()))
+        {
+            return false;
+        }
+        journalLength = 0;
+    }
+
+    ofstream file(m_journalPath.c_str(), ios::out | ios::binary | ios::app);
+    file.write(records.data(), records.length());
+    file.flush();
+    if (!file.good())
+    {
+        return false;
+    }
+
+    o_generation = FileGeneration(snapshotEpoch, journalLength + records.length());
+    return true;
+}
+
+uint64_t FileServerListStore::GetGeneration()
+{
+    uint64_t snapshotEpoch = 0;
+    if (!ReadEpochFile(m_snapshotPath, snapshotEpoch, NULL))
+    {
+        return 0;
+    }
+
+    uint64_t journalEpoch = 0, journalLength = 0;
+    if (!ReadEpochFile(m_journalPath, journalEpoch, NULL, &journalLength) || journalEpoch != snapshotEpoch)
+    {
+        journalLength = 0;
+    }
+
+    return FileGeneration(snapshotEpoch, journalLength);
+}
+
+
+/***********************************************
+MappedServerListStore
+*/
+
+// NOTE: The layout, locking and update protocol below are the same on every
+// platform. Only opening, sizing, mapping, flushing and locking the file are
+// platform specific. On Windows these use Win32; elsewhere, POSIX mmap and
+// fcntl locks, so that the protocol can be exercised on non-Windows systems.
+
+static const char MAPPED_STORE_MAGIC[4] = { 'P', 'S', 'L', 'M' };
+static const uint32_t MAPPED_STORE_VERSION = 1;
+
+// The file is grown in multiples of this, so that appending to the journal
+// doesn't remap the file every time.
+static const uint64_t MAPPED_STORE_GROWTH_ALIGNMENT = 64 * 1024;
+
+// The lock is taken on a byte range beyond any real file data, so that it
+// doesn't interfere with mapping or I/O. (Locking past the end of the file
+// is allowed.)
+static const DWORD MAPPED_STORE_LOCK_OFFSET_HIGH = 0x7FFFFFFF;
+
+struct MappedServerListStore::Header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t generation;
+    uint64_t snapshotOffset;
+    uint64_t snapshotLength;
+    uint64_t journalLength;
+    uint64_t reserved[2];
+    // Covers all of the fields above, so a header that was only partly
+    // written (if the process is killed, say) is detected.
+    uint64_t checksum;
+};
+
+static uint64_t HeaderChecksum(const void* header, size_t length)
+{
+    // FNV-1a
+    const unsigned char* bytes = (const unsigned char*)header;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#ifdef _WIN32
+
+static const HANDLE INVALID_MAPPED_STORE_FILE = INVALID_HANDLE_VALUE;
+
+class ScopedFileLock
+{
+public:
+    ScopedFileLock(HANDLE file, bool exclusive)
+        : m_file(file)
+    {
+        ZeroMemory(&m_overlapped, sizeof(m_overlapped));
+        m_overlapped.OffsetHigh = MAPPED_STORE_LOCK_OFFSET_HIGH;
+        m_locked = !!LockFileEx(m_file, exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, 1, 0, &m_overlapped);
+    }
+
+    ~ScopedFileLock()
+    {
+        if (m_locked)
+        {
+            UnlockFileEx(m_file, 0, 1, 0, &m_overlapped);
+        }
+    }
+
+    bool IsLocked() const { return m_locked; }
+
+private:
+    HANDLE m_file;
+    OVERLAPPED m_overlapped;
+    bool m_locked;
+};
+
+// An arbitrary starting generation, so that a new file can't be mistaken for
+// a previous file's.
+static uint64_t InitialGeneration()
+{
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+#else
+
+static const int INVALID_MAPPED_STORE_FILE = -1;
+
+// Open file description locks belong to the open file rather than to the
+// process, so they also exclude other stores in the same process, as
+// LockFileEx does. Where they aren't available, fall back to process locks.
+#ifdef F_OFD_SETLKW
+static const int MAPPED_STORE_LOCK_COMMAND = F_OFD_SETLKW;
+#else
+static const int MAPPED_STORE_LOCK_COMMAND = F_SETLKW;
+#endif
+
+class ScopedFileLock
+{
+public:
+    ScopedFileLock(int file, bool exclusive)
+        : m_file(file)
+    {
+        m_locked = Lock(exclusive ? F_WRLCK : F_RDLCK);
+    }
+
+    ~ScopedFileLock()
+    {
+        if (m_locked)
+        {
+            (void)Lock(F_UNLCK);
+        }
+    }
+
+    bool IsLocked() const { return m_locked; }
+
+private:
+    bool Lock(short type)
+    {
+        struct flock lock;
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = type;
+        lock.l_whence = SEEK_SET;
+        lock.l_start = (off_t)MAPPED_STORE_LOCK_OFFSET_HIGH << 32;
+        lock.l_len = 1;
+
+        int result;
+        do
+        {
+            result = fcntl(m_file, MAPPED_STORE_LOCK_COMMAND, &lock);
+        } while (result == -1 && errno == EINTR);
+
+        return result == 0;
+    }
+
+    int m_file;
+    bool m_locked;
+};
+
+static uint64_t InitialGeneration()
+{
+    return (uint64_t)chrono::system_clock::now().time_since_epoch().count();
+}
+
+#endif
+
+
+MappedServerListStore::MappedServerListStore(const filesystem::path& basePath)
+    : m_file(INVALID_MAPPED_STORE_FILE),
+#ifdef _WIN32
+      m_mapping(NULL),
+#endif
+      m_view(NULL),
+      m_viewSize(0)
+{
+    m_path = basePath;
+    m_path += ".list";
+}
+
+MappedServerListStore::~MappedServerListStore()
+{
+    Unmap();
+    if (m_file != INVALID_MAPPED_STORE_FILE)
+    {
+#ifdef _WIN32
+        CloseHandle(m_file);
+#else
+        close(m_file);
+#endif
+    }
+}
+
+bool MappedServerListStore::Open()
+{
+    if (m_file != INVALID_MAPPED_STORE_FILE)
+    {
+        return true;
+    }
+
+#ifdef _WIN32
+    m_file = CreateFileW(
+                m_path.c_str(),
+                GENERIC_READ | GENERIC_WRITE,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                NULL,
+                OPEN_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL,
+                NULL);
+#else
+    m_file = open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+#endif
+
+    return m_file != INVALID_MAPPED_STORE_FILE;
+}
+
+bool MappedServerListStore::GetFileSize(uint64_t& o_size) const
+{
+#ifdef _WIN32
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_file, &fileSize))
+    {
+        return false;
+    }
+    o_size = (uint64_t)fileSize.QuadPart;
+#else
+    struct stat fileStat;
+    if (fstat(m_file, &fileStat) != 0)
+    {
+        return false;
+    }
+    o_size = (uint64_t)fileStat.st_size;
+#endif
+    return true;
+}
+
+// Maps the whole file, growing it first if it's smaller than minimumSize.
+// Another process may have grown the file since it was last mapped, so this
+// is called (with the file locked) before each use of the view.
+// Returns false if the file can't be mapped or is empty.
+bool MappedServerListStore::Map(uint64_t minimumSize)
+{
+    uint64_t fileSize;
+    if (!GetFileSize(fileSize))
+    {
+        return false;
+    }
+
+    uint64_t size = fileSize;
+    if (size < minimumSize)
+    {
+        size = max(minimumSize, size + size / 2);
+        size = (size + MAPPED_STORE_GROWTH_ALIGNMENT - 1) / MAPPED_STORE_GROWTH_ALIGNMENT * MAPPED_STORE_GROWTH_ALIGNMENT;
+    }
+
+    if (m_view && size == m_viewSize)
+    {
+        return true;
+    }
+
+    Unmap();
+
+    if (size == 0 || size > (size_t)-1)
+    {
+        return false;
+    }
+
+#ifdef _WIN32
+    // Creating a mapping larger than the file extends the file.
+    m_mapping = CreateFileMapping(m_file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (!m_mapping)
+    {
+        return false;
+    }
+
+    m_view = (char*)MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+    if (!m_view)
+    {
+        Unmap();
+        return false;
+    }
+#else
+    // The file is only ever grown, and only with the file exclusively
+    // locked, so it can't shrink out from under another process's view.
+    if (size > fileSize && ftruncate(m_file, (off_t)size) != 0)
+    {
+        return false;
+    }
+
+    void* view = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+    if (view == MAP_FAILED)
+    {
+        return false;
+    }
+    m_view = (char*)view;
+#endif
+
+    m_viewSize = size;
+    return true;
+}
+
+void MappedServerListStore::Unmap()
+{
+#ifdef _WIN32
+    if (m_view)
+    {
+        UnmapViewOfFile(m_view);
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = NULL;
+    }
+#else
+    if (m_view)
+    {
+        munmap(m_view, (size_t)m_viewSize);
+    }
+#endif
+    m_view = NULL;
+    m_viewSize = 0;
+}
+
+// Writes [offset, offset + length) of the view through to disk. Flushing the
+// view only hands the pages to the file system, so the file is flushed too:
+// otherwise the header could reach the disk before the data it refers to.
+bool MappedServerListStore::Flush(uint64_t offset, uint64_t length) const
+{
+#ifdef _WIN32
+    return FlushViewOfFile(m_view + offset, (SIZE_T)length)
+        && FlushFileBuffers(m_file);
+#else
+    // msync needs a page-aligned address
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / pageSize * pageSize;
+    return msync(m_view + start, (size_t)(offset + length - start), MS_SYNC) == 0
+        && fdatasync(m_file) == 0;
+#endif
+}
+
+// Must be called with the file locked and mapped.
+// A file that has never had a header written to it holds nothing; one with a
+// header that doesn't check out can't be read.
+IServerListStore::LoadResult MappedServerListStore::ReadHeader(Header& o_header) const
+{
+    if (m_viewSize < sizeof(Header))
+    {
+        return LOAD_NOT_FOUND;
+    }
+
+    memcpy(&o_header, m_view, sizeof(Header));
+
+    static const char NO_MAGIC[sizeof(o_header.magic)] = { 0 };
+    if (memcmp(o_header.magic, NO_MAGIC, sizeof(o_header.magic)) == 0)
+    {
+        return LOAD_NOT_FOUND;
+    }
+
+    bool valid = memcmp(o_header.magic, MAPPED_STORE_MAGIC, sizeof(o_header.magic)) == 0
+        && o_header.version == MAPPED_STORE_VERSION
+        && o_header.checksum == HeaderChecksum(&o_header, offsetof(Header, checksum))
+        && o_header.snapshotOffset >= sizeof(Header)
+        && o_header.snapshotOffset <= m_viewSize
+        && o_header.snapshotLength <= m_viewSize - o_header.snapshotOffset
+        && o_header.journalLength <= m_viewSize - o_header.snapshotOffset - o_header.snapshotLength;
+
+    return valid ? LOAD_OK : LOAD_ERROR;
+}
+
+// Must be called with the file exclusively locked and mapped, and with the
+// data the header refers to already flushed.
+bool MappedServerListStore::WriteHeader(Header& header)
+{
+    header.checksum = HeaderChecksum(&header, offsetof(Header, checksum));
+    memcpy(m_view, &header, sizeof(Header));
+    return Flush(0, sizeof(Header));
+}
+
+IServerListStore::LoadResult MappedServerListStore::Load(string& o_snapshot, string& o_journal, uint64_t& o_generation)
+{
+    o_snapshot.clear();
+    o_journal.clear();
+    o_generation = 0;
+
+    if (!Open())
+    {
+        return LOAD_ERROR;
+    }
+
+    ScopedFileLock lock(m_file, false);
+    if (!lock.IsLocked())
+    {
+        return LOAD_ERROR;
+    }
+
+    uint64_t fileSize;
+    if (!GetFileSize(fileSize))
+    {
+        return LOAD_ERROR;
+    }
+    if (fileSize == 0)
+    {
+        // Open() just created it
+        return LOAD_NOT_FOUND;
+    }
+
+    Header header;
+    if (!Map(0))
+    {
+        return LOAD_ERROR;
+    }
+    LoadResult result = ReadHeader(header);
+    if (result != LOAD_OK)
+    {
+        return result;
+    }
+
+    const char* snapshot = m_view + header.snapshotOffset;
+    o_snapshot.assign(snapshot, (size_t)header.snapshotLength);
+    o_journal.assign(snapshot + header.snapshotLength, (size_t)header.journalLength);
+    o_generation = header.generation;
+
+    return LOAD_OK;
+}
+
+bool MappedServerListStore::WriteSnapshot(const string& snapshot, uint64_t& o_generation)
+{
+    if (!Open())
+    {
+        return false;
+    }
+
+    ScopedFileLock lock(m_file, true);
+    if (!lock.IsLocked())
+    {
+        return false;
+    }
+
+    Header header;
+    uint64_t offset = sizeof(Header);
+
+    if (Map(0) && ReadHeader(header) == LOAD_OK)
+    {
+        // Don't overwrite the current snapshot and journal: if we're
+        // interrupted, they're still the stored list.
+        if (offset + snapshot.length() > header.snapshotOffset)
+        {
+            offset = header.snapshotOffset + header.snapshotLength + header.journalLength;
+        }
+    }
+    else
+    {
+        // A new (or unreadable) file
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MAPPED_STORE_MAGIC, sizeof(header.magic));
+        header.version = MAPPED_STORE_VERSION;
+        header.generation = InitialGeneration();
+    }
+
+    // Leave room for the journal to grow into
+    if (!Map(offset + snapshot.length() + snapshot.length() / 2))
+    {
+        return false;
+    }
+
+    memcpy(m_view + offset, snapshot.data(), snapshot.length());
+    if (!Flush(offset, snapshot.length()))
+    {
+        // The header still refers to the previous snapshot
+        return false;
+    }
+
+    header.generation++;
+    header.snapshotOffset = offset;
+    header.snapshotLength = snapshot.length();
+    header.journalLength = 0;
+    if (!WriteHeader(header))
+    {
+        return false;
+    }
+
+    o_generation = header.generation;
+    return true;
+}
+
+bool MappedServerListStore::AppendJournal(const string& records, uint64_t& o_generation)
+{
+    if (!Open())
+    {
+        return false;
+    }
+
+    ScopedFileLock lock(m_file, true);
+    Header header;
+    if (!lock.IsLocked() || !Map(0) || ReadHeader(header) != LOAD_OK)
+    {
+        // There's nothing for the journal to apply to
+        return false;
+    }
+
+    uint64_t end = header.snapshotOffset + header.snapshotLength + header.journalLength;
+    if (!Map(end + records.length()))
+    {
+        return false;
+    }
+
+    memcpy(m_view + end, records.data(), records.length());
+    if (!Flush(end, records.length()))
+    {
+        return false;
+    }
+
+    header.generation++;
+    header.journalLength += records.length();
+    if (!WriteHeader(header))
+    {
+        return false;
+    }
+
+    o_generation = header.generation;
+    return true;
+}
+
+uint64_t MappedServerListStore::GetGeneration()
+{
+    if (!Open())
+    {
+        return 0;
+    }
+
+    ScopedFileLock lock(m_file, false);
+    Header header;
+    if (!lock.IsLocked() || !Map(0) || ReadHeader(header) != LOAD_OK)
+    {
+        return 0;
+    }
+
+    return header.generation;
+}
+
+
+/***********************************************
+RegistryServerListStore
+*/
+
+// The journal value starts with the epoch of the snapshot it applies to, as
+// the files of FileServerListStore do. The epoch of the current snapshot is
+// kept in its own value, since the snapshot value must stay a plain list.
+
+RegistryServerListStore::RegistryServerListStore(const string& valueName)
+    : m_snapshotName(valueName),
+      m_journalName(valueName + "Journal"),
+      m_epochName(valueName + "Epoch"),
+      m_generationName(valueName + "Generation"),
+      m_writeTooLong(false)
+{
+}
+
+bool RegistryServerListStore::ReadJournal(DWORD epoch, string& o_records)
+{
+    string value;
+    if (!ReadRegistryBinaryValue(m_journalName.c_str(), value) ||
+        value.length() < EPOCH_LENGTH ||
+        DecodeEpoch(value.data()) != epoch)
+    {
+        o_records.clear();
+        return false;
+    }
+
+    o_records = value.substr(EPOCH_LENGTH);
+    return true;
+}
+
+bool RegistryServerListStore::BumpGeneration(uint64_t& o_generation)
+{
+    DWORD generation = 0;
+    (void)ReadRegistryDwordValue(m_generationName, generation);
+    if (!WriteRegistryDwordValue(m_generationName, generation + 1))
+    {
+        return false;
+    }
+
+    o_generation = generation + 1;
+    return true;
+}
+
+IServerListStore::LoadResult RegistryServerListStore::Load(string& o_snapshot, string& o_journal, uint64_t& o_generation)
+{
+    o_snapshot.clear();
+    o_journal.clear();
+    o_generation = 0;
+
+    // There's no lock to read the generation under, so it's read first. If
+    // the list is written in the meantime, the generation is then older than
+    // the list read, and the list is just loaded again next time.
+    uint64_t generation = GetGeneration();
+
+    if (!ReadRegistryBinaryValue(m_snapshotName.c_str(), o_snapshot))
+    {
+        o_snapshot.clear();
+
+        // Older versions stored the list as a string, which is migrated just
+        // as if nothing were stored.
+        string legacy;
+        if (!DoesRegistryValueExist(m_snapshotName) || ReadRegistryStringValue(m_snapshotName.c_str(), legacy))
+        {
+            return LOAD_NOT_FOUND;
+        }
+        return LOAD_ERROR;
+    }
+
+    // A journal from another epoch belongs to an older snapshot
+    DWORD epoch = 0;
+    if (!ReadRegistryDwordValue(m_epochName, epoch) || !ReadJournal(epoch, o_journal))
+    {
+        o_journal.clear();
+    }
+
+    o_generation = generation;
+    return LOAD_OK;
+}
+
+bool RegistryServerListStore::WriteSnapshot(const string& snapshot, uint64_t& o_generation)
+{
+    m_writeTooLong = false;
+
+    DWORD epoch = 0;
+    (void)ReadRegistryDwordValue(m_epochName, epoch);
+    epoch++;
+
+    // The epoch is bumped first. If the snapshot then can't be written, the
+    // old journal is lost, rather than being replayed on top of a snapshot
+    // that already includes it.
+    RegistryFailureReason reason = REGISTRY_FAILURE_NO_REASON;
+    if (!WriteRegistryDwordValue(m_epochName, epoch) ||
+        !WriteRegistryBinaryValue(m_snapshotName, snapshot, reason))
+    {
+        m_writeTooLong = (reason == REGISTRY_FAILURE_WRITE_TOO_LONG);
+        return false;
+    }
+
+    // If this fails the old journal will be ignored anyway, as its epoch no
+    // longer matches the snapshot's.
+    (void)WriteRegistryBinaryValue(m_journalName, EncodeEpoch(epoch), reason);
+
+    return BumpGeneration(o_generation);
+}
+
+bool RegistryServerListStore::AppendJournal(const string& records, uint64_t& o_generation)
+{
+    m_writeTooLong = false;
+
+    // Only WriteSnapshot sets the epoch
+    DWORD epoch = 0;
+    if (!ReadRegistryDwordValue(m_epochName, epoch))
+    {
+        return false;
+    }
+
+    string journal;
+    (void)ReadJournal(epoch, journal);
+
+    // Every append rewrites the whole journal
+    if (journal.length() + records.length() > REGISTRY_STORE_MAX_JOURNAL_LENGTH)
+    {
+        m_writeTooLong = true;
+        return false;
+    }
+
+    RegistryFailureReason reason = REGISTRY_FAILURE_NO_REASON;
+    if (!WriteRegistryBinaryValue(m_journalName, EncodeEpoch(epoch) + journal + records, reason))
+    {
+        m_writeTooLong = (reason == REGISTRY_FAILURE_WRITE_TOO_LONG);
+        return false;
+    }
+
+    return BumpGeneration(o_generation);
+}
+
+uint64_t RegistryServerListStore::GetGeneration()
+{
+    // 0 until the first write, as required
+    DWORD generation = 0;
+    if (!ReadRegistryDwordValue(m_generationName, generation))
+    {
+        return 0;
+    }
+    return generation;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <filesystem>
+
+using namespace std;
+using namespace std::experimental;
+
+
+/*
+Persistent storage for a server list.
+
+A stored list is a snapshot of the whole list plus a journal of the
+mutations made since the snapshot was written (see server_list_encoding.h
+for both encodings). Mutating the list appends a small record to the journal
+instead of rewriting the whole list; now and then the list is compacted by
+writing a new snapshot, which empties the journal.
+
+The store knows nothing about the contents of the snapshot or journal.
+ServerList serializes its own access to the store; stores that can be shared
+by processes outside that (e.g., in other sessions) do their own locking.
+*/
+class IServerListStore
+{
+public:
+    virtual ~IServerListStore() {}
+
+    enum LoadResult
+    {
+        LOAD_OK,
+        // Nothing has been stored yet
+        LOAD_NOT_FOUND,
+        // Something may be stored, but it can't be read right now. The caller
+        // must not write over it as if it were empty.
+        LOAD_ERROR
+    };
+
+    // Sets o_generation to the generation (see GetGeneration) of the loaded
+    // list, read along with it; or to 0 if nothing is loaded.
+    virtual LoadResult Load(string& o_snapshot, string& o_journal, uint64_t& o_generation) = 0;
+
+    // Replaces the snapshot and empties the journal. On success, sets
+    // o_generation to the generation of the list as written.
+    virtual bool WriteSnapshot(const string& snapshot, uint64_t& o_generation) = 0;
+
+    // Appends to the journal. Fails if there is no snapshot. On success, sets
+    // o_generation to the generation of the list as written.
+    virtual bool AppendJournal(const string& records, uint64_t& o_generation) = 0;
+
+    // Whether the last WriteSnapshot or AppendJournal failed because the
+    // store can't hold that much, so that writing less may succeed: a
+    // shorter list, or a snapshot instead of a long journal. Only the
+    // registry store has such a limit.
+    virtual bool WriteTooLong() const { return false; }
+
+    // Returns a value that changes whenever the stored list changes, including
+    // by another ServerList instance or process. Returns 0 if nothing is stored.
+    //
+    // This is only for checking whether a list already loaded is still
+    // current. Another process can write between a call to this and a Load
+    // or write, so a list must be tagged with the generation returned along
+    // with it instead.
+    virtual uint64_t GetGeneration() = 0;
+};
+
+
+// Stores the snapshot and journal in two files, `<basePath>.snapshot` and
+// `<basePath>.journal`, using only portable file I/O. Each file starts with
+// an epoch number that is bumped when the snapshot is replaced, so a journal
+// left over from before a compaction that was interrupted is never replayed
+// on top of the new snapshot.
+class FileServerListStore : public IServerListStore
+{
+public:
+    FileServerListStore(const filesystem::path& basePath);
+    virtual ~FileServerListStore() {}
+
+    virtual LoadResult Load(string& o_snapshot, string& o_journal, uint64_t& o_generation);
+    virtual bool WriteSnapshot(const string& snapshot, uint64_t& o_generation);
+    virtual bool AppendJournal(const string& records, uint64_t& o_generation);
+    virtual uint64_t GetGeneration();
+
+private:
+    filesystem::path m_snapshotPath;
+    filesystem::path m_journalPath;
+};
+
+
+// Stores the snapshot and journal in a single memory-mapped file,
+// `<basePath>.list`, laid out as:
+//
+//     header | ... | snapshot | journal | ... (free space)
+//
+// The header records where the snapshot is and how long it and the journal
+// are. Data is always written to free space first and the header updated
+// after, so the header only ever refers to complete data. A new snapshot is
+// written in front of the current one if it fits, otherwise after the
+// current journal; so the file stays within a small multiple of the list size.
+//
+// Access is serialized across processes -- not just within a session, as the
+// ServerList mutex is -- by locking the file.
+//
+// Implemented with Win32 file mapping and LockFileEx on Windows, and with
+// mmap and fcntl locks elsewhere.
+class MappedServerListStore : public IServerListStore
+{
+public:
+    MappedServerListStore(const filesystem::path& basePath);
+    virtual ~MappedServerListStore();
+
+    virtual LoadResult Load(string& o_snapshot, string& o_journal, uint64_t& o_generation);
+    virtual bool WriteSnapshot(const string& snapshot, uint64_t& o_generation);
+    virtual bool AppendJournal(const string& records, uint64_t& o_generation);
+    virtual uint64_t GetGeneration();
+
+private:
+    struct Header;
+
+    bool Open();
+    bool GetFileSize(uint64_t& o_size) const;
+    bool Map(uint64_t minimumSize);
+    void Unmap();
+    bool Flush(uint64_t offset, uint64_t length) const;
+    LoadResult ReadHeader(Header& o_header) const;
+    bool WriteHeader(Header& header);
+
+    filesystem::path m_path;
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_file;
+#endif
+    char* m_view;
+    uint64_t m_viewSize;
+};
+
+
+static const size_t REGISTRY_STORE_MAX_JOURNAL_LENGTH = 64 * 1024;
+
+// Stores the list in the registry, where the client kept it before it had a
+// data directory. Used when the data directory isn't available.
+//
+// The snapshot is stored in the `valueName` value, as the plain encoded list
+// that older versions wrote; so if the data directory becomes available, the
+// list is migrated from here as it would be from an older version. The journal
+// is `<valueName>Journal`. Since values can only be replaced, not appended to,
+// appending rewrites the journal, so the journal is kept short: an append that
+// would make it longer than REGISTRY_STORE_MAX_JOURNAL_LENGTH fails, with
+// WriteTooLong, and the list has to be compacted instead. A snapshot that's
+// larger than a registry value can hold fails the same way.
+//
+// Unlike MappedServerListStore, this one isn't locked across sessions.
+class RegistryServerListStore : public IServerListStore
+{
+public:
+    RegistryServerListStore(const string& valueName);
+    virtual ~RegistryServerListStore() {}
+
+    virtual LoadResult Load(string& o_snapshot, string& o_journal, uint64_t& o_generation);
+    virtual bool WriteSnapshot(const string& snapshot, uint64_t& o_generation);
+    virtual bool AppendJournal(const string& records, uint64_t& o_generation);
+    virtual bool WriteTooLong() const { return m_writeTooLong; }
+    virtual uint64_t GetGeneration();
+
+private:
+    bool ReadJournal(DWORD epoch, string& o_records);
+    bool BumpGeneration(uint64_t& o_generation);
+
+    string m_snapshotName;
+    string m_journalName;
+    string m_epochName;
+    string m_generationName;
+    bool m_writeTooLong;
+};
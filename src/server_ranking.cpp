@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include <algorithm>
+#include <cmath>
+#include "server_ranking.h"
+
+
+// Successes and failures count half as much after this long.
+static const double SCORE_HALF_LIFE_SECONDS = 7 * 24 * 60 * 60;
+
+// The total of the success and failure counts is capped at this, so that a
+// long history doesn't keep the model from noticing a change.
+static const double MAX_SCORE_EVIDENCE = 100;
+
+// How much a response to a reachability check counts, relative to a
+// successful connection.
+static const double RESPONSE_SUCCESS_WEIGHT = 0.25;
+
+// The weight of the newest sample in the response time average.
+static const double RESPONSE_TIME_EWMA_WEIGHT = 0.3;
+
+// The response time assumed for servers that have never responded, and how
+// uncertain it is (as the standard deviation of its log).
+static const double PRIOR_RESPONSE_TIME_MILLISECONDS = 1000;
+static const double PRIOR_RESPONSE_TIME_LOG_SIGMA = 1.0;
+
+// The uncertainty of a single response time sample, which shrinks as
+// samples accumulate and grows as they age.
+static const double RESPONSE_TIME_LOG_SIGMA = 0.5;
+static const double RESPONSE_TIME_LOG_SIGMA_PER_DAY = 0.1;
+
+// Making a connection takes several round trips (TCP, then the tunnel
+// protocol's handshakes); a failed attempt usually costs a timeout.
+static const double ROUND_TRIPS_PER_CONNECTION = 8;
+static const double FAILED_CONNECTION_COST_MILLISECONDS = 20000;
+
+// Scores for the least recently updated servers are dropped beyond this.
+static const size_t MAX_SCORED_SERVERS = 2000;
+
+static const int RANKING_ENCODING_VERSION = 1;
+
+// For ShuffleFastResponders. Measuring from the fastest server factors out
+// local conditions, such as the network and the CPU.
+static const double RESPONSE_TIME_THRESHOLD_FACTOR = 2;
+
+
+// The factor by which counts recorded at `then` have decayed by `now`.
+static double DecayFactor(int64_t then, int64_t now)
+{
+    if (now <= then)
+    {
+        return 1.0;
+    }
+    return exp2(-(double)(now - then) / SCORE_HALF_LIFE_SECONDS);
+}
+
+static double SampleBeta(double alpha, double beta, mt19937& rng)
+{
+    gamma_distribution<double> x(alpha, 1.0);
+    gamma_distribution<double> y(beta, 1.0);
+    double a = x(rng);
+    double b = y(rng);
+    return (a + b > 0) ? a / (a + b) : 0.5;
+}
+
+
+ServerScore& ServerRanking::Update(const string& serverAddress, int64_t now)
+{
+    ServerScore& score = m_scores[serverAddress];
+
+    double decay = DecayFactor(score.lastUpdateTime, now);
+    score.successes *= decay;
+    score.failures *= decay;
+
+    double evidence = score.successes + score.failures;
+    if (evidence > MAX_SCORE_EVIDENCE - 1)
+    {
+        // Make room for the new observation
+        double scale = (MAX_SCORE_EVIDENCE - 1) / evidence;
+        score.successes *= scale;
+        score.failures *= scale;
+    }
+
+    score.lastUpdateTime = max(score.lastUpdateTime, now);
+
+    m_changed.insert(serverAddress);
+
+    return score;
+}
+
+void ServerRanking::RecordResponse(const string& serverAddress, double responseTimeMilliseconds, int64_t now)
+{
+    ServerScore& score = Update(serverAddress, now);
+
+    score.successes += RESPONSE_SUCCESS_WEIGHT;
+    score.lastSuccessTime = max(score.lastSuccessTime, now);
+
+    if (responseTimeMilliseconds > 0)
+    {
+        if (score.responseTimeSamples == 0)
+        {
+            score.responseTimeMilliseconds = responseTimeMilliseconds;
+        }
+        else
+        {
+            score.responseTimeMilliseconds +=
+                RESPONSE_TIME_EWMA_WEIGHT * (responseTimeMilliseconds - score.responseTimeMilliseconds);
+        }
+        score.responseTimeSamples++;
+    }
+
+    Prune();
+}
+
+void ServerRanking::RecordNoResponse(const string& serverAddress, int64_t now)
+{
+    ServerScore& score = Update(serverAddress, now);
+
+    score.failures += 1;
+
+    Prune();
+}
+
+void ServerRanking::RecordConnection(const string& serverAddress, bool connected, int64_t now)
+{
+    ServerScore& score = Update(serverAddress, now);
+
+    if (connected)
+    {
+        score.successes += 1;
+        score.lastSuccessTime = max(score.lastSuccessTime, now);
+    }
+    else
+    {
+        score.failures += 1;
+    }
+
+    Prune();
+}
+
+const ServerScore* ServerRanking::Find(const string& serverAddress) const
+{
+    auto score = m_scores.find(serverAddress);
+    return (score == m_scores.end()) ? NULL : &score->second;
+}
+
+vector<size_t> ServerRanking::Rank(const vector<string>& serverAddresses, int64_t now, mt19937& rng) const
+{
+    normal_distribution<double> normal;
+
+    vector<pair<double, size_t>> samples;
+    samples.reserve(serverAddresses.size());
+
+    for (size_t i = 0; i < serverAddresses.size(); i++)
+    {
+        double successes = 0;
+        double failures = 0;
+        double responseTime = PRIOR_RESPONSE_TIME_MILLISECONDS;
+        double responseTimeLogSigma = PRIOR_RESPONSE_TIME_LOG_SIGMA;
+
+        const ServerScore* score = Find(serverAddresses[i]);
+        if (score)
+        {
+            double decay = DecayFactor(score->lastUpdateTime, now);
+            successes = score->successes * decay;
+            failures = score->failures * decay;
+
+            if (score->responseTimeSamples > 0)
+            {
+                double daysSinceSuccess = max<int64_t>(now - score->lastSuccessTime, 0) / (24.0 * 60 * 60);
+                responseTime = score->responseTimeMilliseconds;
+                responseTimeLogSigma = min(
+                    RESPONSE_TIME_LOG_SIGMA / sqrt((double)min(score->responseTimeSamples, 10u))
+                        + RESPONSE_TIME_LOG_SIGMA_PER_DAY * daysSinceSuccess,
+                    PRIOR_RESPONSE_TIME_LOG_SIGMA);
+            }
+        }
+
+        // Beta(1, 1) -- uniform -- prior
+        double p = SampleBeta(successes + 1, failures + 1, rng);
+        double sampledResponseTime = responseTime * exp(responseTimeLogSigma * normal(rng));
+
+        double expectedCost =
+            p * sampledResponseTime * ROUND_TRIPS_PER_CONNECTION
+            + (1 - p) * FAILED_CONNECTION_COST_MILLISECONDS;
+
+        samples.push_back(make_pair(p / expectedCost, i));
+    }
+
+    sort(samples.begin(), samples.end(),
+        [](const pair<double, size_t>& a, const pair<double, size_t>& b) { return a.first > b.first; });
+
+    vector<size_t> order;
+    order.reserve(samples.size());
+    for (auto sample = samples.begin(); sample != samples.end(); ++sample)
+    {
+        order.push_back(sample->second);
+    }
+
+    return order;
+}
+
+void ServerRanking::Prune()
+{
+    if (m_scores.size() <= MAX_SCORED_SERVERS)
+    {
+        return;
+    }
+
+    // Drop down to 90% of the limit, so that we aren't pruning on every update.
+
+    vector<pair<int64_t, string>> updateTimes;
+    updateTimes.reserve(m_scores.size());
+    for (auto score = m_scores.begin(); score != m_scores.end(); ++score)
+    {
+        updateTimes.push_back(make_pair(score->second.lastUpdateTime, score->first));
+    }
+
+    size_t excess = m_scores.size() - MAX_SCORED_SERVERS * 9 / 10;
+    nth_element(updateTimes.begin(), updateTimes.begin() + excess, updateTimes.end());
+
+    for (size_t i = 0; i < excess; i++)
+    {
+        m_scores.erase(updateTimes[i].second);
+        m_changed.insert(updateTimes[i].second);
+    }
+}
+
+static Json::Value EncodeScore(const string& serverAddress, const ServerScore& score)
+{
+    Json::Value server;
+    server["address"] = serverAddress;
+    server["responseTime"] = score.responseTimeMilliseconds;
+    server["responseTimeSamples"] = score.responseTimeSamples;
+    server["successes"] = score.successes;
+    server["failures"] = score.failures;
+    server["lastSuccessTime"] = (Json::Int64)score.lastSuccessTime;
+    server["lastUpdateTime"] = (Json::Int64)score.lastUpdateTime;
+    return server;
+}
+
+// May throw, if the fields have the wrong types.
+static ServerScore DecodeScore(const Json::Value& server)
+{
+    ServerScore score;
+    score.responseTimeMilliseconds = server.get("responseTime", 0).asDouble();
+    score.responseTimeSamples = server.get("responseTimeSamples", 0).asUInt();
+    score.successes = server.get("successes", 0).asDouble();
+    score.failures = server.get("failures", 0).asDouble();
+    score.lastSuccessTime = server.get("lastSuccessTime", 0).asInt64();
+    score.lastUpdateTime = server.get("lastUpdateTime", 0).asInt64();
+    return score;
+}
+
+string ServerRanking::Encode() const
+{
+    Json::Value servers(Json::arrayValue);
+
+    for (auto score = m_scores.begin(); score != m_scores.end(); ++score)
+    {
+        servers.append(EncodeScore(score->first, score->second));
+    }
+
+    Json::Value json;
+    json["version"] = RANKING_ENCODING_VERSION;
+    json["servers"] = servers;
+
+    Json::FastWriter jsonWriter;
+    return jsonWriter.write(json);
+}
+
+bool ServerRanking::Decode(const string& data)
+{
+    m_scores.clear();
+    m_changed.clear();
+
+    Json::Value json;
+    Json::Reader reader;
+    if (!reader.parse(data, json) || !json.isObject())
+    {
+        return false;
+    }
+
+    try
+    {
+        if (json.get("version", 0).asInt() != RANKING_ENCODING_VERSION)
+        {
+            return false;
+        }
+
+        const Json::Value& servers = json["servers"];
+        if (!servers.isArray())
+        {
+            return false;
+        }
+
+        for (Json::ArrayIndex i = 0; i < servers.size(); i++)
+        {
+            const Json::Value& server = servers[i];
+            m_scores[server.get("address", "").asString()] = DecodeScore(server);
+        }
+    }
+    catch (exception&)
+    {
+        m_scores.clear();
+        return false;
+    }
+
+    return true;
+}
+
+string ServerRanking::EncodeChanges() const
+{
+    // One record per line. A record holds the server's whole score, rather
+    // than what changed about it, so that replaying it twice does no harm.
+    Json::FastWriter jsonWriter;
+    string journal;
+
+    for (auto address = m_changed.begin(); address != m_changed.end(); ++address)
+    {
+        const ServerScore* score = Find(*address);
+        if (score)
+        {
+            journal += jsonWriter.write(EncodeScore(*address, *score));
+        }
+        else
+        {
+            Json::Value dropped;
+            dropped["address"] = *address;
+            dropped["dropped"] = true;
+            journal += jsonWriter.write(dropped);
+        }
+    }
+
+    return journal;
+}
+
+bool ServerRanking::ReplayJournal(const string& journal)
+{
+    size_t start = 0;
+    while (start < journal.length())
+    {
+        size_t end = journal.find('\n', start);
+        if (end == string::npos)
+        {
+            return false;
+        }
+
+        Json::Value record;
+        Json::Reader reader;
+        if (!reader.parse(journal.data() + start, journal.data() + end, record, false) || !record.isObject())
+        {
+            return false;
+        }
+
+        try
+        {
+            string address = record.get("address", "").asString();
+            if (record.get("dropped", false).asBool())
+            {
+                m_scores.erase(address);
+            }
+            else
+            {
+                m_scores[address] = DecodeScore(record);
+            }
+        }
+        catch (exception&)
+        {
+            return false;
+        }
+
+        start = end + 1;
+    }
+
+    return true;
+}
+
+vector<size_t> ShuffleFastResponders(const vector<ServerResponse>& responses, mt19937& rng)
+{
+    double fastest = -1;
+    for (const ServerResponse& response : responses)
+    {
+        if (response.responded && (fastest < 0 || response.responseTimeMilliseconds < fastest))
+        {
+            fastest = response.responseTimeMilliseconds;
+        }
+    }
+
+    vector<size_t> order;
+    for (size_t i = 0; i < responses.size(); i++)
+    {
+        if (responses[i].responded
+            && responses[i].responseTimeMilliseconds <= fastest * RESPONSE_TIME_THRESHOLD_FACTOR)
+        {
+            order.push_back(i);
+        }
+    }
+
+    shuffle(order.begin(), order.end(), rng);
+
+    return order;
+}
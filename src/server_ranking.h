@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+
+/*
+Server ranking model.
+
+For each server we remember how often it has been reachable -- in
+reachability checks and in connection attempts -- and how quickly it
+responds. Servers are then ordered to minimize the expected time until a
+connection succeeds: trying a server with success probability p, which
+costs c_s when it succeeds and c_f when it fails, the best order is by
+descending p / (p*c_s + (1-p)*c_f).
+
+p and the response time aren't known exactly, so rather than ranking by
+their estimates we use Thompson sampling: each time servers are ranked, p
+is drawn from a Beta distribution over the success and failure counts and
+the response time from a distribution around its average, whose spread
+reflects how little we know. Servers with little history are thereby
+explored, and servers that are about equally good trade places randomly
+from run to run, which spreads clients across them.
+
+The counts decay with a half-life, so that the model follows servers that
+become blocked or unblocked.
+
+The ranking is stored the same way as a server list (see
+server_list_store.h): a snapshot of all the scores, from Encode, plus a
+journal of the scores that have changed since, from EncodeChanges.
+*/
+
+struct ServerScore
+{
+    ServerScore()
+        : responseTimeMilliseconds(0), responseTimeSamples(0),
+          successes(0), failures(0), lastSuccessTime(0), lastUpdateTime(0) {}
+
+    // Exponentially weighted moving average of the response times. Only valid
+    // if responseTimeSamples > 0.
+    double responseTimeMilliseconds;
+    unsigned int responseTimeSamples;
+
+    // Decayed counts, as of lastUpdateTime.
+    double successes;
+    double failures;
+
+    // Unix times; 0 if never.
+    int64_t lastSuccessTime;
+    int64_t lastUpdateTime;
+};
+
+// The outcome of checking a server's reachability.
+struct ServerResponse
+{
+    ServerResponse(bool responded, double responseTimeMilliseconds)
+        : responded(responded), responseTimeMilliseconds(responseTimeMilliseconds) {}
+
+    bool responded;
+    double responseTimeMilliseconds;
+};
+
+class ServerRanking
+{
+public:
+    ServerRanking() {}
+
+    // Record the outcome of a reachability check. A server that responds to
+    // a check may still fail to connect (e.g., if the tunnel protocol is
+    // blocked), so a response counts for less than a successful connection.
+    void RecordResponse(const string& serverAddress, double responseTimeMilliseconds, int64_t now);
+    void RecordNoResponse(const string& serverAddress, int64_t now);
+
+    void RecordConnection(const string& serverAddress, bool connected, int64_t now);
+
+    // Returns NULL if nothing is known about the server.
+    const ServerScore* Find(const string& serverAddress) const;
+
+    // Returns the order in which to try the servers -- as indexes into
+    // serverAddresses, best first. The order is random (see above), so
+    // successive calls may give different orders.
+    vector<size_t> Rank(const vector<string>& serverAddresses, int64_t now, mt19937& rng) const;
+
+    // Encodes all of the scores, as a snapshot.
+    string Encode() const;
+    // Returns false, leaving the ranking empty, if the data is corrupt.
+    bool Decode(const string& data);
+
+    // Encodes a journal record for each score that has changed (or been
+    // dropped) since the last call to ClearChanges or Decode. Replaying them
+    // on top of the previous encoding gives the current scores.
+    string EncodeChanges() const;
+    bool HasChanges() const { return !m_changed.empty(); }
+    void ClearChanges() { m_changed.clear(); }
+
+    // Applies journal records from EncodeChanges. Returns false if the
+    // journal ends with a truncated or corrupt record (for example, if a
+    // write was interrupted); all records before that are still applied.
+    bool ReplayJournal(const string& journal);
+
+    size_t size() const { return m_scores.size(); }
+
+private:
+    ServerScore& Update(const string& serverAddress, int64_t now);
+    void Prune();
+
+    unordered_map<string, ServerScore> m_scores;
+    // Servers whose scores have changed or been dropped
+    unordered_set<string> m_changed;
+};
+
+// The order that servers were tried in before the ranking model, and still
+// the default (see Settings::RankServers): the servers that responded within
+// twice the fastest response time, shuffled. Returns indexes into
+// `responses`; the servers that were slower or didn't respond are left out.
+vector<size_t> ShuffleFastResponders(const vector<ServerResponse>& responses, mt19937& rng);
@@ -21,17 +21,119 @@
 #include "logging.h"
 #include "psiclient.h"
 #include "serverlist.h"
+#include "server_list_encoding.h"
 #include "embeddedvalues.h"
 #include "config.h"
 #include "utilities.h"
 #include <algorithm>
+#include <atomic>
 #include <sstream>
+#include <ctime>
 
 
+// The journal is compacted into a new snapshot once it is larger than this,
+// or than half the snapshot, whichever is bigger.
+static const size_t MIN_JOURNAL_LENGTH_BEFORE_COMPACTION = 64 * 1024;
+
+
+/***********************************************
+Parsed server list cache
+*/
+
+// Loading a list means decoding the snapshot, replaying the journal and
+// merging the embedded list. Rather than doing that on every call, the
+// resulting list is cached process-wide, keyed by list name, along with the
+// store generation it matches. Any write to the store -- by another ServerList
+// instance or another process -- changes the generation and so invalidates
+// the cache.
+
+static map<string, CachedServerList> g_serverListCache;
+static HANDLE g_serverListCacheMutex = CreateMutex(NULL, FALSE, 0);
+
+static bool GetCachedServerList(const string& listName, uint64_t generation, CachedServerList& o_cached)
+{
+    AutoMUTEX lock(g_serverListCacheMutex);
+
+    auto cached = g_serverListCache.find(listName);
+    if (cached == g_serverListCache.end() || cached->second.generation != generation)
+    {
+        return false;
+    }
+
+    o_cached = cached->second;
+    return true;
+}
+
+static void SetCachedServerList(const string& listName, const CachedServerList& cached)
+{
+    AutoMUTEX lock(g_serverListCacheMutex);
+
+    g_serverListCache[listName] = cached;
+}
+
+static void InvalidateCachedServerList(const string& listName)
+{
+    AutoMUTEX lock(g_serverListCacheMutex);
+
+    g_serverListCache.erase(listName);
+}
+
+// The cached entries are shared, so changes are made to a copy. This makes
+// the copy the first time it's needed, so that a call that turns out to
+// change nothing doesn't copy the list.
+static IndexedServerEntries& CopyOnWrite(shared_ptr<IndexedServerEntries>& copy, const CachedServerList& current)
+{
+    if (!copy)
+    {
+        copy = make_shared<IndexedServerEntries>(*current.entries);
+    }
+    return *copy;
+}
+
+static std::atomic<unsigned int> g_serverListParses(0);
+static std::atomic<unsigned int> g_serverListWrites(0);
+static std::atomic<unsigned int> g_serverListJournalAppends(0);
+static std::atomic<unsigned int> g_serverListCacheHits(0);
+
+
+/***********************************************
+ServerList members
+*/
+
 ServerList::ServerList(LPCSTR listName)
+{
+    Init(listName);
+
+    tstring dataPath;
+    if (GetPsiphonDataPath({ _T("server_lists") }, true, dataPath))
+    {
+        m_store.reset(new MappedServerListStore(filesystem::path(dataPath) / UTF8ToWString(listName)));
+        m_rankingStore.reset(new MappedServerListStore(filesystem::path(dataPath) / (UTF8ToWString(listName) + _T("_ranking"))));
+    }
+    else
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: GetPsiphonDataPath failed; storing server list in the registry (%d)"), __TFUNCTION__, GetLastError());
+        m_store.reset(new RegistryServerListStore(GetListName()));
+        m_rankingStore.reset(new RegistryServerListStore(GetListName() + "Ranking"));
+    }
+}
+
+ServerList::ServerList(LPCSTR listName, IServerListStore* store)
+{
+    assert(store);
+    Init(listName);
+    m_store.reset(store);
+}
+
+void ServerList::Init(LPCSTR listName)
 {
     assert(listName && strlen(listName));
     m_name = listName;
+    m_rankingGeneration = 0;
+    m_rankingSnapshotLength = 0;
+    m_rankingJournalLength = 0;
+    m_rankingNeedsSnapshot = false;
+    m_rankingStoreUnreadable = false;
 
     // Used a named mutex, because we'll need to use the mutex across instances.
     tstring mutexName = _T("Local\\ServerListMutex-") + UTF8ToWString(listName);
@@ -77,42 +179,26 @@ size_t ServerList::AddEntriesToList(
     // Randomize this list for load-balancing
     ShuffleVector(decodedServerEntries.begin(), decodedServerEntries.end());
 
-    ServerEntries oldServerEntryList = GetList();
+    CachedServerList current = GetCurrentList();
+    shared_ptr<IndexedServerEntries> serverEntryList = make_shared<IndexedServerEntries>(*current.entries);
+    string journal;
 
     vector<ServerEntry>::const_iterator decodedEntryIter;
     for (decodedEntryIter = decodedServerEntries.begin();
          decodedEntryIter != decodedServerEntries.end(); ++decodedEntryIter)
     {
-        // Check if we already know about this server
-        bool alreadyKnown = false;
-        for (ServerEntries::iterator oldServerEntry = oldServerEntryList.begin();
-             oldServerEntry != oldServerEntryList.end(); ++oldServerEntry)
-        {
-            if ((*decodedEntryIter).serverAddress == oldServerEntry->serverAddress)
-            {
-                alreadyKnown = true;
-                // NOTE: We always update the values for known servers, because we trust the
-                //       discovery mechanisms
-                oldServerEntry->Copy(*decodedEntryIter);
-                break;
-            }
-        }
-
-        if (!alreadyKnown)
+        // NOTE: We always update the values for known servers, because we trust the
+        //       discovery mechanisms.
+        // New entries are inserted as the second entry, so that the first entry can
+        // continue to be used if it is reachable (unless there are no pre-existing entries).
+        if (serverEntryList->Upsert(*decodedEntryIter))
         {
-            // Insert the new entry as the second entry, so that the first entry can continue
-            // to be used if it is reachable (unless there are no pre-existing entries).
-            oldServerEntryList.insert(
-                oldServerEntryList.size() == 0 ?
-                    oldServerEntryList.begin() :
-                    oldServerEntryList.begin() + 1,
-                *decodedEntryIter);
-
             entriesAdded++;
         }
+        AppendServerListJournalUpsert(journal, *decodedEntryIter);
     }
 
-    WriteListToSystem(oldServerEntryList);
+    WriteChanges(serverEntryList, journal, current);
 
     return entriesAdded;
 }
@@ -121,61 +207,48 @@ void ServerList::MoveEntriesToFront(const ServerEntries& entries, bool veryFront
 {
     AutoMUTEX lock(m_mutex);
 
-    ServerEntries persistentServerEntryList = GetList();
+    CachedServerList current = GetCurrentList();
+    shared_ptr<IndexedServerEntries> updatedServerEntryList;
+    string journal;
 
     // Insert entries in input order
 
     for (ServerEntries::const_reverse_iterator entry = entries.rbegin(); entry != entries.rend(); ++entry)
     {
-        // Remove existing entry for server, if present. In the case where
+        // Move existing entry for server, if present. In the case where
         // the existing entry has different data, we must assume that a
         // discovery has happened that overwrote the data that's being
         // passed in. In that edge case, we just keep the existing entry
         // in its current position.
 
-        bool existingEntryChanged = false;
+        const IndexedServerEntries& persistentServerEntryList =
+            updatedServerEntryList ? *updatedServerEntryList : *current.entries;
 
-        // If we replace the head item, we want to make sure we insert at the head.
-        bool forceHead = false;
-
-        for (ServerEntries::iterator persistentEntry = persistentServerEntryList.begin();
-             persistentEntry != persistentServerEntryList.end();
-             ++persistentEntry)
+        const ServerEntry* persistentEntry = persistentServerEntryList.Find(entry->serverAddress);
+        if (persistentEntry && entry->ToString() != persistentEntry->ToString())
         {
-            if (entry->serverAddress == persistentEntry->serverAddress)
-            {
-                if (entry->ToString() != persistentEntry->ToString())
-                {
-                    existingEntryChanged = true;
-                }
-                else
-                {
-                    forceHead = (persistentEntry == persistentServerEntryList.begin());
-                    persistentServerEntryList.erase(persistentEntry);
-                }
-                break;
-            }
+            continue;
         }
 
-        // Re-insert entry for server in new position
+        // If we replace the head item, we want to make sure we insert at the head.
+        bool forceHead = persistentEntry && persistentServerEntryList.IsFirst(entry->serverAddress);
 
-        if (!existingEntryChanged)
-        {
-            ServerEntries::const_iterator insertionPoint;
-            if (veryFront || forceHead || persistentServerEntryList.size() == 0)
-            {
-                insertionPoint = persistentServerEntryList.begin();
-            }
-            else
-            {
-                insertionPoint = persistentServerEntryList.begin() + 1;
-            }
+        IndexedServerEntries& serverEntryList = CopyOnWrite(updatedServerEntryList, current);
 
-            persistentServerEntryList.insert(insertionPoint, *entry);
+        if (!persistentEntry)
+        {
+            serverEntryList.Upsert(*entry);
+            AppendServerListJournalUpsert(journal, *entry);
         }
+
+        serverEntryList.MoveToFront(entry->serverAddress, veryFront || forceHead);
+        AppendServerListJournalMoveToFront(journal, entry->serverAddress, veryFront || forceHead);
     }
 
-    WriteListToSystem(persistentServerEntryList);
+    if (updatedServerEntryList)
+    {
+        WriteChanges(updatedServerEntryList, journal, current);
+    }
 }
 
 void ServerList::MoveEntryToFront(const ServerEntry& serverEntry, bool veryFront/*=false*/)
@@ -189,47 +262,45 @@ void ServerList::MarkServersFailed(const ServerEntries& failedServerEntries)
 {
     AutoMUTEX lock(m_mutex);
 
-    ServerEntries serverEntryList = GetList();
-    if (serverEntryList.size() == 0 || failedServerEntries.size() == 0)
+    CachedServerList current = GetCurrentList();
+    if (current.entries->size() == 0 || failedServerEntries.size() == 0)
     {
         return;
     }
 
     my_print(NOT_SENSITIVE, true, _T("%s: Marking %d servers failed"), __TFUNCTION__, failedServerEntries.size());
 
-    bool changeMade = false;
+    LoadRanking();
+
+    shared_ptr<IndexedServerEntries> serverEntryList;
+    string journal;
+    int64_t now = time(NULL);
 
     for (ServerEntries::const_iterator failed = failedServerEntries.begin();
             failed != failedServerEntries.end();
             ++failed)
     {
-        for (ServerEntries::iterator entry = serverEntryList.begin();
-             entry != serverEntryList.end();
-             ++entry)
-        {
-            if (failed->serverAddress == entry->serverAddress)
-            {
-                ServerEntry failedServer;
-                failedServer.Copy(*entry);
-
-                // Move the failed server to the end of the list
-                serverEntryList.erase(entry);
-                serverEntryList.push_back(failedServer);
+        m_ranking.RecordConnection(failed->serverAddress, false, now);
 
-                changeMade = true;
-                break;
-            }
+        // Move the failed server to the end of the list. Moving doesn't
+        // change which servers are in the list.
+        if (current.entries->Find(failed->serverAddress))
+        {
+            CopyOnWrite(serverEntryList, current).MoveToBack(failed->serverAddress);
+            AppendServerListJournalMoveToBack(journal, failed->serverAddress);
         }
     }
 
-    if (changeMade)
+    if (!journal.empty())
     {
-        WriteListToSystem(serverEntryList);
+        WriteChanges(serverEntryList, journal, current);
     }
     else
     {
         my_print(NOT_SENSITIVE, true, _T("%s: Couldn't find server"), __TFUNCTION__);
     }
+
+    SaveRanking();
 }
 
 void ServerList::MarkServerFailed(const ServerEntry& failedServerEntry)
@@ -239,476 +310,512 @@ void ServerList::MarkServerFailed(const ServerEntry& failedServerEntry)
     MarkServersFailed(failedServerEntries);
 }
 
-// This function should not throw
-ServerEntries ServerList::GetList()
+void ServerList::MarkServerSucceeded(const ServerEntry& serverEntry)
 {
     AutoMUTEX lock(m_mutex);
 
-    // Load persistent list of servers from system (registry)
+    LoadRanking();
+    m_ranking.RecordConnection(serverEntry.serverAddress, true, time(NULL));
+    SaveRanking();
 
-    ServerEntries systemServerEntryList;
+    MoveEntryToFront(serverEntry, true);
+}
 
-    if (!IGNORE_SYSTEM_SERVER_LIST)
+size_t ServerList::RankCheckedEntries(const ServerEntries& checkedEntries, const vector<ServerResponse>& responses, bool useRanking)
+{
+    assert(checkedEntries.size() == responses.size());
+
+    static thread_local mt19937 rng{random_device{}()};
+
+    AutoMUTEX lock(m_mutex);
+
+    LoadRanking();
+
+    int64_t now = time(NULL);
+    vector<string> respondingAddresses;
+    ServerEntries respondingEntries;
+
+    for (size_t i = 0; i < checkedEntries.size() && i < responses.size(); i++)
     {
-        try
+        if (responses[i].responded)
         {
-            systemServerEntryList = GetListFromSystem();
+            m_ranking.RecordResponse(checkedEntries[i].serverAddress, responses[i].responseTimeMilliseconds, now);
+            respondingAddresses.push_back(checkedEntries[i].serverAddress);
+            respondingEntries.push_back(checkedEntries[i]);
         }
-        catch (std::exception &ex)
+        else
         {
-            my_print(NOT_SENSITIVE, false, string("Not using corrupt System Server List: ") + ex.what());
+            m_ranking.RecordNoResponse(checkedEntries[i].serverAddress, now);
         }
     }
 
-    // Add embedded list to system list.
-    // Cases:
-    // - This may be a new client run on a system with an existing registry entry; we want the new embedded values
-    // - This may be the first run, in which case the system list is empty
+    SaveRanking();
 
-    ServerEntries embeddedServerEntryList;
-    try
+    ServerEntries rankedEntries;
+
+    if (useRanking)
     {
-        embeddedServerEntryList = GetListFromEmbeddedValues();
-        // Randomize this list for load-balancing
-        ShuffleVector(embeddedServerEntryList.begin(), embeddedServerEntryList.end());
+        // Rank by the whole history of each server, not just this check.
+        vector<size_t> order = m_ranking.Rank(respondingAddresses, now, rng);
+        rankedEntries.reserve(order.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            rankedEntries.push_back(respondingEntries[order[i]]);
+        }
     }
-    catch (std::exception &ex)
+    else
     {
-        my_print(NOT_SENSITIVE, false, string("Not using corrupt Embedded Server List: ") + ex.what());
-        embeddedServerEntryList.clear();
+        vector<size_t> order = ShuffleFastResponders(responses, rng);
+        rankedEntries.reserve(order.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            rankedEntries.push_back(checkedEntries[order[i]]);
+        }
     }
 
-    for (ServerEntries::iterator embeddedServerEntry = embeddedServerEntryList.begin();
-         embeddedServerEntry != embeddedServerEntryList.end(); ++embeddedServerEntry)
+    if (!rankedEntries.empty())
     {
-        // Check if we already know about this server
-        // We prioritize discovery information, so skip embedded entry entirely when already known
-        bool alreadyKnown = false;
-        for (ServerEntries::iterator systemServerEntry = systemServerEntryList.begin();
-             systemServerEntry != systemServerEntryList.end(); ++systemServerEntry)
-        {
-            if (embeddedServerEntry->serverAddress == systemServerEntry->serverAddress)
-            {
-                alreadyKnown = true;
+        MoveEntriesToFront(rankedEntries);
+    }
 
-                // Special case: if the embedded server entry has new info that the
-                // existing system entry does not, we know the embedded entry is actually newer
-                if (embeddedServerEntry->sshObfuscatedKey.length() > 0 &&
-                    systemServerEntry->sshObfuscatedKey.length() == 0)
-                {
-                    systemServerEntry->Copy(*embeddedServerEntry);
-                }
+    return rankedEntries.size();
+}
 
-                break;
-            }
-        }
+// Must be called with m_mutex held
+void ServerList::LoadRanking()
+{
+    if (!m_rankingStore)
+    {
+        return;
+    }
 
-        if (!alreadyKnown)
-        {
-            // Insert the new entry as the second entry (if there already is at least one),
-            // so that the first entry can continue to be used if it is reachable
-            systemServerEntryList.insert(systemServerEntryList.size() > 0 ?
-                                            systemServerEntryList.begin() + 1 :
-                                            systemServerEntryList.begin(),
-                                         *embeddedServerEntry);
-        }
+    // A generation of 0 means nothing readable is stored, which is worth
+    // finding out more about.
+    uint64_t generation = m_rankingStore->GetGeneration();
+    if (generation != 0 && generation == m_rankingGeneration)
+    {
+        return;
     }
 
-    // Write this out immediately, so the next time we'll get it from the system
-    // (Also so MarkCurrentServerFailed reads the same list we're returning)
-    WriteListToSystem(systemServerEntryList);
+    string snapshot, journal;
+    IServerListStore::LoadResult loadResult = m_rankingStore->Load(snapshot, journal, generation);
 
-    // WriteListToSystem could truncate the list if it is too long to write to the registry.
-    // Try to return what is stored in the system for consistency.
-    try
+    m_rankingStoreUnreadable = (loadResult == IServerListStore::LOAD_ERROR);
+    if (m_rankingStoreUnreadable)
     {
-        return GetListFromSystem();
+        // Carry on with the scores we have, and try the store again next time
+        my_print(NOT_SENSITIVE, true, _T("%s: Failed to load server ranking"), __TFUNCTION__);
+        return;
     }
-    catch (std::exception &ex)
+
+    m_rankingSnapshotLength = snapshot.length();
+    m_rankingJournalLength = journal.length();
+    m_rankingNeedsSnapshot = false;
+
+    if (loadResult == IServerListStore::LOAD_NOT_FOUND)
     {
-        my_print(NOT_SENSITIVE, true, string("Just wrote a corrupt System Server List: ") + ex.what());
-        return systemServerEntryList;
+        m_ranking = ServerRanking();
+        m_rankingNeedsSnapshot = true;
+    }
+    else if (!m_ranking.Decode(snapshot))
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: Failed to decode server ranking; starting over"), __TFUNCTION__);
+        m_ranking = ServerRanking();
+        m_rankingNeedsSnapshot = true;
+    }
+    else if (!m_ranking.ReplayJournal(journal))
+    {
+        // Start a fresh journal, rather than appending after the bad record
+        my_print(NOT_SENSITIVE, true, _T("%s: Server ranking journal is incomplete"), __TFUNCTION__);
+        m_rankingNeedsSnapshot = true;
     }
-}
 
-string ServerList::GetListName() const
-{
-    return string(LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS) + m_name;
+    m_rankingGeneration = generation;
 }
 
-ServerEntries ServerList::GetListFromEmbeddedValues()
+// Must be called with m_mutex held
+void ServerList::SaveRanking()
 {
-    return ParseServerEntries(EMBEDDED_SERVER_LIST);
-}
+    if (!m_rankingStore)
+    {
+        return;
+    }
 
-ServerEntries ServerList::GetListFromSystem()
-{
-    return GetListFromSystem(GetListName().c_str());
-}
+    if (m_rankingStoreUnreadable || (!m_ranking.HasChanges() && !m_rankingNeedsSnapshot))
+    {
+        return;
+    }
 
-ServerEntries ServerList::GetListFromSystem(const char* listName)
-{
-    string serverEntryListString;
+    // Typically only the scores that changed are appended to the journal.
+    // Once the journal gets large relative to the snapshot, it's compacted.
+    string changes = m_ranking.EncodeChanges();
+    bool writeSnapshot = m_rankingNeedsSnapshot
+        || m_rankingJournalLength + changes.length() > max(MIN_JOURNAL_LENGTH_BEFORE_COMPACTION, m_rankingSnapshotLength / 2);
 
-    if (!ReadRegistryStringValue(
-            listName,
-            serverEntryListString))
+    bool written = false;
+    uint64_t generation = 0;
+    if (!writeSnapshot)
     {
-        // If we're migrating from an old version, there's no m_name qualifier.
-        if (!ReadRegistryStringValue(
-                LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS,
-                serverEntryListString))
+        written = m_rankingStore->AppendJournal(changes, generation);
+        if (written)
         {
-            return ServerEntries();
+            m_rankingJournalLength += changes.length();
         }
-    }
-
-    return ParseServerEntries(serverEntryListString.c_str());
-}
 
-// The errors below throw (preventing any Server connection from starting)
-ServerEntries ServerList::ParseServerEntries(const char* serverEntryListString)
-{
-    ServerEntries serverEntryList;
-
-    stringstream stream(serverEntryListString);
-    string item;
+        // The store can't take a longer journal, so compact it instead
+        writeSnapshot = !written && m_rankingStore->WriteTooLong();
+    }
 
-    while (getline(stream, item, '\n'))
+    if (writeSnapshot)
     {
-        ServerEntry entry = ParseServerEntry(item);
-        if (entry.webServerCertificate != "None")
+        string snapshot = m_ranking.Encode();
+        written = m_rankingStore->WriteSnapshot(snapshot, generation);
+        if (written)
         {
-            serverEntryList.push_back(entry);
+            m_rankingSnapshotLength = snapshot.length();
+            m_rankingJournalLength = 0;
+            m_rankingNeedsSnapshot = false;
         }
     }
 
-    return serverEntryList;
+    if (written)
+    {
+        m_ranking.ClearChanges();
+        m_rankingGeneration = generation;
+    }
+    else
+    {
+        // The changes are kept, to be written with the next ones
+        my_print(NOT_SENSITIVE, false, _T("%s: Failed to store server ranking"), __TFUNCTION__);
+    }
 }
 
-ServerEntry ServerList::ParseServerEntry(const string& serverEntry)
+// This function should not throw
+ServerEntries ServerList::GetList()
 {
-    string line = Dehexlify(serverEntry);
-
-    ServerEntry entry;
-    entry.FromString(line);
+    AutoMUTEX lock(m_mutex);
 
-    return entry;
+    return GetCurrentList().entries->ToVector();
 }
 
-// NOTE: This function does not throw because we don't want a failure to prevent a connection attempt.
-void ServerList::WriteListToSystem(const ServerEntries& serverEntryList)
+// Must be called with m_mutex held
+CachedServerList ServerList::GetCurrentList()
 {
-    string encodedServerEntryList = EncodeServerEntries(serverEntryList);
+    CachedServerList cached;
+    if (GetCachedServerList(GetListName(), m_store->GetGeneration(), cached))
+    {
+        g_serverListCacheHits++;
+        return cached;
+    }
+
+    cached.generation = 0;
+    cached.snapshotLength = 0;
+    cached.journalLength = 0;
+    cached.storeUnreadable = false;
 
-    RegistryFailureReason reason = REGISTRY_FAILURE_NO_REASON;
+    // Load persistent list of servers from the store
 
-    if (!WriteRegistryStringValue(
-            GetListName().c_str(),
-            encodedServerEntryList,
-            reason))
+    shared_ptr<IndexedServerEntries> systemServerEntryList = make_shared<IndexedServerEntries>();
+    bool writeSnapshot = false;
+
+    if (!IGNORE_SYSTEM_SERVER_LIST)
     {
-        if (REGISTRY_FAILURE_WRITE_TOO_LONG == reason)
+        try
         {
-            int bisect = serverEntryList.size()/2;
-            if (bisect > 1)
+            string snapshot, journal;
+            IServerListStore::LoadResult loadResult = m_store->Load(snapshot, journal, cached.generation);
+
+            if (loadResult == IServerListStore::LOAD_OK)
+            {
+                *systemServerEntryList = IndexedServerEntries(ParseServerEntries(snapshot));
+                cached.snapshotLength = snapshot.length();
+                cached.journalLength = journal.length();
+
+                if (!ReplayServerListJournal(journal, *systemServerEntryList))
+                {
+                    // Start a fresh journal, rather than appending after the bad record
+                    my_print(NOT_SENSITIVE, true, _T("%s: Server list journal is incomplete"), __TFUNCTION__);
+                    writeSnapshot = true;
+                }
+            }
+            else if (loadResult == IServerListStore::LOAD_NOT_FOUND)
             {
-                my_print(NOT_SENSITIVE, true, _T("%s: List is too long to write to registry, truncating"), __TFUNCTION__);
-                ServerEntries truncatedServerEntryList(serverEntryList.begin(),
-                                                       serverEntryList.begin() + bisect);
-                WriteListToSystem(truncatedServerEntryList);
+                // Nothing has been stored yet. Older versions kept the list in the
+                // registry, so migrate it from there.
+                *systemServerEntryList = IndexedServerEntries(GetListFromRegistry(GetListName().c_str()));
+                writeSnapshot = true;
             }
             else
             {
-                my_print(NOT_SENSITIVE, true,
-                    _T("%s: List is still too long to write to registry, but there are only %ld entries"),
-                    __TFUNCTION__, serverEntryList.size());
+                // The stored list may be fine, and just not readable right now
+                // (another process may have it locked, say). Get by on the
+                // embedded list, and leave the store alone.
+                my_print(NOT_SENSITIVE, false, _T("%s: Failed to load server list; using embedded list"), __TFUNCTION__);
+                cached.storeUnreadable = true;
             }
         }
+        catch (std::exception &ex)
+        {
+            my_print(NOT_SENSITIVE, false, string("Not using corrupt System Server List: ") + ex.what());
+            *systemServerEntryList = IndexedServerEntries();
+            writeSnapshot = true;
+        }
     }
-}
-
-string ServerList::EncodeServerEntries(const ServerEntries& serverEntryList)
-{
-    string encodedServerList;
-    for (ServerEntryIterator it = serverEntryList.begin(); it != serverEntryList.end(); ++it)
+    else
     {
-        string stringServerEntry = it->ToString();
-        encodedServerList += Hexlify(
-                                (const unsigned char*)stringServerEntry.c_str(),
-                                stringServerEntry.length()) + "\n";
+        // The list doesn't depend on what's stored, so any generation will do
+        cached.generation = m_store->GetGeneration();
     }
-    return encodedServerList;
-}
-
-
-/***********************************************
-ServerEntry members
-*/
-
-ServerEntry::ServerEntry(
-    const string& serverAddress, const string& region, int webServerPort,
-    const string& webServerSecret, const string& webServerCertificate,
-    int sshPort, const string& sshUsername, const string& sshPassword,
-    const string& sshHostKey, int sshObfuscatedPort,
-    const string& sshObfuscatedKey,
-    const string& meekObfuscatedKey, const int meekServerPort,
-    const string& meekCookieEncryptionPublicKey,
-    const string& meekFrontingDomain, const string& meekFrontingHost,
-    const string& meekFrontingAddressesRegex,
-    const vector<string>& meekFrontingAddresses,
-    const vector<string>& capabilities)
-{
-    this->serverAddress = serverAddress;
-    this->region = region;
-    this->webServerPort = webServerPort;
-    this->webServerSecret = webServerSecret;
-    this->webServerCertificate = webServerCertificate;
-    this->sshPort = sshPort;
-    this->sshUsername = sshUsername;
-    this->sshPassword = sshPassword;
-    this->sshHostKey = sshHostKey;
-    this->sshObfuscatedPort = sshObfuscatedPort;
-    this->sshObfuscatedKey = sshObfuscatedKey;
-    this->meekObfuscatedKey = meekObfuscatedKey;
-    this->meekServerPort =  meekServerPort;
-    this->meekCookieEncryptionPublicKey = meekCookieEncryptionPublicKey;
-    this->meekFrontingDomain = meekFrontingDomain;
-    this->meekFrontingHost = meekFrontingHost;
-    this->meekFrontingAddressesRegex = meekFrontingAddressesRegex;
-    this->meekFrontingAddresses = meekFrontingAddresses;
-
-    this->capabilities = capabilities;
-}
 
-void ServerEntry::Copy(const ServerEntry& src)
-{
-    *this = src;
-}
+    // Add embedded list to system list.
+    // Cases:
+    // - This may be a new client run on a system with an existing stored list; we want the new embedded values
+    // - This may be the first run, in which case the system list is empty
 
-string ServerEntry::ToString() const
-{
-    stringstream ss;
+    // Usually most embedded entries are already known, so the embedded list is
+    // decoded lazily: only the entries we actually add are fully decoded.
 
-    //
-    // Legacy values are simply space-separated strings
-    //
+    string embeddedServerEntryListString = EMBEDDED_SERVER_LIST;
+    vector<const ServerEntry*> newServerEntries;
+    unique_ptr<ServerEntryListView> embeddedServerEntryList;
+    try
+    {
+        embeddedServerEntryList.reset(new ServerEntryListView(embeddedServerEntryListString));
 
-    ss << serverAddress << " ";
-    ss << webServerPort << " ";
-    ss << webServerSecret << " ";
-    ss << webServerCertificate << " ";
+        // Randomize this list for load-balancing
+        vector<size_t> embeddedOrder;
+        for (size_t i = 0; i < embeddedServerEntryList->size(); i++)
+        {
+            embeddedOrder.push_back(i);
+        }
+        ShuffleVector(embeddedOrder.begin(), embeddedOrder.end());
 
-    //
-    // Extended values are JSON-encoded.
-    //
+        for (vector<size_t>::const_iterator index = embeddedOrder.begin(); index != embeddedOrder.end(); ++index)
+        {
+            // Check if we already know about this server
+            // We prioritize discovery information, so skip embedded entry entirely when already known
+            const ServerEntry* systemServerEntry = systemServerEntryList->Find(embeddedServerEntryList->GetServerAddress(*index));
+
+            // Special case: if the embedded server entry has new info that the
+            // existing system entry does not, we know the embedded entry is actually newer
+            if (!systemServerEntry ||
+                (systemServerEntry->sshObfuscatedKey.length() == 0 &&
+                 embeddedServerEntryList->GetEntry(*index).sshObfuscatedKey.length() > 0))
+            {
+                newServerEntries.push_back(&embeddedServerEntryList->GetEntry(*index));
+            }
+        }
+    }
+    catch (std::exception &ex)
+    {
+        my_print(NOT_SENSITIVE, false, string("Not using corrupt Embedded Server List: ") + ex.what());
+        newServerEntries.clear();
+    }
 
-    // Note: for legacy reasons, webServerPort is a string, not an int
-    ostringstream webServerPortString;
-    webServerPortString << webServerPort;
+    string journal;
 
-    Json::Value entry;
+    for (vector<const ServerEntry*>::const_iterator newServerEntry = newServerEntries.begin();
+         newServerEntry != newServerEntries.end(); ++newServerEntry)
+    {
+        // New entries are inserted as the second entry (if there already is at least one),
+        // so that the first entry can continue to be used if it is reachable
+        systemServerEntryList->Upsert(**newServerEntry);
+        AppendServerListJournalUpsert(journal, **newServerEntry);
+    }
 
-    entry["ipAddress"] = serverAddress;
-    entry["region"] = region;
-    entry["webServerPort"] = webServerPortString.str();
-    entry["webServerCertificate"] = webServerCertificate;
-    entry["webServerSecret"] = webServerSecret;
-    entry["sshPort"] = sshPort;
-    entry["sshUsername"] = sshUsername;
-    entry["sshPassword"] = sshPassword;
-    entry["sshHostKey"] = sshHostKey;
-    entry["sshObfuscatedPort"] = sshObfuscatedPort;
-    entry["sshObfuscatedKey"] = sshObfuscatedKey;
-    entry["meekObfuscatedKey"] = meekObfuscatedKey;
-    entry["meekServerPort"] = meekServerPort;
-    entry["meekFrontingDomain"] = meekFrontingDomain;
-    entry["meekFrontingHost"] = meekFrontingHost;
-    entry["meekCookieEncryptionPublicKey"] = meekCookieEncryptionPublicKey;
-    entry["meekFrontingAddressesRegex"] = meekFrontingAddressesRegex;
+    cached.entries = systemServerEntryList;
 
-    Json::Value capabilitiesJson(Json::arrayValue);
-    for (const auto& i : this->capabilities)
+    if (cached.storeUnreadable)
     {
-        capabilitiesJson.append(i);
+        // Not cached, so that the next call tries the store again
+        return cached;
     }
-    entry["capabilities"] = capabilitiesJson;
 
-    Json::Value meekFrontingAddressesJson(Json::arrayValue);
-    for (const auto& i : this->meekFrontingAddresses)
+    // Write changes out immediately, so the next time we'll get them from the store
+    // (Also so MarkCurrentServerFailed reads the same list we're returning)
+    if (writeSnapshot || !journal.empty())
     {
-        meekFrontingAddressesJson.append(i);
+        return WriteChanges(cached.entries, journal, cached, writeSnapshot);
     }
-    entry["meekFrontingAddresses"] = meekFrontingAddressesJson;
-
-    Json::FastWriter jsonWriter;
-    ss << jsonWriter.write(entry);
 
-    return ss.str();
+    SetCachedServerList(GetListName(), cached);
+    return cached;
 }
 
-void ServerEntry::FromString(const string& str)
+// Must be called with m_mutex held. Returns the updated list.
+// NOTE: This function does not throw because we don't want a failure to prevent a connection attempt.
+CachedServerList ServerList::WriteChanges(
+    const shared_ptr<const IndexedServerEntries>& serverEntryList,
+    const string& journal,
+    const CachedServerList& previous,
+    bool writeSnapshot/*=false*/)
 {
-    stringstream lineStream(str);
-    string lineItem;
-
-    //
-    // Legacy values are simply space-separated strings
-    //
-
-    if (!getline(lineStream, lineItem, ' '))
+    if (journal.empty() && !writeSnapshot)
     {
-        throw std::exception("Server Entries are corrupt: can't parse Server Address");
+        return previous;
     }
-    serverAddress = lineItem;
 
-    if (!getline(lineStream, lineItem, ' '))
-    {
-        throw std::exception("Server Entries are corrupt: can't parse Web Server Port");
-    }
-    webServerPort = (int) strtol(lineItem.c_str(), NULL, 10);
+    CachedServerList updated;
+    updated.generation = 0;
+    updated.entries = serverEntryList;
+    updated.snapshotLength = previous.snapshotLength;
+    updated.journalLength = previous.journalLength + journal.length();
+    updated.storeUnreadable = previous.storeUnreadable;
 
-    if (!getline(lineStream, lineItem, ' '))
+    if (updated.storeUnreadable)
     {
-        throw std::exception("Server Entries are corrupt: can't parse Web Server Secret");
+        // Only a list read from the store may be written back to it
+        return updated;
     }
-    webServerSecret = lineItem;
 
-    if (!getline(lineStream, lineItem, ' '))
+    // Typically we just append the changes to the journal. Once the journal
+    // gets large relative to the list, we compact it by writing a snapshot.
+    if (updated.journalLength > max(MIN_JOURNAL_LENGTH_BEFORE_COMPACTION, updated.snapshotLength / 2))
     {
-        throw std::exception("Server Entries are corrupt: can't parse Web Server Certificate");
+        writeSnapshot = true;
     }
-    webServerCertificate = lineItem;
 
-    //
-    // Extended values are JSON-encoded.
-    //
+    bool written = false;
 
-    if (!getline(lineStream, lineItem, '\0'))
+    if (!writeSnapshot)
     {
-        my_print(NOT_SENSITIVE, true, _T("%s: Extended JSON values not present"), __TFUNCTION__);
+        g_serverListJournalAppends++;
+        written = m_store->AppendJournal(journal, updated.generation);
 
-        // Assumption: we're not reading into a ServerEntry struct that already
-        // has values set. So we're relying on the default values being set by
-        // the constructor.
-        return;
+        // The store can't take a longer journal, so compact it instead
+        writeSnapshot = !written && m_store->WriteTooLong();
     }
 
-    Json::Value json_entry;
-    Json::Reader reader;
-    bool parsingSuccessful = reader.parse(lineItem, json_entry);
-    if (!parsingSuccessful)
-    {
-        string fail = reader.getFormattedErrorMessages();
-        my_print(NOT_SENSITIVE, false, _T("%s: Extended JSON parse failed: %S"), __TFUNCTION__, reader.getFormattedErrorMessages().c_str());
-        throw std::exception("Server Entries are corrupt: can't parse JSON");
-    }
-
-
-    // At the time of introduction of the server capabilities feature
-    // these are the default capabilities possessed by all servers.
-    Json::Value defaultCapabilities(Json::arrayValue);
-    defaultCapabilities.append("OSSH");
-    defaultCapabilities.append("SSH");
-    defaultCapabilities.append("VPN");
-    defaultCapabilities.append("handshake");
-
-    try
+    if (writeSnapshot)
     {
-        region = json_entry.get("region", "").asString();
-        sshPort = json_entry.get("sshPort", 0).asInt();
-        sshUsername = json_entry.get("sshUsername", "").asString();
-        sshPassword = json_entry.get("sshPassword", "").asString();
-        sshHostKey = json_entry.get("sshHostKey", "").asString();
-        sshObfuscatedPort = json_entry.get("sshObfuscatedPort", 0).asInt();
-        sshObfuscatedKey = json_entry.get("sshObfuscatedKey", "").asString();
-
-        Json::Value capabilitiesJson;
-        capabilitiesJson = json_entry.get("capabilities", defaultCapabilities);
+        ServerEntries serverEntries = updated.entries->ToVector();
+        string snapshot = EncodeServerEntries(serverEntries);
+        g_serverListWrites++;
+        written = m_store->WriteSnapshot(snapshot, updated.generation);
 
-        this->capabilities.clear();
-        for (Json::ArrayIndex i = 0; i < capabilitiesJson.size(); i++)
+        // If the list is too long for the store, store as much of the front
+        // of it as fits, rather than nothing. The rest is dropped.
+        bool truncated = false;
+        while (!written && m_store->WriteTooLong() && serverEntries.size() / 2 > 1)
         {
-            string item = capabilitiesJson.get(i, "").asString();
-            if (!item.empty())
-            {
-                this->capabilities.push_back(item);
-            }
+            my_print(NOT_SENSITIVE, true, _T("%s: List is too long to store, truncating"), __TFUNCTION__);
+            serverEntries.resize(serverEntries.size() / 2);
+            snapshot = EncodeServerEntries(serverEntries);
+            g_serverListWrites++;
+            written = m_store->WriteSnapshot(snapshot, updated.generation);
+            truncated = true;
         }
 
-        if (HasCapability("FRONTED-MEEK") || HasCapability("UNFRONTED-MEEK") || HasCapability("UNFRONTED-MEEK-HTTPS"))
+        if (written && truncated)
         {
-            meekServerPort = json_entry.get("meekServerPort", 0).asInt();
-            meekObfuscatedKey = json_entry.get("meekObfuscatedKey", "").asString();
-            meekCookieEncryptionPublicKey = json_entry.get("meekCookieEncryptionPublicKey", "").asString();
-        }
-        else
-        {
-            meekServerPort = -1;
-            meekObfuscatedKey = "";
-            meekCookieEncryptionPublicKey = "";
+            updated.entries = make_shared<const IndexedServerEntries>(serverEntries);
         }
 
-        if (HasCapability("FRONTED-MEEK"))
-        {
-            meekFrontingDomain = json_entry.get("meekFrontingDomain", "").asString();
-            meekFrontingHost  = json_entry.get("meekFrontingHost", "").asString();
-            meekFrontingAddressesRegex = json_entry.get("meekFrontingAddressesRegex", "").asString();
-            Json::Value meekFrontingAddressesJson;
-            Json::Value emptyArray(Json::arrayValue);
-            meekFrontingAddressesJson = json_entry.get("meekFrontingAddresses", emptyArray);
-            this->meekFrontingAddresses.clear();
-            for (Json::ArrayIndex i = 0; i < meekFrontingAddressesJson.size(); i++)
-            {
-                string item = meekFrontingAddressesJson.get(i, "").asString();
-                if (!item.empty())
-                {
-                    this->meekFrontingAddresses.push_back(item);
-                }
-            }
-        }
-        else
-        {
-            meekFrontingDomain = "";
-            meekFrontingHost  = "";
-            meekFrontingAddressesRegex = "";
-            meekFrontingAddresses.clear();
-        }
+        updated.snapshotLength = snapshot.length();
+        updated.journalLength = 0;
+    }
+
+    if (written)
+    {
+        SetCachedServerList(GetListName(), updated);
     }
-    catch (exception& e)
+    else
     {
-        my_print(NOT_SENSITIVE, false, _T("%s: Extended JSON parse exception: %S"), __TFUNCTION__, e.what());
-        throw std::exception("Server Entries are corrupt: parse JSON exception");
+        my_print(NOT_SENSITIVE, true, _T("%s: Failed to store server list"), __TFUNCTION__);
+        InvalidateCachedServerList(GetListName());
     }
+
+    return updated;
+}
+
+string ServerList::GetListName() const
+{
+    return string(LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS) + m_name;
+}
+
+ServerListStats ServerList::GetStats()
+{
+    ServerListStats stats;
+    stats.parses = g_serverListParses;
+    stats.writes = g_serverListWrites;
+    stats.journalAppends = g_serverListJournalAppends;
+    stats.cacheHits = g_serverListCacheHits;
+    return stats;
 }
 
-bool ServerEntry::HasCapability(const string& capability) const
+void ServerList::ResetStats()
 {
-    for (size_t i = 0; i < this->capabilities.size(); i++)
+    g_serverListParses = 0;
+    g_serverListWrites = 0;
+    g_serverListJournalAppends = 0;
+    g_serverListCacheHits = 0;
+}
+
+ServerEntries ServerList::GetListFromRegistry(const char* listName)
+{
+    string serverEntryListString;
+
+    // Recent versions stored the list in the binary encoding. Lists stored
+    // by older versions are legacy REG_SZ values.
+    if (!ReadRegistryBinaryValue(
+            listName,
+            serverEntryListString)
+        && !ReadRegistryStringValue(
+            listName,
+            serverEntryListString))
     {
-        if (this->capabilities[i] == capability)
+        // If we're migrating from an old version, there's no m_name qualifier.
+        if (!ReadRegistryStringValue(
+                LOCAL_SETTINGS_REGISTRY_VALUE_SERVERS,
+                serverEntryListString))
         {
-            return true;
+            return ServerEntries();
         }
     }
 
-    return false;
+    return ParseServerEntries(serverEntryListString);
 }
 
-int ServerEntry::GetPreferredReachablityTestPort() const
+// The errors below throw (preventing any Server connection from starting)
+ServerEntries ServerList::ParseServerEntries(const string& serverEntryListString)
 {
-    if (HasCapability("OSSH"))
-    {
-        return sshObfuscatedPort;
-    }
-    else if (HasCapability("SSH"))
+    g_serverListParses++;
+
+    if (IsBinaryServerEntryList(serverEntryListString))
     {
-        return sshPort;
+        return DecodeBinaryServerEntryList(serverEntryListString);
     }
-    else if (HasCapability("handshake"))
+
+    // Legacy format: one hex-encoded ServerEntry::ToString() per line
+
+    ServerEntries serverEntryList;
+
+    stringstream stream(serverEntryListString);
+    string item;
+
+    while (getline(stream, item, '\n'))
     {
-        return webServerPort;
+        ServerEntry entry = ParseServerEntry(item);
+        if (entry.webServerCertificate != "None")
+        {
+            serverEntryList.push_back(entry);
+        }
     }
 
-    return -1;
+    return serverEntryList;
+}
+
+ServerEntry ServerList::ParseServerEntry(const string& serverEntry)
+{
+    string line = Dehexlify(serverEntry);
+
+    ServerEntry entry;
+    entry.FromString(line);
+
+    return entry;
+}
+
+string ServerList::EncodeServerEntries(const ServerEntries& serverEntryList)
+{
+    return EncodeBinaryServerEntryList(serverEntryList);
 }
@@ -20,6 +20,11 @@
 #pragma once
 
 #include <vector>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "server_list_store.h"
+#include "server_ranking.h"
 
 using namespace std;
 
@@ -73,10 +78,84 @@ struct ServerEntry
 typedef vector<ServerEntry> ServerEntries;
 typedef ServerEntries::const_iterator ServerEntryIterator;
 
+// An ordered list of server entries with an index on serverAddress.
+// Lookups, moves and insertions are O(1), rather than requiring a scan of
+// the whole list. Entries are unique by serverAddress: when constructed from
+// a vector with duplicates, the first occurrence is kept.
+class IndexedServerEntries
+{
+public:
+    IndexedServerEntries() {}
+    IndexedServerEntries(const ServerEntries& entries);
+    IndexedServerEntries(const IndexedServerEntries& src);
+    IndexedServerEntries& operator=(const IndexedServerEntries& src);
+
+    size_t size() const { return m_entries.size(); }
+    bool empty() const { return m_entries.empty(); }
+
+    // Returns NULL if there is no entry for serverAddress.
+    const ServerEntry* Find(const string& serverAddress) const;
+
+    bool IsFirst(const string& serverAddress) const;
+
+    // Replaces the existing entry with the same address, in place. If there
+    // isn't one, inserts serverEntry as the second entry (or the first, if the
+    // list is empty), so that the first entry can continue to be used.
+    // Returns true if serverEntry is new.
+    bool Upsert(const ServerEntry& serverEntry);
+
+    // Moves the entry to the head of the list if `veryFront` is true;
+    // otherwise moves it to second place.
+    // These return false if there is no entry for serverAddress.
+    bool MoveToFront(const string& serverAddress, bool veryFront);
+    bool MoveToBack(const string& serverAddress);
+    bool Erase(const string& serverAddress);
+
+    ServerEntries ToVector() const;
+
+private:
+    typedef list<ServerEntry> EntryList;
+
+    void Assign(const EntryList& entries);
+    EntryList::iterator FrontInsertionPoint(bool veryFront);
+
+    EntryList m_entries;
+    unordered_map<string, EntryList::iterator> m_index;
+};
+
+// Process-wide counts of the expensive server list operations, so we can
+// see how much work each connection attempt is causing.
+struct ServerListStats
+{
+    ServerListStats() : parses(0), writes(0), journalAppends(0), cacheHits(0) {}
+
+    unsigned int parses;            // Server entry lists decoded
+    unsigned int writes;            // Whole lists (snapshots) written to the store
+    unsigned int journalAppends;    // Incremental changes appended to the store
+    unsigned int cacheHits;         // Lists satisfied by the in-process cache
+};
+
+// A loaded server list, as cached between calls. (Internal to ServerList.)
+// The entries are shared with the cache, so they're never changed in place: a
+// change is made to a copy, which then replaces them.
+struct CachedServerList
+{
+    uint64_t generation;
+    shared_ptr<const IndexedServerEntries> entries;
+    size_t snapshotLength;
+    size_t journalLength;
+    // The store couldn't be read, so this list must not be written over it
+    bool storeUnreadable;
+};
+
 class ServerList
 {
 public:
+    // The list is stored in a memory-mapped file in the Psiphon data directory,
+    // or in the registry if the data directory isn't available.
     ServerList(LPCSTR listName);
+    // The list is stored in `store`, which this takes ownership of.
+    ServerList(LPCSTR listName, IServerListStore* store);
     virtual ~ServerList();
 
     ServerEntries GetList();
@@ -88,25 +167,65 @@ public:
         const vector<string>& newServerEntryList,
         const ServerEntry* serverEntry);
 
+    // These record the outcome of connecting to the servers in the ranking
+    // model (see server_ranking.h), as well as moving them within the list.
     void MarkServersFailed(const ServerEntries& failedServerEntries);
     void MarkServerFailed(const ServerEntry& failedServerEntry);
+    // Moves the entry to the very front of the list.
+    void MarkServerSucceeded(const ServerEntry& serverEntry);
+
+    // Records the results of checking the reachability of checkedEntries
+    // (responses[i] being the result for checkedEntries[i]), then moves the
+    // entries that responded to the front of the list. If `useRanking`, they
+    // go in the order chosen by the ranking model; otherwise only those that
+    // responded quickly go, in the order of ShuffleFastResponders. The
+    // results are recorded either way. Returns the number of entries moved.
+    size_t RankCheckedEntries(const ServerEntries& checkedEntries, const vector<ServerResponse>& responses, bool useRanking);
 
     // Setting `veryFront` to true will force entries to go to the actual head
     // of the list, instead of just near it. Use carefully -- it can break server affinity.
     void MoveEntriesToFront(const ServerEntries& entries, bool veryFront=false);
     void MoveEntryToFront(const ServerEntry& serverEntry, bool veryFront=false);
 
-    static ServerEntries GetListFromSystem(const char* listName);
+    // Encodes the list in the format used for snapshots of the list
+    // (see server_list_encoding.h).
     static string EncodeServerEntries(const ServerEntries& serverEntryList);
 
+    static ServerListStats GetStats();
+    static void ResetStats();
+
 private:
+    void Init(LPCSTR listName);
     string GetListName() const;
-    ServerEntries GetListFromEmbeddedValues();
-    ServerEntries GetListFromSystem();
-    static ServerEntries ParseServerEntries(const char* serverEntryListString);
+    CachedServerList GetCurrentList();
+    CachedServerList WriteChanges(
+        const shared_ptr<const IndexedServerEntries>& serverEntryList,
+        const string& journal,
+        const CachedServerList& previous,
+        bool writeSnapshot=false);
+    static ServerEntries GetListFromRegistry(const char* listName);
+    // Accepts both the binary and the legacy encodings.
+    static ServerEntries ParseServerEntries(const string& serverEntryListString);
     static ServerEntry ParseServerEntry(const string& serverEntry);
-    void WriteListToSystem(const ServerEntries& serverEntryList);
+    // These must be called with m_mutex held.
+    void LoadRanking();
+    void SaveRanking();
 
     HANDLE m_mutex;
     string m_name;
+    unique_ptr<IServerListStore> m_store;
+
+    // The ranking model's scores are stored separately from the list; they
+    // change more often and are a lot smaller. As with the list, changes are
+    // appended to the journal, and compacted into a snapshot now and then.
+    unique_ptr<IServerListStore> m_rankingStore;
+    uint64_t m_rankingGeneration;
+    ServerRanking m_ranking;
+    size_t m_rankingSnapshotLength;
+    size_t m_rankingJournalLength;
+    // The stored ranking is missing or its journal is damaged, so the next
+    // save must write a snapshot.
+    bool m_rankingNeedsSnapshot;
+    // The stored ranking couldn't be read, so it mustn't be written over.
+    bool m_rankingStoreUnreadable;
 };
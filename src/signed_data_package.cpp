@@ -0,0 +1,652 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "logging.h"
+#include "signed_data_package.h"
+#include "utilities.h"
+
+#pragma warning(push, 0)
+#pragma warning(disable: 4244)
+#include "zlib.h"
+#pragma warning(pop)
+
+
+// The most decompressed package data we'll process.
+static const size_t SANITY_CHECK_SIZE = 100 * 1024 * 1024;
+
+// Large enough that zlib spends nearly all of its time in its fast decoding
+// loop, rather than on the overhead of each call (such as saving the window).
+static const size_t INFLATE_CHUNK_SIZE = 256 * 1024;
+
+// The signature and digest are short; anything much longer isn't a valid package.
+static const size_t MAX_SIGNATURE_FIELD_LENGTH = 64 * 1024;
+
+
+/*
+Parses a signed data package, which is a JSON object like:
+
+    {"data": "...", "signingPublicKeyDigest": "...", "signature": "..."}
+
+(see psi_ops_server_entry_auth.py), from text that arrives in chunks. The
+data, which may be many MB, is unescaped and written to a sink as it's
+parsed, and never held whole; the other two fields are short and are
+collected. Other members are skipped.
+
+JSON strings are decoded the way Json::Reader decodes them, so the data is
+byte-for-byte what the previous, non-streaming, verifier signed over.
+*/
+class SignedDataPackageParser
+{
+public:
+    SignedDataPackageParser(IDataPackageSink& dataSink)
+        : m_dataSink(dataSink),
+          m_state(EXPECT_OBJECT),
+          m_stringState(STRING_CHARACTERS),
+          m_stringField(FIELD_NONE),
+          m_codePoint(0),
+          m_highSurrogate(0),
+          m_hexDigits(0),
+          m_nestingDepth(0),
+          m_haveData(false),
+          m_haveSignature(false),
+          m_haveSigningPublicKeyDigest(false),
+          m_error(NULL)
+    {
+    }
+
+    // Returns false if the input is invalid (see GetError) or the sink fails.
+    bool Parse(const char* input, size_t length);
+
+    // Call after the last chunk. Returns false if the package is incomplete.
+    bool Finish();
+
+    const string& GetSignature() const { return m_signature; }
+    const string& GetSigningPublicKeyDigest() const { return m_signingPublicKeyDigest; }
+    const char* GetError() const { return m_error ? m_error : "no error"; }
+
+private:
+    enum State
+    {
+        EXPECT_OBJECT,
+        EXPECT_FIRST_KEY,       // or the end of an empty object
+        EXPECT_KEY,
+        EXPECT_COLON,
+        EXPECT_VALUE,
+        IN_STRING,
+        IN_SKIPPED_SCALAR,
+        IN_SKIPPED_CONTAINER,
+        EXPECT_COMMA_OR_END,
+        DONE
+    };
+
+    // Within a string, for escape sequences that may be split across chunks
+    enum StringState
+    {
+        STRING_CHARACTERS,
+        STRING_ESCAPE,
+        STRING_UNICODE_DIGITS,
+        STRING_LOW_SURROGATE_BACKSLASH,
+        STRING_LOW_SURROGATE_U,
+        STRING_LOW_SURROGATE_DIGITS
+    };
+
+    // Where the contents of the current string go
+    enum StringField
+    {
+        FIELD_NONE,
+        FIELD_KEY,
+        FIELD_DATA,
+        FIELD_SIGNATURE,
+        FIELD_SIGNING_PUBLIC_KEY_DIGEST
+    };
+
+    bool Fail(const char* error) { m_error = error; return false; }
+    void BeginString(StringField field, State returnState);
+    // Parses string contents starting at input[i]; advances i past what's consumed.
+    bool ParseString(const char* input, size_t length, size_t& i);
+    bool EndString();
+    bool EmitString(const char* data, size_t length);
+    bool EmitCodePoint(unsigned int codePoint);
+    bool BeginValue();
+
+    IDataPackageSink& m_dataSink;
+
+    State m_state;
+    State m_stringReturnState;
+    StringState m_stringState;
+    StringField m_stringField;
+    unsigned int m_codePoint;
+    unsigned int m_highSurrogate;
+    int m_hexDigits;
+    int m_nestingDepth;
+
+    string m_key;
+    bool m_haveData;
+    bool m_haveSignature;
+    bool m_haveSigningPublicKeyDigest;
+    string m_signature;
+    string m_signingPublicKeyDigest;
+    const char* m_error;
+};
+
+static bool IsJsonWhitespace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int HexDigitValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void SignedDataPackageParser::BeginString(StringField field, State returnState)
+{
+    m_state = IN_STRING;
+    m_stringState = STRING_CHARACTERS;
+    m_stringField = field;
+    m_stringReturnState = returnState;
+    if (field == FIELD_KEY)
+    {
+        m_key.clear();
+    }
+}
+
+bool SignedDataPackageParser::EmitString(const char* data, size_t length)
+{
+    switch (m_stringField)
+    {
+    case FIELD_DATA:
+        return m_dataSink.Write(data, length);
+    case FIELD_KEY:
+        // Only the keys we're looking for matter, and they're short.
+        if (m_key.length() < 64)
+        {
+            m_key.append(data, min(length, (size_t)64));
+        }
+        return true;
+    case FIELD_SIGNATURE:
+    case FIELD_SIGNING_PUBLIC_KEY_DIGEST:
+    {
+        string& field = (m_stringField == FIELD_SIGNATURE) ? m_signature : m_signingPublicKeyDigest;
+        if (field.length() + length > MAX_SIGNATURE_FIELD_LENGTH)
+        {
+            return Fail("signature field too long");
+        }
+        field.append(data, length);
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+// Encodes the code point as UTF-8, as Json::Reader does.
+bool SignedDataPackageParser::EmitCodePoint(unsigned int codePoint)
+{
+    char utf8[4];
+    size_t length;
+
+    if (codePoint <= 0x7F)
+    {
+        utf8[0] = (char)codePoint;
+        length = 1;
+    }
+    else if (codePoint <= 0x7FF)
+    {
+        utf8[0] = (char)(0xC0 | (codePoint >> 6));
+        utf8[1] = (char)(0x80 | (codePoint & 0x3F));
+        length = 2;
+    }
+    else if (codePoint <= 0xFFFF)
+    {
+        utf8[0] = (char)(0xE0 | (codePoint >> 12));
+        utf8[1] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+        utf8[2] = (char)(0x80 | (codePoint & 0x3F));
+        length = 3;
+    }
+    else
+    {
+        utf8[0] = (char)(0xF0 | (codePoint >> 18));
+        utf8[1] = (char)(0x80 | ((codePoint >> 12) & 0x3F));
+        utf8[2] = (char)(0x80 | ((codePoint >> 6) & 0x3F));
+        utf8[3] = (char)(0x80 | (codePoint & 0x3F));
+        length = 4;
+    }
+
+    return EmitString(utf8, length);
+}
+
+bool SignedDataPackageParser::ParseString(const char* input, size_t length, size_t& i)
+{
+    while (i < length)
+    {
+        if (m_stringState == STRING_CHARACTERS)
+        {
+            // Pass on runs of ordinary characters in one go.
+            size_t start = i;
+            while (i < length && input[i] != '"' && input[i] != '\\')
+            {
+                i++;
+            }
+            if (i > start && !EmitString(input + start, i - start))
+            {
+                return false;
+            }
+            if (i == length)
+            {
+                return true;
+            }
+
+            if (input[i++] == '"')
+            {
+                return EndString();
+            }
+            m_stringState = STRING_ESCAPE;
+            continue;
+        }
+
+        char c = input[i++];
+
+        switch (m_stringState)
+        {
+        case STRING_ESCAPE:
+        {
+            char unescaped;
+            switch (c)
+            {
+            case '"': unescaped = '"'; break;
+            case '/': unescaped = '/'; break;
+            case '\\': unescaped = '\\'; break;
+            case 'b': unescaped = '\b'; break;
+            case 'f': unescaped = '\f'; break;
+            case 'n': unescaped = '\n'; break;
+            case 'r': unescaped = '\r'; break;
+            case 't': unescaped = '\t'; break;
+            case 'u':
+                m_stringState = STRING_UNICODE_DIGITS;
+                m_codePoint = 0;
+                m_hexDigits = 0;
+                continue;
+            default:
+                return Fail("bad escape sequence");
+            }
+            if (!EmitString(&unescaped, 1))
+            {
+                return false;
+            }
+            m_stringState = STRING_CHARACTERS;
+            break;
+        }
+
+        case STRING_UNICODE_DIGITS:
+        case STRING_LOW_SURROGATE_DIGITS:
+        {
+            int digit = HexDigitValue(c);
+            if (digit < 0)
+            {
+                return Fail("bad unicode escape sequence");
+            }
+            m_codePoint = (m_codePoint << 4) | digit;
+            if (++m_hexDigits < 4)
+            {
+                break;
+            }
+
+            if (m_stringState == STRING_UNICODE_DIGITS && m_codePoint >= 0xD800 && m_codePoint <= 0xDBFF)
+            {
+                // A high surrogate, which must be followed by a low surrogate
+                m_highSurrogate = m_codePoint;
+                m_stringState = STRING_LOW_SURROGATE_BACKSLASH;
+                break;
+            }
+
+            unsigned int codePoint = m_codePoint;
+            if (m_stringState == STRING_LOW_SURROGATE_DIGITS)
+            {
+                if (m_codePoint < 0xDC00 || m_codePoint > 0xDFFF)
+                {
+                    return Fail("bad unicode surrogate pair");
+                }
+                codePoint = 0x10000 + ((m_highSurrogate & 0x3FF) << 10) + (m_codePoint & 0x3FF);
+            }
+
+            if (!EmitCodePoint(codePoint))
+            {
+                return false;
+            }
+            m_stringState = STRING_CHARACTERS;
+            break;
+        }
+
+        case STRING_LOW_SURROGATE_BACKSLASH:
+            if (c != '\\')
+            {
+                return Fail("expected unicode low surrogate");
+            }
+            m_stringState = STRING_LOW_SURROGATE_U;
+            break;
+
+        case STRING_LOW_SURROGATE_U:
+            if (c != 'u')
+            {
+                return Fail("expected unicode low surrogate");
+            }
+            m_stringState = STRING_LOW_SURROGATE_DIGITS;
+            m_codePoint = 0;
+            m_hexDigits = 0;
+            break;
+
+        default:
+            return Fail("internal error");
+        }
+    }
+
+    return true;
+}
+
+bool SignedDataPackageParser::EndString()
+{
+    if (m_stringField == FIELD_DATA && !m_dataSink.End())
+    {
+        return Fail("data rejected");
+    }
+
+    m_state = m_stringReturnState;
+    return true;
+}
+
+bool SignedDataPackageParser::BeginValue()
+{
+    // Called with m_key holding the member's key
+
+    bool* seen = NULL;
+    StringField field = FIELD_NONE;
+
+    if (m_key == "data")
+    {
+        seen = &m_haveData;
+        field = FIELD_DATA;
+    }
+    else if (m_key == "signature")
+    {
+        seen = &m_haveSignature;
+        field = FIELD_SIGNATURE;
+    }
+    else if (m_key == "signingPublicKeyDigest")
+    {
+        seen = &m_haveSigningPublicKeyDigest;
+        field = FIELD_SIGNING_PUBLIC_KEY_DIGEST;
+    }
+
+    if (seen)
+    {
+        // The data can't be un-written to the sink, so, unlike Json::Reader,
+        // we don't let a later member override an earlier one.
+        if (*seen)
+        {
+            return Fail("duplicate member");
+        }
+        *seen = true;
+    }
+
+    BeginString(field, EXPECT_COMMA_OR_END);
+    return true;
+}
+
+bool SignedDataPackageParser::Parse(const char* input, size_t length)
+{
+    if (m_error)
+    {
+        return false;
+    }
+
+    size_t i = 0;
+
+    while (i < length)
+    {
+        if (m_state == IN_STRING)
+        {
+            if (!ParseString(input, length, i))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        char c = input[i++];
+
+        switch (m_state)
+        {
+        case EXPECT_OBJECT:
+            if (IsJsonWhitespace(c)) break;
+            if (c != '{') return Fail("expected an object");
+            m_state = EXPECT_FIRST_KEY;
+            break;
+
+        case EXPECT_FIRST_KEY:
+        case EXPECT_KEY:
+            if (IsJsonWhitespace(c)) break;
+            if (c == '}' && m_state == EXPECT_FIRST_KEY)
+            {
+                m_state = DONE;
+                break;
+            }
+            if (c != '"') return Fail("expected a member name");
+            BeginString(FIELD_KEY, EXPECT_COLON);
+            break;
+
+        case EXPECT_COLON:
+            if (IsJsonWhitespace(c)) break;
+            if (c != ':') return Fail("expected ':'");
+            m_state = EXPECT_VALUE;
+            break;
+
+        case EXPECT_VALUE:
+            if (IsJsonWhitespace(c)) break;
+            if (c == '"')
+            {
+                if (!BeginValue()) return false;
+            }
+            else if (m_key == "data" || m_key == "signature" || m_key == "signingPublicKeyDigest")
+            {
+                return Fail("expected a string");
+            }
+            else if (c == '{' || c == '[')
+            {
+                m_state = IN_SKIPPED_CONTAINER;
+                m_nestingDepth = 1;
+            }
+            else
+            {
+                m_state = IN_SKIPPED_SCALAR;
+                i--;
+            }
+            break;
+
+        case IN_SKIPPED_SCALAR:
+            if (c == ',' || c == '}' || IsJsonWhitespace(c))
+            {
+                m_state = EXPECT_COMMA_OR_END;
+                i--;
+            }
+            else if (!isalnum((unsigned char)c) && c != '-' && c != '+' && c != '.')
+            {
+                return Fail("bad value");
+            }
+            break;
+
+        case IN_SKIPPED_CONTAINER:
+            if (c == '"')
+            {
+                BeginString(FIELD_NONE, IN_SKIPPED_CONTAINER);
+            }
+            else if (c == '{' || c == '[')
+            {
+                m_nestingDepth++;
+            }
+            else if ((c == '}' || c == ']') && --m_nestingDepth == 0)
+            {
+                m_state = EXPECT_COMMA_OR_END;
+            }
+            break;
+
+        case EXPECT_COMMA_OR_END:
+            if (IsJsonWhitespace(c)) break;
+            if (c == ',') m_state = EXPECT_KEY;
+            else if (c == '}') m_state = DONE;
+            else return Fail("expected ',' or '}'");
+            break;
+
+        case DONE:
+            // Like Json::Reader, ignore anything after the object.
+            return true;
+
+        default:
+            return Fail("internal error");
+        }
+    }
+
+    return true;
+}
+
+bool SignedDataPackageParser::Finish()
+{
+    if (m_error)
+    {
+        return false;
+    }
+    if (m_state != DONE)
+    {
+        return Fail("incomplete package");
+    }
+    if (!m_haveData || !m_haveSignature || !m_haveSigningPublicKeyDigest)
+    {
+        return Fail("missing member");
+    }
+    return true;
+}
+
+
+// The uncompressed length of a gzip package, from its trailer. (It's modulo
+// 2^32, but we don't accept packages that big.) Returns 0 if unknown.
+static size_t GzipUncompressedLength(const char* package, size_t length)
+{
+    if (length < 18) // the minimum header plus trailer
+    {
+        return 0;
+    }
+
+    const unsigned char* trailer = (const unsigned char*)package + length - 4;
+    return (size_t)trailer[0] | ((size_t)trailer[1] << 8) | ((size_t)trailer[2] << 16) | ((size_t)trailer[3] << 24);
+}
+
+
+bool InflateSignedDataPackage(
+    const char* signedDataPackage,
+    const size_t signedDataPackageLen,
+    bool gzipped,
+    IDataPackageSink& dataSink,
+    string& o_signature,
+    string& o_signingPublicKeyDigest)
+{
+    SignedDataPackageParser parser(dataSink);
+
+    // The package is compressed with either gzip or zlib. Inflate it a chunk
+    // at a time, parsing each chunk as it comes out.
+    // See psi_ops_server_entry_auth.py for details
+
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.avail_in = (uInt)signedDataPackageLen;
+    stream.next_in = (Bytef*)signedDataPackage;
+
+    // 16 + MAX_WBITS expects a gzip wrapper rather than a zlib one.
+    int ret = inflateInit2(&stream, gzipped ? 16 + MAX_WBITS : MAX_WBITS);
+    if (ret != Z_OK)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: inflateInit failed (%d)"), __TFUNCTION__, ret);
+        return false;
+    }
+
+    auto cleanup = finally([&]() { inflateEnd(&stream); });
+
+    if (gzipped)
+    {
+        size_t uncompressedLength = GzipUncompressedLength(signedDataPackage, signedDataPackageLen);
+        if (uncompressedLength > 0 && uncompressedLength <= SANITY_CHECK_SIZE)
+        {
+            dataSink.Reserve(uncompressedLength);
+        }
+    }
+
+    vector<unsigned char> out(INFLATE_CHUNK_SIZE);
+    size_t totalLength = 0;
+
+    do
+    {
+        stream.avail_out = (uInt)out.size();
+        stream.next_out = &out[0];
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+        {
+            // Including Z_BUF_ERROR, when the package is truncated
+            my_print(NOT_SENSITIVE, false, _T("%s: inflate failed (%d)"), __TFUNCTION__, ret);
+            return false;
+        }
+
+        size_t length = out.size() - stream.avail_out;
+        totalLength += length;
+        if (totalLength > SANITY_CHECK_SIZE)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s: inflate overflow"), __TFUNCTION__);
+            return false;
+        }
+
+        try
+        {
+            if (!parser.Parse((const char*)&out[0], length))
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s: JSON parse failed: %S"), __TFUNCTION__, parser.GetError());
+                return false;
+            }
+        }
+        catch (exception& e)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s: data sink exception: %S"), __TFUNCTION__, e.what());
+            return false;
+        }
+
+    } while (ret != Z_STREAM_END);
+
+    if (!parser.Finish())
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: JSON parse failed: %S"), __TFUNCTION__, parser.GetError());
+        return false;
+    }
+
+    o_signature = parser.GetSignature();
+    o_signingPublicKeyDigest = parser.GetSigningPublicKeyDigest();
+    return true;
+}
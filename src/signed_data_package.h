@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include "authenticated_data_package.h"
+
+
+// Decompresses a signed data package and parses it, writing its data to
+// dataSink as it's decoded, a chunk at a time. On success, o_signature and
+// o_signingPublicKeyDigest are the package's other two (Base64) fields.
+//
+// Nothing is verified here: this is the part of verifySignedDataPackage that
+// doesn't involve cryptography, which checks the data (as dataSink sees it)
+// against the signature.
+bool InflateSignedDataPackage(
+    const char* signedDataPackage,
+    const size_t signedDataPackageLen,
+    bool gzipped,
+    IDataPackageSink& dataSink,
+    string& o_signature,
+    string& o_signingPublicKeyDigest);
@@ -44,8 +44,6 @@ Complications to remember:
 
 #include "stdafx.h"
 #include "stopsignal.h"
-#include "psiclient.h"
-#include "utilities.h"
 
 
 /***********************************************************************
@@ -53,43 +51,113 @@ Complications to remember:
  */
 
 StopSignal::StopSignal()
+    : m_stop(STOP_REASON_NONE),
+      m_nextSubscriptionID(1)
 {
-    m_stop = STOP_REASON_NONE;
-
-    // Note that because our stop signal is a simple primitive type, and we're
-    // only doing simple sets or simple checks (but not check-and-set), then we
-    // don't really need to use a mutex. But a) this simple functionality might
-    // change in the future; b) using a mutex isn't a lot of overhead; c) using
-    // a mutex makes it clear that this is threadsafe.
-    m_mutex = CreateMutex(NULL, FALSE, 0);
+    // The stop state is an atomic bitmask, so that CheckSignal -- which is
+    // called from every polling loop -- never has to take a lock. The mutex
+    // is only taken when the state is set, and by waiters and subscribers.
 }
 
 StopSignal::~StopSignal()
 {
-    CloseHandle(m_mutex);
-    m_mutex = 0;
 }
 
 DWORD StopSignal::CheckSignal(DWORD reasons, bool throwIfTrue/*=false*/) const
 {
-    AutoMUTEX lock(m_mutex);
-    if (throwIfTrue && (reasons & m_stop))
+    DWORD matched = reasons & m_stop.load();
+    if (throwIfTrue && matched)
     {
-        ThrowSignalException(reasons & m_stop);
+        ThrowSignalException(matched);
     }
-    return (reasons & m_stop);
+    return matched;
 }
 
 void StopSignal::SignalStop(DWORD reason)
 {
-    AutoMUTEX lock(m_mutex);
-    m_stop = m_stop | reason;
+    m_stop.fetch_or(reason);
+
+    // A waiter checks the state with the mutex held before it sleeps, so
+    // taking the mutex here (after the state is set) means it either sees
+    // the new state or is asleep and gets woken.
+    lock_guard<mutex> lock(m_mutex);
+    m_signalled.notify_all();
+
+    for (vector<Subscription>::const_iterator it = m_subscriptions.begin(); it != m_subscriptions.end(); ++it)
+    {
+        if (it->reasons & reason)
+        {
+            it->callback(it->reasons & reason);
+        }
+    }
 }
 
 void StopSignal::ClearStopSignal(DWORD reason)
 {
-    AutoMUTEX lock(m_mutex);
-    m_stop = m_stop & ~reason;
+    m_stop.fetch_and(~reason);
+}
+
+DWORD StopSignal::WaitForSignal(DWORD reasons, DWORD timeoutMilliseconds) const
+{
+    // CheckSignal is virtual, so that subclasses that add to the state are
+    // waited on properly. They wake waiters with NotifyWaiters.
+    DWORD matched = CheckSignal(reasons);
+    if (matched || timeoutMilliseconds == 0)
+    {
+        return matched;
+    }
+
+    unique_lock<mutex> lock(m_mutex);
+    auto signalled = [&]() { return (matched = CheckSignal(reasons)) != 0; };
+
+    if (timeoutMilliseconds == INFINITE)
+    {
+        m_signalled.wait(lock, signalled);
+    }
+    else
+    {
+        (void)m_signalled.wait_for(lock, chrono::milliseconds(timeoutMilliseconds), signalled);
+    }
+
+    return matched;
+}
+
+void StopSignal::NotifyWaiters() const
+{
+    lock_guard<mutex> lock(m_mutex);
+    m_signalled.notify_all();
+}
+
+int StopSignal::Subscribe(DWORD reasons, const Callback& callback)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    Subscription subscription = { m_nextSubscriptionID++, reasons, callback };
+    m_subscriptions.push_back(subscription);
+
+    // A SignalStop that comes after this check will call the callback,
+    // since it can't run until the subscription has been added.
+    DWORD matched = CheckSignal(reasons);
+    if (matched)
+    {
+        callback(matched);
+    }
+
+    return subscription.id;
+}
+
+void StopSignal::Unsubscribe(int subscriptionID)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    for (vector<Subscription>::iterator it = m_subscriptions.begin(); it != m_subscriptions.end(); ++it)
+    {
+        if (it->id == subscriptionID)
+        {
+            m_subscriptions.erase(it);
+            return;
+        }
+    }
 }
 
 // static
@@ -114,6 +182,39 @@ void StopSignal::ThrowSignalException(DWORD reason)
 }
 
 
+/***********************************************************************
+ StopSignalEvent
+ */
+
+#ifdef _WIN32
+StopSignalEvent::StopSignalEvent(const StopInfo& stopInfo)
+    : m_stopSignal(stopInfo.stopSignal),
+      m_subscriptionID(0)
+{
+    m_event = CreateEvent(NULL, FALSE, FALSE, 0); // auto reset
+    if (m_event != NULL && m_stopSignal != NULL)
+    {
+        HANDLE event = m_event;
+        m_subscriptionID = m_stopSignal->Subscribe(
+                                stopInfo.stopReasons,
+                                [event](DWORD) { SetEvent(event); });
+    }
+}
+
+StopSignalEvent::~StopSignalEvent()
+{
+    if (m_subscriptionID != 0)
+    {
+        m_stopSignal->Unsubscribe(m_subscriptionID);
+    }
+    if (m_event != NULL)
+    {
+        CloseHandle(m_event);
+    }
+}
+#endif
+
+
 /***********************************************************************
  GlobalStopSignal
  */
@@ -19,6 +19,14 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
 //
 // Stop conditions
 //
@@ -129,23 +137,60 @@ public:
     // Check if the current state of the stop signal matches any of the
     // bitwise-OR'd `reasons`. Returns the matching reasons, or 0 if no match.
     // If `throwIfTrue` is true, an exception is thrown.
+    // Doesn't lock, so is cheap enough to call from any polling loop.
     virtual DWORD CheckSignal(DWORD reasons, bool throwIfTrue=false) const;
 
     // Sets the stop signal to the given reason. (More specifically, ORs
     // the stop signal into the currently set reasons.)
+    // Wakes WaitForSignal callers and calls subscribers that are interested
+    // in `reason`.
     virtual void SignalStop(DWORD reason);
 
     // Removes `reason` from the set of currently set reasons.
     virtual void ClearStopSignal(DWORD reason);
 
+    // Blocks until any of `reasons` is set, or `timeoutMilliseconds` has
+    // elapsed (which may be INFINITE). Returns the matching reasons, or 0 on
+    // timeout.
+    virtual DWORD WaitForSignal(DWORD reasons, DWORD timeoutMilliseconds) const;
+
+    typedef function<void(DWORD reasons)> Callback;
+
+    // Calls `callback` with the matching reasons whenever any of `reasons`
+    // is signalled -- and immediately, if any already is. Callbacks are
+    // called on the signalling thread, with an internal lock held, so they
+    // must be quick and must not call back into this stop signal. Returns an
+    // ID to pass to Unsubscribe; the callback won't be called once
+    // Unsubscribe has returned.
+    virtual int Subscribe(DWORD reasons, const Callback& callback);
+    virtual void Unsubscribe(int subscriptionID);
+
     static void ThrowSignalException(DWORD reason);
 
     StopSignal();
     virtual ~StopSignal();
 
+protected:
+    // Wakes WaitForSignal callers, to re-check CheckSignal. For subclasses
+    // whose CheckSignal depends on more than SignalStop.
+    void NotifyWaiters() const;
+
 private:
-    HANDLE m_mutex;
-    DWORD m_stop;
+    struct Subscription
+    {
+        int id;
+        DWORD reasons;
+        Callback callback;
+    };
+
+    atomic<DWORD> m_stop;
+
+    // Guards the subscriptions, and orders SignalStop against waiters
+    // going to sleep, so that no wake-up is lost.
+    mutable mutex m_mutex;
+    mutable condition_variable m_signalled;
+    vector<Subscription> m_subscriptions;
+    int m_nextSubscriptionID;
 };
 
 // Convenience struct for passing around a stop signal and set of reasons
@@ -157,6 +202,32 @@ struct StopInfo
     StopInfo(StopSignal* stopSignal, DWORD stopReasons) : stopSignal(stopSignal), stopReasons(stopReasons) {}
 };
 
+#ifdef _WIN32
+//
+// An auto-reset event that's set whenever any of a StopInfo's reasons is
+// signalled, for waiting on a stop together with other handles. As with
+// StopSignal::WaitForSignal, CheckSignal must be called when it's set.
+//
+class StopSignalEvent
+{
+public:
+    StopSignalEvent(const StopInfo& stopInfo);
+    ~StopSignalEvent();
+
+    // NULL if the event couldn't be created
+    HANDLE Get() const { return m_event; }
+
+private:
+    // not copyable
+    StopSignalEvent(StopSignalEvent const&);
+    StopSignalEvent& operator=(StopSignalEvent const&);
+
+    StopSignal* m_stopSignal;
+    HANDLE m_event;
+    int m_subscriptionID;
+};
+#endif
+
 //
 // Singleton class providing access to the global stop conditions
 //
@@ -27,10 +27,18 @@
 #include "utilities.h"
 
 
-Subprocess::Subprocess(const tstring& exePath, ISubprocessOutputHandler* outputHandler, bool deleteExe/*=true*/)
+// A child that was given a way to say that it's ready but hasn't, this long
+// after starting, may be a build that doesn't. It's probed for instead.
+const DWORD READY_SIGNAL_GRACE_MILLISECONDS = 5000;
+
+
+Subprocess::Subprocess(const tstring& exePath, ISubprocessOutputHandler* outputHandler, bool deleteExe/*=true*/, const string& outputDelimiter/*="\n"*/)
     : m_parentOutputPipe(INVALID_HANDLE_VALUE),
       m_parentInputPipe(INVALID_HANDLE_VALUE),
-      m_deleteExe(deleteExe)
+      m_outputReader(outputDelimiter),
+      m_deleteExe(deleteExe),
+      m_readyProtocol(false),
+      m_readyEvent(NULL)
 {
     if (outputHandler == NULL) {
         throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) "outputHandler null");
@@ -54,7 +62,36 @@ bool Subprocess::SpawnSubprocess(const tstring &commandLineFlags)
     AutoMUTEX lock(m_mutex);
     tstringstream commandLine;
 
-    commandLine << m_exePath << commandLineFlags;
+    // The ready event is only inheritable if the child is to be told of it.
+    tstring flags = commandLineFlags;
+    size_t readyEventPlaceholder = flags.find(SUBPROCESS_READY_EVENT_PLACEHOLDER);
+
+    SECURITY_ATTRIBUTES readyEventAttributes;
+    readyEventAttributes.nLength = sizeof(readyEventAttributes);
+    readyEventAttributes.lpSecurityDescriptor = NULL;
+    readyEventAttributes.bInheritHandle = (readyEventPlaceholder != tstring::npos);
+
+    if (m_readyEvent != NULL)
+    {
+        CloseHandle(m_readyEvent);
+    }
+    m_readyEvent = CreateEvent(&readyEventAttributes, TRUE, FALSE, NULL); // manual reset
+    if (m_readyEvent == NULL)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s - CreateEvent failed (%d)"), __TFUNCTION__, GetLastError());
+        return false;
+    }
+
+    if (readyEventPlaceholder != tstring::npos)
+    {
+        tstringstream handleValue;
+        handleValue << (ULONG_PTR)m_readyEvent;
+        flags.replace(readyEventPlaceholder, _tcslen(SUBPROCESS_READY_EVENT_PLACEHOLDER), handleValue.str());
+    }
+
+    m_readyProtocol = !m_readyLine.empty() || (readyEventPlaceholder != tstring::npos);
+
+    commandLine << m_exePath << flags;
 
     STARTUPINFO startupInfo;
     ZeroMemory(&startupInfo, sizeof(startupInfo));
@@ -72,7 +109,9 @@ bool Subprocess::SpawnSubprocess(const tstring &commandLineFlags)
         parentInputPipe,
         startupInfo.hStdInput,
         startupInfo.hStdOutput,
-        startupInfo.hStdError))
+        startupInfo.hStdError,
+        true, // overlapped output, for m_outputReader
+        true)) // overlapped input, so writers can wait for output at the same time
     {
         my_print(NOT_SENSITIVE, false, _T("%s - CreateSubprocessPipes failed (%d)"), __TFUNCTION__, GetLastError());
         return false;
@@ -139,6 +178,11 @@ bool Subprocess::SpawnSubprocess(const tstring &commandLineFlags)
         return false;
     }
 
+    if (!m_outputReader.Attach(m_parentOutputPipe))
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s - failed to start reading subprocess output"), __TFUNCTION__);
+    }
+
     WaitForInputIdle(m_processInfo.hProcess, 5000);
 
     m_parentInputPipe = parentInputPipe;
@@ -156,6 +200,90 @@ HANDLE Subprocess::ParentInputPipe()
     return m_parentInputPipe;
 }
 
+HANDLE Subprocess::OutputEvent()
+{
+    return m_outputReader.ReadyEvent();
+}
+
+void Subprocess::SetReadyLine(const string& readyLine)
+{
+    AutoMUTEX lock(m_mutex);
+    m_readyLine = readyLine;
+    m_outputReader.SetWatchedText(readyLine);
+}
+
+HANDLE Subprocess::ReadyEvent()
+{
+    return m_readyEvent;
+}
+
+DWORD Subprocess::WaitForReady(DWORD timeoutMilliseconds, int fallbackPort, const StopInfo& stopInfo)
+{
+    if (!m_readyProtocol)
+    {
+        // The child can't tell us, so wait until it's listening. This is the
+        // slow way: each connection attempt can take up to 100ms to fail.
+        return WaitForConnectability((USHORT)fallbackPort, timeoutMilliseconds, Process(), stopInfo);
+    }
+
+    StopSignalEvent stopEvent(stopInfo);
+
+    DWORD start = GetTickCount();
+
+    while (true)
+    {
+        // The ready line arrives as output
+        ConsumeSubprocessOutput();
+
+        if (WAIT_OBJECT_0 == WaitForSingleObject(m_readyEvent, 0))
+        {
+            return ERROR_SUCCESS;
+        }
+
+        if (stopInfo.stopSignal != NULL
+            && stopInfo.stopSignal->CheckSignal(stopInfo.stopReasons))
+        {
+            return ERROR_OPERATION_ABORTED;
+        }
+
+        if (WAIT_OBJECT_0 == WaitForSingleObject(Process(), 0))
+        {
+            return ERROR_SYSTEM_PROCESS_TERMINATED;
+        }
+
+        // Note: GetTickCount wraps after 49 days; the subtraction handles it
+        DWORD elapsed = GetTickCount() - start;
+        if (elapsed >= timeoutMilliseconds)
+        {
+            return WAIT_TIMEOUT;
+        }
+
+        if (elapsed >= READY_SIGNAL_GRACE_MILLISECONDS && fallbackPort > 0)
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s - no ready signal; probing port %d"), __TFUNCTION__, fallbackPort);
+            return WaitForConnectability((USHORT)fallbackPort, timeoutMilliseconds - elapsed, Process(), stopInfo);
+        }
+
+        HANDLE waitHandles[] = { m_readyEvent, OutputEvent(), Process(), stopEvent.Get() };
+        DWORD waitHandlesCount = (stopEvent.Get() != NULL) ? 4 : 3;
+        DWORD waitMilliseconds = timeoutMilliseconds - elapsed;
+        if (fallbackPort > 0)
+        {
+            waitMilliseconds = min(waitMilliseconds, READY_SIGNAL_GRACE_MILLISECONDS - elapsed);
+        }
+        if (stopInfo.stopSignal != NULL && stopEvent.Get() == NULL)
+        {
+            // Can't wait for the stop signal, so poll it
+            waitMilliseconds = min(waitMilliseconds, (DWORD)100);
+        }
+
+        if (WAIT_FAILED == WaitForMultipleObjects(waitHandlesCount, waitHandles, FALSE, waitMilliseconds))
+        {
+            Sleep(100);
+        }
+    }
+}
+
 bool Subprocess::CloseInputPipes()
 {
     AutoMUTEX lock(m_mutex);
@@ -171,6 +299,7 @@ bool Subprocess::CloseInputPipes()
         }
     }
     if (!success && m_parentOutputPipe != NULL && m_parentOutputPipe != INVALID_HANDLE_VALUE) {
+        m_outputReader.Detach();
         if (!CloseHandle(m_parentOutputPipe)) {
             my_print(NOT_SENSITIVE, false, _T("%s:%d - CloseHandle failed (%d)"), __FUNCTION__, __LINE__, GetLastError());
         }
@@ -261,6 +390,8 @@ bool Subprocess::Cleanup()
     }
     ZeroMemory(&m_processInfo, sizeof(m_processInfo));
 
+    m_outputReader.Detach();
+
     if (m_parentOutputPipe != 0
         && m_parentOutputPipe != INVALID_HANDLE_VALUE)
     {
@@ -269,7 +400,13 @@ bool Subprocess::Cleanup()
         }
     }
     m_parentOutputPipe = INVALID_HANDLE_VALUE;
-    m_parentOutputPipeBuffer.clear();
+
+    if (m_readyEvent != NULL)
+    {
+        CloseHandle(m_readyEvent);
+        m_readyEvent = NULL;
+    }
+    m_readyProtocol = false;
 
     return true;
 }
@@ -278,50 +415,12 @@ bool Subprocess::Cleanup()
 void Subprocess::ConsumeSubprocessOutput()
 {
     AutoMUTEX lock(m_mutex);
-    DWORD bytes_avail = 0;
 
-    // ReadFile will block forever if there's no data to read, so we need
-    // to check if there's data available to read first.
-    if (!PeekNamedPipe(m_parentOutputPipe, NULL, 0, NULL, &bytes_avail, NULL))
-    {
-        my_print(NOT_SENSITIVE, false, _T("%s:%d - PeekNamedPipe failed (%d)"), __TFUNCTION__, __LINE__, GetLastError());
-    }
+    (void)m_outputReader.Consume(*m_outputHandler);
 
-    if (bytes_avail <= 0)
+    if (m_readyEvent != NULL && m_outputReader.WatchedTextSeen())
     {
-        return;
-    }
-
-    // If there's data available from the pipe, process it.
-    unique_ptr<char> buffer(new char[bytes_avail + 1]);
-
-    DWORD num_read = 0;
-    if (!ReadFile(m_parentOutputPipe, buffer.get(), bytes_avail, &num_read, NULL))
-    {
-        my_print(NOT_SENSITIVE, false, _T("%s:%d - ReadFile failed (%d)"), __TFUNCTION__, __LINE__, GetLastError());
-    }
-    buffer.get()[num_read] = '\0';
-
-    // Don't assume we receive complete lines in a read: "Data is written to an anonymous pipe
-    // as a stream of bytes. This means that the parent process reading from a pipe cannot
-    // distinguish between the bytes written in separate write operations, unless both the
-    // parent and child processes use a protocol to indicate where the write operation ends."
-    // http://msdn.microsoft.com/en-us/library/windows/desktop/aa365782%28v=vs.85%29.aspx
-
-    m_parentOutputPipeBuffer.append(buffer.get());
-
-    int start = 0;
-    while (true)
-    {
-        int end = m_parentOutputPipeBuffer.find("\n", start);
-        if (end == string::npos)
-        {
-            m_parentOutputPipeBuffer = m_parentOutputPipeBuffer.substr(start);
-            break;
-        }
-        string line = m_parentOutputPipeBuffer.substr(start, end - start);
-        m_outputHandler->HandleSubprocessOutputLine(line);
-        start = end + 1;
+        SetEvent(m_readyEvent);
     }
 }
 
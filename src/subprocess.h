@@ -20,6 +20,7 @@
 #pragma once
 
 #include "worker_thread.h"
+#include "subprocess_output_reader.h"
 
 // Subprocess is running
 #define SUBPROCESS_STATUS_RUNNING    0x0L
@@ -30,23 +31,22 @@
 // No subprocess is running
 #define SUBPROCESS_STATUS_NO_PROCESS (1L << 1)
 
+// Replaced, in the command line flags given to SpawnSubprocess, with the
+// value of an inherited event handle that the child sets once it's ready.
+#define SUBPROCESS_READY_EVENT_PLACEHOLDER _T("%READY_EVENT%")
 
-class ISubprocessOutputHandler
-{
-public:
-    /**
-    Called for each line of data read from the subprocess when
-    ConsumeSubprocessOutput is invoked on a Subprocess instance.
-    See Subprocess::ConsumeSubprocessOutput.
-    */
-    virtual void HandleSubprocessOutputLine(const string& line) = 0;
-};
 
 /**
 Subprocess provides functionality around launching an executable as a
 subprocess. This includes handling output written by the subproccess
 to stdout, querying the state of the running process and managing its
 lifecycle. The provided methods are thread safe.
+
+A child that knows when it's ready -- typically, when its listeners are
+accepting connections -- can tell the parent so the moment it is, rather
+than the parent probing for it. It can either write a ready line to its
+output (see SetReadyLine), or set an event that it's given on its command
+line (see SUBPROCESS_READY_EVENT_PLACEHOLDER). See WaitForReady.
 */
 class Subprocess
 {
@@ -54,8 +54,9 @@ public:
     /**
     Initialize a new instance. Throws std::exception if outputHandler is null.
     If deleteExe is true, the file at exePath will be deleted on cleanup.
+    outputDelimiter ends each "line" of output passed to outputHandler.
     */
-    Subprocess(const tstring& exePath, ISubprocessOutputHandler* outputHandler, bool deleteExe=true);
+    Subprocess(const tstring& exePath, ISubprocessOutputHandler* outputHandler, bool deleteExe=true, const string& outputDelimiter="\n");
     virtual ~Subprocess();
 
     /**
@@ -67,13 +68,47 @@ public:
     */
     virtual bool SpawnSubprocess(const tstring& commandLineFlags);
 
+    /**
+    Sets the line that the child writes to its output when it's ready. It's
+    recognised as soon as it's read, however the output is delimited, and
+    is still passed to the output handler as part of a line. Must be called
+    before SpawnSubprocess.
+    */
+    virtual void SetReadyLine(const string& readyLine);
+
+    /**
+    Returns an event that is set once the child has said that it's ready,
+    by either means. Only valid when Status() == SUBPROCESS_STATUS_RUNNING.
+    */
+    virtual HANDLE ReadyEvent();
+
+    /**
+    Waits until the child says that it's ready, consuming its output while
+    waiting. If the child has no means of saying so (no ready line was set,
+    and SUBPROCESS_READY_EVENT_PLACEHOLDER wasn't in its command line), or
+    hasn't said so within READY_SIGNAL_GRACE_MILLISECONDS, waits until
+    localhost `fallbackPort` accepts connections instead. Returns the same
+    values as WaitForConnectability.
+    */
+    virtual DWORD WaitForReady(DWORD timeoutMilliseconds, int fallbackPort, const StopInfo& stopInfo);
+
     /**
     Reads stdout of the child process and calls HandleSubprocessOutputLine,
-    on the provided SubprocessOutputHandler, once for each line of newline
-    delimited output data read, until there is no more data to be read.
+    on the provided SubprocessOutputHandler, once for each line of delimited
+    output data read (see the constructor), until there is no more data to be
+    read.
+    Doesn't block.
     */
     virtual void ConsumeSubprocessOutput();
 
+    /**
+    Returns an event that is signalled when there is output for
+    ConsumeSubprocessOutput to consume, so that callers can wait for output
+    rather than polling for it. Only valid when
+    Status() == SUBPROCESS_STATUS_RUNNING.
+    */
+    virtual HANDLE OutputEvent();
+
     /**
     Subprocess status. Possible values are defined by the constants
     SUBPROCESS_STATUS_{RUNNING, EXITED, NO_PROCESS}.
@@ -89,7 +124,9 @@ public:
 
     /**
     Returns a handle to stdin of the subprocess. Only returns a valid handle
-    when Status() == SUBPROCESS_STATUS_RUNNING.
+    when Status() == SUBPROCESS_STATUS_RUNNING. It's opened for overlapped
+    I/O, so that a writer can keep consuming the child's output while a
+    write is waiting for the child to read.
     */
     virtual HANDLE ParentInputPipe();
 
@@ -125,8 +162,13 @@ protected:
     PROCESS_INFORMATION m_processInfo;
     HANDLE m_parentInputPipe;
     HANDLE m_parentOutputPipe;
-    string m_parentOutputPipeBuffer;
+    SubprocessOutputReader m_outputReader;
     HANDLE m_mutex;
     ISubprocessOutputHandler* m_outputHandler;
     bool m_deleteExe;
+
+    string m_readyLine;
+    // Whether the child has been given a way to say that it's ready
+    bool m_readyProtocol;
+    HANDLE m_readyEvent;
 };
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include <algorithm>
+#include "subprocess_output_reader.h"
+#include "logging.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+
+// Enough for a burst of notices to be read at once.
+static const size_t INITIAL_BUFFER_SIZE = 64 * 1024;
+
+// Lines longer than this are dropped, rather than buffered without limit.
+static const size_t MAX_LINE_LENGTH = 4 * 1024 * 1024;
+
+// A subprocess that writes without pause could otherwise keep Consume from
+// returning. Anything left over is picked up by the next call.
+static const int MAX_READS_PER_CONSUME = 16;
+
+
+SubprocessOutputReader::SubprocessOutputReader(const string& delimiter/*="\n"*/)
+    : m_delimiter(delimiter.empty() ? "\n" : delimiter),
+      m_attached(false),
+      m_closed(false),
+      m_lineStart(0),
+      m_scanned(0),
+      m_end(0),
+      m_droppingLine(false),
+      m_watchedTextSeen(false)
+{
+#ifdef _WIN32
+    m_pipe = INVALID_HANDLE_VALUE;
+    ZeroMemory(&m_overlapped, sizeof(m_overlapped));
+    // Manual reset, as overlapped I/O requires
+    m_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_readPending = false;
+#else
+    m_pipe = -1;
+#endif
+}
+
+
+SubprocessOutputReader::~SubprocessOutputReader()
+{
+    Detach();
+#ifdef _WIN32
+    CloseHandle(m_overlapped.hEvent);
+#endif
+}
+
+
+void SubprocessOutputReader::MakeRoom()
+{
+    if (m_lineStart > 0)
+    {
+        size_t length = m_end - m_lineStart;
+        if (length > 0)
+        {
+            memmove(&m_buffer[0], &m_buffer[m_lineStart], length);
+        }
+        m_end = length;
+        m_scanned -= m_lineStart;
+        m_lineStart = 0;
+    }
+
+    if (m_end < m_buffer.size())
+    {
+        return;
+    }
+
+    if (m_buffer.size() < MAX_LINE_LENGTH)
+    {
+        m_buffer.resize(max(INITIAL_BUFFER_SIZE, min(m_buffer.size() * 2, MAX_LINE_LENGTH)));
+        return;
+    }
+
+    // The buffer is full of one line, which we won't buffer any more of.
+    // Drop it, and what's still to come of it.
+    if (!m_droppingLine)
+    {
+        my_print(NOT_SENSITIVE, false, _T("%s: dropping subprocess output line longer than %d bytes"), __TFUNCTION__, (int)MAX_LINE_LENGTH);
+    }
+    m_droppingLine = true;
+    m_lineStart = m_scanned = m_end = 0;
+}
+
+
+void SubprocessOutputReader::HandleLines(ISubprocessOutputHandler& handler)
+{
+    // Don't assume we receive complete lines in a read: "Data is written to an anonymous pipe
+    // as a stream of bytes. This means that the parent process reading from a pipe cannot
+    // distinguish between the bytes written in separate write operations, unless both the
+    // parent and child processes use a protocol to indicate where the write operation ends."
+    // http://msdn.microsoft.com/en-us/library/windows/desktop/aa365782%28v=vs.85%29.aspx
+
+    const size_t delimiterLength = m_delimiter.length();
+
+    while (m_end - m_scanned >= delimiterLength)
+    {
+        char* delimiter = FindDelimiter(&m_buffer[m_scanned], &m_buffer[0] + m_end);
+        if (!delimiter)
+        {
+            // The end may be the start of a delimiter that the next read
+            // completes, so look at it again then.
+            m_scanned = m_end - (delimiterLength - 1);
+            break;
+        }
+
+        // Replacing the delimiter's first character terminates the line in
+        // place.
+        *delimiter = '\0';
+
+        const char* line = &m_buffer[m_lineStart];
+        size_t length = delimiter - line;
+        bool dropped = m_droppingLine;
+
+        // Advance first, in case the handler throws.
+        m_lineStart = m_scanned = delimiter + delimiterLength - &m_buffer[0];
+        m_droppingLine = false;
+
+        if (!dropped)
+        {
+            handler.HandleSubprocessOutputLine(line, length);
+        }
+    }
+
+    if (m_lineStart == m_end)
+    {
+        m_lineStart = m_scanned = m_end = 0;
+    }
+}
+
+
+char* SubprocessOutputReader::FindDelimiter(char* start, char* end) const
+{
+    const size_t length = m_delimiter.length();
+
+    while ((size_t)(end - start) >= length)
+    {
+        char* candidate = (char*)memchr(start, m_delimiter[0], end - start - (length - 1));
+        if (!candidate)
+        {
+            return NULL;
+        }
+        if (0 == memcmp(candidate + 1, m_delimiter.data() + 1, length - 1))
+        {
+            return candidate;
+        }
+        start = candidate + 1;
+    }
+
+    return NULL;
+}
+
+
+void SubprocessOutputReader::SetWatchedText(const string& text)
+{
+    m_watchedText = text;
+    m_watchedTextSeen = false;
+    m_watchedTail.clear();
+}
+
+
+bool SubprocessOutputReader::WatchedTextSeen() const
+{
+    return m_watchedTextSeen;
+}
+
+
+void SubprocessOutputReader::WatchOutput(const char* data, size_t length)
+{
+    if (m_watchedText.empty() || m_watchedTextSeen || length == 0)
+    {
+        return;
+    }
+
+    const size_t tailLength = m_watchedText.length() - 1;
+
+    // Text that starts in an earlier read and ends in this one
+    string boundary = m_watchedTail + string(data, min(length, tailLength));
+    if (boundary.find(m_watchedText) != string::npos
+        || search(data, data + length, m_watchedText.begin(), m_watchedText.end()) != data + length)
+    {
+        m_watchedTextSeen = true;
+        m_watchedTail.clear();
+        return;
+    }
+
+    if (length >= tailLength)
+    {
+        m_watchedTail.assign(data + length - tailLength, tailLength);
+    }
+    else
+    {
+        m_watchedTail.append(data, length);
+        if (m_watchedTail.length() > tailLength)
+        {
+            m_watchedTail.erase(0, m_watchedTail.length() - tailLength);
+        }
+    }
+}
+
+
+#ifdef _WIN32
+
+bool SubprocessOutputReader::Attach(SubprocessPipe pipe)
+{
+    Detach();
+
+    if (pipe == NULL || pipe == INVALID_HANDLE_VALUE || m_overlapped.hEvent == NULL)
+    {
+        return false;
+    }
+
+    m_pipe = pipe;
+    m_attached = true;
+    m_closed = false;
+
+    if (!StartRead())
+    {
+        Detach();
+        return false;
+    }
+
+    return true;
+}
+
+
+void SubprocessOutputReader::Detach()
+{
+    if (m_readPending)
+    {
+        // The read must be complete before its buffer and OVERLAPPED can be
+        // reused, or the pipe closed.
+        DWORD bytesRead;
+        CancelIoEx(m_pipe, &m_overlapped);
+        (void)GetOverlappedResult(m_pipe, &m_overlapped, &bytesRead, TRUE);
+        m_readPending = false;
+    }
+
+    m_pipe = INVALID_HANDLE_VALUE;
+    m_attached = false;
+    m_closed = false;
+    m_lineStart = m_scanned = m_end = 0;
+    m_droppingLine = false;
+    m_watchedTextSeen = false;
+    m_watchedTail.clear();
+}
+
+
+SubprocessOutputEvent SubprocessOutputReader::ReadyEvent() const
+{
+    return m_overlapped.hEvent;
+}
+
+
+bool SubprocessOutputReader::StartRead()
+{
+    MakeRoom();
+
+    // ReadFile resets the event. It may complete immediately, in which case
+    // the event is signalled and the result is collected the same way as
+    // for a read that completes later.
+    if (!ReadFile(m_pipe, &m_buffer[m_end], (DWORD)(m_buffer.size() - m_end), NULL, &m_overlapped)
+        && GetLastError() != ERROR_IO_PENDING)
+    {
+        if (GetLastError() != ERROR_BROKEN_PIPE)
+        {
+            my_print(NOT_SENSITIVE, false, _T("%s:%d - ReadFile failed (%d)"), __TFUNCTION__, __LINE__, GetLastError());
+        }
+        m_closed = true;
+        ResetEvent(m_overlapped.hEvent);
+        return false;
+    }
+
+    m_readPending = true;
+    return true;
+}
+
+
+bool SubprocessOutputReader::Consume(ISubprocessOutputHandler& handler)
+{
+    if (!m_attached || m_closed)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < MAX_READS_PER_CONSUME; i++)
+    {
+        if (!m_readPending && !StartRead())
+        {
+            return false;
+        }
+
+        DWORD bytesRead = 0;
+        if (!GetOverlappedResult(m_pipe, &m_overlapped, &bytesRead, FALSE))
+        {
+            DWORD error = GetLastError();
+            if (error == ERROR_IO_INCOMPLETE)
+            {
+                return true;
+            }
+
+            m_readPending = false;
+            m_closed = true;
+            // Don't leave the event signalled for a pipe that's done, or a
+            // waiter would spin on it until the process exits
+            ResetEvent(m_overlapped.hEvent);
+            if (error != ERROR_BROKEN_PIPE)
+            {
+                my_print(NOT_SENSITIVE, false, _T("%s:%d - GetOverlappedResult failed (%d)"), __TFUNCTION__, __LINE__, error);
+            }
+            return false;
+        }
+
+        m_readPending = false;
+        m_end += bytesRead;
+
+        // Before HandleLines terminates lines in place
+        WatchOutput(&m_buffer[m_end - bytesRead], bytesRead);
+        HandleLines(handler);
+    }
+
+    // Keep a read outstanding, so that ReadyEvent is signalled by new output
+    return m_readPending || StartRead();
+}
+
+#else
+
+bool SubprocessOutputReader::Attach(SubprocessPipe pipe)
+{
+    Detach();
+
+    int flags = fcntl(pipe, F_GETFL, 0);
+    if (pipe < 0 || flags == -1 || -1 == fcntl(pipe, F_SETFL, flags | O_NONBLOCK))
+    {
+        return false;
+    }
+
+    m_pipe = pipe;
+    m_attached = true;
+    m_closed = false;
+    return true;
+}
+
+
+void SubprocessOutputReader::Detach()
+{
+    m_pipe = -1;
+    m_attached = false;
+    m_closed = false;
+    m_lineStart = m_scanned = m_end = 0;
+    m_droppingLine = false;
+    m_watchedTextSeen = false;
+    m_watchedTail.clear();
+}
+
+
+SubprocessOutputEvent SubprocessOutputReader::ReadyEvent() const
+{
+    // The pipe polls readable when there's output, or when it has closed
+    return m_pipe;
+}
+
+
+bool SubprocessOutputReader::Consume(ISubprocessOutputHandler& handler)
+{
+    if (!m_attached || m_closed)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < MAX_READS_PER_CONSUME; i++)
+    {
+        MakeRoom();
+
+        ssize_t bytesRead = read(m_pipe, &m_buffer[m_end], m_buffer.size() - m_end);
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return true;
+        }
+        if (bytesRead <= 0)
+        {
+            m_closed = true;
+            return false;
+        }
+
+        m_end += bytesRead;
+
+        // Before HandleLines terminates lines in place
+        WatchOutput(&m_buffer[m_end - bytesRead], bytesRead);
+        HandleLines(handler);
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+class ISubprocessOutputHandler
+{
+public:
+    /**
+    Called for each line of data read from the subprocess when
+    ConsumeSubprocessOutput is invoked on a Subprocess instance.
+    See Subprocess::ConsumeSubprocessOutput.
+    The line, which doesn't include its delimiter (a newline, unless the
+    reader was given another), is also NUL-terminated. It points into the
+    reader's buffer, so is only valid during the call.
+    */
+    virtual void HandleSubprocessOutputLine(const char* line, size_t length) = 0;
+};
+
+
+#ifdef _WIN32
+// The read end of a pipe that was opened for overlapped I/O (see
+// CreateSubprocessPipes); anonymous pipes don't support it.
+typedef HANDLE SubprocessPipe;
+// An event that can be waited on with WaitForSingleObject and friends.
+typedef HANDLE SubprocessOutputEvent;
+#else
+typedef int SubprocessPipe;
+// A file descriptor that can be waited on with poll.
+typedef int SubprocessOutputEvent;
+#endif
+
+
+/**
+Reads newline-delimited output from a subprocess without blocking. A child
+whose output isn't newline-delimited can be read with its own delimiter
+instead, of any length; "lines" are then whatever ends with it.
+
+A read is always outstanding on the pipe (on Windows, as overlapped I/O), so
+a waiting thread can be woken by ReadyEvent() as soon as output arrives
+rather than polling for it. Output is read into a buffer that is reused for
+the life of the reader, and lines are handed to the handler in place; only a
+trailing partial line is moved, to the front of the buffer, before the next
+read. The buffer grows to hold a line longer than it, up to a limit beyond
+which the line is dropped.
+
+The reader can also watch the output for a given text, such as the message
+a child writes once it's ready. It's noticed as soon as it's read, whether or
+not a delimiter follows it.
+
+Not thread safe; Subprocess serializes access to it.
+*/
+class SubprocessOutputReader
+{
+public:
+    /**
+    `delimiter` ends each line. If it's empty, a newline is used.
+    */
+    SubprocessOutputReader(const string& delimiter="\n");
+    virtual ~SubprocessOutputReader();
+
+    /**
+    Starts reading from the pipe. The pipe remains owned by the caller, who
+    must call Detach before closing it.
+    Returns false if reading could not be started.
+    */
+    bool Attach(SubprocessPipe pipe);
+
+    /**
+    Cancels any outstanding read and discards any partial line.
+    */
+    void Detach();
+
+    /**
+    Signalled when there's output for Consume to process. Only valid while
+    attached.
+    */
+    SubprocessOutputEvent ReadyEvent() const;
+
+    /**
+    Calls HandleSubprocessOutputLine once for each complete line that has
+    been read, without blocking. Returns false once the pipe has closed or
+    failed, or if not attached. Output after the last newline when the pipe
+    closes is discarded, as an incomplete line.
+    */
+    bool Consume(ISubprocessOutputHandler& handler);
+
+    /**
+    Sets the text to watch the output for. It's looked for anywhere in the
+    output, including across reads and delimiters. Remains set across Attach
+    and Detach.
+    */
+    void SetWatchedText(const string& text);
+
+    /**
+    True once the watched text has been read since Attach.
+    */
+    bool WatchedTextSeen() const;
+
+private:
+    void MakeRoom();
+    void HandleLines(ISubprocessOutputHandler& handler);
+    char* FindDelimiter(char* start, char* end) const;
+    void WatchOutput(const char* data, size_t length);
+
+    string m_delimiter;
+    SubprocessPipe m_pipe;
+    bool m_attached;
+    bool m_closed;
+
+    // [m_lineStart, m_end) has been read but not handled. It's a partial
+    // line, of which [m_lineStart, m_scanned) is known to hold no delimiter.
+    vector<char> m_buffer;
+    size_t m_lineStart;
+    size_t m_scanned;
+    size_t m_end;
+    // Set while skipping the rest of a line that was too long.
+    bool m_droppingLine;
+
+    string m_watchedText;
+    bool m_watchedTextSeen;
+    // The end of the output read so far, which may hold the start of the
+    // watched text. One character shorter than it.
+    string m_watchedTail;
+
+#ifdef _WIN32
+    bool StartRead();
+
+    OVERLAPPED m_overlapped;
+    bool m_readPending;
+#endif
+};
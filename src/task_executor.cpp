@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include <algorithm>
+#include <chrono>
+#include "task_executor.h"
+
+
+// Enough for a UI request, an upgrade download, a feedback upload and a
+// server list reorder to all run at once.
+const size_t MIN_WORKERS = 4;
+const size_t MAX_WORKERS = 16;
+
+typedef chrono::steady_clock TaskClock;
+
+enum TaskRunState
+{
+    TASK_QUEUED,
+    TASK_RUNNING,
+    TASK_DONE
+};
+
+struct TaskState
+{
+    TaskExecutor::Task task;
+    CancellationToken token;
+    TaskClock::time_point submitTime;
+    atomic<int> runState;
+
+    mutex doneMutex;
+    condition_variable done;
+
+    TaskState(const TaskExecutor::Task& task, const StopInfo& stopInfo)
+        : task(task), token(stopInfo), submitTime(TaskClock::now()), runState(TASK_QUEUED)
+    {
+    }
+
+    // Returns false if the task had already left the queued state
+    bool TransitionFromQueued(int toState)
+    {
+        int expected = TASK_QUEUED;
+        return runState.compare_exchange_strong(expected, toState);
+    }
+
+    void SetDone()
+    {
+        lock_guard<mutex> lock(doneMutex);
+        runState = TASK_DONE;
+        done.notify_all();
+    }
+};
+
+// Which executor, and which of its workers, the current thread is
+static thread_local TaskExecutor* t_executor = NULL;
+static thread_local size_t t_workerIndex = 0;
+
+
+//==== CancellationToken ======================================================
+
+CancellationToken::CancellationToken(const StopInfo& stopInfo)
+    : m_stopInfo(stopInfo), m_cancelled(false)
+{
+}
+
+bool CancellationToken::IsCancelled() const
+{
+    return m_cancelled
+        || (m_stopInfo.stopSignal != NULL && m_stopInfo.stopSignal->CheckSignal(m_stopInfo.stopReasons));
+}
+
+
+//==== TaskHandle =============================================================
+
+bool TaskHandle::IsDone() const
+{
+    return !m_state || m_state->runState == TASK_DONE;
+}
+
+bool TaskHandle::Wait(DWORD timeoutMilliseconds/*=INFINITE*/) const
+{
+    if (!m_state)
+    {
+        return true;
+    }
+
+    // A queued task could be a long way from starting
+    if (m_state->token.IsCancelled() && m_state->TransitionFromQueued(TASK_DONE))
+    {
+        m_state->SetDone();
+        return true;
+    }
+
+    unique_lock<mutex> lock(m_state->doneMutex);
+    auto isDone = [this] { return m_state->runState == TASK_DONE; };
+
+    if (timeoutMilliseconds == INFINITE)
+    {
+        m_state->done.wait(lock, isDone);
+        return true;
+    }
+
+    return m_state->done.wait_for(lock, chrono::milliseconds(timeoutMilliseconds), isDone);
+}
+
+void TaskHandle::Cancel() const
+{
+    if (!m_state)
+    {
+        return;
+    }
+
+    m_state->token.m_cancelled = true;
+
+    if (m_state->TransitionFromQueued(TASK_DONE))
+    {
+        m_state->SetDone();
+    }
+}
+
+
+//==== TaskExecutor ===========================================================
+
+TaskExecutor& TaskExecutor::Instance()
+{
+    // Never destroyed: tasks may still be running when the process exits,
+    // and worker threads can't be joined safely during static destruction.
+    static TaskExecutor* instance = new TaskExecutor();
+    return *instance;
+}
+
+TaskExecutor::TaskExecutor(size_t workerCount/*=0*/)
+    : m_nextWorker(0), m_backgroundRunning(0), m_stolen(0), m_sleeping(0), m_quit(false)
+{
+    if (workerCount == 0)
+    {
+        workerCount = min(max((size_t)thread::hardware_concurrency(), MIN_WORKERS), MAX_WORKERS);
+    }
+
+    // Keep a worker free for UI tasks, unless there's only one
+    m_maxBackgroundRunning = max(workerCount - 1, (size_t)1);
+
+    for (size_t p = 0; p < TASK_PRIORITY_COUNT; p++)
+    {
+        m_counters[p].queued = 0;
+        m_counters[p].submitted = 0;
+        m_counters[p].completed = 0;
+        m_counters[p].cancelled = 0;
+        m_counters[p].totalLatencyMicroseconds = 0;
+        m_counters[p].maxLatencyMicroseconds = 0;
+    }
+
+    // All workers must exist before any of them starts stealing
+    for (size_t i = 0; i < workerCount; i++)
+    {
+        m_workers.push_back(unique_ptr<Worker>(new Worker()));
+    }
+    for (size_t i = 0; i < workerCount; i++)
+    {
+        m_workers[i]->workerThread = thread(&TaskExecutor::WorkerThread, this, i);
+    }
+}
+
+TaskExecutor::~TaskExecutor()
+{
+    {
+        lock_guard<mutex> lock(m_idleMutex);
+        m_quit = true;
+    }
+    m_workAvailable.notify_all();
+
+    for (auto& worker : m_workers)
+    {
+        if (worker->workerThread.joinable())
+        {
+            worker->workerThread.join();
+        }
+    }
+
+    // Release anyone waiting on a task that will now never run
+    for (auto& worker : m_workers)
+    {
+        for (auto& queue : worker->queues)
+        {
+            for (auto& state : queue)
+            {
+                if (state->TransitionFromQueued(TASK_DONE))
+                {
+                    state->SetDone();
+                }
+            }
+        }
+    }
+}
+
+TaskHandle TaskExecutor::Submit(TaskPriority priority, const Task& task, const StopInfo& stopInfo/*=StopInfo()*/)
+{
+    shared_ptr<TaskState> state = make_shared<TaskState>(task, stopInfo);
+
+    // Keep work submitted by a task on the same worker, where it's likely
+    // to run soonest; otherwise spread it around.
+    size_t workerIndex = (t_executor == this)
+                            ? t_workerIndex
+                            : m_nextWorker++ % m_workers.size();
+
+    // Counted before it's queued, so that the count never goes negative
+    m_counters[priority].submitted++;
+    m_counters[priority].queued++;
+
+    {
+        Worker& worker = *m_workers[workerIndex];
+        lock_guard<mutex> lock(worker.queuesMutex);
+        worker.queues[priority].push_back(state);
+    }
+
+    WakeWorker();
+
+    return TaskHandle(state);
+}
+
+void TaskExecutor::WakeWorker()
+{
+    // A worker that's going to sleep increments m_sleeping before checking
+    // for work under m_idleMutex, and the work was queued before this check,
+    // so either it sees the work or we see it sleeping. Taking the mutex
+    // makes sure it's actually waiting before it's notified.
+    if (m_sleeping > 0)
+    {
+        {
+            lock_guard<mutex> lock(m_idleMutex);
+        }
+        m_workAvailable.notify_one();
+    }
+}
+
+bool TaskExecutor::HasRunnableTask() const
+{
+    return m_counters[TASK_PRIORITY_UI].queued > 0
+        || (m_counters[TASK_PRIORITY_BACKGROUND].queued > 0
+            && m_backgroundRunning < m_maxBackgroundRunning);
+}
+
+shared_ptr<TaskState> TaskExecutor::TakeTask(size_t workerIndex, TaskPriority& o_priority)
+{
+    for (int p = 0; p < TASK_PRIORITY_COUNT; p++)
+    {
+        o_priority = (TaskPriority)p;
+
+        if (m_counters[p].queued == 0)
+        {
+            continue;
+        }
+
+        if (o_priority == TASK_PRIORITY_BACKGROUND)
+        {
+            // Claim a background slot before taking the task
+            size_t running = m_backgroundRunning;
+            do
+            {
+                if (running >= m_maxBackgroundRunning)
+                {
+                    return nullptr;
+                }
+            } while (!m_backgroundRunning.compare_exchange_weak(running, running + 1));
+        }
+
+        // Our own queue first, oldest first; then steal the newest from the
+        // others
+        for (size_t i = 0; i < m_workers.size(); i++)
+        {
+            Worker& worker = *m_workers[(workerIndex + i) % m_workers.size()];
+            lock_guard<mutex> lock(worker.queuesMutex);
+            auto& queue = worker.queues[p];
+            if (queue.empty())
+            {
+                continue;
+            }
+
+            shared_ptr<TaskState> state;
+            if (i == 0)
+            {
+                state = queue.front();
+                queue.pop_front();
+            }
+            else
+            {
+                state = queue.back();
+                queue.pop_back();
+                m_stolen++;
+            }
+            m_counters[p].queued--;
+            return state;
+        }
+
+        if (o_priority == TASK_PRIORITY_BACKGROUND)
+        {
+            m_backgroundRunning--;
+        }
+    }
+
+    return nullptr;
+}
+
+void TaskExecutor::RunTask(const shared_ptr<TaskState>& state, TaskPriority priority)
+{
+    PriorityCounters& counters = m_counters[priority];
+
+    if (state->token.IsCancelled() || !state->TransitionFromQueued(TASK_RUNNING))
+    {
+        // Cancelled while queued. It may already have been marked done.
+        counters.cancelled++;
+        state->SetDone();
+        return;
+    }
+
+    unsigned long long latency = chrono::duration_cast<chrono::microseconds>(TaskClock::now() - state->submitTime).count();
+    counters.totalLatencyMicroseconds += latency;
+    unsigned long long maxLatency = counters.maxLatencyMicroseconds;
+    while (latency > maxLatency
+           && !counters.maxLatencyMicroseconds.compare_exchange_weak(maxLatency, latency))
+    {
+    }
+
+    try
+    {
+        state->task(state->token);
+    }
+    catch (...)
+    {
+        // A task that can be stopped is expected to catch its own
+        // StopException; nothing else should get here. Either way, the
+        // worker must survive it.
+    }
+
+    counters.completed++;
+
+    // Release the task's captures now, rather than whenever the last
+    // TaskHandle goes away.
+    state->task = nullptr;
+    state->SetDone();
+}
+
+void TaskExecutor::WorkerThread(size_t workerIndex)
+{
+    t_executor = this;
+    t_workerIndex = workerIndex;
+
+    while (true)
+    {
+        TaskPriority priority;
+        shared_ptr<TaskState> state = TakeTask(workerIndex, priority);
+
+        if (state)
+        {
+            RunTask(state, priority);
+
+            if (priority == TASK_PRIORITY_BACKGROUND)
+            {
+                m_backgroundRunning--;
+                // A background task may have been waiting for the slot
+                if (m_counters[TASK_PRIORITY_BACKGROUND].queued > 0)
+                {
+                    WakeWorker();
+                }
+            }
+            continue;
+        }
+
+        unique_lock<mutex> lock(m_idleMutex);
+        m_sleeping++;
+        m_workAvailable.wait(lock, [this] { return m_quit || HasRunnableTask(); });
+        m_sleeping--;
+
+        if (m_quit)
+        {
+            return;
+        }
+    }
+}
+
+TaskExecutorMetrics TaskExecutor::GetMetrics() const
+{
+    TaskExecutorMetrics metrics;
+    metrics.workers = m_workers.size();
+    metrics.stolen = m_stolen;
+
+    for (size_t p = 0; p < TASK_PRIORITY_COUNT; p++)
+    {
+        const PriorityCounters& counters = m_counters[p];
+        TaskExecutorMetrics::Priority& priority = metrics.priorities[p];
+
+        priority.queueDepth = counters.queued;
+        priority.submitted = counters.submitted;
+        priority.completed = counters.completed;
+        priority.cancelled = counters.cancelled;
+
+        unsigned long long started = priority.completed;
+        priority.meanLatencyMilliseconds = started > 0
+            ? (double)counters.totalLatencyMicroseconds / started / 1000.0
+            : 0.0;
+        priority.maxLatencyMilliseconds = (double)counters.maxLatencyMicroseconds / 1000.0;
+    }
+
+    return metrics;
+}
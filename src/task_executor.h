@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "stopsignal.h"
+
+using namespace std;
+
+
+// Tasks of a higher priority (lower value) are always started before tasks
+// of a lower priority, pool-wide.
+//
+// There's no priority for work on the path to connecting: the connection
+// runs on ConnectionManager's own thread for its whole life, and nothing it
+// does is submitted here. A level that nothing uses would only take a share
+// of the worker that's kept free for UI tasks.
+enum TaskPriority
+{
+    // Work that the user is waiting on, such as a request made from the UI
+    TASK_PRIORITY_UI = 0,
+    // Everything else: upgrades, feedback, server list maintenance
+    TASK_PRIORITY_BACKGROUND,
+
+    TASK_PRIORITY_COUNT
+};
+
+
+/**
+Passed to each task to tell it whether it should give up. A task is
+cancelled when TaskHandle::Cancel is called, or when any of the reasons in
+the StopInfo it was submitted with is signalled.
+*/
+class CancellationToken
+{
+public:
+    CancellationToken(const StopInfo& stopInfo);
+
+    bool IsCancelled() const;
+
+    // For passing on to functions that take a StopInfo. Note that this
+    // doesn't reflect TaskHandle::Cancel.
+    const StopInfo& GetStopInfo() const { return m_stopInfo; }
+
+private:
+    friend class TaskExecutor;
+    friend class TaskHandle;
+
+    StopInfo m_stopInfo;
+    atomic<bool> m_cancelled;
+};
+
+
+struct TaskState;
+
+/**
+Refers to a submitted task. Takes the place of a thread handle: a
+default-constructed TaskHandle refers to no task, and is considered done.
+*/
+class TaskHandle
+{
+public:
+    TaskHandle() {}
+
+    // Whether this refers to a task at all
+    bool IsValid() const { return (bool)m_state; }
+
+    // True once the task has finished running, or won't run at all
+    bool IsDone() const;
+
+    // Blocks until the task is done, or `timeoutMilliseconds` has elapsed
+    // (which may be INFINITE). Returns IsDone(). A task that hasn't started
+    // yet is given up on, rather than waited for, once it's cancelled.
+    bool Wait(DWORD timeoutMilliseconds = INFINITE) const;
+
+    // Cancels the task's token. If the task hasn't started, it never will.
+    void Cancel() const;
+
+    void Reset() { m_state.reset(); }
+
+private:
+    friend class TaskExecutor;
+    TaskHandle(const shared_ptr<TaskState>& state) : m_state(state) {}
+
+    shared_ptr<TaskState> m_state;
+};
+
+
+struct TaskExecutorMetrics
+{
+    size_t workers;
+    // Tasks stolen by a worker from another worker's queue
+    unsigned long long stolen;
+
+    struct Priority
+    {
+        // Tasks waiting to start
+        size_t queueDepth;
+        unsigned long long submitted;
+        unsigned long long completed;
+        // Cancelled before they started
+        unsigned long long cancelled;
+        // Time from Submit until the task started running
+        double meanLatencyMilliseconds;
+        double maxLatencyMilliseconds;
+    } priorities[TASK_PRIORITY_COUNT];
+};
+
+
+/**
+A pool of worker threads that runs short and long-lived background work,
+in place of a thread per job.
+
+Each worker has its own queue for each priority. Tasks submitted from a
+worker go on that worker's queue; tasks submitted from any other thread are
+spread across the workers' queues. A worker runs the oldest task on its own
+queue, and when that's empty steals the newest from another worker's.
+
+Much of the work here blocks on the network for a long time. So that such
+work can't hold up a request the user is waiting on, background tasks are
+never given the last free worker.
+
+Tasks must not wait on a task that was submitted after them.
+*/
+class TaskExecutor
+{
+public:
+    typedef function<void(const CancellationToken& token)> Task;
+
+    // The process-wide executor
+    static TaskExecutor& Instance();
+
+    // A workerCount of 0 picks a count based on the number of processors
+    TaskExecutor(size_t workerCount = 0);
+    // Waits for running tasks to finish; tasks that haven't started never will
+    ~TaskExecutor();
+
+    /**
+    Queues `task` to be run. It's cancelled if any of stopInfo's reasons is
+    signalled. Exceptions that escape the task are swallowed.
+    */
+    TaskHandle Submit(TaskPriority priority, const Task& task, const StopInfo& stopInfo = StopInfo());
+
+    TaskExecutorMetrics GetMetrics() const;
+
+private:
+    // not copyable
+    TaskExecutor(TaskExecutor const&);
+    TaskExecutor& operator=(TaskExecutor const&);
+
+    struct Worker
+    {
+        mutex queuesMutex;
+        deque<shared_ptr<TaskState>> queues[TASK_PRIORITY_COUNT];
+        thread workerThread;
+    };
+
+    struct PriorityCounters
+    {
+        atomic<size_t> queued;
+        atomic<unsigned long long> submitted;
+        atomic<unsigned long long> completed;
+        atomic<unsigned long long> cancelled;
+        atomic<unsigned long long> totalLatencyMicroseconds;
+        atomic<unsigned long long> maxLatencyMicroseconds;
+    };
+
+    void WorkerThread(size_t workerIndex);
+    shared_ptr<TaskState> TakeTask(size_t workerIndex, TaskPriority& o_priority);
+    bool HasRunnableTask() const;
+    void WakeWorker();
+    void RunTask(const shared_ptr<TaskState>& state, TaskPriority priority);
+
+    vector<unique_ptr<Worker>> m_workers;
+    atomic<size_t> m_nextWorker;
+    size_t m_maxBackgroundRunning;
+    atomic<size_t> m_backgroundRunning;
+
+    PriorityCounters m_counters[TASK_PRIORITY_COUNT];
+    atomic<unsigned long long> m_stolen;
+
+    // Idle workers sleep on m_workAvailable. See WakeWorker.
+    mutex m_idleMutex;
+    condition_variable m_workAvailable;
+    atomic<size_t> m_sleeping;
+    atomic<bool> m_quit;
+};
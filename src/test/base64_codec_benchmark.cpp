@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures base64 encoding and decoding throughput, for inputs from a key's
+size to a megabyte:
+- simple: a codec that goes a character at a time, appending to a string.
+  CryptoAPI, which Base64Encode and Base64Decode used, is only on Windows,
+  so this stands in for it.
+- scalar, avx2: Base64EncodeInto and Base64Decoder limited to each
+  instruction set the CPU supports.
+
+Decoding is also measured for the same input wrapped into 64-character
+lines, as PEM is.
+
+    base64_codec_benchmark [total megabytes per measurement]
+*/
+
+#include "stdafx.h"
+#include "base64_codec.h"
+#include "cpu_features.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const size_t LENGTHS[] = { 48, 1024, 64 * 1024, 1024 * 1024 };
+
+const pair<SimdInstructionSet, const char*> INSTRUCTION_SETS[] = {
+    { SIMD_NONE, "scalar" }, { SIMD_AVX2, "avx2" } };
+
+const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+string SimpleEncode(const unsigned char* input, size_t length)
+{
+    string output;
+    for (size_t i = 0; i < length; i += 3)
+    {
+        uint32_t group = (uint32_t)input[i] << 16;
+        if (i + 1 < length) group |= (uint32_t)input[i + 1] << 8;
+        if (i + 2 < length) group |= input[i + 2];
+
+        output += ALPHABET[(group >> 18) & 63];
+        output += ALPHABET[(group >> 12) & 63];
+        output += (i + 1 < length) ? ALPHABET[(group >> 6) & 63] : '=';
+        output += (i + 2 < length) ? ALPHABET[group & 63] : '=';
+    }
+    return output;
+}
+
+string SimpleDecode(const string& input)
+{
+    string output;
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : input)
+    {
+        if (c == '=' || c == '\n' || c == '\r')
+        {
+            continue;
+        }
+        const char* position = strchr(ALPHABET, c);
+        if (!position || !c)
+        {
+            abort();
+        }
+        bits = (bits << 6) | (uint32_t)(position - ALPHABET);
+        if (++count == 4)
+        {
+            output += (char)(bits >> 16);
+            output += (char)(bits >> 8);
+            output += (char)bits;
+            bits = 0;
+            count = 0;
+        }
+    }
+    if (count == 3)
+    {
+        output += (char)(bits >> 10);
+        output += (char)(bits >> 2);
+    }
+    else if (count == 2)
+    {
+        output += (char)(bits >> 4);
+    }
+    return output;
+}
+
+string Wrap(const string& encoded)
+{
+    string wrapped;
+    for (size_t i = 0; i < encoded.length(); i += 64)
+    {
+        wrapped += encoded.substr(i, 64) + "\n";
+    }
+    return wrapped;
+}
+
+void Decode(const string& encoded, string& decoded)
+{
+    Base64Decoder decoder;
+    decoded.clear();
+    if (!decoder.Update(encoded.data(), encoded.length(), decoded) || !decoder.Final(decoded))
+    {
+        abort();
+    }
+}
+
+// Returns the throughput, in MB/s of bytes encoded or decoded, of enough calls
+// to get through totalBytes
+double Throughput(size_t length, size_t totalBytes, const function<void()>& operation)
+{
+    operation();
+
+    size_t calls = max<size_t>(1, totalBytes / length);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < calls; i++)
+    {
+        operation();
+    }
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+    return (double)calls * length / seconds / (1024 * 1024);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    size_t totalBytes = (size_t)((argc > 1) ? atoi(argv[1]) : 256) * 1024 * 1024;
+    SimdInstructionSet supported = GetSimdInstructionSet();
+
+    mt19937 rng(1);
+    for (size_t length : LENGTHS)
+    {
+        vector<unsigned char> bytes(length);
+        for (unsigned char& byte : bytes)
+        {
+            byte = (unsigned char)rng();
+        }
+        string encoded = SimpleEncode(bytes.data(), length);
+        string wrapped = Wrap(encoded);
+        string output(Base64EncodedLength(length), '\0');
+        string decoded;
+        decoded.reserve(length);
+
+        printf("%zu bytes\n", length);
+        printf("  %-8s encode %8.0f MB/s  decode %8.0f MB/s  decode wrapped %8.0f MB/s\n", "simple",
+               Throughput(length, totalBytes, [&]() { output = SimpleEncode(bytes.data(), length); }),
+               Throughput(length, totalBytes, [&]() { decoded = SimpleDecode(encoded); }),
+               Throughput(length, totalBytes, [&]() { decoded = SimpleDecode(wrapped); }));
+
+        for (const auto& instructionSet : INSTRUCTION_SETS)
+        {
+            if (instructionSet.first > supported)
+            {
+                continue;
+            }
+            LimitSimdInstructionSet(instructionSet.first);
+            printf("  %-8s encode %8.0f MB/s  decode %8.0f MB/s  decode wrapped %8.0f MB/s\n", instructionSet.second,
+                   Throughput(length, totalBytes, [&]() { Base64EncodeInto(bytes.data(), length, &output[0]); }),
+                   Throughput(length, totalBytes, [&]() { Decode(encoded, decoded); }),
+                   Throughput(length, totalBytes, [&]() { Decode(wrapped, decoded); }));
+        }
+        LimitSimdInstructionSet(supported);
+    }
+
+    return 0;
+}
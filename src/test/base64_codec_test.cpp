@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "base64_codec.h"
+#include "cpu_features.h"
+#include <gtest/gtest.h>
+#include <random>
+
+
+namespace {
+
+// Long enough to go through the AVX2 loops several times, with every
+// possible leftover for the scalar code to finish
+const size_t MAX_LENGTH = 300;
+
+string RandomBytes(mt19937& rng, size_t length)
+{
+    string bytes(length, '\0');
+    for (char& c : bytes)
+    {
+        c = (char)(rng() & 0xFF);
+    }
+    return bytes;
+}
+
+string Encode(const string& bytes)
+{
+    string encoded(Base64EncodedLength(bytes.length()), '\0');
+    Base64EncodeInto((const unsigned char*)bytes.data(), bytes.length(), &encoded[0]);
+    return encoded;
+}
+
+// Decodes `encoded` in chunks ending at each of `splits`, then the rest.
+// Returns false if Update or Final does.
+bool Decode(const string& encoded, string& o_decoded, const vector<size_t>& splits = vector<size_t>())
+{
+    Base64Decoder decoder;
+    o_decoded.clear();
+    size_t start = 0;
+    for (size_t split : splits)
+    {
+        if (!decoder.Update(encoded.data() + start, split - start, o_decoded))
+        {
+            return false;
+        }
+        start = split;
+    }
+    return decoder.Update(encoded.data() + start, encoded.length() - start, o_decoded) &&
+           decoder.Final(o_decoded);
+}
+
+// Runs each test once with each implementation: the dispatch is limited to
+// the parameter, and the test skipped if the CPU doesn't have it. (Base64
+// has no SSE2 implementation.)
+class Base64CodecTest : public testing::TestWithParam<SimdInstructionSet>
+{
+protected:
+    void SetUp() override
+    {
+        LimitSimdInstructionSet(GetParam());
+        if (GetSimdInstructionSet() != GetParam())
+        {
+            GTEST_SKIP() << "Not supported by this CPU";
+        }
+    }
+
+    void TearDown() override
+    {
+        LimitSimdInstructionSet(SIMD_AVX2);
+    }
+};
+
+}  // namespace
+
+
+TEST_P(Base64CodecTest, KnownEncodings)
+{
+    // From RFC 4648
+    const char* const vectors[][2] = {
+        { "", "" },
+        { "f", "Zg==" },
+        { "fo", "Zm8=" },
+        { "foo", "Zm9v" },
+        { "foob", "Zm9vYg==" },
+        { "fooba", "Zm9vYmE=" },
+        { "foobar", "Zm9vYmFy" },
+    };
+
+    for (const auto& vector : vectors)
+    {
+        EXPECT_EQ(vector[1], Encode(vector[0]));
+
+        string decoded;
+        ASSERT_TRUE(Decode(vector[1], decoded)) << vector[1];
+        EXPECT_EQ(vector[0], decoded);
+    }
+}
+
+TEST_P(Base64CodecTest, RoundTrip)
+{
+    mt19937 rng(1);
+    for (size_t length = 0; length <= MAX_LENGTH; length++)
+    {
+        string bytes = RandomBytes(rng, length);
+        string encoded = Encode(bytes);
+        ASSERT_EQ(Base64EncodedLength(length), encoded.length());
+
+        string decoded;
+        ASSERT_TRUE(Decode(encoded, decoded)) << length;
+        ASSERT_EQ(bytes, decoded) << length;
+    }
+}
+
+TEST_P(Base64CodecTest, ChunksMaySplitTheInputAnywhere)
+{
+    mt19937 rng(2);
+    string bytes = RandomBytes(rng, MAX_LENGTH + 1);
+    string encoded = Encode(bytes);
+
+    // Every two-chunk split
+    for (size_t split = 0; split <= encoded.length(); split++)
+    {
+        string decoded;
+        ASSERT_TRUE(Decode(encoded, decoded, { split })) << split;
+        ASSERT_EQ(bytes, decoded) << split;
+    }
+
+    // One character at a time
+    vector<size_t> everyCharacter;
+    for (size_t i = 1; i < encoded.length(); i++)
+    {
+        everyCharacter.push_back(i);
+    }
+    string decoded;
+    ASSERT_TRUE(Decode(encoded, decoded, everyCharacter));
+    EXPECT_EQ(bytes, decoded);
+
+    // Random chunks
+    for (int trial = 0; trial < 100; trial++)
+    {
+        vector<size_t> splits;
+        for (size_t i = rng() % 40; i < encoded.length(); i += rng() % 40)
+        {
+            splits.push_back(i);
+        }
+        ASSERT_TRUE(Decode(encoded, decoded, splits)) << trial;
+        ASSERT_EQ(bytes, decoded) << trial;
+    }
+}
+
+TEST_P(Base64CodecTest, EncoderChunksMaySplitTheInputAnywhere)
+{
+    mt19937 rng(5);
+    for (size_t length = 0; length <= MAX_LENGTH; length += 7)
+    {
+        string bytes = RandomBytes(rng, length);
+        const unsigned char* input = (const unsigned char*)bytes.data();
+
+        // Every two-chunk split
+        for (size_t split = 0; split <= length; split++)
+        {
+            Base64Encoder encoder;
+            string encoded;
+            encoder.Update(input, split, encoded);
+            encoder.Update(input + split, length - split, encoded);
+            encoder.Final(encoded);
+            ASSERT_EQ(Encode(bytes), encoded) << length << " " << split;
+        }
+
+        // Random chunks, including empty ones
+        Base64Encoder encoder;
+        string encoded;
+        for (size_t i = 0; i < length; )
+        {
+            size_t chunk = min<size_t>(rng() % 8, length - i);
+            encoder.Update(input + i, chunk, encoded);
+            i += chunk;
+        }
+        encoder.Final(encoded);
+        ASSERT_EQ(Encode(bytes), encoded) << length;
+    }
+}
+
+TEST_P(Base64CodecTest, WhitespaceAndMissingPaddingAreAccepted)
+{
+    mt19937 rng(3);
+    for (size_t length = 0; length <= MAX_LENGTH; length++)
+    {
+        string bytes = RandomBytes(rng, length);
+        string encoded = Encode(bytes);
+
+        // Line-wrapped, as PEM is, so the whitespace lands in various places
+        // relative to the groups
+        string wrapped;
+        for (size_t i = 0; i < encoded.length(); i += 64)
+        {
+            wrapped += encoded.substr(i, 64) + "\r\n";
+        }
+
+        string decoded;
+        ASSERT_TRUE(Decode(wrapped, decoded)) << length;
+        ASSERT_EQ(bytes, decoded) << length;
+
+        string unpadded = encoded.substr(0, encoded.find('='));
+        ASSERT_TRUE(Decode(unpadded, decoded)) << length;
+        ASSERT_EQ(bytes, decoded) << length;
+    }
+}
+
+TEST_P(Base64CodecTest, InvalidCharacterIsRejectedAnywhere)
+{
+    const char invalid[] = { '\0', '-', '_', '.', '*', '\x7F', (char)0x80, (char)0xFF };
+
+    mt19937 rng(4);
+    string encoded = Encode(RandomBytes(rng, MAX_LENGTH / 2));
+    for (size_t position = 0; position < encoded.length(); position++)
+    {
+        for (char c : invalid)
+        {
+            string corrupt = encoded;
+            corrupt[position] = c;
+            string decoded;
+            ASSERT_FALSE(Decode(corrupt, decoded)) << position << " " << (int)(unsigned char)c;
+        }
+    }
+}
+
+TEST_P(Base64CodecTest, MisplacedPaddingAndPartialBytesAreRejected)
+{
+    const char* const invalid[] = {
+        "A",            // Not even one byte
+        "AAAAA",
+        "A===",
+        "=AAA",
+        "AA=A",
+        "AAAA=",        // Padding after a whole group
+        "AA==AAAA",     // Data after padding
+        "AA===",
+        "AA=",          // Incomplete padding
+    };
+
+    for (const char* input : invalid)
+    {
+        string decoded;
+        EXPECT_FALSE(Decode(input, decoded)) << input;
+    }
+}
+
+TEST_P(Base64CodecTest, DecoderStaysFailed)
+{
+    Base64Decoder decoder;
+    string decoded;
+    EXPECT_FALSE(decoder.Update("Zm9v*", 5, decoded));
+    EXPECT_FALSE(decoder.Update("Zm9v", 4, decoded));
+    EXPECT_FALSE(decoder.Final(decoded));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AllImplementations,
+    Base64CodecTest,
+    testing::Values(SIMD_NONE, SIMD_AVX2),
+    [](const testing::TestParamInfo<SimdInstructionSet>& info) {
+        return info.param == SIMD_AVX2 ? "AVX2" : "Scalar";
+    });
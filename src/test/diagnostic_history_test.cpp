@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "diagnostic_history.h"
+#include <gtest/gtest.h>
+#include <random>
+
+
+namespace {
+
+// As DiagnosticHistory::Record, which GetMemoryUsage counts for each record
+const size_t RECORD_HEADER_SIZE = sizeof(uint64_t) + 2 * sizeof(size_t);
+
+// The size of the arenas' buffers
+size_t BufferBytes(const DiagnosticHistoryMemoryUsage& usage)
+{
+    return usage.allocatedBytes - usage.records * RECORD_HEADER_SIZE;
+}
+
+string Record(uint64_t sequence, size_t length)
+{
+    string record = to_string(sequence) + ":";
+    record.resize(max(length, record.length()), (char)('a' + sequence % 26));
+    return record;
+}
+
+void Add(DiagnosticHistory& history, const string& category, const string& record)
+{
+    ASSERT_TRUE(history.Add(category, record.data(), record.length()));
+}
+
+vector<string> AllRecords(const DiagnosticHistory& history)
+{
+    uint64_t sequence = 0;
+    vector<string> records;
+    history.GetRecords(sequence, history.NextSequence(), SIZE_MAX, records);
+    return records;
+}
+
+}  // namespace
+
+
+TEST(DiagnosticHistoryTest, BufferGrowsAsNeededUpToTheQuota)
+{
+    const size_t QUOTA = 1024 * 1024;
+    DiagnosticHistory history(QUOTA);
+
+    EXPECT_EQ(0u, BufferBytes(history.GetMemoryUsage()));
+
+    // A few small records don't commit the quota
+    for (int i = 0; i < 10; i++)
+    {
+        Add(history, "quiet", Record(i, 100));
+    }
+    DiagnosticHistoryMemoryUsage usage = history.GetMemoryUsage();
+    EXPECT_EQ(10u, usage.records);
+    EXPECT_LT(BufferBytes(usage), QUOTA / 16);
+
+    // As records are added, the buffer at most doubles each time it grows,
+    // and never holds more than twice what's stored, until it reaches the
+    // quota. Nothing is evicted before then.
+    size_t allocated = BufferBytes(usage);
+    uint64_t sequence = 10;
+    while (allocated < QUOTA)
+    {
+        Add(history, "quiet", Record(sequence++, 1000));
+        usage = history.GetMemoryUsage();
+        EXPECT_LE(BufferBytes(usage), max(allocated * 2, usage.recordBytes));
+        EXPECT_LE(BufferBytes(usage), QUOTA);
+        EXPECT_LE(BufferBytes(usage), max(usage.recordBytes * 2, (size_t)4096));
+        EXPECT_EQ(0u, usage.evictedRecords);
+        allocated = BufferBytes(usage);
+    }
+
+    // From here on, records are evicted instead
+    for (int i = 0; i < 2000; i++)
+    {
+        Add(history, "quiet", Record(sequence++, 1000));
+    }
+    usage = history.GetMemoryUsage();
+    EXPECT_EQ(QUOTA, BufferBytes(usage));
+    EXPECT_GT(usage.evictedRecords, 0u);
+}
+
+TEST(DiagnosticHistoryTest, RecordsSurviveGrowthInOrder)
+{
+    // Records of random sizes in two categories, the small one wrapping
+    // around its buffer many times while the large one is still growing
+    const size_t SMALL_QUOTA = 8 * 1024;
+    const size_t LARGE_QUOTA = 256 * 1024;
+    DiagnosticHistory history(LARGE_QUOTA);
+    history.SetQuota("small", SMALL_QUOTA);
+
+    mt19937 rng(1);
+    map<string, vector<string>> added;
+    map<uint64_t, string> categories;
+
+    for (uint64_t sequence = 0; sequence < 5000; sequence++)
+    {
+        string category = (rng() % 3 == 0) ? "small" : "large";
+        string record = Record(sequence, 1 + rng() % 700);
+        Add(history, category, record);
+        added[category].push_back(record);
+        categories[sequence] = category;
+
+        if (sequence % 100 != 0 && sequence != 4999)
+        {
+            continue;
+        }
+
+        DiagnosticHistoryMemoryUsage usage = history.GetMemoryUsage();
+        ASSERT_LE(BufferBytes(usage), SMALL_QUOTA + LARGE_QUOTA);
+
+        // What's held of each category is the newest records added to it,
+        // intact and in order
+        map<string, vector<string>> held;
+        for (const string& record : AllRecords(history))
+        {
+            held[categories[stoull(record)]].push_back(record);
+        }
+        ASSERT_EQ(added.size(), held.size());
+        for (auto& category : held)
+        {
+            const vector<string>& all = added[category.first];
+            ASSERT_LE(category.second.size(), all.size());
+            ASSERT_TRUE(equal(category.second.begin(), category.second.end(),
+                              all.end() - category.second.size()))
+                << category.first << " at " << sequence;
+        }
+    }
+
+    DiagnosticHistoryMemoryUsage usage = history.GetMemoryUsage();
+    EXPECT_EQ(SMALL_QUOTA + LARGE_QUOTA, BufferBytes(usage));
+    EXPECT_EQ(5000u, usage.records + usage.evictedRecords);
+}
+
+TEST(DiagnosticHistoryTest, QuotaIsSetBeforeFirstRecord)
+{
+    DiagnosticHistory history(1024);
+    history.SetQuota("small", 100);
+
+    string record = Record(0, 101);
+    EXPECT_FALSE(history.Add("small", record.data(), record.length()));
+    EXPECT_TRUE(history.Add("default", record.data(), record.length()));
+    EXPECT_EQ(1u, history.GetMemoryUsage().droppedRecords);
+
+    // A record as large as the quota fills the buffer exactly
+    record = Record(1, 100);
+    EXPECT_TRUE(history.Add("small", record.data(), record.length()));
+    EXPECT_EQ(1024u + 100u, BufferBytes(history.GetMemoryUsage()));
+}
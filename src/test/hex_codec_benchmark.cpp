@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures hex encoding and decoding throughput, for inputs from a digest's
+size to a megabyte:
+- old: Hexlify and Dehexlify as they were, a byte at a time, with a binary
+  search of the digits to decode.
+- scalar, sse2, avx2: HexEncode and HexDecode limited to each instruction
+  set the CPU supports.
+
+    hex_codec_benchmark [total megabytes per measurement]
+*/
+
+#include "stdafx.h"
+#include "hex_codec.h"
+#include "cpu_features.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const size_t LENGTHS[] = { 32, 1024, 64 * 1024, 1024 * 1024 };
+
+const pair<SimdInstructionSet, const char*> INSTRUCTION_SETS[] = {
+    { SIMD_NONE, "scalar" }, { SIMD_SSE2, "sse2" }, { SIMD_AVX2, "avx2" } };
+
+string OldHexlify(const unsigned char* input, size_t length)
+{
+    static const char* const lut = "0123456789ABCDEF";
+
+    string output;
+    output.reserve(2 * length);
+    for (size_t i = 0; i < length; ++i)
+    {
+        const unsigned char c = input[i];
+        output.push_back(lut[c >> 4]);
+        output.push_back(lut[c & 15]);
+    }
+    return output;
+}
+
+string OldDehexlify(const string& input)
+{
+    static const char* const lut = "0123456789ABCDEF";
+    size_t len = input.length();
+
+    string output;
+    output.reserve(len / 2);
+    for (size_t i = 0; i < len; i += 2)
+    {
+        char a = (char)toupper(input[i]);
+        const char* p = std::lower_bound(lut, lut + 16, a);
+        char b = (char)toupper(input[i + 1]);
+        const char* q = std::lower_bound(lut, lut + 16, b);
+        if (*p != a || *q != b)
+        {
+            abort();
+        }
+        output.push_back((char)(((p - lut) << 4) | (q - lut)));
+    }
+    return output;
+}
+
+// Returns the throughput, in MB/s of bytes encoded or decoded, of enough calls
+// to get through totalBytes
+double Throughput(size_t length, size_t totalBytes, const function<void()>& operation)
+{
+    operation();
+
+    size_t calls = max<size_t>(1, totalBytes / length);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < calls; i++)
+    {
+        operation();
+    }
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+    return (double)calls * length / seconds / (1024 * 1024);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    size_t totalBytes = (size_t)((argc > 1) ? atoi(argv[1]) : 256) * 1024 * 1024;
+    SimdInstructionSet supported = GetSimdInstructionSet();
+
+    mt19937 rng(1);
+    for (size_t length : LENGTHS)
+    {
+        vector<unsigned char> bytes(length);
+        for (unsigned char& byte : bytes)
+        {
+            byte = (unsigned char)rng();
+        }
+        string hex = OldHexlify(bytes.data(), length);
+        string encoded(2 * length, '\0');
+        vector<unsigned char> decoded(length);
+
+        printf("%zu bytes\n", length);
+        printf("  %-8s encode %8.0f MB/s  decode %8.0f MB/s\n", "old",
+               Throughput(length, totalBytes, [&]() { encoded = OldHexlify(bytes.data(), length); }),
+               Throughput(length, totalBytes, [&]() { OldDehexlify(hex); }));
+
+        for (const auto& instructionSet : INSTRUCTION_SETS)
+        {
+            if (instructionSet.first > supported)
+            {
+                continue;
+            }
+            LimitSimdInstructionSet(instructionSet.first);
+            printf("  %-8s encode %8.0f MB/s  decode %8.0f MB/s\n", instructionSet.second,
+                   Throughput(length, totalBytes, [&]() { HexEncode(bytes.data(), length, &encoded[0]); }),
+                   Throughput(length, totalBytes, [&]() {
+                       if (!HexDecode(hex.data(), hex.length(), decoded.data()))
+                       {
+                           abort();
+                       }
+                   }));
+        }
+        LimitSimdInstructionSet(supported);
+    }
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "hex_codec.h"
+#include "cpu_features.h"
+#include <gtest/gtest.h>
+#include <random>
+
+
+namespace {
+
+// Long enough to go through the widest SIMD loop several times, with every
+// possible leftover for the scalar code to finish
+const size_t MAX_LENGTH = 200;
+
+// The simple way, to check against
+string ReferenceHexEncode(const string& bytes)
+{
+    static const char* const digits = "0123456789ABCDEF";
+    string hex;
+    for (unsigned char c : bytes)
+    {
+        hex += digits[c >> 4];
+        hex += digits[c & 0x0F];
+    }
+    return hex;
+}
+
+string RandomBytes(mt19937& rng, size_t length)
+{
+    string bytes(length, '\0');
+    for (char& c : bytes)
+    {
+        c = (char)(rng() & 0xFF);
+    }
+    return bytes;
+}
+
+string Encode(const string& bytes)
+{
+    string hex(2 * bytes.length(), '\0');
+    HexEncode((const unsigned char*)bytes.data(), bytes.length(), &hex[0]);
+    return hex;
+}
+
+bool Decode(const string& hex, string& o_bytes)
+{
+    o_bytes.assign(hex.length() / 2, '\0');
+    return HexDecode(hex.data(), hex.length(), (unsigned char*)&o_bytes[0]);
+}
+
+// Runs each test once with each implementation: the dispatch is limited to
+// the parameter, and the test skipped if the CPU doesn't have it.
+class HexCodecTest : public testing::TestWithParam<SimdInstructionSet>
+{
+protected:
+    void SetUp() override
+    {
+        LimitSimdInstructionSet(GetParam());
+        if (GetSimdInstructionSet() != GetParam())
+        {
+            GTEST_SKIP() << "Not supported by this CPU";
+        }
+    }
+
+    void TearDown() override
+    {
+        LimitSimdInstructionSet(SIMD_AVX2);
+    }
+};
+
+}  // namespace
+
+
+TEST_P(HexCodecTest, RoundTrip)
+{
+    mt19937 rng(1);
+    for (size_t length = 0; length <= MAX_LENGTH; length++)
+    {
+        string bytes = RandomBytes(rng, length);
+        string hex = Encode(bytes);
+        ASSERT_EQ(ReferenceHexEncode(bytes), hex) << length;
+
+        string decoded;
+        ASSERT_TRUE(Decode(hex, decoded)) << length;
+        ASSERT_EQ(bytes, decoded) << length;
+    }
+}
+
+TEST_P(HexCodecTest, EveryByteValue)
+{
+    string bytes;
+    for (int i = 0; i < 256; i++)
+    {
+        bytes += (char)i;
+    }
+    EXPECT_EQ(ReferenceHexEncode(bytes), Encode(bytes));
+
+    string decoded;
+    ASSERT_TRUE(Decode(ReferenceHexEncode(bytes), decoded));
+    EXPECT_EQ(bytes, decoded);
+}
+
+TEST_P(HexCodecTest, LowercaseDecodes)
+{
+    mt19937 rng(2);
+    for (size_t length = 0; length <= MAX_LENGTH; length++)
+    {
+        string bytes = RandomBytes(rng, length);
+        string hex = ReferenceHexEncode(bytes);
+        for (char& c : hex)
+        {
+            c = (char)tolower(c);
+        }
+
+        string decoded;
+        ASSERT_TRUE(Decode(hex, decoded)) << length;
+        ASSERT_EQ(bytes, decoded) << length;
+    }
+}
+
+TEST_P(HexCodecTest, OddLengthIsRejected)
+{
+    string decoded;
+    EXPECT_FALSE(Decode("A", decoded));
+    EXPECT_FALSE(Decode(string(2 * MAX_LENGTH + 1, 'A'), decoded));
+}
+
+TEST_P(HexCodecTest, InvalidDigitIsRejectedAnywhere)
+{
+    // The characters either side of each range of digits, and some that
+    // only differ from a digit in the high bit or in case-folding
+    const char invalid[] = { '\0', '/', ':', '@', 'G', '`', 'g', ' ', 'x',
+                             (char)0x80, (char)0xB0, (char)0xC1, (char)0xFF };
+
+    mt19937 rng(3);
+    string hex = ReferenceHexEncode(RandomBytes(rng, MAX_LENGTH / 2));
+    for (size_t position = 0; position < hex.length(); position++)
+    {
+        for (char c : invalid)
+        {
+            string corrupt = hex;
+            corrupt[position] = c;
+            string decoded;
+            ASSERT_FALSE(Decode(corrupt, decoded)) << position << " " << (int)(unsigned char)c;
+        }
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AllImplementations,
+    HexCodecTest,
+    testing::Values(SIMD_NONE, SIMD_SSE2, SIMD_AVX2),
+    [](const testing::TestParamInfo<SimdInstructionSet>& info) {
+        return info.param == SIMD_AVX2 ? "AVX2" : info.param == SIMD_SSE2 ? "SSE2" : "Scalar";
+    });
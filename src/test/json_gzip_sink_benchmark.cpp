@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures writing a feedback upload's content -- a diagnostic history of
+about 17,500 core notices, nearly the 4MB CoreNotice quota -- through a
+JSONStreamWriter:
+- plain: the content written as it is, as it's uploaded by default.
+- gzip: the content written through WriteGzipBase64String, as it's uploaded
+  with COMPRESS_FEEDBACK.
+
+Prints the size of the upload and the time to write it. The output goes to a
+sink that only counts it.
+
+    json_gzip_sink_benchmark [notices] [iterations]
+*/
+
+#include "stdafx.h"
+#include "json_gzip_sink.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+class CountingSink : public IJSONStreamSink
+{
+public:
+    CountingSink() : written(0) {}
+
+    bool Write(const char*, size_t length)
+    {
+        written += length;
+        return true;
+    }
+
+    size_t written;
+};
+
+// Diagnostic history entries, as the core's notices are stored: about 200
+// bytes each, mostly a few notice types with varying values.
+vector<string> Notices(int count)
+{
+    mt19937 rng(1);
+    vector<string> notices;
+    for (int i = 0; i < count; i++)
+    {
+        char timestamp[32];
+        snprintf(timestamp, sizeof(timestamp), "2026-10-16T%02d:%02d:%02d.%03dZ",
+                 i / 2400 % 24, i / 40 % 60, i % 60, (int)(rng() % 1000));
+
+        string data;
+        switch (rng() % 4)
+        {
+        case 0:
+            data = "{\"noticeType\":\"BytesTransferred\",\"data\":{\"diagnosticID\":\"" + to_string(rng() % 100000) +
+                   "\",\"sent\":" + to_string(rng() % 100000) + ",\"received\":" + to_string(rng() % 1000000) + "}";
+            break;
+        case 1:
+            data = "{\"noticeType\":\"ConnectingServer\",\"data\":{\"diagnosticID\":\"" + to_string(rng() % 100000) +
+                   "\",\"region\":\"CA\",\"protocol\":\"OSSH\",\"candidateNumber\":" + to_string(rng() % 100) + "}";
+            break;
+        case 2:
+            data = "{\"noticeType\":\"Info\",\"data\":{\"message\":\"established tunnel to " + to_string(rng() % 256) +
+                   "." + to_string(rng() % 256) + ".x.x in " + to_string(rng() % 5000) + "ms\"}";
+            break;
+        default:
+            data = "{\"noticeType\":\"Alert\",\"data\":{\"message\":\"meek round trip failed: context deadline exceeded " +
+                   to_string(rng()) + "\"}";
+            break;
+        }
+        data += string(",\"showUser\":false,\"timestamp\":\"") + timestamp + "\"}";
+
+        notices.push_back(string("{\"msg\":\"CoreNotice\",\"timestamp!!timestamp\":\"") + timestamp + "\",\"data\":" + data + "}");
+    }
+    return notices;
+}
+
+void WriteContent(const vector<string>& notices, JSONStreamWriter& writer)
+{
+    writer.BeginObject();
+    writer.Key("DiagnosticInfo");
+    writer.BeginObject();
+    writer.Key("DiagnosticHistory");
+    writer.BeginArray();
+    for (const string& notice : notices)
+    {
+        writer.RawValue(notice.data(), notice.size());
+    }
+    writer.EndArray();
+    writer.EndObject();
+    writer.EndObject();
+}
+
+size_t WritePlain(const vector<string>& notices)
+{
+    CountingSink sink;
+    JSONStreamWriter writer(sink);
+    writer.BeginObject();
+    writer.Key("Body");
+    WriteContent(notices, writer);
+    writer.EndObject();
+    writer.Finish();
+    return sink.written;
+}
+
+size_t WriteGzip(const vector<string>& notices)
+{
+    CountingSink sink;
+    JSONStreamWriter writer(sink);
+    writer.BeginObject();
+    writer.Key("Body");
+    WriteGzipBase64String(writer, [&notices](JSONStreamWriter& contentWriter) {
+        WriteContent(notices, contentWriter);
+    });
+    writer.EndObject();
+    writer.Finish();
+    return sink.written;
+}
+
+void Time(const char* name, int iterations, const function<size_t()>& write)
+{
+    size_t written = write();
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        write();
+    }
+    double milliseconds = chrono::duration<double, milli>(Clock::now() - start).count() / iterations;
+    printf("  %-6s %9zu bytes  %8.2f ms\n", name, written, milliseconds);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int noticeCount = (argc > 1) ? atoi(argv[1]) : 17500;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 10;
+
+    vector<string> notices = Notices(noticeCount);
+    size_t noticeBytes = 0;
+    for (const string& notice : notices)
+    {
+        noticeBytes += notice.size();
+    }
+
+    printf("%d notices (%zu bytes), %d iterations\n", noticeCount, noticeBytes, iterations);
+    Time("plain", iterations, [&]() { return WritePlain(notices); });
+    Time("gzip", iterations, [&]() { return WriteGzip(notices); });
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "json_gzip_sink.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <zlib.h>
+
+
+namespace {
+
+class StringSink : public IJSONStreamSink
+{
+public:
+    // Fails every write that would go past `limit` bytes, and every write
+    // after that
+    StringSink(size_t limit = SIZE_MAX) : m_limit(limit), writes(0), failedAt(0) {}
+
+    bool Write(const char* data, size_t length)
+    {
+        writes++;
+        if (failedAt > 0 || output.size() + length > m_limit)
+        {
+            failedAt = failedAt > 0 ? failedAt : writes;
+            return false;
+        }
+        output.append(data, length);
+        return true;
+    }
+
+    string output;
+    int writes;
+    // The first write that failed, or 0
+    int failedAt;
+
+private:
+    size_t m_limit;
+};
+
+// Decoded independently of the encoder, so that the test doesn't depend on
+// the codec agreeing with itself
+bool DecodeBase64(const string& input, string& o_output)
+{
+    static const string ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    o_output.clear();
+    uint32_t bits = 0;
+    int count = 0;
+    size_t end = input.find_last_not_of('=') + 1;
+    if (end == 0 || input.length() % 4 != 0 || input.length() - end > 2)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < end; i++)
+    {
+        size_t value = ALPHABET.find(input[i]);
+        if (value == string::npos)
+        {
+            return false;
+        }
+        bits = (bits << 6) | (uint32_t)value;
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            o_output += (char)((bits >> count) & 0xFF);
+        }
+    }
+    return true;
+}
+
+bool Gunzip(const string& input, string& o_output)
+{
+    z_stream stream = {};
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+    {
+        return false;
+    }
+
+    o_output.clear();
+    stream.next_in = (Bytef*)input.data();
+    stream.avail_in = (uInt)input.size();
+    int result;
+    do
+    {
+        char buffer[64 * 1024];
+        stream.next_out = (Bytef*)buffer;
+        stream.avail_out = sizeof(buffer);
+        result = inflate(&stream, Z_NO_FLUSH);
+        o_output.append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (result == Z_OK);
+
+    // The whole of the input is one complete gzip member
+    bool complete = (result == Z_STREAM_END && stream.avail_in == 0);
+    inflateEnd(&stream);
+    return complete;
+}
+
+// Content shaped like a feedback upload's: mostly diagnostic history entries
+void WriteContent(JSONStreamWriter& writer, int entries)
+{
+    mt19937 rng(1);
+    const char* messages[] = { "CoreNotice", "ServerResponseCheck", "SystemProxySettings" };
+
+    writer.BeginObject();
+    writer.Key("DiagnosticInfo");
+    writer.BeginObject();
+    writer.Key("DiagnosticHistory");
+    writer.BeginArray();
+    for (int i = 0; i < entries; i++)
+    {
+        string entry = "{\"msg\":\"" + string(messages[rng() % 3]) + "\","
+                       "\"timestamp!!timestamp\":\"2021-03-04T05:06:" + to_string(10 + i % 50) + ".123Z\","
+                       "\"data\":{\"count\":" + to_string(rng() % 1000) + ",\"id\":\"" + to_string(rng()) + "\"}}";
+        writer.RawValue(entry.data(), entry.size());
+    }
+    writer.EndArray();
+    writer.EndObject();
+
+    writer.Key("Feedback");
+    writer.BeginObject();
+    writer.Key("text");
+    // Needs escaping, and isn't ASCII
+    writer.Value(string("a \"quoted\"\\ line\nand \xE4\xBD\xA0\xE5\xA5\xBD\x01"));
+    writer.EndObject();
+    writer.EndObject();
+}
+
+// As WriteFeedbackJSON writes a compressed upload
+bool WriteCompressed(IJSONStreamSink& sink, const function<void(JSONStreamWriter&)>& writeContent, size_t bufferSize = 64 * 1024)
+{
+    JSONStreamWriter writer(sink, bufferSize);
+    writer.BeginObject();
+    writer.Key("Body");
+    bool written = WriteGzipBase64String(writer, writeContent);
+    writer.Key("Metadata");
+    writer.BeginObject();
+    writer.Key("contentEncoding");
+    writer.Value(string("gzip"));
+    writer.EndObject();
+    writer.EndObject();
+    return writer.Finish() && written;
+}
+
+void ExpectRoundTrip(const function<void(JSONStreamWriter&)>& writeContent)
+{
+    StringSink plain;
+    JSONStreamWriter plainWriter(plain);
+    writeContent(plainWriter);
+    ASSERT_TRUE(plainWriter.Finish());
+
+    StringSink compressed;
+    ASSERT_TRUE(WriteCompressed(compressed, writeContent));
+
+    Json::Value upload;
+    Json::Reader reader;
+    ASSERT_TRUE(reader.parse(compressed.output, upload)) << compressed.output.substr(0, 200);
+    EXPECT_EQ("gzip", upload["Metadata"]["contentEncoding"].asString());
+
+    string body = upload["Body"].asString();
+    EXPECT_EQ(string::npos, body.find_first_not_of(
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/="));
+
+    string gzipped, content;
+    ASSERT_TRUE(DecodeBase64(body, gzipped));
+    ASSERT_TRUE(Gunzip(gzipped, content));
+
+    // Byte for byte what the uncompressed writer produces
+    EXPECT_EQ(plain.output.size(), content.size());
+    EXPECT_TRUE(plain.output == content);
+
+    Json::Value parsed;
+    ASSERT_TRUE(reader.parse(content, parsed));
+}
+
+}  // namespace
+
+
+TEST(JSONGzipSinkTest, RoundTripMatchesUncompressedContent)
+{
+    // Large enough to go through the writers' buffers many times
+    ExpectRoundTrip([](JSONStreamWriter& writer) { WriteContent(writer, 50000); });
+}
+
+TEST(JSONGzipSinkTest, RoundTripSmallContent)
+{
+    ExpectRoundTrip([](JSONStreamWriter& writer) { WriteContent(writer, 1); });
+    ExpectRoundTrip([](JSONStreamWriter& writer) {
+        writer.BeginObject();
+        writer.EndObject();
+    });
+}
+
+TEST(JSONGzipSinkTest, StopsWritingWhenTheSinkFails)
+{
+    StringSink sink(4096);
+    EXPECT_FALSE(WriteCompressed(sink, [](JSONStreamWriter& writer) { WriteContent(writer, 50000); }, 1024));
+
+    // The sink saw the failed write, and nothing after it
+    EXPECT_LE(sink.output.size(), 4096u);
+    EXPECT_GT(sink.failedAt, 0);
+    EXPECT_EQ(sink.failedAt, sink.writes);
+}
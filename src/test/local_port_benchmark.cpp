@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures finding the automatic HTTP proxy port when the ports from the start
+of the search are in use, by listening sockets held by this process:
+- by binding: LocalPortReservation::ReserveFirstFree, as LocalProxy does;
+- by probing: as TestForOpenPort did, with WaitForConnectability. A port
+  that accepts a connection is in use. On Windows, a connection to a loopback
+  port that isn't listening isn't refused straight away, so finding the free
+  port takes the whole 100ms the attempt is given; that's emulated here.
+
+    local_port_benchmark [first port] [runs]
+*/
+
+#include "stdafx.h"
+#include "local_port.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const int OCCUPIED_PORTS[] = { 0, 1, 10, 100, 1000 };
+const auto PROBE_ATTEMPT_TIME = chrono::milliseconds(100);
+
+double ElapsedMilliseconds(Clock::time_point start)
+{
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+sockaddr_in LoopbackAddress(int port)
+{
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    return address;
+}
+
+int ListenOn(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = LoopbackAddress(port);
+    if (0 != ::bind(sock, (sockaddr*)&address, sizeof(address)) || 0 != listen(sock, SOMAXCONN))
+    {
+        fprintf(stderr, "port %d is already in use\n", port);
+        exit(1);
+    }
+    return sock;
+}
+
+int ReserveByBinding(int firstPort)
+{
+    LocalPortReservation reservation;
+    if (!reservation.ReserveFirstFree(firstPort, 0xFFFF))
+    {
+        return 0;
+    }
+    return reservation.Port();
+}
+
+int ReserveByProbing(int firstPort)
+{
+    for (int port = firstPort; port <= 0xFFFF; port++)
+    {
+        Clock::time_point attemptStart = Clock::now();
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = LoopbackAddress(port);
+        bool connected = (0 == connect(sock, (sockaddr*)&address, sizeof(address)));
+        close(sock);
+        if (!connected)
+        {
+            this_thread::sleep_until(attemptStart + PROBE_ATTEMPT_TIME);
+            return port;
+        }
+    }
+    return 0;
+}
+
+double Median(vector<double> times)
+{
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int firstPort = (argc > 1) ? atoi(argv[1]) : 20000;
+    int runs = (argc > 2) ? atoi(argv[2]) : 5;
+
+    printf("ports in use from %d, %d runs\n", firstPort, runs);
+
+    for (int occupied : OCCUPIED_PORTS)
+    {
+        vector<int> sockets;
+        for (int i = 0; i < occupied; i++)
+        {
+            sockets.push_back(ListenOn(firstPort + i));
+        }
+
+        vector<double> binding, probing;
+        int boundPort = 0, probedPort = 0;
+        for (int run = 0; run < runs; run++)
+        {
+            Clock::time_point start = Clock::now();
+            boundPort = ReserveByBinding(firstPort);
+            binding.push_back(ElapsedMilliseconds(start));
+
+            start = Clock::now();
+            probedPort = ReserveByProbing(firstPort);
+            probing.push_back(ElapsedMilliseconds(start));
+        }
+
+        printf("%5d in use  binding: port %d, median %8.2f ms  probing: port %d, median %8.2f ms\n",
+               occupied, boundPort, Median(binding), probedPort, Median(probing));
+
+        for (int sock : sockets)
+        {
+            close(sock);
+        }
+    }
+
+    return 0;
+}
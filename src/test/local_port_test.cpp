@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "local_port.h"
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+
+namespace {
+
+sockaddr_in Address(uint32_t host, int port)
+{
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(host);
+    address.sin_port = htons((uint16_t)port);
+    return address;
+}
+
+// Binds a plain socket, as another program would, and returns it, or -1
+int BindSocket(uint32_t host, int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = Address(host, port);
+    if (sock != -1 && 0 != ::bind(sock, (sockaddr*)&address, sizeof(address)))
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int BoundPort(int sock)
+{
+    sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (0 != getsockname(sock, (sockaddr*)&address, &length))
+    {
+        return 0;
+    }
+    return ntohs(address.sin_port);
+}
+
+bool CanConnect(int port)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = Address(INADDR_LOOPBACK, port);
+    bool connected = (0 == connect(sock, (sockaddr*)&address, sizeof(address)));
+    close(sock);
+    return connected;
+}
+
+// Binds `count` consecutive free ports, on all addresses, and returns the
+// sockets; the first is bound to the lowest port.
+vector<int> BindConsecutivePorts(int count)
+{
+    for (int first = 20000; first + count <= 0xFFFF; first += count)
+    {
+        vector<int> sockets;
+        for (int port = first; port < first + count; port++)
+        {
+            int sock = BindSocket(INADDR_ANY, port);
+            if (sock == -1)
+            {
+                break;
+            }
+            sockets.push_back(sock);
+        }
+        if ((int)sockets.size() == count)
+        {
+            return sockets;
+        }
+        for (int sock : sockets)
+        {
+            close(sock);
+        }
+    }
+    return vector<int>();
+}
+
+}  // namespace
+
+
+TEST(LocalPortTest, PortZeroIsAssigned)
+{
+    LocalPortReservation first, second;
+    EXPECT_EQ(0, first.Port());
+
+    ASSERT_TRUE(first.Reserve(0));
+    ASSERT_TRUE(second.Reserve(0));
+    EXPECT_GT(first.Port(), 0);
+    EXPECT_GT(second.Port(), 0);
+    EXPECT_NE(first.Port(), second.Port());
+}
+
+TEST(LocalPortTest, BusyConfiguredPortIsRejected)
+{
+    // Held by another socket on the loopback address
+    int sock = BindSocket(INADDR_LOOPBACK, 0);
+    ASSERT_NE(-1, sock);
+    int port = BoundPort(sock);
+
+    LocalPortReservation reservation;
+    EXPECT_FALSE(reservation.Reserve(port));
+    EXPECT_EQ(0, reservation.Port());
+    close(sock);
+
+    // Held by another socket on all addresses
+    sock = BindSocket(INADDR_ANY, 0);
+    ASSERT_NE(-1, sock);
+    port = BoundPort(sock);
+    EXPECT_FALSE(reservation.Reserve(port));
+    close(sock);
+
+    // Held by another reservation
+    LocalPortReservation holder;
+    ASSERT_TRUE(holder.Reserve(0));
+    EXPECT_FALSE(reservation.Reserve(holder.Port()));
+
+    // Free once the holder lets go
+    port = holder.Port();
+    holder.Close();
+    EXPECT_EQ(port, holder.Port());
+    EXPECT_TRUE(reservation.Reserve(port));
+    EXPECT_EQ(port, reservation.Port());
+}
+
+TEST(LocalPortTest, InvalidPortIsRejected)
+{
+    LocalPortReservation reservation;
+    EXPECT_FALSE(reservation.Reserve(-1));
+    EXPECT_FALSE(reservation.Reserve(0x10000));
+    EXPECT_EQ(0, reservation.Port());
+}
+
+TEST(LocalPortTest, ReleaseKeepsTheSocket)
+{
+    int port;
+    LocalPortSocket sock;
+    {
+        LocalPortReservation reservation;
+        ASSERT_TRUE(reservation.Reserve(0, true));
+        port = reservation.Port();
+        sock = reservation.Release();
+        ASSERT_NE(-1, sock);
+        EXPECT_EQ(port, reservation.Port());
+
+        // Nothing left to release
+        EXPECT_EQ(-1, reservation.Release());
+    }
+
+    // Neither releasing nor the reservation's destructor closed the socket:
+    // it still holds the port and is still listening
+    EXPECT_EQ(port, BoundPort(sock));
+    LocalPortReservation other;
+    EXPECT_FALSE(other.Reserve(port));
+    EXPECT_TRUE(CanConnect(port));
+
+    close(sock);
+}
+
+TEST(LocalPortTest, ReservingAgainClosesThePreviousReservation)
+{
+    LocalPortReservation reservation;
+    ASSERT_TRUE(reservation.Reserve(0));
+    int port = reservation.Port();
+
+    // Only succeeds if the first socket was closed before binding again
+    EXPECT_TRUE(reservation.Reserve(port));
+    EXPECT_EQ(port, reservation.Port());
+
+    // A failed reservation leaves nothing reserved
+    LocalPortReservation other;
+    EXPECT_FALSE(other.Reserve(port));
+    EXPECT_FALSE(reservation.Reserve(-1));
+    EXPECT_EQ(0, reservation.Port());
+    EXPECT_TRUE(other.Reserve(port));
+}
+
+TEST(LocalPortTest, FirstFreePortIsReserved)
+{
+    vector<int> sockets = BindConsecutivePorts(5);
+    ASSERT_EQ(5u, sockets.size());
+    const int first = BoundPort(sockets[0]);
+    const int last = first + 4;
+
+    // Free the third and fifth ports
+    close(sockets[2]);
+    close(sockets[4]);
+
+    LocalPortReservation reservation;
+    ASSERT_TRUE(reservation.ReserveFirstFree(first, last));
+    EXPECT_EQ(first + 2, reservation.Port());
+
+    // The same port again, once it's free again
+    reservation.Close();
+    ASSERT_TRUE(reservation.ReserveFirstFree(first, last));
+    EXPECT_EQ(first + 2, reservation.Port());
+
+    // Skips a port held by another reservation
+    LocalPortReservation other;
+    ASSERT_TRUE(other.ReserveFirstFree(first, last, true));
+    EXPECT_EQ(last, other.Port());
+    EXPECT_TRUE(CanConnect(last));
+
+    // None left
+    LocalPortReservation none;
+    EXPECT_FALSE(none.ReserveFirstFree(first, last));
+    EXPECT_EQ(0, none.Port());
+
+    for (int i : { 0, 1, 3 })
+    {
+        close(sockets[i]);
+    }
+}
+
+TEST(LocalPortTest, FirstFreePortRangeIsChecked)
+{
+    LocalPortReservation reservation;
+    EXPECT_FALSE(reservation.ReserveFirstFree(0x10000, 0x10010));
+    EXPECT_FALSE(reservation.ReserveFirstFree(2000, 1999));
+
+    // Starts from port 1, not 0, which would let the system choose a port
+    // outside the range
+    vector<int> sockets = BindConsecutivePorts(1);
+    ASSERT_EQ(1u, sockets.size());
+    int busy = BoundPort(sockets[0]);
+    EXPECT_FALSE(reservation.ReserveFirstFree(0, 0));
+    EXPECT_FALSE(reservation.ReserveFirstFree(busy, busy));
+    close(sockets[0]);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures adding my_print messages to the message history from many threads
+at once, with a reader taking snapshots all the while, as the feedback and
+diagnostic info code does:
+- ring: MessageHistory, as it is now. Writers take no lock, and readers
+  don't block them.
+- locked: a vector of messages behind a mutex, as it was. Writers and the
+  reader all take the lock, and the vector grows without limit.
+
+The time to format a timestamp, which the locked history also did for each
+message, is left out.
+
+    logging_benchmark [messages per thread] [most threads]
+*/
+
+#include "stdafx.h"
+#include "message_history.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const TCHAR MESSAGE[] = _T("ConnectionManager::DoVPNConnection: tunnel core notice received: ActiveTunnel");
+
+class LockedHistory
+{
+public:
+    void Add(uint64_t timestamp, bool debug, const TCHAR* message)
+    {
+        MessageHistoryItem item;
+        item.timestamp = timestamp;
+        item.debug = debug;
+        item.message = message;
+
+        lock_guard<mutex> lock(m_mutex);
+        m_items.push_back(item);
+    }
+
+    void Get(vector<MessageHistoryItem>& items) const
+    {
+        lock_guard<mutex> lock(m_mutex);
+        items = m_items;
+    }
+
+private:
+    mutable mutex m_mutex;
+    vector<MessageHistoryItem> m_items;
+};
+
+// Returns the nanoseconds per message, and the number of snapshots the
+// reader took meanwhile
+template <class History>
+pair<double, int> Run(History& history, int threads, int messages)
+{
+    atomic<bool> writing(true);
+    int snapshots = 0;
+    thread reader([&]() {
+        vector<MessageHistoryItem> items;
+        while (writing)
+        {
+            history.Get(items);
+            snapshots++;
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    });
+
+    Clock::time_point start = Clock::now();
+    vector<thread> writers;
+    for (int i = 0; i < threads; i++)
+    {
+        writers.emplace_back([&, i]() {
+            for (int j = 0; j < messages; j++)
+            {
+                history.Add(((uint64_t)i << 32) | j, false, MESSAGE);
+            }
+        });
+    }
+    for (thread& writer : writers)
+    {
+        writer.join();
+    }
+    double nanoseconds = chrono::duration<double, nano>(Clock::now() - start).count();
+
+    writing = false;
+    reader.join();
+
+    return make_pair(nanoseconds / ((double)threads * messages), snapshots);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int messages = (argc > 1) ? atoi(argv[1]) : 100000;
+    int mostThreads = (argc > 2) ? atoi(argv[2]) : 16;
+
+    printf("%d messages per thread\n", messages);
+
+    for (int threads = 1; threads <= mostThreads; threads *= 2)
+    {
+        unique_ptr<MessageHistory> ring(new MessageHistory());
+        pair<double, int> ringResult = Run(*ring, threads, messages);
+
+        LockedHistory locked;
+        pair<double, int> lockedResult = Run(locked, threads, messages);
+
+        printf("%3d threads  ring: %7.1f ns/message, %5d snapshots  locked: %7.1f ns/message, %5d snapshots\n",
+               threads, ringResult.first, ringResult.second, lockedResult.first, lockedResult.second);
+    }
+
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "message_history.h"
+#include "message_printing.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+
+namespace {
+
+// Each writer's messages have timestamps of writer<<32 | index, and contents
+// that follow from the timestamp, so that a torn record would show.
+uint64_t Timestamp(uint32_t writer, uint32_t index)
+{
+    return ((uint64_t)writer << 32) | index;
+}
+
+tstring Message(uint64_t timestamp)
+{
+    uint32_t writer = (uint32_t)(timestamp >> 32);
+    uint32_t index = (uint32_t)timestamp;
+    tstring message = to_wstring(writer) + L":" + to_wstring(index) + L":";
+    message.append(index % 300, (TCHAR)(L'a' + (writer + index) % 26));
+    return message;
+}
+
+void Add(MessageHistory& history, uint32_t writer, uint32_t index)
+{
+    uint64_t timestamp = Timestamp(writer, index);
+    history.Add(timestamp, index % 2 == 0, Message(timestamp).c_str());
+}
+
+void ExpectItemIsWhole(const MessageHistoryItem& item)
+{
+    EXPECT_EQ(Message(item.timestamp), item.message);
+    EXPECT_EQ((uint32_t)item.timestamp % 2 == 0, item.debug);
+}
+
+struct HistoryCall
+{
+    LogSensitivity sensitivity;
+    bool debug;
+    tstring format;
+    bool formatted;
+    tstring message;
+};
+
+class RecordingOutput
+{
+public:
+    void AddToHistory(LogSensitivity sensitivity, bool debug, const TCHAR* format, const TCHAR* message)
+    {
+        HistoryCall call = { sensitivity, debug, format, message != NULL, message ? message : _T("") };
+        history.push_back(call);
+    }
+
+    void Display(bool debug, TCHAR* message)
+    {
+        displayed.push_back(message);
+        free(message);
+    }
+
+    vector<HistoryCall> history;
+    vector<tstring> displayed;
+};
+
+// As my_print, with debug messages shown or not
+template <bool showDebugMessages>
+void Print(RecordingOutput& output, LogSensitivity sensitivity, bool debug, const TCHAR* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    PrintMessage<showDebugMessages>(output, sensitivity, debug, format, args);
+    va_end(args);
+}
+
+}  // namespace
+
+
+TEST(MessageHistoryTest, EmptyHistoryHasNoMessages)
+{
+    unique_ptr<MessageHistory> history(new MessageHistory());
+
+    vector<MessageHistoryItem> items(1);
+    history->Get(items);
+    EXPECT_TRUE(items.empty());
+}
+
+TEST(MessageHistoryTest, MessagesAreKeptInOrder)
+{
+    unique_ptr<MessageHistory> history(new MessageHistory());
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        Add(*history, 0, i);
+    }
+
+    vector<MessageHistoryItem> items;
+    history->Get(items);
+    ASSERT_EQ(10u, items.size());
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        EXPECT_EQ(Timestamp(0, i), items[i].timestamp);
+        ExpectItemIsWhole(items[i]);
+    }
+}
+
+TEST(MessageHistoryTest, WrapsAroundKeepingTheMostRecentMessages)
+{
+    const uint32_t CAPACITY = (uint32_t)MessageHistory::CAPACITY;
+    unique_ptr<MessageHistory> history(new MessageHistory());
+
+    // Exactly full
+    for (uint32_t i = 0; i < CAPACITY; i++)
+    {
+        Add(*history, 0, i);
+    }
+    vector<MessageHistoryItem> items;
+    history->Get(items);
+    ASSERT_EQ(MessageHistory::CAPACITY, items.size());
+    EXPECT_EQ(Timestamp(0, 0), items.front().timestamp);
+    EXPECT_EQ(Timestamp(0, CAPACITY - 1), items.back().timestamp);
+
+    // One more overwrites the oldest
+    Add(*history, 0, CAPACITY);
+    history->Get(items);
+    ASSERT_EQ(MessageHistory::CAPACITY, items.size());
+    EXPECT_EQ(Timestamp(0, 1), items.front().timestamp);
+    EXPECT_EQ(Timestamp(0, CAPACITY), items.back().timestamp);
+
+    // And several times round
+    for (uint32_t i = CAPACITY + 1; i < 3 * CAPACITY + 100; i++)
+    {
+        Add(*history, 0, i);
+    }
+    history->Get(items);
+    ASSERT_EQ(MessageHistory::CAPACITY, items.size());
+    for (uint32_t i = 0; i < CAPACITY; i++)
+    {
+        EXPECT_EQ(Timestamp(0, 2 * CAPACITY + 100 + i), items[i].timestamp);
+        ExpectItemIsWhole(items[i]);
+    }
+}
+
+TEST(MessageHistoryTest, LongMessagesAreTruncated)
+{
+    const size_t MAX_LENGTH = MessageHistory::MAX_MESSAGE_LENGTH;
+    unique_ptr<MessageHistory> history(new MessageHistory());
+
+    const size_t LENGTHS[] = { 0, 1, MAX_LENGTH - 1, MAX_LENGTH, MAX_LENGTH + 1, 4 * MAX_LENGTH };
+    for (size_t length : LENGTHS)
+    {
+        tstring message;
+        for (size_t i = 0; i < length; i++)
+        {
+            message += (TCHAR)(L'a' + i % 26);
+        }
+        history->Add(length, false, message.c_str());
+    }
+
+    vector<MessageHistoryItem> items;
+    history->Get(items);
+    ASSERT_EQ(sizeof(LENGTHS) / sizeof(LENGTHS[0]), items.size());
+    for (const MessageHistoryItem& item : items)
+    {
+        size_t length = (size_t)item.timestamp;
+        ASSERT_EQ(min(length, MAX_LENGTH), item.message.length()) << length;
+        for (size_t i = 0; i < item.message.length(); i++)
+        {
+            ASSERT_EQ((TCHAR)(L'a' + i % 26), item.message[i]) << length;
+        }
+    }
+}
+
+TEST(MessageHistoryTest, ConcurrentWritersWithAReader)
+{
+    const uint32_t WRITERS = 8;
+    const uint32_t MESSAGES_PER_WRITER = 20000;
+    unique_ptr<MessageHistory> history(new MessageHistory());
+
+    atomic<bool> writing(true);
+    thread reader([&]() {
+        vector<MessageHistoryItem> items;
+        bool lastSnapshot = false;
+        while (!lastSnapshot)
+        {
+            lastSnapshot = !writing.load();
+
+            history->Get(items);
+            ASSERT_LE(items.size(), MessageHistory::CAPACITY);
+
+            // Messages are whole, and each writer's are in the order it
+            // added them
+            vector<int64_t> lastIndex(WRITERS, -1);
+            for (const MessageHistoryItem& item : items)
+            {
+                ASSERT_NO_FATAL_FAILURE(ExpectItemIsWhole(item));
+                uint32_t writer = (uint32_t)(item.timestamp >> 32);
+                ASSERT_LT(writer, WRITERS);
+                ASSERT_LT(lastIndex[writer], (int64_t)(uint32_t)item.timestamp);
+                lastIndex[writer] = (uint32_t)item.timestamp;
+            }
+
+            if (lastSnapshot)
+            {
+                // Nothing is being written any more, so nothing is skipped
+                EXPECT_EQ(MessageHistory::CAPACITY, items.size());
+            }
+        }
+    });
+
+    vector<thread> writers;
+    for (uint32_t writer = 0; writer < WRITERS; writer++)
+    {
+        writers.emplace_back([&, writer]() {
+            for (uint32_t i = 0; i < MESSAGES_PER_WRITER; i++)
+            {
+                Add(*history, writer, i);
+            }
+        });
+    }
+    for (thread& writer : writers)
+    {
+        writer.join();
+    }
+    writing = false;
+    reader.join();
+}
+
+TEST(PrintMessageTest, SuppressedDebugMessagesAreNeverFormatted)
+{
+    RecordingOutput output;
+    int formatCalls = StandInFormatCalls();
+
+    Print<false>(output, SENSITIVE_LOG, true, _T("connected to %d"), 1);
+    Print<false>(output, SENSITIVE_FORMAT_ARGS, true, _T("connected to %d"), 2);
+
+    EXPECT_EQ(formatCalls, StandInFormatCalls());
+    EXPECT_TRUE(output.displayed.empty());
+
+    // The history is still offered the format string, which it keeps if
+    // only the arguments are sensitive
+    ASSERT_EQ(2u, output.history.size());
+    for (const HistoryCall& call : output.history)
+    {
+        EXPECT_TRUE(call.debug);
+        EXPECT_EQ(_T("connected to %d"), call.format);
+        EXPECT_FALSE(call.formatted);
+    }
+}
+
+TEST(PrintMessageTest, HiddenDebugMessagesAreFormattedOnlyForTheHistory)
+{
+    RecordingOutput output;
+    int formatCalls = StandInFormatCalls();
+
+    Print<false>(output, NOT_SENSITIVE, true, _T("connected to %d"), 1);
+
+    EXPECT_EQ(formatCalls + 1, StandInFormatCalls());
+    EXPECT_TRUE(output.displayed.empty());
+    ASSERT_EQ(1u, output.history.size());
+    EXPECT_TRUE(output.history[0].formatted);
+    EXPECT_EQ(_T("DEBUG: connected to 1"), output.history[0].message);
+}
+
+TEST(PrintMessageTest, DisplayedMessagesAreFormattedOnce)
+{
+    const LogSensitivity SENSITIVITIES[] = { NOT_SENSITIVE, SENSITIVE_LOG, SENSITIVE_FORMAT_ARGS };
+    for (LogSensitivity sensitivity : SENSITIVITIES)
+    {
+        RecordingOutput output;
+        int formatCalls = StandInFormatCalls();
+
+        Print<false>(output, sensitivity, false, _T("connected to %d"), 1);
+        Print<true>(output, sensitivity, true, _T("connected to %d"), 2);
+
+        EXPECT_EQ(formatCalls + 2, StandInFormatCalls()) << sensitivity;
+        EXPECT_EQ(vector<tstring>({ _T("connected to 1"), _T("DEBUG: connected to 2") }), output.displayed) << sensitivity;
+        ASSERT_EQ(2u, output.history.size()) << sensitivity;
+        EXPECT_EQ(_T("connected to 1"), output.history[0].message) << sensitivity;
+        EXPECT_EQ(_T("DEBUG: connected to 2"), output.history[1].message) << sensitivity;
+    }
+}
+
+TEST(PrintMessageTest, LongMessagesAreDisplayedInFull)
+{
+    RecordingOutput output;
+
+    Print<true>(output, NOT_SENSITIVE, true, _T("%1000d"), 1);
+
+    tstring expected = _T("DEBUG: ") + tstring(999, _T(' ')) + _T("1");
+    ASSERT_EQ(1u, output.displayed.size());
+    EXPECT_EQ(expected, output.displayed[0]);
+
+    // The history is given as much as fit the first time round
+    ASSERT_EQ(1u, output.history.size());
+    EXPECT_EQ(expected.substr(0, MESSAGE_FORMAT_BUFFER_LENGTH - 1), output.history[0].message);
+}
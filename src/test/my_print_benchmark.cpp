@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures a my_print call, for messages that go to different places, in a
+build where debug messages aren't shown:
+- deferred: PrintMessage, as it is now. A message is only formatted if
+  it's displayed or kept, and only allocated if it's displayed.
+- eager: as it was. Every message is sized, allocated and formatted, and
+  then kept or displayed if it should be.
+
+Messages are kept in a MessageHistory, and displaying a message is left out:
+the buffer is freed instead of being posted to the main window. The
+stand-in _vsctprintf formats into a buffer of its own, which Windows' doesn't
+need to do, so the eager times here are somewhat high.
+
+    my_print_benchmark [calls]
+*/
+
+#include "stdafx.h"
+#include "message_history.h"
+#include "message_printing.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const TCHAR FORMAT[] = _T("ConnectionManager: tunnel core notice received: %d %d");
+
+MessageHistory* g_history;
+
+void AddToHistory(LogSensitivity sensitivity, bool debug, const TCHAR* format, const TCHAR* message)
+{
+    const TCHAR* kept = (sensitivity == NOT_SENSITIVE) ? message
+                      : (sensitivity == SENSITIVE_FORMAT_ARGS) ? format
+                      : NULL;
+    if (kept)
+    {
+        g_history->Add(0, debug, kept);
+    }
+}
+
+struct FreeingOutput
+{
+    void AddToHistory(LogSensitivity sensitivity, bool debug, const TCHAR* format, const TCHAR* message)
+    {
+        ::AddToHistory(sensitivity, debug, format, message);
+    }
+
+    void Display(bool, TCHAR* message)
+    {
+        free(message);
+    }
+};
+
+void PrintDeferred(LogSensitivity sensitivity, bool debug, const TCHAR* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    FreeingOutput output;
+    PrintMessage<false>(output, sensitivity, debug, format, args);
+    va_end(args);
+}
+
+void PrintEager(LogSensitivity sensitivity, bool debug, const TCHAR* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    int length = _vsctprintf(format, argsCopy);
+    va_end(argsCopy);
+
+    TCHAR* buffer = (TCHAR*)malloc((length + 1) * sizeof(TCHAR));
+    _vsntprintf_s(buffer, length + 1, _TRUNCATE, format, args);
+    va_end(args);
+
+    AddToHistory(sensitivity, debug, format, buffer);
+    free(buffer);
+}
+
+double Time(int calls, const function<void(int)>& print)
+{
+    print(0);
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < calls; i++)
+    {
+        print(i);
+    }
+    return chrono::duration<double, nano>(Clock::now() - start).count() / calls;
+}
+
+void Compare(const char* name, int calls, LogSensitivity sensitivity, bool debug)
+{
+    double deferred = Time(calls, [&](int i) {
+        PrintDeferred(sensitivity, debug, FORMAT, i, i * 7);
+    });
+    double eager = Time(calls, [&](int i) {
+        PrintEager(sensitivity, debug, FORMAT, i, i * 7);
+    });
+    printf("  %-34s deferred %8.1f ns  eager %8.1f ns\n", name, deferred, eager);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int calls = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+    unique_ptr<MessageHistory> history(new MessageHistory());
+    g_history = history.get();
+
+    printf("%d calls each\n", calls);
+    Compare("debug, SENSITIVE_LOG", calls, SENSITIVE_LOG, true);
+    Compare("debug, SENSITIVE_FORMAT_ARGS", calls, SENSITIVE_FORMAT_ARGS, true);
+    Compare("debug, NOT_SENSITIVE", calls, NOT_SENSITIVE, true);
+    Compare("displayed, SENSITIVE_LOG", calls, SENSITIVE_LOG, false);
+    Compare("displayed, NOT_SENSITIVE", calls, NOT_SENSITIVE, false);
+
+    return 0;
+}
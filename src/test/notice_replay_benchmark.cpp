@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Replays a stream of tunnel core notices through the two ways
+PsiphonTunnelCore::HandleSubprocessOutputLine can route them, and measures
+lines per second and heap allocations per line:
+- scan: ScanNoticeType finds the type, and only notices that CoreTransport
+  handles are parsed, as it is now.
+- parse: every line is parsed into a Json::Value, as it was.
+
+Logging the notices is left out.
+
+The stream is read from a file of notices, one per line, such as the core's
+notices file; without one, a stream like a session's is made up, mostly of
+the notices that are only logged.
+
+    notice_replay_benchmark [notices file] [passes]
+*/
+
+#include "stdafx.h"
+#include "notice_scanner.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <unordered_set>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+atomic<size_t> g_allocations(0);
+
+// As HANDLED_CORE_NOTICE_TYPES in coretransport.cpp
+const unordered_set<string> HANDLED_NOTICE_TYPES = {
+    "Tunnels", "ClientUpgradeDownloaded", "Homepage", "ListeningSocksProxyPort",
+    "ListeningHttpProxyPort", "SocksProxyPortInUse", "HttpProxyPortInUse", "Untunneled",
+    "UpstreamProxyError", "AvailableEgressRegions", "ActiveAuthorizationIDs", "ClientRegion",
+    "SplitTunnelRegions", "TrafficRateLimits" };
+
+string Notice(const string& type, const string& data)
+{
+    return "{\"data\":" + data + ",\"noticeType\":\"" + type + "\",\"timestamp\":\"2021-01-01T00:00:00.000Z\"}";
+}
+
+vector<string> MadeUpStream()
+{
+    vector<string> lines;
+    lines.push_back(Notice("ListeningSocksProxyPort", "{\"port\":1080}"));
+    lines.push_back(Notice("ListeningHttpProxyPort", "{\"port\":8080}"));
+    lines.push_back(Notice("AvailableEgressRegions", "{\"regions\":[\"CA\",\"DE\",\"GB\",\"JP\",\"NL\",\"SG\",\"US\"]}"));
+    for (int i = 0; i < 1000; i++)
+    {
+        lines.push_back(Notice("ConnectingServer", "{\"diagnosticID\":\"abcdef0123\",\"region\":\"CA\",\"protocol\":\"OSSH\",\"dialParameters\":{\"dialPortNumber\":\"443\",\"selectedUserAgent\":true}}"));
+        lines.push_back(Notice("Info", "{\"message\":\"establish tunnel: server entry candidate " + to_string(i) + " rejected: \\\"dial failed\\\"\"}"));
+        lines.push_back(Notice("Info", "{\"message\":\"pruned " + to_string(i % 7) + " server entries\"}"));
+        if (i % 50 == 0)
+        {
+            lines.push_back(Notice("ActiveTunnel", "{\"diagnosticID\":\"abcdef0123\",\"protocol\":\"OSSH\",\"isTCS\":false}"));
+            lines.push_back(Notice("Tunnels", "{\"count\":" + to_string(i % 100 == 0 ? 1 : 0) + "}"));
+        }
+        if (i % 100 == 0)
+        {
+            lines.push_back(Notice("BytesTransferred", "{\"diagnosticID\":\"abcdef0123\",\"sent\":12345,\"received\":678901}"));
+            lines.push_back(Notice("Homepage", "{\"url\":\"https://example.com/?client_region=CA\"}"));
+        }
+    }
+    return lines;
+}
+
+vector<string> ReadStream(const char* path)
+{
+    vector<string> lines;
+    ifstream file(path);
+    string line;
+    while (getline(file, line))
+    {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// Returns the number of notices handled, so that the work isn't optimized away
+size_t RouteByScanning(const vector<string>& lines)
+{
+    size_t handled = 0;
+    string noticeType;
+    for (const string& line : lines)
+    {
+        const char* type;
+        size_t typeLength;
+        if (ScanNoticeType(line.data(), line.length(), type, typeLength))
+        {
+            noticeType.assign(type, typeLength);
+            if (!HANDLED_NOTICE_TYPES.count(noticeType))
+            {
+                continue;
+            }
+        }
+
+        Json::Value notice;
+        Json::Reader reader;
+        if (reader.parse(line.data(), line.data() + line.length(), notice) && notice.isObject())
+        {
+            noticeType = notice["noticeType"].asString();
+            handled += HANDLED_NOTICE_TYPES.count(noticeType);
+        }
+    }
+    return handled;
+}
+
+size_t RouteByParsing(const vector<string>& lines)
+{
+    size_t handled = 0;
+    string noticeType;
+    for (const string& line : lines)
+    {
+        Json::Value notice;
+        Json::Reader reader;
+        if (reader.parse(line.data(), line.data() + line.length(), notice) && notice.isObject())
+        {
+            noticeType = notice["noticeType"].asString();
+            handled += HANDLED_NOTICE_TYPES.count(noticeType);
+        }
+    }
+    return handled;
+}
+
+void Replay(const char* name, const vector<string>& lines, int passes, const function<size_t(const vector<string>&)>& route)
+{
+    size_t handled = route(lines);
+
+    size_t allocations = g_allocations;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < passes; i++)
+    {
+        route(lines);
+    }
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+    allocations = g_allocations - allocations;
+
+    double routed = (double)lines.size() * passes;
+    printf("  %-6s %10.0f lines/s  %6.2f allocations/line  (%zu handled)\n",
+           name, routed / seconds, allocations / routed, handled);
+}
+
+}  // namespace
+
+
+void* operator new(size_t size)
+{
+    g_allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p)
+    {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+
+int main(int argc, char* argv[])
+{
+    vector<string> lines = (argc > 1 && *argv[1]) ? ReadStream(argv[1]) : MadeUpStream();
+    int passes = (argc > 2) ? atoi(argv[2]) : 20;
+
+    printf("%zu lines, %d passes\n", lines.size(), passes);
+    Replay("scan", lines, passes, RouteByScanning);
+    Replay("parse", lines, passes, RouteByParsing);
+
+    return 0;
+}
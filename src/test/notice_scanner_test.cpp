@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "notice_scanner.h"
+#include <gtest/gtest.h>
+#include <random>
+
+
+namespace {
+
+// As HANDLED_CORE_NOTICE_TYPES in coretransport.cpp, along with the most
+// common of the notices that are only logged
+const char* NOTICE_TYPES[] = {
+    "Tunnels", "ClientUpgradeDownloaded", "Homepage", "ListeningSocksProxyPort",
+    "ListeningHttpProxyPort", "SocksProxyPortInUse", "HttpProxyPortInUse", "Untunneled",
+    "UpstreamProxyError", "AvailableEgressRegions", "ActiveAuthorizationIDs", "ClientRegion",
+    "SplitTunnelRegions", "TrafficRateLimits",
+    "Info", "Alert", "ConnectingServer", "ActiveTunnel", "RequestedTactics" };
+
+const char* DATA = "{\"count\":1,\"regions\":[\"CA\",\"US\"],\"ok\":true,\"none\":null,\"rate\":-1.5e+3}";
+
+// The noticeType that PsiphonTunnelCore gets from the full parse. Returns
+// false if it would have ignored the line or failed on it.
+bool ParseNoticeType(const string& line, string& type)
+{
+    Json::Value notice;
+    Json::Reader reader;
+    if (!reader.parse(line.data(), line.data() + line.length(), notice) || !notice.isObject())
+    {
+        return false;
+    }
+    try
+    {
+        type = notice["noticeType"].asString();
+    }
+    catch (exception&)
+    {
+        return false;
+    }
+    return true;
+}
+
+// Whenever the scanner finds a type, the full parse must find the same one.
+// Returns whether the scanner found it.
+bool ExpectAgreement(const string& line)
+{
+    const char* scanned;
+    size_t scannedLength;
+    if (!ScanNoticeType(line.data(), line.length(), scanned, scannedLength))
+    {
+        return false;
+    }
+
+    string parsed;
+    EXPECT_TRUE(ParseNoticeType(line, parsed)) << line;
+    EXPECT_EQ(parsed, string(scanned, scannedLength)) << line;
+    return true;
+}
+
+// The ways a notice might be written, all with the same type
+vector<string> NoticeVariants(const string& type)
+{
+    const string noticeType = "\"noticeType\":\"" + type + "\"";
+    const string data = string("\"data\":") + DATA;
+    const string timestamp = "\"timestamp\":\"2021-01-01T00:00:00.000Z\"";
+
+    return {
+        // As the core writes it
+        "{" + data + "," + noticeType + "," + timestamp + "}",
+        // Reordered
+        "{" + noticeType + "," + data + "," + timestamp + "}",
+        "{" + timestamp + "," + data + "," + noticeType + "}",
+        "{" + noticeType + "}",
+        // With whitespace
+        " { " + data + " , " + noticeType + " , " + timestamp + " } ",
+        "{\n\t\"data\" :\t{ \"count\" : 1 },\r\n\"noticeType\"  :  \"" + type + "\"\n}\r",
+        "{" + data + ",\"noticeType\" : \"" + type + "\"," + timestamp + "}\r\n",
+        // With escapes elsewhere
+        "{\"data\":{\"message\":\"a \\\"quoted\\\" \\\\ path\\/to \\u00e9 \\ud83d\\ude00\\n\"}," + noticeType + "}",
+        "{\"da\\u0074a\":{}," + noticeType + ",\"note\\\"Type\":\"x\"}",
+        // With a key that's nearly noticeType
+        "{\"noticeTypes\":\"x\",\"noticeTyp\":\"y\"," + noticeType + "}",
+    };
+}
+
+// Edits a line at random, with the characters most likely to upset a scanner
+string Mutate(string line, mt19937& rng)
+{
+    static const char CHARACTERS[] = "{}[]\",:\\u0123456789abcdefABCDEF.eE+- \t\r\ntrue\0nul";
+    int edits = 1 + rng() % 3;
+    for (int i = 0; i < edits && !line.empty(); i++)
+    {
+        size_t position = rng() % line.length();
+        char character = CHARACTERS[rng() % (sizeof(CHARACTERS) - 1)];
+        switch (rng() % 4)
+        {
+        case 0:
+            line.erase(position, 1);
+            break;
+        case 1:
+            line.insert(line.begin() + position, character);
+            break;
+        case 2:
+            line[position] = character;
+            break;
+        case 3:
+            line.resize(position);
+            break;
+        }
+    }
+    return line;
+}
+
+}  // namespace
+
+
+TEST(NoticeScannerTest, AgreesWithTheFullParseForEveryType)
+{
+    for (const char* type : NOTICE_TYPES)
+    {
+        for (const string& line : NoticeVariants(type))
+        {
+            // The scanner takes them all, so none needs the full parse to route it
+            EXPECT_TRUE(ExpectAgreement(line)) << line;
+        }
+    }
+}
+
+TEST(NoticeScannerTest, EscapedTypesAreLeftToTheFullParse)
+{
+    for (const char* type : NOTICE_TYPES)
+    {
+        string escaped = string("\\u00") + "0123456789abcdef"[type[0] / 16] + "0123456789abcdef"[type[0] % 16] + (type + 1);
+        const string lines[] = {
+            "{\"noticeType\":\"" + escaped + "\"}",
+            "{\"notice\\u0054ype\":\"" + string(type) + "\"}",
+        };
+        for (const string& line : lines)
+        {
+            EXPECT_FALSE(ExpectAgreement(line)) << line;
+
+            string parsed;
+            EXPECT_TRUE(ParseNoticeType(line, parsed)) << line;
+            if (line.find("notice\\u0054ype") == string::npos)
+            {
+                EXPECT_EQ(type, parsed) << line;
+            }
+        }
+    }
+}
+
+TEST(NoticeScannerTest, LinesThatAreNotSimpleNoticesAreLeftToTheFullParse)
+{
+    const string lines[] = {
+        "",
+        "   ",
+        "panic: runtime error: invalid memory address or nil pointer dereference",
+        "fatal error: concurrent map writes",
+        "[\"noticeType\",\"Info\"]",
+        "\"noticeType\"",
+        "{}",
+        "{\"data\":{}}",
+        "{\"noticeType\":1}",
+        "{\"noticeType\":null}",
+        "{\"noticeType\":[\"Info\"]}",
+        "{\"noticeType\":\"Info\",\"noticeType\":\"Tunnels\"}",
+        "{\"noticeType\":\"Info\"",
+        "{\"noticeType\":\"Info\"}}",
+        "{\"noticeType\":\"Info\"} {}",
+        "{\"noticeType\":\"Info\",}",
+        "{\"noticeType\":\"Info\" \"data\":{}}",
+        "{\"data\":{\"count\":01},\"noticeType\":\"Info\"}",
+        "{\"data\":{\"count\":1.},\"noticeType\":\"Info\"}",
+        "{\"data\":{\"ok\":tru},\"noticeType\":\"Info\"}",
+        "{\"data\":\"\\x\",\"noticeType\":\"Info\"}",
+        "{\"data\":\"\\u12\",\"noticeType\":\"Info\"}",
+        "{\"data\":\"\\ud83d\",\"noticeType\":\"Info\"}",
+        "{\"data\":\"\\ud83d\\u0041\",\"noticeType\":\"Info\"}",
+        "{/* comment */\"noticeType\":\"Info\"}",
+        "{\"noticeType\":\"Info\"} // comment",
+        string("{\"data\":\"a\\") + '\0' + "\",\"noticeType\":\"Info\"}",
+        string("{\"data\":\"\\ud83d\\ud") + '\0' + "00\",\"noticeType\":\"Info\"}",
+    };
+
+    for (const string& line : lines)
+    {
+        EXPECT_FALSE(ExpectAgreement(line)) << line;
+    }
+}
+
+TEST(NoticeScannerTest, AgreesWithTheFullParseForMutatedNotices)
+{
+    mt19937 rng(1);
+    vector<string> notices;
+    for (const char* type : NOTICE_TYPES)
+    {
+        for (const string& line : NoticeVariants(type))
+        {
+            notices.push_back(line);
+        }
+    }
+
+    int scanned = 0;
+    for (int i = 0; i < 200000; i++)
+    {
+        string line = Mutate(notices[rng() % notices.size()], rng);
+        if (ExpectAgreement(line))
+        {
+            scanned++;
+        }
+        if (HasFailure())
+        {
+            return;
+        }
+    }
+
+    // Some edits, such as to a data value, leave a valid notice
+    EXPECT_GT(scanned, 0);
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Stands in for the client's logging.h. Log messages are discarded.
+
+#pragma once
+
+enum LogSensitivity
+{
+    NOT_SENSITIVE,
+    SENSITIVE_LOG,
+    SENSITIVE_FORMAT_ARGS
+};
+
+inline void my_print(LogSensitivity, bool, const TCHAR*, ...) {}
+inline void my_print(LogSensitivity, bool, const string&) {}
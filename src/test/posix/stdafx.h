@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Stands in for the precompiled header of the Windows build, for the
+// portable sources that the tests build. Only what those sources use from
+// it is provided.
+
+#pragma once
+
+#include <cassert>
+#include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <json/json.h>
+
+using namespace std;
+
+// The Windows build gets <filesystem> from the VS2015 toolset, as
+// std::experimental::filesystem.
+namespace std { namespace experimental {} }
+
+typedef uint32_t DWORD;
+typedef void* HANDLE;
+typedef const char* LPCSTR;
+// The Windows build is a Unicode build
+typedef wchar_t TCHAR;
+#define tstring wstring
+
+#define INFINITE 0xFFFFFFFF
+#define _T(x) L##x
+#define __TFUNCTION__ L""
+
+// <tchar.h>'s formatting functions, as they are in a Unicode build. Calls are
+// counted, so that tests can tell whether a message was formatted.
+
+#define _TRUNCATE ((size_t)-1)
+
+// Not thread safe
+inline int& StandInFormatCalls()
+{
+    static int calls = 0;
+    return calls;
+}
+
+// With _TRUNCATE, formats as much as fits, and returns -1 if that isn't all
+inline int _vsntprintf_s(TCHAR* buffer, size_t bufferLength, size_t count, const TCHAR* format, va_list args)
+{
+    assert(count == _TRUNCATE);
+    StandInFormatCalls()++;
+    int length = vswprintf(buffer, bufferLength, format, args);
+    buffer[bufferLength - 1] = 0;
+    return length;
+}
+
+// The length of the formatted message
+inline int _vsctprintf(const TCHAR* format, va_list args)
+{
+    StandInFormatCalls()++;
+    vector<TCHAR> buffer(256);
+    while (true)
+    {
+        va_list argsCopy;
+        va_copy(argsCopy, args);
+        int length = vswprintf(buffer.data(), buffer.size(), format, argsCopy);
+        va_end(argsCopy);
+        if (length >= 0 || buffer.size() > 1024 * 1024)
+        {
+            return length;
+        }
+        buffer.resize(2 * buffer.size());
+    }
+}
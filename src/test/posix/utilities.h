@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Stands in for the client's utilities.h. Only the data encoding utilities
+// and finally are provided, defined as they are in utilities.h and
+// utilities.cpp, along with the registry utilities, which keep their values
+// in memory.
+
+#pragma once
+
+#include <map>
+#include <stdexcept>
+#include "hex_codec.h"
+
+inline string Hexlify(const unsigned char* input, size_t length)
+{
+    string output(2 * length, '\0');
+    if (length > 0)
+    {
+        HexEncode(input, length, &output[0]);
+    }
+    return output;
+}
+
+inline string Dehexlify(const string& input)
+{
+    size_t len = input.length();
+    if (len & 1)
+    {
+        throw std::invalid_argument("Dehexlify: odd length");
+    }
+
+    string output(len / 2, '\0');
+    if (len > 0 && !HexDecode(input.data(), len, (unsigned char*)&output[0]))
+    {
+        throw std::invalid_argument("Dehexlify: not a hex digit");
+    }
+
+    return output;
+}
+
+template <typename F>
+struct FinalAction {
+    FinalAction(F f) : clean_{ f } {}
+    ~FinalAction() { clean_(); }
+    F clean_;
+};
+
+template <typename F>
+FinalAction<F> finally(F f) {
+    return FinalAction<F>(f);
+}
+
+
+/*
+ * Registry Utilities
+ */
+
+enum RegistryFailureReason
+{
+    REGISTRY_FAILURE_NO_REASON = 0,
+    REGISTRY_FAILURE_WRITE_TOO_LONG
+};
+
+enum RegistryStandInType
+{
+    REGISTRY_STAND_IN_DWORD,
+    REGISTRY_STAND_IN_STRING,
+    REGISTRY_STAND_IN_BINARY
+};
+
+typedef map<string, pair<RegistryStandInType, string>> RegistryStandInValues;
+
+// The values written so far. Tests may change or clear them.
+inline RegistryStandInValues& RegistryStandIn()
+{
+    static RegistryStandInValues values;
+    return values;
+}
+
+// Writing a longer value fails with REGISTRY_FAILURE_WRITE_TOO_LONG, as
+// RegSetValueEx fails with ERROR_NO_SYSTEM_RESOURCES for a value that's too
+// large. 0 for no limit.
+inline size_t& RegistryStandInMaxValueLength()
+{
+    static size_t maxLength = 0;
+    return maxLength;
+}
+
+inline bool WriteRegistryStandInValue(const string& name, RegistryStandInType type, const string& value, RegistryFailureReason& reason)
+{
+    reason = REGISTRY_FAILURE_NO_REASON;
+    if (RegistryStandInMaxValueLength() > 0 && value.length() > RegistryStandInMaxValueLength())
+    {
+        reason = REGISTRY_FAILURE_WRITE_TOO_LONG;
+        return false;
+    }
+    RegistryStandIn()[name] = make_pair(type, value);
+    return true;
+}
+
+inline bool ReadRegistryStandInValue(const string& name, RegistryStandInType type, string& value)
+{
+    auto entry = RegistryStandIn().find(name);
+    if (entry == RegistryStandIn().end() || entry->second.first != type)
+    {
+        return false;
+    }
+    value = entry->second.second;
+    return true;
+}
+
+inline bool DoesRegistryValueExist(const string& name)
+{
+    return RegistryStandIn().count(name) > 0;
+}
+
+inline bool WriteRegistryDwordValue(const string& name, DWORD value)
+{
+    RegistryFailureReason reason;
+    return WriteRegistryStandInValue(name, REGISTRY_STAND_IN_DWORD, to_string(value), reason);
+}
+
+inline bool ReadRegistryDwordValue(const string& name, DWORD& value)
+{
+    string stored;
+    if (!ReadRegistryStandInValue(name, REGISTRY_STAND_IN_DWORD, stored))
+    {
+        return false;
+    }
+    value = (DWORD)stoul(stored);
+    return true;
+}
+
+inline bool WriteRegistryStringValue(const string& name, const string& value, RegistryFailureReason& reason)
+{
+    return WriteRegistryStandInValue(name, REGISTRY_STAND_IN_STRING, value, reason);
+}
+
+inline bool ReadRegistryStringValue(LPCSTR name, string& value)
+{
+    return ReadRegistryStandInValue(name, REGISTRY_STAND_IN_STRING, value);
+}
+
+inline bool WriteRegistryBinaryValue(const string& name, const string& value, RegistryFailureReason& reason)
+{
+    return WriteRegistryStandInValue(name, REGISTRY_STAND_IN_BINARY, value, reason);
+}
+
+inline bool ReadRegistryBinaryValue(LPCSTR name, string& value)
+{
+    return ReadRegistryStandInValue(name, REGISTRY_STAND_IN_BINARY, value);
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "reachability_prober.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const DWORD STOP_REASONS = STOP_REASON_CANCEL;
+
+// A TCP socket bound to an ephemeral port on the loopback address.
+class LocalSocket
+{
+public:
+    LocalSocket()
+    {
+        m_sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = LoopbackAddress(0);
+        if (m_sock == -1 || 0 != ::bind(m_sock, (sockaddr*)&address, sizeof(address)))
+        {
+            throw std::runtime_error("LocalSocket: bind failed");
+        }
+        socklen_t length = sizeof(address);
+        getsockname(m_sock, (sockaddr*)&address, &length);
+        m_port = ntohs(address.sin_port);
+    }
+
+    ~LocalSocket()
+    {
+        close(m_sock);
+    }
+
+    void Listen(int backlog)
+    {
+        ASSERT_EQ(0, listen(m_sock, backlog));
+    }
+
+    int Port() const { return m_port; }
+
+    static sockaddr_in LoopbackAddress(int port)
+    {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((uint16_t)port);
+        return address;
+    }
+
+private:
+    int m_sock;
+    int m_port;
+};
+
+// A listener whose accept queue is full, so that it drops further
+// connection attempts (SYNs) without replying, as an unreachable server
+// would. Connections to it stay pending until they're abandoned.
+class UnresponsiveListener
+{
+public:
+    UnresponsiveListener()
+    {
+        m_listener.Listen(0);
+
+        // A backlog of 0 still queues a connection or so; the rest of these
+        // are left pending themselves
+        for (int i = 0; i < 4; i++)
+        {
+            int sock = socket(AF_INET, SOCK_STREAM, 0);
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+            sockaddr_in address = LocalSocket::LoopbackAddress(m_listener.Port());
+            connect(sock, (sockaddr*)&address, sizeof(address));
+            m_fillers.push_back(sock);
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+
+    ~UnresponsiveListener()
+    {
+        for (int sock : m_fillers)
+        {
+            close(sock);
+        }
+    }
+
+    int Port() const { return m_listener.Port(); }
+
+private:
+    LocalSocket m_listener;
+    vector<int> m_fillers;
+};
+
+double ElapsedMilliseconds(Clock::time_point start)
+{
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+}  // namespace
+
+
+TEST(ReachabilityProberTest, ListeningServersRespond)
+{
+    LocalSocket listener;
+    listener.Listen(SOMAXCONN);
+
+    // More probes than may be in flight at once
+    vector<ReachabilityProbe> probes(10, ReachabilityProbe("127.0.0.1", listener.Port()));
+    StopSignal stopSignal;
+
+    Clock::time_point start = Clock::now();
+    ProbeReachability(probes, 10000, 3, StopInfo(&stopSignal, STOP_REASONS));
+    EXPECT_LT(ElapsedMilliseconds(start), 5000);
+
+    for (const ReachabilityProbe& probe : probes)
+    {
+        EXPECT_TRUE(probe.responded);
+        EXPECT_GE(probe.responseTimeMilliseconds, 0);
+    }
+}
+
+TEST(ReachabilityProberTest, RefusedConnectionsDontRespond)
+{
+    // Bound, so no one else gets the port, but not listening
+    LocalSocket closed;
+    LocalSocket listener;
+    listener.Listen(SOMAXCONN);
+
+    vector<ReachabilityProbe> probes;
+    probes.push_back(ReachabilityProbe("127.0.0.1", closed.Port()));
+    probes.push_back(ReachabilityProbe("127.0.0.1", listener.Port()));
+    StopSignal stopSignal;
+
+    // Refusals complete the probes, without waiting for the timeout
+    Clock::time_point start = Clock::now();
+    ProbeReachability(probes, 10000, 10, StopInfo(&stopSignal, STOP_REASONS));
+    EXPECT_LT(ElapsedMilliseconds(start), 5000);
+
+    EXPECT_FALSE(probes[0].responded);
+    EXPECT_TRUE(probes[1].responded);
+}
+
+TEST(ReachabilityProberTest, InvalidProbesDontRespond)
+{
+    vector<ReachabilityProbe> probes;
+    probes.push_back(ReachabilityProbe("127.0.0.1", 0));
+    probes.push_back(ReachabilityProbe("127.0.0.1", 70000));
+    probes.push_back(ReachabilityProbe("not an address", 80));
+    StopSignal stopSignal;
+
+    ProbeReachability(probes, 10000, 10, StopInfo(&stopSignal, STOP_REASONS));
+
+    for (const ReachabilityProbe& probe : probes)
+    {
+        EXPECT_FALSE(probe.responded);
+    }
+}
+
+TEST(ReachabilityProberTest, UnansweredProbesAreAbandonedAtTheDeadline)
+{
+    UnresponsiveListener unresponsive;
+    LocalSocket listener;
+    listener.Listen(SOMAXCONN);
+
+    vector<ReachabilityProbe> probes;
+    probes.push_back(ReachabilityProbe("127.0.0.1", unresponsive.Port()));
+    probes.push_back(ReachabilityProbe("127.0.0.1", listener.Port()));
+    StopSignal stopSignal;
+
+    const unsigned int TIMEOUT = 500;
+    Clock::time_point start = Clock::now();
+    ProbeReachability(probes, TIMEOUT, 10, StopInfo(&stopSignal, STOP_REASONS));
+    double elapsed = ElapsedMilliseconds(start);
+    EXPECT_GE(elapsed, TIMEOUT);
+    EXPECT_LT(elapsed, TIMEOUT + 1000);
+
+    EXPECT_FALSE(probes[0].responded);
+    EXPECT_GE(probes[0].responseTimeMilliseconds, TIMEOUT);
+    EXPECT_TRUE(probes[1].responded);
+}
+
+TEST(ReachabilityProberTest, StopSignalAbandonsProbes)
+{
+    UnresponsiveListener unresponsive;
+
+    vector<ReachabilityProbe> probes(3, ReachabilityProbe("127.0.0.1", unresponsive.Port()));
+    StopSignal stopSignal;
+
+    thread stopper([&stopSignal]() {
+        this_thread::sleep_for(chrono::milliseconds(200));
+        stopSignal.SignalStop(STOP_REASON_CANCEL);
+    });
+
+    Clock::time_point start = Clock::now();
+    ProbeReachability(probes, 30000, 10, StopInfo(&stopSignal, STOP_REASONS));
+    double elapsed = ElapsedMilliseconds(start);
+    stopper.join();
+
+    // The stop signal is checked at least this often while waiting
+    EXPECT_LT(elapsed, 5000);
+
+    for (const ReachabilityProbe& probe : probes)
+    {
+        EXPECT_FALSE(probe.responded);
+        EXPECT_LT(probe.responseTimeMilliseconds, 5000);
+    }
+}
+
+TEST(ReachabilityProberTest, OtherStopReasonsAreIgnored)
+{
+    UnresponsiveListener unresponsive;
+
+    vector<ReachabilityProbe> probes(1, ReachabilityProbe("127.0.0.1", unresponsive.Port()));
+    StopSignal stopSignal;
+    stopSignal.SignalStop(STOP_REASON_CONNECTED);
+
+    const unsigned int TIMEOUT = 300;
+    Clock::time_point start = Clock::now();
+    ProbeReachability(probes, TIMEOUT, 10, StopInfo(&stopSignal, STOP_REASONS));
+    EXPECT_GE(ElapsedMilliseconds(start), TIMEOUT);
+    EXPECT_FALSE(probes[0].responded);
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures merging the embedded server list into the system list, as
+ServerList::GetCurrentList does, for an embedded list of 2,000 entries of
+which some are already in the system list:
+- decoded: the whole embedded list is decoded up front, as it was, and each
+  entry looked up.
+- view: the list is read through a ServerEntryListView, as it is now. Only
+  addresses are read for the entries that are already known; only new
+  entries are fully decoded.
+
+Both encodings of the embedded list are measured. Adding the new entries to
+the system list is left out.
+
+    server_entry_list_view_benchmark [entries] [iterations]
+*/
+
+#include "stdafx.h"
+#include "server_list_encoding.h"
+#include "utilities.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <sstream>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const int KNOWN_PERCENT[] = { 100, 90, 50, 0 };
+
+const char* CAPABILITIES[] = { "OSSH", "SSH", "VPN", "handshake", "FRONTED-MEEK", "UNFRONTED-MEEK" };
+const char* REGIONS[] = { "CA", "DE", "GB", "NL", "US" };
+
+string RandomHex(mt19937& rng, size_t length)
+{
+    static const char* const digits = "0123456789abcdef";
+    string value(length, '\0');
+    for (char& c : value)
+    {
+        c = digits[rng() % 16];
+    }
+    return value;
+}
+
+ServerEntry Entry(mt19937& rng, int index)
+{
+    ServerEntry entry;
+    entry.serverAddress = "10." + to_string(index / 65536) + "." + to_string(index / 256 % 256) + "." + to_string(index % 256);
+    entry.region = REGIONS[rng() % 5];
+    entry.webServerPort = 8000 + rng() % 1000;
+    entry.webServerSecret = RandomHex(rng, 64);
+    entry.webServerCertificate = RandomHex(rng, 1000);
+    entry.sshPort = 22;
+    entry.sshUsername = RandomHex(rng, 32);
+    entry.sshPassword = RandomHex(rng, 64);
+    entry.sshHostKey = RandomHex(rng, 400);
+    entry.sshObfuscatedPort = 443;
+    entry.sshObfuscatedKey = RandomHex(rng, 64);
+    for (const char* capability : CAPABILITIES)
+    {
+        if (rng() % 2)
+        {
+            entry.capabilities.push_back(capability);
+        }
+    }
+    entry.meekServerPort = -1;
+    return entry;
+}
+
+string EncodeLegacy(const ServerEntries& entries)
+{
+    string encoded;
+    for (const ServerEntry& entry : entries)
+    {
+        string line = entry.ToString();
+        encoded += Hexlify((const unsigned char*)line.data(), line.length()) + "\n";
+    }
+    return encoded;
+}
+
+ServerEntries DecodeLegacy(const string& encoded)
+{
+    ServerEntries entries;
+    istringstream lines(encoded);
+    string line;
+    while (getline(lines, line))
+    {
+        ServerEntry entry;
+        entry.FromString(Dehexlify(line));
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+bool IsNew(const ServerEntry* systemServerEntry, const ServerEntry& embeddedServerEntry)
+{
+    return !systemServerEntry ||
+        (systemServerEntry->sshObfuscatedKey.length() == 0 && embeddedServerEntry.sshObfuscatedKey.length() > 0);
+}
+
+size_t MergeDecoded(const IndexedServerEntries& system, const string& embedded)
+{
+    ServerEntries entries = IsBinaryServerEntryList(embedded) ? DecodeBinaryServerEntryList(embedded) : DecodeLegacy(embedded);
+
+    vector<const ServerEntry*> newServerEntries;
+    for (const ServerEntry& entry : entries)
+    {
+        if (IsNew(system.Find(entry.serverAddress), entry))
+        {
+            newServerEntries.push_back(&entry);
+        }
+    }
+    return newServerEntries.size();
+}
+
+size_t MergeView(const IndexedServerEntries& system, const string& embedded)
+{
+    ServerEntryListView view(embedded);
+
+    vector<const ServerEntry*> newServerEntries;
+    for (size_t i = 0; i < view.size(); i++)
+    {
+        const ServerEntry* systemServerEntry = system.Find(view.GetServerAddress(i));
+        if (!systemServerEntry ||
+            (systemServerEntry->sshObfuscatedKey.length() == 0 && view.GetEntry(i).sshObfuscatedKey.length() > 0))
+        {
+            newServerEntries.push_back(&view.GetEntry(i));
+        }
+    }
+    return newServerEntries.size();
+}
+
+double Milliseconds(int iterations, const function<void()>& operation)
+{
+    operation();
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        operation();
+    }
+    return chrono::duration<double, milli>(Clock::now() - start).count() / iterations;
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int entryCount = (argc > 1) ? atoi(argv[1]) : 2000;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 10;
+
+    mt19937 rng(1);
+    ServerEntries entries;
+    for (int i = 0; i < entryCount; i++)
+    {
+        entries.push_back(Entry(rng, i));
+    }
+
+    const string legacy = EncodeLegacy(entries);
+    const string binary = EncodeBinaryServerEntryList(entries);
+
+    printf("%d embedded entries, %d iterations\n", entryCount, iterations);
+
+    for (int knownPercent : KNOWN_PERCENT)
+    {
+        IndexedServerEntries system;
+        for (int i = 0; i < entryCount * knownPercent / 100; i++)
+        {
+            system.Upsert(entries[i]);
+        }
+
+        printf("%3d%% known\n", knownPercent);
+        for (const string* embedded : { &legacy, &binary })
+        {
+            if (MergeDecoded(system, *embedded) != MergeView(system, *embedded))
+            {
+                fprintf(stderr, "merges differ\n");
+                return 1;
+            }
+
+            printf("  %-7s decoded %8.2f ms  view %8.2f ms\n", (embedded == &legacy) ? "legacy" : "binary",
+                   Milliseconds(iterations, [&]() { MergeDecoded(system, *embedded); }),
+                   Milliseconds(iterations, [&]() { MergeView(system, *embedded); }));
+        }
+    }
+
+    return 0;
+}
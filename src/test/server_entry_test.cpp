@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "serverlist.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+
+
+namespace {
+
+ServerEntry Entry(const string& address, const string& region = "CA")
+{
+    ServerEntry entry;
+    entry.serverAddress = address;
+    entry.region = region;
+    return entry;
+}
+
+vector<string> Addresses(const IndexedServerEntries& entries)
+{
+    vector<string> addresses;
+    for (const ServerEntry& entry : entries.ToVector())
+    {
+        addresses.push_back(entry.serverAddress);
+    }
+    return addresses;
+}
+
+// Checks that every entry in the list, and no other, can be found, and that
+// Find returns the entry in the list.
+void ExpectIndexMatches(const IndexedServerEntries& entries, const vector<string>& expected, int addresses)
+{
+    EXPECT_EQ(expected, Addresses(entries));
+    EXPECT_EQ(expected.size(), entries.size());
+    for (int i = 0; i < addresses; i++)
+    {
+        string address = "10.0.0." + to_string(i);
+        const ServerEntry* entry = entries.Find(address);
+        bool listed = find(expected.begin(), expected.end(), address) != expected.end();
+        ASSERT_EQ(listed, entry != NULL) << address;
+        if (entry)
+        {
+            EXPECT_EQ(address, entry->serverAddress);
+        }
+    }
+    if (!expected.empty())
+    {
+        EXPECT_TRUE(entries.IsFirst(expected.front()));
+    }
+}
+
+}  // namespace
+
+
+TEST(IndexedServerEntriesTest, DuplicatesKeepTheFirstOccurrence)
+{
+    IndexedServerEntries entries(ServerEntries({
+        Entry("10.0.0.1", "CA"), Entry("10.0.0.2"), Entry("10.0.0.1", "DE"), Entry("10.0.0.3") }));
+
+    EXPECT_EQ(vector<string>({ "10.0.0.1", "10.0.0.2", "10.0.0.3" }), Addresses(entries));
+    ASSERT_TRUE(entries.Find("10.0.0.1"));
+    EXPECT_EQ("CA", entries.Find("10.0.0.1")->region);
+    EXPECT_FALSE(entries.Find("10.0.0.4"));
+    EXPECT_FALSE(entries.Find(""));
+}
+
+TEST(IndexedServerEntriesTest, UpsertInsertsSecondOrReplacesInPlace)
+{
+    IndexedServerEntries entries;
+    EXPECT_TRUE(entries.empty());
+    EXPECT_FALSE(entries.IsFirst("10.0.0.1"));
+
+    // Into an empty list, the new entry is first
+    EXPECT_TRUE(entries.Upsert(Entry("10.0.0.1")));
+    EXPECT_TRUE(entries.Upsert(Entry("10.0.0.2")));
+    EXPECT_TRUE(entries.Upsert(Entry("10.0.0.3")));
+    EXPECT_EQ(vector<string>({ "10.0.0.1", "10.0.0.3", "10.0.0.2" }), Addresses(entries));
+
+    EXPECT_FALSE(entries.Upsert(Entry("10.0.0.2", "DE")));
+    EXPECT_EQ(vector<string>({ "10.0.0.1", "10.0.0.3", "10.0.0.2" }), Addresses(entries));
+    EXPECT_EQ("DE", entries.Find("10.0.0.2")->region);
+}
+
+TEST(IndexedServerEntriesTest, MoveAndErase)
+{
+    IndexedServerEntries entries(ServerEntries({
+        Entry("10.0.0.0"), Entry("10.0.0.1"), Entry("10.0.0.2"), Entry("10.0.0.3") }));
+
+    EXPECT_TRUE(entries.MoveToFront("10.0.0.3", false));
+    ExpectIndexMatches(entries, { "10.0.0.0", "10.0.0.3", "10.0.0.1", "10.0.0.2" }, 5);
+
+    EXPECT_TRUE(entries.MoveToFront("10.0.0.2", true));
+    ExpectIndexMatches(entries, { "10.0.0.2", "10.0.0.0", "10.0.0.3", "10.0.0.1" }, 5);
+
+    // Moving the head, not to the very front, puts it second
+    EXPECT_TRUE(entries.MoveToFront("10.0.0.2", false));
+    ExpectIndexMatches(entries, { "10.0.0.0", "10.0.0.2", "10.0.0.3", "10.0.0.1" }, 5);
+
+    EXPECT_TRUE(entries.MoveToBack("10.0.0.0"));
+    ExpectIndexMatches(entries, { "10.0.0.2", "10.0.0.3", "10.0.0.1", "10.0.0.0" }, 5);
+
+    EXPECT_TRUE(entries.Erase("10.0.0.3"));
+    ExpectIndexMatches(entries, { "10.0.0.2", "10.0.0.1", "10.0.0.0" }, 5);
+
+    EXPECT_FALSE(entries.MoveToFront("10.0.0.3", true));
+    EXPECT_FALSE(entries.MoveToBack("10.0.0.3"));
+    EXPECT_FALSE(entries.Erase("10.0.0.3"));
+    EXPECT_FALSE(entries.Erase("10.0.0.4"));
+    ExpectIndexMatches(entries, { "10.0.0.2", "10.0.0.1", "10.0.0.0" }, 5);
+
+    EXPECT_TRUE(entries.Erase("10.0.0.2"));
+    EXPECT_TRUE(entries.Erase("10.0.0.1"));
+    EXPECT_TRUE(entries.Erase("10.0.0.0"));
+    ExpectIndexMatches(entries, {}, 5);
+}
+
+TEST(IndexedServerEntriesTest, RandomOperationsMatchAPlainList)
+{
+    const int ADDRESSES = 50;
+    mt19937 rng(1);
+
+    IndexedServerEntries entries;
+    vector<string> expected;
+
+    for (int i = 0; i < 5000; i++)
+    {
+        string address = "10.0.0." + to_string(rng() % ADDRESSES);
+        auto position = find(expected.begin(), expected.end(), address);
+        bool listed = (position != expected.end());
+
+        switch (rng() % 4)
+        {
+        case 0:
+            EXPECT_EQ(!listed, entries.Upsert(Entry(address)));
+            if (!listed)
+            {
+                expected.insert(expected.empty() ? expected.begin() : expected.begin() + 1, address);
+            }
+            break;
+        case 1:
+        {
+            bool veryFront = (rng() % 2 == 0);
+            EXPECT_EQ(listed, entries.MoveToFront(address, veryFront));
+            if (listed)
+            {
+                expected.erase(position);
+                expected.insert((veryFront || expected.empty()) ? expected.begin() : expected.begin() + 1, address);
+            }
+            break;
+        }
+        case 2:
+            EXPECT_EQ(listed, entries.MoveToBack(address));
+            if (listed)
+            {
+                expected.erase(position);
+                expected.push_back(address);
+            }
+            break;
+        case 3:
+            // Less often, so that the list fills up
+            if (rng() % 3 == 0)
+            {
+                EXPECT_EQ(listed, entries.Erase(address));
+                if (listed)
+                {
+                    expected.erase(position);
+                }
+            }
+            break;
+        }
+
+        ASSERT_NO_FATAL_FAILURE(ExpectIndexMatches(entries, expected, ADDRESSES)) << "operation " << i;
+    }
+}
+
+TEST(IndexedServerEntriesTest, CopiesAreIndependent)
+{
+    // ServerList shares the cached list and changes a copy of it, so a copy
+    // mustn't share anything with the original
+    IndexedServerEntries original(ServerEntries({ Entry("10.0.0.0"), Entry("10.0.0.1"), Entry("10.0.0.2") }));
+    const ServerEntry* originalEntry = original.Find("10.0.0.1");
+
+    IndexedServerEntries copy(original);
+    EXPECT_NE(originalEntry, copy.Find("10.0.0.1"));
+
+    EXPECT_TRUE(copy.MoveToBack("10.0.0.0"));
+    EXPECT_TRUE(copy.Erase("10.0.0.1"));
+    EXPECT_TRUE(copy.Upsert(Entry("10.0.0.3")));
+    EXPECT_FALSE(copy.Upsert(Entry("10.0.0.2", "DE")));
+
+    ExpectIndexMatches(original, { "10.0.0.0", "10.0.0.1", "10.0.0.2" }, 4);
+    EXPECT_EQ(originalEntry, original.Find("10.0.0.1"));
+    EXPECT_EQ("CA", original.Find("10.0.0.2")->region);
+    ExpectIndexMatches(copy, { "10.0.0.2", "10.0.0.3", "10.0.0.0" }, 4);
+
+    // And by assignment
+    copy = original;
+    EXPECT_TRUE(copy.Erase("10.0.0.2"));
+    ExpectIndexMatches(original, { "10.0.0.0", "10.0.0.1", "10.0.0.2" }, 4);
+    ExpectIndexMatches(copy, { "10.0.0.0", "10.0.0.1" }, 4);
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures what ServerList does to its cached list on each call, for a list of
+10,000 entries, with the list cached as:
+- vector: a shared ServerEntries, as it was. Every change indexes the vector
+  into an IndexedServerEntries, changes that, and flattens it back into a
+  vector for the cache.
+- indexed: a shared IndexedServerEntries, as it is now. A change is made to a
+  copy of it, made only once something is to change, and the copy is cached
+  as it is.
+
+ServerList itself needs Windows (its named mutex and stores), so this does
+the same steps on the same types. Storing the changes is left out.
+
+    server_list_benchmark [entries] [iterations]
+*/
+
+#include "stdafx.h"
+#include "serverlist.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+// As RankCheckedEntries moves, at most
+const int CHECKED_SERVERS = 30;
+
+string Address(int i)
+{
+    return "10." + to_string(i / 65536) + "." + to_string(i / 256 % 256) + "." + to_string(i % 256);
+}
+
+// About the size of a real entry
+ServerEntry Entry(int i)
+{
+    ServerEntry entry;
+    entry.serverAddress = Address(i);
+    entry.region = "CA";
+    entry.webServerPort = 8000;
+    entry.webServerSecret = string(64, 's');
+    entry.webServerCertificate = string(1000, 'c');
+    entry.sshPort = 22;
+    entry.sshUsername = string(32, 'u');
+    entry.sshPassword = string(64, 'p');
+    entry.sshHostKey = string(400, 'k');
+    entry.sshObfuscatedPort = 443;
+    entry.sshObfuscatedKey = string(64, 'o');
+    entry.capabilities = { "OSSH", "SSH", "VPN", "handshake" };
+    entry.meekServerPort = -1;
+    return entry;
+}
+
+void Time(const char* name, int iterations, const function<void()>& operation)
+{
+    operation();
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        operation();
+    }
+    double microseconds = chrono::duration<double, micro>(Clock::now() - start).count() / iterations;
+    printf("  %-8s %10.1f us\n", name, microseconds);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int entryCount = (argc > 1) ? atoi(argv[1]) : 10000;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 50;
+
+    ServerEntries entries;
+    for (int i = 0; i < entryCount; i++)
+    {
+        entries.push_back(Entry(i));
+    }
+
+    shared_ptr<const ServerEntries> vectorCache = make_shared<const ServerEntries>(entries);
+    shared_ptr<const IndexedServerEntries> indexedCache = make_shared<const IndexedServerEntries>(entries);
+
+    mt19937 rng(1);
+    ServerEntries checked;
+    for (int i = 0; i < CHECKED_SERVERS; i++)
+    {
+        checked.push_back(entries[rng() % entryCount]);
+    }
+    const string failed = Address(entryCount / 2);
+    const string unknown = Address(entryCount + 1);
+
+    printf("%d entries, %d iterations\n", entryCount, iterations);
+
+    printf("GetList\n");
+    Time("vector", iterations, [&]() {
+        ServerEntries list = *vectorCache;
+    });
+    Time("indexed", iterations, [&]() {
+        ServerEntries list = indexedCache->ToVector();
+    });
+
+    printf("MarkServerFailed\n");
+    Time("vector", iterations, [&]() {
+        IndexedServerEntries list(*vectorCache);
+        list.MoveToBack(failed);
+        vectorCache = make_shared<const ServerEntries>(list.ToVector());
+    });
+    Time("indexed", iterations, [&]() {
+        shared_ptr<IndexedServerEntries> list = make_shared<IndexedServerEntries>(*indexedCache);
+        list->MoveToBack(failed);
+        indexedCache = list;
+    });
+
+    printf("MarkServerFailed, for a server that isn't in the list\n");
+    Time("vector", iterations, [&]() {
+        IndexedServerEntries list(*vectorCache);
+        list.MoveToBack(unknown);
+    });
+    Time("indexed", iterations, [&]() {
+        if (indexedCache->Find(unknown))
+        {
+            abort();
+        }
+    });
+
+    printf("MoveEntriesToFront, %d entries\n", CHECKED_SERVERS);
+    Time("vector", iterations, [&]() {
+        IndexedServerEntries list(*vectorCache);
+        for (auto entry = checked.rbegin(); entry != checked.rend(); ++entry)
+        {
+            list.MoveToFront(entry->serverAddress, false);
+        }
+        vectorCache = make_shared<const ServerEntries>(list.ToVector());
+    });
+    Time("indexed", iterations, [&]() {
+        shared_ptr<IndexedServerEntries> list = make_shared<IndexedServerEntries>(*indexedCache);
+        for (auto entry = checked.rbegin(); entry != checked.rend(); ++entry)
+        {
+            list->MoveToFront(entry->serverAddress, false);
+        }
+        indexedCache = list;
+    });
+
+    return 0;
+}
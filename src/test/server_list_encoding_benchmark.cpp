@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Compares the persisted server list encodings, for a list of 2,000 entries:
+- legacy: one hex-encoded ServerEntry::ToString() -- space-separated fields
+  and a JSON object -- per line.
+- binary: EncodeBinaryServerEntryList, as lists are now written.
+
+Prints the size of each encoding, and the time to encode and fully decode
+the list. Entries are shaped like real ones, with printable keys and
+certificates, and regions, capabilities and fronting domains repeated across
+entries.
+
+    server_list_encoding_benchmark [entries] [iterations]
+*/
+
+#include "stdafx.h"
+#include "server_list_encoding.h"
+#include "utilities.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <sstream>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const char* CAPABILITIES[] = { "OSSH", "SSH", "VPN", "handshake", "FRONTED-MEEK", "UNFRONTED-MEEK" };
+const char* REGIONS[] = { "CA", "DE", "GB", "NL", "US" };
+
+string RandomHex(mt19937& rng, size_t length)
+{
+    static const char* const digits = "0123456789abcdef";
+    string value(length, '\0');
+    for (char& c : value)
+    {
+        c = digits[rng() % 16];
+    }
+    return value;
+}
+
+ServerEntry Entry(mt19937& rng, int index)
+{
+    ServerEntry entry;
+    entry.serverAddress = "10." + to_string(index / 65536) + "." + to_string(index / 256 % 256) + "." + to_string(index % 256);
+    entry.region = REGIONS[rng() % 5];
+    entry.webServerPort = 8000 + rng() % 1000;
+    entry.webServerSecret = RandomHex(rng, 64);
+    entry.webServerCertificate = RandomHex(rng, 1000);
+    entry.sshPort = 22;
+    entry.sshUsername = RandomHex(rng, 32);
+    entry.sshPassword = RandomHex(rng, 64);
+    entry.sshHostKey = RandomHex(rng, 400);
+    entry.sshObfuscatedPort = 443;
+    entry.sshObfuscatedKey = RandomHex(rng, 64);
+    for (const char* capability : CAPABILITIES)
+    {
+        if (rng() % 2)
+        {
+            entry.capabilities.push_back(capability);
+        }
+    }
+    bool meek = (rng() % 2 == 0);
+    entry.meekServerPort = meek ? 443 : -1;
+    if (meek)
+    {
+        entry.meekObfuscatedKey = RandomHex(rng, 64);
+        entry.meekCookieEncryptionPublicKey = RandomHex(rng, 44);
+        entry.meekFrontingDomain = "fronting.example.com";
+        entry.meekFrontingHost = "host.example.com";
+    }
+    return entry;
+}
+
+string EncodeLegacy(const ServerEntries& entries)
+{
+    string encoded;
+    for (const ServerEntry& entry : entries)
+    {
+        string line = entry.ToString();
+        encoded += Hexlify((const unsigned char*)line.data(), line.length()) + "\n";
+    }
+    return encoded;
+}
+
+ServerEntries DecodeLegacy(const string& encoded)
+{
+    ServerEntries entries;
+    istringstream lines(encoded);
+    string line;
+    while (getline(lines, line))
+    {
+        ServerEntry entry;
+        entry.FromString(Dehexlify(line));
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+double Milliseconds(int iterations, const function<void()>& operation)
+{
+    operation();
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        operation();
+    }
+    return chrono::duration<double, milli>(Clock::now() - start).count() / iterations;
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int entryCount = (argc > 1) ? atoi(argv[1]) : 2000;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 10;
+
+    mt19937 rng(1);
+    ServerEntries entries;
+    for (int i = 0; i < entryCount; i++)
+    {
+        entries.push_back(Entry(rng, i));
+    }
+
+    string legacy = EncodeLegacy(entries);
+    string binary = EncodeBinaryServerEntryList(entries);
+    if (DecodeLegacy(legacy).size() != entries.size() || DecodeBinaryServerEntryList(binary).size() != entries.size())
+    {
+        fprintf(stderr, "round trip failed\n");
+        return 1;
+    }
+
+    printf("%d entries, %d iterations\n", entryCount, iterations);
+    printf("  %-7s %9zu bytes  encode %8.2f ms  decode %8.2f ms\n", "legacy", legacy.length(),
+           Milliseconds(iterations, [&]() { legacy = EncodeLegacy(entries); }),
+           Milliseconds(iterations, [&]() { DecodeLegacy(legacy); }));
+    printf("  %-7s %9zu bytes  encode %8.2f ms  decode %8.2f ms\n", "binary", binary.length(),
+           Milliseconds(iterations, [&]() { binary = EncodeBinaryServerEntryList(entries); }),
+           Milliseconds(iterations, [&]() { DecodeBinaryServerEntryList(binary); }));
+
+    return 0;
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "server_list_encoding.h"
+#include "utilities.h"
+#include <gtest/gtest.h>
+#include <random>
+
+
+namespace {
+
+const char* CAPABILITIES[] = { "OSSH", "SSH", "VPN", "handshake", "FRONTED-MEEK", "UNFRONTED-MEEK" };
+const char* REGIONS[] = { "CA", "DE", "GB", "NL", "US" };
+
+string RandomString(mt19937& rng, size_t maxLength)
+{
+    string value(rng() % (maxLength + 1), '\0');
+    for (size_t i = 0; i < value.length(); i++)
+    {
+        // Any byte, including NUL
+        value[i] = (char)(rng() & 0xFF);
+    }
+    return value;
+}
+
+// Shaped like a real entry: repeated regions and capabilities, long keys and
+// certificates, and meekServerPort of -1 where there's no meek.
+ServerEntry RandomServerEntry(mt19937& rng, int index)
+{
+    ServerEntry entry;
+    entry.serverAddress = "192.0." + to_string(index / 256) + "." + to_string(index % 256);
+    entry.region = REGIONS[rng() % 5];
+    entry.webServerPort = 8000 + rng() % 1000;
+    entry.webServerSecret = RandomString(rng, 64);
+    entry.webServerCertificate = RandomString(rng, 1000);
+    entry.sshPort = 22;
+    entry.sshUsername = RandomString(rng, 32);
+    entry.sshPassword = RandomString(rng, 64);
+    entry.sshHostKey = RandomString(rng, 400);
+    entry.sshObfuscatedPort = (rng() % 2) ? 443 : 0;
+    entry.sshObfuscatedKey = RandomString(rng, 64);
+    for (size_t i = 0; i < 6; i++)
+    {
+        if (rng() % 2)
+        {
+            entry.capabilities.push_back(CAPABILITIES[i]);
+        }
+    }
+    entry.meekServerPort = (rng() % 2) ? -1 : (int)(rng() % 65536);
+    entry.meekObfuscatedKey = RandomString(rng, 64);
+    entry.meekCookieEncryptionPublicKey = RandomString(rng, 44);
+    entry.meekFrontingDomain = (rng() % 2) ? "" : "fronting.example.com";
+    entry.meekFrontingHost = RandomString(rng, 20);
+    entry.meekFrontingAddressesRegex = RandomString(rng, 20);
+    for (size_t count = rng() % 3; count > 0; count--)
+    {
+        entry.meekFrontingAddresses.push_back(RandomString(rng, 16));
+    }
+    return entry;
+}
+
+ServerEntries RandomServerEntries(mt19937& rng, int count)
+{
+    ServerEntries entries;
+    for (int i = 0; i < count; i++)
+    {
+        entries.push_back(RandomServerEntry(rng, i));
+    }
+    return entries;
+}
+
+void ExpectSameEntry(const ServerEntry& expected, const ServerEntry& actual)
+{
+    EXPECT_EQ(expected.serverAddress, actual.serverAddress);
+    EXPECT_EQ(expected.region, actual.region);
+    EXPECT_EQ(expected.webServerPort, actual.webServerPort);
+    EXPECT_EQ(expected.webServerSecret, actual.webServerSecret);
+    EXPECT_EQ(expected.webServerCertificate, actual.webServerCertificate);
+    EXPECT_EQ(expected.sshPort, actual.sshPort);
+    EXPECT_EQ(expected.sshUsername, actual.sshUsername);
+    EXPECT_EQ(expected.sshPassword, actual.sshPassword);
+    EXPECT_EQ(expected.sshHostKey, actual.sshHostKey);
+    EXPECT_EQ(expected.sshObfuscatedPort, actual.sshObfuscatedPort);
+    EXPECT_EQ(expected.sshObfuscatedKey, actual.sshObfuscatedKey);
+    EXPECT_EQ(expected.capabilities, actual.capabilities);
+    EXPECT_EQ(expected.meekObfuscatedKey, actual.meekObfuscatedKey);
+    EXPECT_EQ(expected.meekServerPort, actual.meekServerPort);
+    EXPECT_EQ(expected.meekCookieEncryptionPublicKey, actual.meekCookieEncryptionPublicKey);
+    EXPECT_EQ(expected.meekFrontingDomain, actual.meekFrontingDomain);
+    EXPECT_EQ(expected.meekFrontingHost, actual.meekFrontingHost);
+    EXPECT_EQ(expected.meekFrontingAddressesRegex, actual.meekFrontingAddressesRegex);
+    EXPECT_EQ(expected.meekFrontingAddresses, actual.meekFrontingAddresses);
+}
+
+void ExpectSameEntries(const ServerEntries& expected, const ServerEntries& actual)
+{
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        ExpectSameEntry(expected[i], actual[i]);
+    }
+}
+
+vector<string> Addresses(const ServerEntries& entries)
+{
+    vector<string> addresses;
+    for (ServerEntryIterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        addresses.push_back(it->serverAddress);
+    }
+    return addresses;
+}
+
+bool DecodeFails(const string& data)
+{
+    try
+    {
+        DecodeBinaryServerEntryList(data);
+    }
+    catch (std::exception&)
+    {
+        return true;
+    }
+    return false;
+}
+
+}  // namespace
+
+
+TEST(ServerListEncodingTest, RoundTrip)
+{
+    mt19937 rng(1);
+    for (int round = 0; round < 50; round++)
+    {
+        ServerEntries entries = RandomServerEntries(rng, rng() % 40);
+
+        string encoded = EncodeBinaryServerEntryList(entries);
+        EXPECT_TRUE(IsBinaryServerEntryList(encoded));
+        ExpectSameEntries(entries, DecodeBinaryServerEntryList(encoded));
+
+        ServerEntryListView view(encoded);
+        ASSERT_EQ(entries.size(), view.size());
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            EXPECT_EQ(entries[i].serverAddress, view.GetServerAddress(i));
+            ExpectSameEntry(entries[i], view.GetEntry(i));
+        }
+    }
+}
+
+TEST(ServerListEncodingTest, SmallerThanLegacyEncoding)
+{
+    mt19937 rng(2);
+    ServerEntries entries = RandomServerEntries(rng, 500);
+
+    string legacy;
+    for (ServerEntryIterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        string line = it->ToString();
+        legacy += Hexlify((const unsigned char*)line.data(), line.length()) + "\n";
+    }
+    string binary = EncodeBinaryServerEntryList(entries);
+
+    // Hex alone doubles the size. The JSON field names and escaping, which
+    // the binary encoding doesn't have, make up the rest.
+    EXPECT_LT(binary.length() * 2, legacy.length());
+}
+
+TEST(ServerListEncodingTest, LegacyListView)
+{
+    mt19937 rng(3);
+    ServerEntries entries = RandomServerEntries(rng, 5);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        // The legacy format is space-separated, and JSON
+        entries[i].webServerSecret = "secret" + to_string(i);
+        entries[i].webServerCertificate = "certificate" + to_string(i);
+        entries[i].region = "CA";
+        entries[i].sshUsername = "user";
+        entries[i].sshPassword = "password";
+        entries[i].sshHostKey = "key";
+        entries[i].sshObfuscatedKey = "obfuscated";
+        entries[i].capabilities = vector<string>(1, "OSSH");
+        entries[i].meekServerPort = -1;
+        entries[i].meekObfuscatedKey = "";
+        entries[i].meekCookieEncryptionPublicKey = "";
+        entries[i].meekFrontingDomain = "";
+        entries[i].meekFrontingHost = "";
+        entries[i].meekFrontingAddressesRegex = "";
+        entries[i].meekFrontingAddresses.clear();
+    }
+    // Entries without a certificate are skipped, as ParseServerEntries does
+    entries[2].webServerCertificate = "None";
+
+    string legacy;
+    for (ServerEntryIterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        string line = it->ToString();
+        legacy += Hexlify((const unsigned char*)line.data(), line.length()) + "\n";
+    }
+    EXPECT_FALSE(IsBinaryServerEntryList(legacy));
+
+    ServerEntryListView view(legacy);
+    ASSERT_EQ(4u, view.size());
+    size_t index = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (i == 2)
+        {
+            continue;
+        }
+        EXPECT_EQ(entries[i].serverAddress, view.GetServerAddress(index));
+        ExpectSameEntry(entries[i], view.GetEntry(index));
+        index++;
+    }
+}
+
+TEST(ServerListEncodingTest, TruncationIsRejected)
+{
+    mt19937 rng(4);
+    string encoded = EncodeBinaryServerEntryList(RandomServerEntries(rng, 3));
+
+    for (size_t length = 0; length < encoded.length(); length++)
+    {
+        string truncated = encoded.substr(0, length);
+        EXPECT_TRUE(DecodeFails(truncated)) << length;
+        if (IsBinaryServerEntryList(truncated))
+        {
+            EXPECT_THROW(ServerEntryListView view(truncated), std::exception) << length;
+        }
+    }
+
+    EXPECT_TRUE(DecodeFails(encoded + '\0'));
+}
+
+TEST(ServerListEncodingTest, CorruptionIsRejectedOrDecoded)
+{
+    mt19937 rng(5);
+    string encoded = EncodeBinaryServerEntryList(RandomServerEntries(rng, 3));
+
+    // Bad version
+    string corrupt = encoded;
+    corrupt[4] = 99;
+    EXPECT_TRUE(DecodeFails(corrupt));
+
+    // A count far larger than the data
+    EXPECT_TRUE(DecodeFails(encoded.substr(0, 5) + "\xFF\xFF\xFF\xFF\x0F"));
+
+    // A varint that never ends
+    EXPECT_TRUE(DecodeFails(encoded.substr(0, 5) + string(20, '\x80')));
+
+    // No strings, and one record that refers to string 0
+    EXPECT_TRUE(DecodeFails(encoded.substr(0, 5) + string("\0\1\1\0", 4)));
+
+    // Random damage must either be detected or decode to something; the
+    // bounds checks mean it can't read outside the data.
+    for (int round = 0; round < 2000; round++)
+    {
+        corrupt = encoded;
+        for (int flips = 1 + rng() % 4; flips > 0; flips--)
+        {
+            corrupt[5 + rng() % (corrupt.length() - 5)] = (char)(rng() & 0xFF);
+        }
+        try
+        {
+            ServerEntries decoded = DecodeBinaryServerEntryList(corrupt);
+            ServerEntryListView view(corrupt);
+            EXPECT_EQ(decoded.size(), view.size());
+        }
+        catch (std::exception&)
+        {
+        }
+    }
+}
+
+TEST(ServerListEncodingTest, JournalReplayMatchesMutations)
+{
+    mt19937 rng(6);
+    ServerEntries initial = RandomServerEntries(rng, 20);
+
+    IndexedServerEntries expected(initial);
+    string journal;
+
+    for (int i = 0; i < 500; i++)
+    {
+        // Some of these aren't in the list, to begin with
+        string address = "192.0.0." + to_string(rng() % 30);
+        switch (rng() % 5)
+        {
+        case 0:
+        {
+            ServerEntry entry = RandomServerEntry(rng, 0);
+            entry.serverAddress = address;
+            expected.Upsert(entry);
+            AppendServerListJournalUpsert(journal, entry);
+            break;
+        }
+        case 1:
+        case 2:
+        {
+            bool veryFront = (rng() % 2) != 0;
+            expected.MoveToFront(address, veryFront);
+            AppendServerListJournalMoveToFront(journal, address, veryFront);
+            break;
+        }
+        case 3:
+            expected.MoveToBack(address);
+            AppendServerListJournalMoveToBack(journal, address);
+            break;
+        case 4:
+            expected.Erase(address);
+            AppendServerListJournalErase(journal, address);
+            break;
+        }
+    }
+
+    // Replayed on top of the snapshot the journal was started from
+    IndexedServerEntries replayed(DecodeBinaryServerEntryList(EncodeBinaryServerEntryList(initial)));
+    EXPECT_TRUE(ReplayServerListJournal(journal, replayed));
+    ExpectSameEntries(expected.ToVector(), replayed.ToVector());
+}
+
+TEST(ServerListEncodingTest, TruncatedJournalAppliesCompleteRecords)
+{
+    mt19937 rng(7);
+    ServerEntries initial = RandomServerEntries(rng, 5);
+
+    string journal;
+    AppendServerListJournalMoveToBack(journal, initial[0].serverAddress);
+    AppendServerListJournalErase(journal, initial[1].serverAddress);
+    size_t completeLength = journal.length();
+    ServerEntry upserted = RandomServerEntry(rng, 100);
+    AppendServerListJournalUpsert(journal, upserted);
+
+    IndexedServerEntries expected(initial);
+    expected.MoveToBack(initial[0].serverAddress);
+    expected.Erase(initial[1].serverAddress);
+
+    // Cut anywhere in the last record: the first two are still applied
+    for (size_t length = completeLength + 1; length < journal.length(); length++)
+    {
+        IndexedServerEntries replayed(initial);
+        EXPECT_FALSE(ReplayServerListJournal(journal.substr(0, length), replayed)) << length;
+        EXPECT_EQ(Addresses(expected.ToVector()), Addresses(replayed.ToVector())) << length;
+    }
+
+    // An unknown operation stops the replay
+    string unknown = journal.substr(0, completeLength);
+    unknown += '\x01';
+    unknown += '\x7F';
+    IndexedServerEntries replayed(initial);
+    EXPECT_FALSE(ReplayServerListJournal(unknown, replayed));
+    EXPECT_EQ(Addresses(expected.ToVector()), Addresses(replayed.ToVector()));
+
+    IndexedServerEntries complete(initial);
+    EXPECT_TRUE(ReplayServerListJournal(journal, complete));
+    ASSERT_NE((const ServerEntry*)NULL, complete.Find(upserted.serverAddress));
+    EXPECT_EQ(5u, complete.size());
+}
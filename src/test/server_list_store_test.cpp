@@ -0,0 +1,609 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "server_list_store.h"
+#include "server_list_encoding.h"
+#include "utilities.h"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+namespace {
+
+class TempDirectory
+{
+public:
+    TempDirectory()
+    {
+        char pattern[] = "/tmp/server_list_store_test.XXXXXX";
+        m_path = mkdtemp(pattern);
+    }
+
+    ~TempDirectory()
+    {
+        error_code ec;
+        filesystem::remove_all(m_path, ec);
+    }
+
+    filesystem::path operator/(const char* name) const { return m_path / name; }
+
+private:
+    filesystem::path m_path;
+};
+
+// Runs each of `children` in its own process, and returns true if they all
+// exited with 0.
+bool RunInChildProcesses(const vector<function<int()>>& children)
+{
+    vector<pid_t> pids;
+    for (const auto& child : children)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            int status = 1;
+            try
+            {
+                status = child();
+            }
+            catch (...)
+            {
+            }
+            _exit(status);
+        }
+        if (pid < 0)
+        {
+            return false;
+        }
+        pids.push_back(pid);
+    }
+
+    bool succeeded = true;
+    for (pid_t pid : pids)
+    {
+        int status = 0;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            succeeded = false;
+        }
+    }
+    return succeeded;
+}
+
+// Journal records and snapshots that can be checked for tearing: each is
+// entirely determined by the few digits at its start.
+
+const size_t RECORD_LENGTH = 64;
+
+string MakeRecord(int writer, int sequence)
+{
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "R%02d%08d", writer, sequence);
+    string record(prefix);
+    record.resize(RECORD_LENGTH - 1, (char)('a' + (writer + sequence) % 26));
+    record += '\n';
+    return record;
+}
+
+bool ParseRecord(const string& journal, size_t offset, int& o_writer, int& o_sequence)
+{
+    if (offset + RECORD_LENGTH > journal.length()
+        || sscanf(journal.c_str() + offset, "R%2d%8d", &o_writer, &o_sequence) != 2)
+    {
+        return false;
+    }
+    return journal.compare(offset, RECORD_LENGTH, MakeRecord(o_writer, o_sequence)) == 0;
+}
+
+string MakeSnapshot(unsigned int seed)
+{
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "S%010u", seed);
+    string snapshot(prefix);
+    snapshot.resize(16 + seed % 20000, (char)('A' + seed % 26));
+    return snapshot;
+}
+
+bool IsSnapshot(const string& snapshot)
+{
+    unsigned int seed = 0;
+    return sscanf(snapshot.c_str(), "S%10u", &seed) == 1 && snapshot == MakeSnapshot(seed);
+}
+
+// Empties the stand-in registry, and lifts its limit, before and after each
+// test that uses it.
+class RegistryStandInScope
+{
+public:
+    RegistryStandInScope() { Reset(); }
+    ~RegistryStandInScope() { Reset(); }
+
+private:
+    void Reset()
+    {
+        RegistryStandIn().clear();
+        RegistryStandInMaxValueLength() = 0;
+    }
+};
+
+ServerEntries MakeServerEntries(int count)
+{
+    mt19937 rng(1);
+    auto randomString = [&](size_t length) {
+        string value(length, '\0');
+        for (char& c : value)
+        {
+            c = (char)('a' + rng() % 26);
+        }
+        return value;
+    };
+
+    ServerEntries entries;
+    for (int i = 0; i < count; i++)
+    {
+        ServerEntry entry;
+        entry.serverAddress = "192.0." + to_string(i / 256) + "." + to_string(i % 256);
+        entry.region = "CA";
+        entry.webServerPort = 8000;
+        // About the size of a real entry, and as unalike
+        entry.webServerCertificate = randomString(1000);
+        entry.sshHostKey = randomString(400);
+        entry.meekServerPort = -1;
+        entries.push_back(entry);
+    }
+    return entries;
+}
+
+}  // namespace
+
+
+/***********************************************
+FileServerListStore
+*/
+
+TEST(FileServerListStoreTest, NotFoundUntilWritten)
+{
+    TempDirectory dir;
+    FileServerListStore store(dir / "list");
+
+    string snapshot = "x", journal = "y";
+    uint64_t generation = 1;
+    EXPECT_EQ(IServerListStore::LOAD_NOT_FOUND, store.Load(snapshot, journal, generation));
+    EXPECT_TRUE(snapshot.empty());
+    EXPECT_TRUE(journal.empty());
+    EXPECT_EQ(0u, generation);
+    EXPECT_EQ(0u, store.GetGeneration());
+    EXPECT_FALSE(store.AppendJournal("record", generation));
+
+    ASSERT_TRUE(store.WriteSnapshot("snapshot", generation));
+    EXPECT_EQ(store.GetGeneration(), generation);
+    ASSERT_TRUE(store.AppendJournal("one", generation));
+    ASSERT_TRUE(store.AppendJournal("two", generation));
+    EXPECT_EQ(store.GetGeneration(), generation);
+
+    uint64_t loadedGeneration = 0;
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, loadedGeneration));
+    EXPECT_EQ("snapshot", snapshot);
+    EXPECT_EQ("onetwo", journal);
+    EXPECT_EQ(generation, loadedGeneration);
+
+    ASSERT_TRUE(store.WriteSnapshot("compacted", generation));
+    EXPECT_NE(loadedGeneration, generation);
+    EXPECT_EQ(store.GetGeneration(), generation);
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, loadedGeneration));
+    EXPECT_EQ("compacted", snapshot);
+    EXPECT_TRUE(journal.empty());
+    EXPECT_EQ(generation, loadedGeneration);
+}
+
+TEST(FileServerListStoreTest, UnreadableIsAnError)
+{
+    TempDirectory dir;
+    FileServerListStore store(dir / "list");
+
+    // Something is there, but it can't be read as a file
+    filesystem::create_directory(dir / "list.snapshot");
+
+    string snapshot, journal;
+    uint64_t generation;
+    EXPECT_EQ(IServerListStore::LOAD_ERROR, store.Load(snapshot, journal, generation));
+}
+
+
+/***********************************************
+MappedServerListStore
+*/
+
+TEST(MappedServerListStoreTest, NotFoundUntilWritten)
+{
+    TempDirectory dir;
+    MappedServerListStore store(dir / "list");
+
+    string snapshot, journal;
+    uint64_t generation = 1;
+    EXPECT_EQ(IServerListStore::LOAD_NOT_FOUND, store.Load(snapshot, journal, generation));
+    EXPECT_EQ(0u, generation);
+    // Loading created the (empty) file; that's still nothing stored
+    EXPECT_EQ(IServerListStore::LOAD_NOT_FOUND, store.Load(snapshot, journal, generation));
+    EXPECT_EQ(0u, store.GetGeneration());
+    EXPECT_FALSE(store.AppendJournal("record", generation));
+
+    ASSERT_TRUE(store.WriteSnapshot("snapshot", generation));
+    EXPECT_EQ(store.GetGeneration(), generation);
+    ASSERT_TRUE(store.AppendJournal("one", generation));
+    ASSERT_TRUE(store.AppendJournal("two", generation));
+    EXPECT_EQ(store.GetGeneration(), generation);
+
+    uint64_t loadedGeneration = 0;
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, loadedGeneration));
+    EXPECT_EQ("snapshot", snapshot);
+    EXPECT_EQ("onetwo", journal);
+    EXPECT_EQ(generation, loadedGeneration);
+
+    // Another instance (as in another process) sees the same list
+    MappedServerListStore other(dir / "list");
+    EXPECT_EQ(store.GetGeneration(), other.GetGeneration());
+    ASSERT_EQ(IServerListStore::LOAD_OK, other.Load(snapshot, journal, loadedGeneration));
+    EXPECT_EQ("onetwo", journal);
+    EXPECT_EQ(generation, loadedGeneration);
+}
+
+TEST(MappedServerListStoreTest, NeverWrittenHeaderIsNotFound)
+{
+    TempDirectory dir;
+
+    // As left by a process that died growing the file, before it wrote the
+    // header
+    {
+        ofstream file((dir / "list.list").c_str(), ios::binary);
+        file << string(4096, '\0');
+    }
+
+    MappedServerListStore store(dir / "list");
+    string snapshot, journal;
+    uint64_t generation;
+    EXPECT_EQ(IServerListStore::LOAD_NOT_FOUND, store.Load(snapshot, journal, generation));
+}
+
+TEST(MappedServerListStoreTest, DamagedHeaderIsAnError)
+{
+    TempDirectory dir;
+    {
+        MappedServerListStore store(dir / "list");
+        uint64_t generation;
+        ASSERT_TRUE(store.WriteSnapshot("snapshot", generation));
+    }
+
+    // Flip a bit in the generation, which the checksum covers
+    {
+        fstream file((dir / "list.list").c_str(), ios::in | ios::out | ios::binary);
+        file.seekg(8);
+        char byte = (char)file.get();
+        file.seekp(8);
+        file.put((char)(byte ^ 1));
+    }
+
+    MappedServerListStore store(dir / "list");
+    string snapshot, journal;
+    uint64_t generation;
+    EXPECT_EQ(IServerListStore::LOAD_ERROR, store.Load(snapshot, journal, generation));
+    EXPECT_EQ(0u, store.GetGeneration());
+    EXPECT_FALSE(store.AppendJournal("record", generation));
+}
+
+TEST(MappedServerListStoreTest, SnapshotsAlternateWithoutOverwritingTheCurrentOne)
+{
+    TempDirectory dir;
+    MappedServerListStore store(dir / "list");
+
+    // Growing, shrinking and growing again moves the snapshot after the
+    // journal and back to the front of the file, and grows the file.
+    const unsigned int seeds[] = { 100, 19000, 5, 12000, 19999, 1 };
+    uint64_t lastGeneration = 0;
+    for (unsigned int seed : seeds)
+    {
+        uint64_t generation;
+        ASSERT_TRUE(store.WriteSnapshot(MakeSnapshot(seed), generation));
+        for (int i = 0; i < 50; i++)
+        {
+            ASSERT_TRUE(store.AppendJournal(MakeRecord(0, i), generation));
+        }
+
+        EXPECT_GT(generation, lastGeneration);
+        lastGeneration = generation;
+
+        string snapshot, journal;
+        ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, generation));
+        EXPECT_EQ(lastGeneration, generation);
+        EXPECT_EQ(MakeSnapshot(seed), snapshot);
+        ASSERT_EQ(50 * RECORD_LENGTH, journal.length());
+        for (int i = 0; i < 50; i++)
+        {
+            int writer, sequence;
+            ASSERT_TRUE(ParseRecord(journal, i * RECORD_LENGTH, writer, sequence));
+            EXPECT_EQ(i, sequence);
+        }
+    }
+}
+
+// Without the file lock, two processes appending at once would both write
+// at the same end of the journal, and one record would be lost.
+TEST(MappedServerListStoreTest, ConcurrentAppendsFromSeveralProcessesAreAllKept)
+{
+    TempDirectory dir;
+    {
+        MappedServerListStore store(dir / "list");
+        uint64_t generation;
+        ASSERT_TRUE(store.WriteSnapshot("snapshot", generation));
+    }
+
+    // Enough to grow the file, and remap it in each process, several times
+    const int WRITERS = 4;
+    const int RECORDS = 1500;
+
+    vector<function<int()>> writers;
+    for (int writer = 0; writer < WRITERS; writer++)
+    {
+        writers.push_back([&dir, writer]() {
+            MappedServerListStore store(dir / "list");
+            uint64_t generation;
+            for (int i = 0; i < RECORDS; i++)
+            {
+                if (!store.AppendJournal(MakeRecord(writer, i), generation))
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        });
+    }
+    ASSERT_TRUE(RunInChildProcesses(writers));
+
+    MappedServerListStore store(dir / "list");
+    string snapshot, journal;
+    uint64_t generation;
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, generation));
+    EXPECT_EQ("snapshot", snapshot);
+    ASSERT_EQ(WRITERS * RECORDS * RECORD_LENGTH, journal.length());
+
+    // Each writer's records are all there, in the order it wrote them
+    vector<int> next(WRITERS, 0);
+    for (size_t offset = 0; offset < journal.length(); offset += RECORD_LENGTH)
+    {
+        int writer, sequence;
+        ASSERT_TRUE(ParseRecord(journal, offset, writer, sequence)) << "at " << offset;
+        ASSERT_TRUE(writer >= 0 && writer < WRITERS);
+        EXPECT_EQ(next[writer], sequence);
+        next[writer] = sequence + 1;
+    }
+}
+
+// Readers in other processes must only ever see a whole snapshot followed by
+// whole journal records, however the writers' updates interleave.
+TEST(MappedServerListStoreTest, ReadersInOtherProcessesNeverSeePartialUpdates)
+{
+    TempDirectory dir;
+    {
+        MappedServerListStore store(dir / "list");
+        uint64_t generation;
+        ASSERT_TRUE(store.WriteSnapshot(MakeSnapshot(0), generation));
+    }
+
+    const int WRITERS = 2;
+    const int READERS = 2;
+    const int WRITES = 400;
+    const int READS = 800;
+
+    vector<function<int()>> children;
+    for (int writer = 0; writer < WRITERS; writer++)
+    {
+        children.push_back([&dir, writer]() {
+            MappedServerListStore store(dir / "list");
+            mt19937 rng(writer);
+            uint64_t generation;
+            for (int i = 0; i < WRITES; i++)
+            {
+                // Mostly appends, with a compaction now and then, as
+                // ServerList does
+                bool written = (rng() % 8 == 0)
+                    ? store.WriteSnapshot(MakeSnapshot(rng()), generation)
+                    : store.AppendJournal(MakeRecord(writer, i), generation);
+                if (!written)
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        });
+    }
+    for (int reader = 0; reader < READERS; reader++)
+    {
+        children.push_back([&dir]() {
+            MappedServerListStore store(dir / "list");
+            uint64_t lastGeneration = 0;
+            string lastSnapshot, lastJournal;
+            for (int i = 0; i < READS; i++)
+            {
+                string snapshot, journal;
+                uint64_t generation;
+                if (store.Load(snapshot, journal, generation) != IServerListStore::LOAD_OK || !IsSnapshot(snapshot))
+                {
+                    return 3;
+                }
+                if (generation < lastGeneration)
+                {
+                    return 2;
+                }
+                // The generation is read with the list, so it identifies it:
+                // the same generation always comes with the same list
+                if (generation == lastGeneration && (snapshot != lastSnapshot || journal != lastJournal))
+                {
+                    return 6;
+                }
+                lastGeneration = generation;
+                lastSnapshot = snapshot;
+                lastJournal = journal;
+                if (journal.length() % RECORD_LENGTH != 0)
+                {
+                    return 4;
+                }
+                for (size_t offset = 0; offset < journal.length(); offset += RECORD_LENGTH)
+                {
+                    int writer, sequence;
+                    if (!ParseRecord(journal, offset, writer, sequence))
+                    {
+                        return 5;
+                    }
+                }
+            }
+            return 0;
+        });
+    }
+
+    EXPECT_TRUE(RunInChildProcesses(children));
+}
+
+
+/***********************************************
+RegistryServerListStore
+*/
+
+TEST(RegistryServerListStoreTest, NotFoundUntilWritten)
+{
+    RegistryStandInScope registry;
+    RegistryServerListStore store("Servers");
+
+    string snapshot, journal;
+    uint64_t generation = 1;
+    EXPECT_EQ(IServerListStore::LOAD_NOT_FOUND, store.Load(snapshot, journal, generation));
+    EXPECT_EQ(0u, generation);
+    EXPECT_EQ(0u, store.GetGeneration());
+
+    // Not for lack of room
+    EXPECT_FALSE(store.AppendJournal("record", generation));
+    EXPECT_FALSE(store.WriteTooLong());
+
+    ASSERT_TRUE(store.WriteSnapshot("snapshot", generation));
+    ASSERT_TRUE(store.AppendJournal("one", generation));
+    ASSERT_TRUE(store.AppendJournal("two", generation));
+    EXPECT_EQ(store.GetGeneration(), generation);
+
+    uint64_t loadedGeneration = 0;
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, loadedGeneration));
+    EXPECT_EQ("snapshot", snapshot);
+    EXPECT_EQ("onetwo", journal);
+    EXPECT_EQ(generation, loadedGeneration);
+
+    // A list stored by an older version, as a string, is migrated as if
+    // nothing were stored
+    RegistryFailureReason reason;
+    RegistryStandIn().clear();
+    ASSERT_TRUE(WriteRegistryStringValue("Servers", "legacy", reason));
+    EXPECT_EQ(IServerListStore::LOAD_NOT_FOUND, store.Load(snapshot, journal, loadedGeneration));
+}
+
+TEST(RegistryServerListStoreTest, JournalLongerThanTheLimitIsTooLong)
+{
+    RegistryStandInScope registry;
+    RegistryServerListStore store("Servers");
+
+    uint64_t generation;
+    ASSERT_TRUE(store.WriteSnapshot("snapshot", generation));
+
+    string written;
+    const string record(1000, 'r');
+    while (written.length() + record.length() <= REGISTRY_STORE_MAX_JOURNAL_LENGTH)
+    {
+        ASSERT_TRUE(store.AppendJournal(record, generation));
+        EXPECT_FALSE(store.WriteTooLong());
+        written += record;
+    }
+
+    uint64_t before = store.GetGeneration();
+    EXPECT_FALSE(store.AppendJournal(record, generation));
+    EXPECT_TRUE(store.WriteTooLong());
+    EXPECT_EQ(before, store.GetGeneration());
+
+    // The journal is as it was, until the list is compacted
+    string snapshot, journal;
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, generation));
+    EXPECT_EQ(written, journal);
+
+    ASSERT_TRUE(store.WriteSnapshot("compacted", generation));
+    EXPECT_FALSE(store.WriteTooLong());
+    ASSERT_TRUE(store.AppendJournal(record, generation));
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, generation));
+    EXPECT_EQ("compacted", snapshot);
+    EXPECT_EQ(record, journal);
+}
+
+TEST(RegistryServerListStoreTest, OversizedListIsStoredTruncated)
+{
+    RegistryStandInScope registry;
+    RegistryStandInMaxValueLength() = 256 * 1024;
+    RegistryServerListStore store("Servers");
+
+    const ServerEntries all = MakeServerEntries(2000);
+    ServerEntries entries = all;
+    string oversized = EncodeBinaryServerEntryList(entries);
+    ASSERT_GT(oversized.length(), RegistryStandInMaxValueLength());
+
+    uint64_t generation;
+    ASSERT_TRUE(store.WriteSnapshot(EncodeBinaryServerEntryList(MakeServerEntries(10)), generation));
+    ASSERT_TRUE(store.AppendJournal("record", generation));
+
+    EXPECT_FALSE(store.WriteSnapshot(oversized, generation));
+    EXPECT_TRUE(store.WriteTooLong());
+
+    // The previous snapshot is still there. Its journal isn't: the epoch was
+    // bumped before the write failed.
+    string snapshot, journal;
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, generation));
+    EXPECT_EQ(10u, DecodeBinaryServerEntryList(snapshot).size());
+    EXPECT_TRUE(journal.empty());
+
+    // As ServerList::WriteChanges does, halve the list until it fits
+    int writes = 1;
+    bool written = false;
+    while (!written && store.WriteTooLong() && entries.size() / 2 > 1)
+    {
+        entries.resize(entries.size() / 2);
+        written = store.WriteSnapshot(EncodeBinaryServerEntryList(entries), generation);
+        writes++;
+    }
+    ASSERT_TRUE(written);
+    EXPECT_FALSE(store.WriteTooLong());
+    EXPECT_LE(writes, 5);
+
+    ASSERT_EQ(IServerListStore::LOAD_OK, store.Load(snapshot, journal, generation));
+    ServerEntries loaded = DecodeBinaryServerEntryList(snapshot);
+    ASSERT_EQ(entries.size(), loaded.size());
+    for (size_t i = 0; i < loaded.size(); i++)
+    {
+        ASSERT_EQ(all[i].serverAddress, loaded[i].serverAddress);
+    }
+
+    // And the journal works with the truncated snapshot
+    EXPECT_TRUE(store.AppendJournal("record", generation));
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Simulates the time it takes clients to make their first connection, with the
+server list ordered by ServerRanking, and with the default policy,
+ShuffleFastResponders: the servers that responded within twice the fastest
+response time are shuffled and moved to the front (see
+ServerList::RankCheckedEntries). The ranking is only to become the default
+once it does at least as well here.
+
+Each client keeps its own server list and, for the ranking policy, its own
+ServerRanking, across sessions an hour apart. In each session the client:
+1. checks the reachability of every server in its list, and reorders the list
+   by the policy;
+2. tries the servers in list order until one connects. A failed server is
+   moved to the back of the list (MarkServersFailed), and the server that
+   connects is moved to the very front (MarkServerSucceeded).
+
+Servers are either working, TCP-blocked (they don't answer the check, and a
+connection times out) or protocol-blocked (they answer the check, but the
+tunnel handshake times out). Part way through, some servers change state, as
+when a censor starts or stops blocking them.
+
+Both policies see the same servers, states and check results.
+
+    server_ranking_simulation [clients] [sessions]
+*/
+
+#include "stdafx.h"
+#include "server_ranking.h"
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+
+
+namespace {
+
+const int SERVERS = 40;
+const double TCP_BLOCKED_FRACTION = 0.3;
+const double PROTOCOL_BLOCKED_FRACTION = 0.2;
+// The fraction of servers whose state is drawn again half way through
+const double CHANGING_FRACTION = 0.3;
+
+// Connecting takes several round trips; a failure costs a timeout.
+const double ROUND_TRIPS_PER_CONNECTION = 8;
+const double TCP_TIMEOUT_MILLISECONDS = 5000;
+const double HANDSHAKE_TIMEOUT_MILLISECONDS = 10000;
+// A working server fails now and then anyway
+const double TRANSIENT_FAILURE_PROBABILITY = 0.05;
+
+const int64_t SESSION_INTERVAL_SECONDS = 60 * 60;
+const int64_t START_TIME = 1600000000;
+
+enum ServerState
+{
+    WORKING,
+    TCP_BLOCKED,
+    PROTOCOL_BLOCKED
+};
+
+struct Server
+{
+    string address;
+    ServerState state;
+    double roundTripMilliseconds;
+};
+
+ServerState DrawState(mt19937& rng)
+{
+    double x = uniform_real_distribution<double>(0, 1)(rng);
+    if (x < TCP_BLOCKED_FRACTION)
+    {
+        return TCP_BLOCKED;
+    }
+    if (x < TCP_BLOCKED_FRACTION + PROTOCOL_BLOCKED_FRACTION)
+    {
+        return PROTOCOL_BLOCKED;
+    }
+    return WORKING;
+}
+
+// ServerList::MoveEntriesToFront: the entries go in after the head of the
+// list, in the order given, unless one of them is the head.
+void MoveToFront(vector<int>& list, const vector<int>& servers)
+{
+    for (auto server = servers.rbegin(); server != servers.rend(); ++server)
+    {
+        auto current = find(list.begin(), list.end(), *server);
+        bool wasHead = (current == list.begin());
+        list.erase(current);
+        list.insert((wasHead || list.empty()) ? list.begin() : list.begin() + 1, *server);
+    }
+}
+
+void MoveToVeryFront(vector<int>& list, int server)
+{
+    list.erase(find(list.begin(), list.end(), server));
+    list.insert(list.begin(), server);
+}
+
+void MoveToBack(vector<int>& list, int server)
+{
+    list.erase(find(list.begin(), list.end(), server));
+    list.push_back(server);
+}
+
+struct Results
+{
+    vector<double> timesToConnect;
+    unsigned long long attempts = 0;
+    unsigned long long protocolBlockedAttempts = 0;
+    unsigned long long tcpBlockedAttempts = 0;
+
+    void Print(const char* name)
+    {
+        sort(timesToConnect.begin(), timesToConnect.end());
+        double mean = accumulate(timesToConnect.begin(), timesToConnect.end(), 0.0) / timesToConnect.size();
+        printf("%-18s mean %6.0f ms  median %6.0f ms  p90 %6.0f ms  attempts %llu "
+               "(TCP-blocked %llu, protocol-blocked %llu)\n",
+               name, mean,
+               timesToConnect[timesToConnect.size() / 2],
+               timesToConnect[timesToConnect.size() * 9 / 10],
+               attempts, tcpBlockedAttempts, protocolBlockedAttempts);
+    }
+};
+
+class Client
+{
+public:
+    Client(bool useRanking, unsigned int seed)
+        : m_useRanking(useRanking), m_rng(seed)
+    {
+        for (int i = 0; i < SERVERS; i++)
+        {
+            m_list.push_back(i);
+        }
+        shuffle(m_list.begin(), m_list.end(), m_rng);
+    }
+
+    // `responseTimes` holds the check result for each server: the response
+    // time, or a negative value for no response. `outcomes` holds, for each
+    // server, how long an attempt takes and whether it connects.
+    void RunSession(
+        const vector<Server>& servers,
+        const vector<double>& responseTimes,
+        const vector<pair<double, bool>>& outcomes,
+        int64_t now,
+        Results& results)
+    {
+        if (m_useRanking)
+        {
+            RankCheckedEntries(servers, responseTimes, now);
+        }
+        else
+        {
+            ShuffleCheckedEntries(responseTimes);
+        }
+
+        double elapsed = 0;
+        vector<int> order = m_list;
+        for (int server : order)
+        {
+            results.attempts++;
+            results.tcpBlockedAttempts += (servers[server].state == TCP_BLOCKED);
+            results.protocolBlockedAttempts += (servers[server].state == PROTOCOL_BLOCKED);
+
+            elapsed += outcomes[server].first;
+            if (outcomes[server].second)
+            {
+                m_ranking.RecordConnection(servers[server].address, true, now);
+                MoveToVeryFront(m_list, server);
+                results.timesToConnect.push_back(elapsed);
+                return;
+            }
+
+            m_ranking.RecordConnection(servers[server].address, false, now);
+            MoveToBack(m_list, server);
+        }
+
+        // Nothing connected this session
+        results.timesToConnect.push_back(elapsed);
+    }
+
+private:
+    void ShuffleCheckedEntries(const vector<double>& responseTimes)
+    {
+        vector<ServerResponse> responses;
+        for (int server : m_list)
+        {
+            responses.push_back(ServerResponse(responseTimes[server] >= 0, responseTimes[server]));
+        }
+
+        vector<int> responding;
+        for (size_t index : ShuffleFastResponders(responses, m_rng))
+        {
+            responding.push_back(m_list[index]);
+        }
+        MoveToFront(m_list, responding);
+    }
+
+    void RankCheckedEntries(const vector<Server>& servers, const vector<double>& responseTimes, int64_t now)
+    {
+        vector<string> respondingAddresses;
+        vector<int> responding;
+        for (int server : m_list)
+        {
+            if (responseTimes[server] >= 0)
+            {
+                m_ranking.RecordResponse(servers[server].address, responseTimes[server], now);
+                respondingAddresses.push_back(servers[server].address);
+                responding.push_back(server);
+            }
+            else
+            {
+                m_ranking.RecordNoResponse(servers[server].address, now);
+            }
+        }
+
+        vector<size_t> order = m_ranking.Rank(respondingAddresses, now, m_rng);
+        vector<int> ranked;
+        for (size_t index : order)
+        {
+            ranked.push_back(responding[index]);
+        }
+        MoveToFront(m_list, ranked);
+    }
+
+    bool m_useRanking;
+    mt19937 m_rng;
+    vector<int> m_list;
+    ServerRanking m_ranking;
+};
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int clients = (argc > 1) ? atoi(argv[1]) : 150;
+    int sessions = (argc > 2) ? atoi(argv[2]) : 200;
+
+    Results shuffled, ranked;
+
+    for (int c = 0; c < clients; c++)
+    {
+        mt19937 world(c);
+
+        vector<Server> servers(SERVERS);
+        for (int i = 0; i < SERVERS; i++)
+        {
+            servers[i].address = "192.0.2." + to_string(i);
+            servers[i].state = DrawState(world);
+            servers[i].roundTripMilliseconds = 150 * exp(0.6 * normal_distribution<double>()(world));
+        }
+
+        Client shuffleClient(false, c);
+        Client rankingClient(true, c);
+
+        for (int s = 0; s < sessions; s++)
+        {
+            if (s == sessions / 2)
+            {
+                for (Server& server : servers)
+                {
+                    if (uniform_real_distribution<double>(0, 1)(world) < CHANGING_FRACTION)
+                    {
+                        server.state = DrawState(world);
+                    }
+                }
+            }
+
+            vector<double> responseTimes(SERVERS);
+            vector<pair<double, bool>> outcomes(SERVERS);
+            for (int i = 0; i < SERVERS; i++)
+            {
+                const Server& server = servers[i];
+                double jitter = exp(0.2 * normal_distribution<double>()(world));
+                bool transientFailure = uniform_real_distribution<double>(0, 1)(world) < TRANSIENT_FAILURE_PROBABILITY;
+
+                responseTimes[i] = (server.state == TCP_BLOCKED) ? -1 : server.roundTripMilliseconds * jitter;
+
+                if (server.state == TCP_BLOCKED)
+                {
+                    outcomes[i] = make_pair(TCP_TIMEOUT_MILLISECONDS, false);
+                }
+                else if (server.state == PROTOCOL_BLOCKED)
+                {
+                    outcomes[i] = make_pair(HANDSHAKE_TIMEOUT_MILLISECONDS, false);
+                }
+                else if (transientFailure)
+                {
+                    outcomes[i] = make_pair(TCP_TIMEOUT_MILLISECONDS, false);
+                }
+                else
+                {
+                    outcomes[i] = make_pair(server.roundTripMilliseconds * jitter * ROUND_TRIPS_PER_CONNECTION, true);
+                }
+            }
+
+            int64_t now = START_TIME + s * SESSION_INTERVAL_SECONDS;
+            shuffleClient.RunSession(servers, responseTimes, outcomes, now, shuffled);
+            rankingClient.RunSession(servers, responseTimes, outcomes, now, ranked);
+        }
+    }
+
+    printf("%d clients x %d sessions, %d servers\n", clients, sessions, SERVERS);
+    shuffled.Print("threshold+shuffle");
+    ranked.Print("ranking");
+
+    return 0;
+}
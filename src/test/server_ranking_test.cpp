@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "server_ranking.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <set>
+
+
+namespace {
+
+const int64_t NOW = 1600000000;
+
+string Address(int i)
+{
+    return "10.0.0." + to_string(i);
+}
+
+void ExpectSameScores(const ServerRanking& expected, const ServerRanking& actual, int servers)
+{
+    EXPECT_EQ(expected.size(), actual.size());
+    for (int i = 0; i < servers; i++)
+    {
+        const ServerScore* e = expected.Find(Address(i));
+        const ServerScore* a = actual.Find(Address(i));
+        ASSERT_EQ(e == NULL, a == NULL) << Address(i);
+        if (!e)
+        {
+            continue;
+        }
+        EXPECT_DOUBLE_EQ(e->responseTimeMilliseconds, a->responseTimeMilliseconds);
+        EXPECT_EQ(e->responseTimeSamples, a->responseTimeSamples);
+        EXPECT_DOUBLE_EQ(e->successes, a->successes);
+        EXPECT_DOUBLE_EQ(e->failures, a->failures);
+        EXPECT_EQ(e->lastSuccessTime, a->lastSuccessTime);
+        EXPECT_EQ(e->lastUpdateTime, a->lastUpdateTime);
+    }
+}
+
+}  // namespace
+
+
+TEST(ServerRankingTest, ChangesTrackUpdates)
+{
+    ServerRanking ranking;
+    EXPECT_FALSE(ranking.HasChanges());
+    EXPECT_EQ("", ranking.EncodeChanges());
+
+    ranking.RecordResponse(Address(1), 120, NOW);
+    ranking.RecordNoResponse(Address(2), NOW);
+    EXPECT_TRUE(ranking.HasChanges());
+
+    ranking.ClearChanges();
+    EXPECT_FALSE(ranking.HasChanges());
+
+    // Only the server that changed is in the next records
+    ranking.RecordConnection(Address(1), true, NOW + 10);
+    string changes = ranking.EncodeChanges();
+    EXPECT_NE(string::npos, changes.find(Address(1)));
+    EXPECT_EQ(string::npos, changes.find(Address(2)));
+}
+
+TEST(ServerRankingTest, SnapshotPlusJournalMatchesCurrentScores)
+{
+    ServerRanking ranking;
+    for (int i = 0; i < 20; i++)
+    {
+        ranking.RecordResponse(Address(i), 100 + i, NOW);
+    }
+
+    string snapshot = ranking.Encode();
+    ranking.ClearChanges();
+
+    // Several rounds of changes, each appended to the journal, with some
+    // servers changing in more than one round
+    string journal;
+    for (int round = 0; round < 5; round++)
+    {
+        int64_t now = NOW + 3600 * (round + 1);
+        for (int i = round; i < 20; i += 3)
+        {
+            ranking.RecordConnection(Address(i), i % 2 == 0, now);
+        }
+        ranking.RecordResponse(Address(20 + round), 300, now);
+        journal += ranking.EncodeChanges();
+        ranking.ClearChanges();
+    }
+
+    ServerRanking loaded;
+    ASSERT_TRUE(loaded.Decode(snapshot));
+    ASSERT_TRUE(loaded.ReplayJournal(journal));
+    EXPECT_FALSE(loaded.HasChanges());
+    ExpectSameScores(ranking, loaded, 30);
+
+    // Replaying a record twice does no harm
+    ServerRanking replayedTwice;
+    ASSERT_TRUE(replayedTwice.Decode(snapshot));
+    ASSERT_TRUE(replayedTwice.ReplayJournal(journal));
+    ASSERT_TRUE(replayedTwice.ReplayJournal(journal));
+    ExpectSameScores(ranking, replayedTwice, 30);
+}
+
+TEST(ServerRankingTest, DroppedServersAreJournalled)
+{
+    // Fill past the limit on scored servers, so that the least recently
+    // updated ones are dropped
+    ServerRanking ranking;
+    const int SERVERS = 2001;
+    for (int i = 0; i < SERVERS - 1; i++)
+    {
+        ranking.RecordNoResponse(Address(i), NOW + i);
+    }
+    string snapshot = ranking.Encode();
+    ranking.ClearChanges();
+
+    ranking.RecordNoResponse(Address(SERVERS - 1), NOW + SERVERS);
+    ASSERT_LT(ranking.size(), (size_t)SERVERS);
+    ASSERT_EQ(NULL, ranking.Find(Address(0)));
+
+    ServerRanking loaded;
+    ASSERT_TRUE(loaded.Decode(snapshot));
+    ASSERT_TRUE(loaded.Find(Address(0)));
+    ASSERT_TRUE(loaded.ReplayJournal(ranking.EncodeChanges()));
+    ExpectSameScores(ranking, loaded, SERVERS);
+}
+
+TEST(ServerRankingTest, TruncatedJournalAppliesCompleteRecords)
+{
+    ServerRanking ranking;
+    string snapshot = ranking.Encode();
+
+    ranking.RecordResponse(Address(1), 100, NOW);
+    string journal = ranking.EncodeChanges();
+    ranking.ClearChanges();
+    ranking.RecordResponse(Address(2), 200, NOW);
+    string second = ranking.EncodeChanges();
+    journal += second.substr(0, second.length() / 2);
+
+    ServerRanking loaded;
+    ASSERT_TRUE(loaded.Decode(snapshot));
+    EXPECT_FALSE(loaded.ReplayJournal(journal));
+    EXPECT_TRUE(loaded.Find(Address(1)));
+    EXPECT_FALSE(loaded.Find(Address(2)));
+
+    ServerRanking garbage;
+    EXPECT_FALSE(garbage.ReplayJournal("not json\n"));
+}
+
+TEST(ServerRankingTest, ShuffleFastRespondersKeepsThoseWithinTwiceTheFastest)
+{
+    const vector<ServerResponse> responses = {
+        ServerResponse(true, 300),
+        ServerResponse(false, 5000),
+        ServerResponse(true, 100),
+        ServerResponse(true, 200),
+        ServerResponse(true, 201),
+        ServerResponse(false, 0),
+    };
+
+    mt19937 rng(1);
+    set<vector<size_t>> orders;
+    for (int i = 0; i < 100; i++)
+    {
+        vector<size_t> order = ShuffleFastResponders(responses, rng);
+        orders.insert(order);
+
+        sort(order.begin(), order.end());
+        EXPECT_EQ(vector<size_t>({ 2, 3 }), order);
+    }
+
+    // Both orders come up
+    EXPECT_EQ(2u, orders.size());
+
+    EXPECT_TRUE(ShuffleFastResponders(vector<ServerResponse>(2, ServerResponse(false, 0)), rng).empty());
+}
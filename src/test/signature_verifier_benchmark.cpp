@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures verifySignedDataPackage's per-verification cost for a small (about
+500 byte) and a large (1MB) package, with the signature verifier:
+- built each time, as it was: the public key is hashed for its digest,
+  Base64-decoded and parsed into a verifier for every package.
+- cached, as it is now: the digest and verifier are built on first use and
+  then looked up, under a mutex, in a map keyed by the public key.
+
+verifySignedDataPackage itself needs CryptoPP, so this does the same steps
+with OpenSSL standing in for it, around the real InflateSignedDataPackage.
+Both are also run on several threads at once, sharing the cache; the time
+given is then the wall time divided by the verifications on all threads.
+
+    signature_verifier_benchmark [iterations]
+*/
+
+#include "stdafx.h"
+#include "signed_data_package.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <zlib.h>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const int THREADS[] = { 1, 8 };
+
+string Base64(const string& input)
+{
+    string output(Base64EncodedLength(input.length()), '\0');
+    Base64EncodeInto((const unsigned char*)input.data(), input.length(), &output[0]);
+    return output;
+}
+
+string Unbase64(const string& input)
+{
+    string output;
+    Base64Decoder decoder;
+    if (!decoder.Update(input.data(), input.length(), output) || !decoder.Final(output))
+    {
+        output.clear();
+    }
+    return output;
+}
+
+string Sha256(const string& input)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    EVP_Digest(input.data(), input.length(), digest, &length, EVP_sha256(), NULL);
+    return string((const char*)digest, length);
+}
+
+string Compress(const string& input)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    string output(deflateBound(&stream, (uLong)input.length()), '\0');
+    stream.next_in = (Bytef*)input.data();
+    stream.avail_in = (uInt)input.length();
+    stream.next_out = (Bytef*)&output[0];
+    stream.avail_out = (uInt)output.length();
+    deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return output;
+}
+
+// A new RSA key; o_publicKey is the Base64 of its SubjectPublicKeyInfo, as
+// the embedded keys are.
+EVP_PKEY* GenerateKey(string& o_publicKey)
+{
+    EVP_PKEY_CTX* context = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    EVP_PKEY* key = NULL;
+    EVP_PKEY_keygen_init(context);
+    EVP_PKEY_CTX_set_rsa_keygen_bits(context, 2048);
+    EVP_PKEY_keygen(context, &key);
+    EVP_PKEY_CTX_free(context);
+
+    unsigned char* der = NULL;
+    int length = i2d_PUBKEY(key, &der);
+    o_publicKey = Base64(string((const char*)der, length));
+    OPENSSL_free(der);
+    return key;
+}
+
+// A zlib-compressed package of data, signed as psi_ops_server_entry_auth.py
+// signs it. The data is printable, so needs no escaping.
+string SignedPackage(EVP_PKEY* key, const string& publicKey, const string& data)
+{
+    EVP_MD_CTX* context = EVP_MD_CTX_new();
+    size_t length = 0;
+    EVP_DigestSignInit(context, NULL, EVP_sha256(), NULL, key);
+    EVP_DigestSign(context, NULL, &length, (const unsigned char*)data.data(), data.length());
+    string signature(length, '\0');
+    EVP_DigestSign(context, (unsigned char*)&signature[0], &length, (const unsigned char*)data.data(), data.length());
+    EVP_MD_CTX_free(context);
+
+    return Compress("{\"data\": \"" + data + "\", \"signingPublicKeyDigest\": \"" + Base64(Sha256(publicKey)) +
+                    "\", \"signature\": \"" + Base64(signature) + "\"}");
+}
+
+// As CachedSignatureVerifier
+struct Verifier
+{
+    Verifier(const string& publicKey)
+        : publicKeyDigest(Base64(Sha256(publicKey)))
+    {
+        string der = Unbase64(publicKey);
+        const unsigned char* input = (const unsigned char*)der.data();
+        key = d2i_PUBKEY(NULL, &input, (long)der.length());
+    }
+
+    ~Verifier() { EVP_PKEY_free(key); }
+
+    string publicKeyDigest;
+    EVP_PKEY* key;
+};
+
+map<string, shared_ptr<const Verifier>> g_verifierCache;
+mutex g_verifierCacheMutex;
+
+shared_ptr<const Verifier> GetCachedVerifier(const string& publicKey)
+{
+    lock_guard<mutex> lock(g_verifierCacheMutex);
+
+    auto cached = g_verifierCache.find(publicKey);
+    if (cached != g_verifierCache.end())
+    {
+        return cached->second;
+    }
+
+    shared_ptr<const Verifier> verifier = make_shared<const Verifier>(publicKey);
+    g_verifierCache[publicKey] = verifier;
+    return verifier;
+}
+
+// As VerifyingDataPackageSink, with a digest context as the accumulator
+class VerifyingSink : public IDataPackageSink
+{
+public:
+    VerifyingSink(IDataPackageSink& sink, EVP_MD_CTX* context)
+        : m_sink(sink), m_context(context) {}
+
+    virtual void Reserve(size_t length) { m_sink.Reserve(length); }
+
+    virtual bool Write(const char* data, size_t length)
+    {
+        EVP_DigestVerifyUpdate(m_context, data, length);
+        return m_sink.Write(data, length);
+    }
+
+    virtual bool End() { return m_sink.End(); }
+
+private:
+    IDataPackageSink& m_sink;
+    EVP_MD_CTX* m_context;
+};
+
+// The steps of verifySignedDataPackage
+bool Verify(const Verifier& verifier, const string& package, string& o_data)
+{
+    o_data.clear();
+    StringDataPackageSink sink(o_data);
+
+    EVP_MD_CTX* context = EVP_MD_CTX_new();
+    EVP_DigestVerifyInit(context, NULL, EVP_sha256(), NULL, verifier.key);
+    VerifyingSink verifyingSink(sink, context);
+
+    string encodedSignature, signingPublicKeyDigest;
+    bool verified =
+        InflateSignedDataPackage(package.data(), package.length(), false, verifyingSink,
+                                 encodedSignature, signingPublicKeyDigest) &&
+        verifier.publicKeyDigest == signingPublicKeyDigest;
+    if (verified)
+    {
+        string signature = Unbase64(encodedSignature);
+        verified = (1 == EVP_DigestVerifyFinal(context, (const unsigned char*)signature.data(), signature.length()));
+    }
+
+    EVP_MD_CTX_free(context);
+    return verified;
+}
+
+string RandomText(size_t length)
+{
+    mt19937 rng(1);
+    string text(length, '\0');
+    for (char& c : text)
+    {
+        c = 'a' + rng() % 26;
+    }
+    return text;
+}
+
+// Microseconds per verification, with each thread doing `iterations`
+double Microseconds(int threadCount, int iterations, const function<bool()>& verify)
+{
+    verify();
+
+    bool failed = false;
+    mutex failedMutex;
+    Clock::time_point start = Clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < threadCount; t++)
+    {
+        threads.push_back(thread([&]() {
+            for (int i = 0; i < iterations; i++)
+            {
+                if (!verify())
+                {
+                    lock_guard<mutex> lock(failedMutex);
+                    failed = true;
+                }
+            }
+        }));
+    }
+    for (thread& t : threads)
+    {
+        t.join();
+    }
+    if (failed)
+    {
+        fprintf(stderr, "verification failed\n");
+        exit(1);
+    }
+    return chrono::duration<double, micro>(Clock::now() - start).count() / (threadCount * iterations);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+
+    string publicKey;
+    EVP_PKEY* key = GenerateKey(publicKey);
+
+    struct
+    {
+        const char* name;
+        size_t dataLength;
+        int iterations;
+    } packages[] = {
+        { "500 byte", 500, iterations },
+        { "1MB", 1024 * 1024, max(1, iterations / 100) }
+    };
+
+    for (const auto& package : packages)
+    {
+        string data = RandomText(package.dataLength);
+        string signedPackage = SignedPackage(key, publicKey, data);
+
+        printf("%s package, %d iterations\n", package.name, package.iterations);
+        for (int threadCount : THREADS)
+        {
+            double built = Microseconds(threadCount, package.iterations, [&]() {
+                string output;
+                Verifier verifier(publicKey);
+                return Verify(verifier, signedPackage, output) && output == data;
+            });
+            double cached = Microseconds(threadCount, package.iterations, [&]() {
+                string output;
+                return Verify(*GetCachedVerifier(publicKey), signedPackage, output) && output == data;
+            });
+            printf("  %d thread%s  built %9.1f us  cached %9.1f us\n",
+                   threadCount, (threadCount == 1) ? " " : "s", built, cached);
+        }
+    }
+
+    EVP_PKEY_free(key);
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "signed_data_package.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <zlib.h>
+
+
+namespace {
+
+const char* const SIGNATURE = "c2lnbmF0dXJl";
+const char* const SIGNING_PUBLIC_KEY_DIGEST = "ZGlnZXN0";
+
+// As Python's json.dumps (see psi_ops_server_entry_auth.py) escapes a
+// string: control characters, including NUL, as \u00XX; bytes above 0x7F
+// are left as they are.
+string JsonString(const string& value)
+{
+    string json = "\"";
+    for (unsigned char c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            json += '\\';
+            json += (char)c;
+        }
+        else if (c < 0x20)
+        {
+            char escape[7];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            json += escape;
+        }
+        else
+        {
+            json += (char)c;
+        }
+    }
+    return json + "\"";
+}
+
+string Package(const string& data)
+{
+    return string("{\"data\": ") + JsonString(data) +
+           ", \"signingPublicKeyDigest\": " + JsonString(SIGNING_PUBLIC_KEY_DIGEST) +
+           ", \"signature\": " + JsonString(SIGNATURE) + "}";
+}
+
+string Compress(const string& input, bool gzipped)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (Z_OK != deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED,
+                             gzipped ? 16 + MAX_WBITS : MAX_WBITS, 8, Z_DEFAULT_STRATEGY))
+    {
+        throw std::runtime_error("deflateInit2 failed");
+    }
+
+    string output(deflateBound(&stream, (uLong)input.length()), '\0');
+    stream.next_in = (Bytef*)input.data();
+    stream.avail_in = (uInt)input.length();
+    stream.next_out = (Bytef*)&output[0];
+    stream.avail_out = (uInt)output.length();
+    int ret = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    if (ret != Z_STREAM_END)
+    {
+        throw std::runtime_error("deflate failed");
+    }
+    return output;
+}
+
+// Returns false if InflateSignedDataPackage does; otherwise checks the
+// signature fields and sets o_data.
+bool Inflate(const string& compressed, bool gzipped, string& o_data)
+{
+    o_data.clear();
+    StringDataPackageSink sink(o_data);
+    string signature, signingPublicKeyDigest;
+    if (!InflateSignedDataPackage(compressed.data(), compressed.length(), gzipped, sink, signature, signingPublicKeyDigest))
+    {
+        return false;
+    }
+
+    EXPECT_EQ(SIGNATURE, signature);
+    EXPECT_EQ(SIGNING_PUBLIC_KEY_DIGEST, signingPublicKeyDigest);
+    return true;
+}
+
+// Text with runs of NULs through it, as the package that used to be
+// truncated at the first NUL had
+string DataWithNuls()
+{
+    string data = "before the NULs\n";
+    data.append(16534, '\0');
+    data += "after the NULs\n";
+    data += string("one\0two\0\0three\n", 15);
+    data.append(1000, '\0');
+    return data;
+}
+
+}  // namespace
+
+
+TEST(SignedDataPackageTest, EmbeddedNulsRoundTrip)
+{
+    string data = DataWithNuls();
+    ASSERT_EQ(16534u + 3 + 1000, (size_t)count(data.begin(), data.end(), '\0'));
+
+    for (bool gzipped : { true, false })
+    {
+        string inflated;
+        ASSERT_TRUE(Inflate(Compress(Package(data), gzipped), gzipped, inflated)) << gzipped;
+        EXPECT_EQ(data.length(), inflated.length()) << gzipped;
+        EXPECT_TRUE(data == inflated) << gzipped;
+    }
+}
+
+TEST(SignedDataPackageTest, DataLargerThanAnInflateChunkRoundTrips)
+{
+    // Every byte value, spread over several 256KB inflate chunks, with
+    // escapes split across the chunk boundaries somewhere
+    mt19937 rng(1);
+    string data(1024 * 1024 + 7, '\0');
+    for (char& c : data)
+    {
+        c = (char)(rng() % 256);
+    }
+
+    string inflated;
+    ASSERT_TRUE(Inflate(Compress(Package(data), true), true, inflated));
+    EXPECT_EQ(data.length(), inflated.length());
+    EXPECT_TRUE(data == inflated);
+}
+
+TEST(SignedDataPackageTest, EscapesAreDecodedAsJsonReaderDoes)
+{
+    // \u escapes are UTF-8 encoded, including surrogate pairs
+    string package = "{\"data\": \"a\\u0000b\\u00e9\\u20ac\\ud83d\\ude00\\n\\t\\/\\\"\\\\\","
+                     " \"signingPublicKeyDigest\": \"ZGlnZXN0\", \"signature\": \"c2lnbmF0dXJl\"}";
+
+    string inflated;
+    ASSERT_TRUE(Inflate(Compress(package, false), false, inflated));
+    EXPECT_EQ(string("a\0b\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80\n\t/\"\\", 17), inflated);
+}
+
+TEST(SignedDataPackageTest, TruncatedPackageIsRejected)
+{
+    string compressed = Compress(Package(DataWithNuls()), true);
+    for (size_t length : { (size_t)0, (size_t)10, compressed.length() / 2, compressed.length() - 1 })
+    {
+        string inflated;
+        EXPECT_FALSE(Inflate(compressed.substr(0, length), true, inflated)) << length;
+    }
+}
+
+TEST(SignedDataPackageTest, MalformedPackageIsRejected)
+{
+    const char* const packages[] = {
+        // Missing members
+        "{\"data\": \"x\", \"signature\": \"c2lnbmF0dXJl\"}",
+        "{\"data\": \"x\", \"signingPublicKeyDigest\": \"ZGlnZXN0\"}",
+        "{\"signingPublicKeyDigest\": \"ZGlnZXN0\", \"signature\": \"c2lnbmF0dXJl\"}",
+        // Not JSON, or not complete
+        "{\"data\": \"x\", \"signingPublicKeyDigest\": \"ZGlnZXN0\", \"signature\": \"c2lnbmF0dXJl\"",
+        "{\"data\": \"\\u00\", \"signingPublicKeyDigest\": \"ZGlnZXN0\", \"signature\": \"c2lnbmF0dXJl\"}",
+        "[]",
+        "",
+    };
+
+    for (const char* package : packages)
+    {
+        string inflated;
+        EXPECT_FALSE(Inflate(Compress(package, false), false, inflated)) << package;
+    }
+
+    // Not compressed at all
+    string inflated;
+    EXPECT_FALSE(Inflate(Package("x"), false, inflated));
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "stopsignal.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+double ElapsedMilliseconds(Clock::time_point start)
+{
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+}  // namespace
+
+
+TEST(StopSignalTest, CheckSignalMatchesOnlyTheGivenReasons)
+{
+    StopSignal stopSignal;
+    EXPECT_EQ(0u, stopSignal.CheckSignal(STOP_REASON_ANY_STOP_TUNNEL));
+
+    stopSignal.SignalStop(STOP_REASON_CONNECTED);
+    stopSignal.SignalStop(STOP_REASON_EXIT);
+    EXPECT_EQ((DWORD)STOP_REASON_EXIT, stopSignal.CheckSignal(STOP_REASON_ANY_STOP_TUNNEL));
+    EXPECT_EQ((DWORD)(STOP_REASON_CONNECTED | STOP_REASON_EXIT),
+              stopSignal.CheckSignal(STOP_REASON_CONNECTED | STOP_REASON_EXIT | STOP_REASON_CANCEL));
+    EXPECT_THROW(stopSignal.CheckSignal(STOP_REASON_EXIT, true), StopSignal::ExitStopException);
+
+    stopSignal.ClearStopSignal(STOP_REASON_EXIT);
+    EXPECT_EQ(0u, stopSignal.CheckSignal(STOP_REASON_ANY_STOP_TUNNEL));
+    EXPECT_EQ((DWORD)STOP_REASON_CONNECTED, stopSignal.CheckSignal(STOP_REASON_CONNECTED));
+}
+
+TEST(StopSignalTest, WaitReturnsWhenSignalled)
+{
+    StopSignal stopSignal;
+
+    thread signaller([&stopSignal]() {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        // Not waited for, so it mustn't end the wait
+        stopSignal.SignalStop(STOP_REASON_CONNECTED);
+        this_thread::sleep_for(chrono::milliseconds(100));
+        stopSignal.SignalStop(STOP_REASON_CANCEL);
+    });
+
+    Clock::time_point start = Clock::now();
+    DWORD matched = stopSignal.WaitForSignal(STOP_REASON_CANCEL | STOP_REASON_EXIT, INFINITE);
+    double elapsed = ElapsedMilliseconds(start);
+    signaller.join();
+
+    EXPECT_EQ((DWORD)STOP_REASON_CANCEL, matched);
+    EXPECT_GE(elapsed, 150);
+}
+
+TEST(StopSignalTest, WaitTimesOut)
+{
+    StopSignal stopSignal;
+    stopSignal.SignalStop(STOP_REASON_CONNECTED);
+
+    Clock::time_point start = Clock::now();
+    EXPECT_EQ(0u, stopSignal.WaitForSignal(STOP_REASON_CANCEL, 200));
+    double elapsed = ElapsedMilliseconds(start);
+    EXPECT_GE(elapsed, 190);
+    EXPECT_LT(elapsed, 5000);
+
+    // A zero timeout only checks
+    EXPECT_EQ(0u, stopSignal.WaitForSignal(STOP_REASON_CANCEL, 0));
+    EXPECT_EQ((DWORD)STOP_REASON_CONNECTED, stopSignal.WaitForSignal(STOP_REASON_CONNECTED, 0));
+}
+
+TEST(StopSignalTest, WaitReturnsAtOnceIfAlreadySignalled)
+{
+    StopSignal stopSignal;
+    stopSignal.SignalStop(STOP_REASON_EXIT);
+
+    Clock::time_point start = Clock::now();
+    EXPECT_EQ((DWORD)STOP_REASON_EXIT, stopSignal.WaitForSignal(STOP_REASON_ANY_STOP_TUNNEL, INFINITE));
+    EXPECT_LT(ElapsedMilliseconds(start), 1000);
+}
+
+TEST(StopSignalTest, SubscribersAreCalledForTheirReasons)
+{
+    StopSignal stopSignal;
+    vector<DWORD> calls;
+    int id = stopSignal.Subscribe(STOP_REASON_CANCEL | STOP_REASON_EXIT, [&calls](DWORD reasons) {
+        calls.push_back(reasons);
+    });
+
+    stopSignal.SignalStop(STOP_REASON_CONNECTED);
+    EXPECT_TRUE(calls.empty());
+
+    stopSignal.SignalStop(STOP_REASON_CANCEL);
+    stopSignal.SignalStop(STOP_REASON_EXIT | STOP_REASON_CONNECTED);
+    ASSERT_EQ(2u, calls.size());
+    EXPECT_EQ((DWORD)STOP_REASON_CANCEL, calls[0]);
+    EXPECT_EQ((DWORD)STOP_REASON_EXIT, calls[1]);
+
+    stopSignal.Unsubscribe(id);
+}
+
+TEST(StopSignalTest, SubscribingWhileSignalledCallsBackAtOnce)
+{
+    StopSignal stopSignal;
+    stopSignal.SignalStop(STOP_REASON_EXIT | STOP_REASON_CONNECTED);
+
+    vector<DWORD> calls;
+    int id = stopSignal.Subscribe(STOP_REASON_ANY_STOP_TUNNEL, [&calls](DWORD reasons) {
+        calls.push_back(reasons);
+    });
+    ASSERT_EQ(1u, calls.size());
+    EXPECT_EQ((DWORD)STOP_REASON_EXIT, calls[0]);
+    stopSignal.Unsubscribe(id);
+
+    // Nothing matching is set, so no call
+    int other = stopSignal.Subscribe(STOP_REASON_CANCEL, [&calls](DWORD reasons) {
+        calls.push_back(reasons);
+    });
+    EXPECT_EQ(1u, calls.size());
+    stopSignal.Unsubscribe(other);
+}
+
+TEST(StopSignalTest, UnsubscribedCallbacksAreNotCalled)
+{
+    StopSignal stopSignal;
+    int firstCalls = 0, secondCalls = 0;
+    int first = stopSignal.Subscribe(STOP_REASON_CANCEL, [&firstCalls](DWORD) { firstCalls++; });
+    int second = stopSignal.Subscribe(STOP_REASON_CANCEL, [&secondCalls](DWORD) { secondCalls++; });
+    EXPECT_NE(first, second);
+
+    stopSignal.Unsubscribe(first);
+    stopSignal.SignalStop(STOP_REASON_CANCEL);
+    EXPECT_EQ(0, firstCalls);
+    EXPECT_EQ(1, secondCalls);
+
+    // Unsubscribing again, or an ID that was never issued, does nothing
+    stopSignal.Unsubscribe(first);
+    stopSignal.Unsubscribe(12345);
+
+    stopSignal.Unsubscribe(second);
+    stopSignal.SignalStop(STOP_REASON_CANCEL);
+    EXPECT_EQ(1, secondCalls);
+}
+
+TEST(StopSignalTest, ManyWaitersAndSignallers)
+{
+    // Each round, waiters wait (some with timeouts, some subscribed instead)
+    // for a reason that several threads signal at once. Every waiter must
+    // see the signal: no wake-up may be lost.
+    const int ROUNDS = 200;
+    const int WAITERS = 8;
+    const int SUBSCRIBERS = 4;
+    const int SIGNALLERS = 4;
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        StopSignal stopSignal;
+        const DWORD reason = (round % 2) ? STOP_REASON_CANCEL : STOP_REASON_EXIT;
+        atomic<int> woken(0);
+        atomic<int> called(0);
+
+        vector<thread> threads;
+        for (int i = 0; i < WAITERS; i++)
+        {
+            threads.push_back(thread([&stopSignal, &woken, reason, i]() {
+                DWORD timeout = (i % 2) ? INFINITE : 60000;
+                if (stopSignal.WaitForSignal(STOP_REASON_CANCEL | STOP_REASON_EXIT, timeout) == reason)
+                {
+                    woken++;
+                }
+            }));
+        }
+
+        vector<int> subscriptions;
+        for (int i = 0; i < SUBSCRIBERS; i++)
+        {
+            subscriptions.push_back(stopSignal.Subscribe(reason, [&called](DWORD) { called++; }));
+        }
+
+        for (int i = 0; i < SIGNALLERS; i++)
+        {
+            threads.push_back(thread([&stopSignal, reason, i]() {
+                // Other reasons are signalled too, which must not confuse anyone
+                stopSignal.SignalStop(STOP_REASON_CONNECTED);
+                this_thread::sleep_for(chrono::microseconds(100 * i));
+                stopSignal.SignalStop(reason);
+            }));
+        }
+
+        for (thread& t : threads)
+        {
+            t.join();
+        }
+        for (int id : subscriptions)
+        {
+            stopSignal.Unsubscribe(id);
+        }
+
+        ASSERT_EQ(WAITERS, woken.load()) << round;
+        // Each subscriber is called for each signal of its reason
+        ASSERT_EQ(SUBSCRIBERS * SIGNALLERS, called.load()) << round;
+    }
+}
@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "subprocess_output_reader.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+namespace {
+
+// As in subprocess_output_reader.cpp
+const size_t INITIAL_BUFFER_SIZE = 64 * 1024;
+const size_t MAX_LINE_LENGTH = 4 * 1024 * 1024;
+const int MAX_READS_PER_CONSUME = 16;
+
+class LineCollector : public ISubprocessOutputHandler
+{
+public:
+    virtual void HandleSubprocessOutputLine(const char* line, size_t length)
+    {
+        // The line is terminated in place
+        EXPECT_EQ('\0', line[length]);
+        lines.push_back(string(line, length));
+        bytes += length + 1;
+    }
+
+    vector<string> lines;
+    size_t bytes = 0;
+};
+
+// A child process writing to a pipe, standing in for a subprocess writing to
+// its stdout.
+class ChildWriter
+{
+public:
+    // `write` is run in the child, with the write end of the pipe.
+    ChildWriter(const function<void(int)>& write)
+    {
+        int fds[2];
+        EXPECT_EQ(0, pipe(fds));
+
+        m_pid = fork();
+        if (m_pid == 0)
+        {
+            close(fds[0]);
+            write(fds[1]);
+            close(fds[1]);
+            _exit(0);
+        }
+
+        close(fds[1]);
+        m_pipe = fds[0];
+    }
+
+    ~ChildWriter()
+    {
+        kill(m_pid, SIGKILL);
+        waitpid(m_pid, NULL, 0);
+        close(m_pipe);
+    }
+
+    int Pipe() const { return m_pipe; }
+
+private:
+    pid_t m_pid;
+    int m_pipe;
+};
+
+void WriteAll(int fd, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0)
+        {
+            _exit(1);
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Waits for output, as Subprocess's callers do, and consumes it until the
+// pipe closes.
+void ConsumeUntilClosed(SubprocessOutputReader& reader, ISubprocessOutputHandler& handler)
+{
+    while (true)
+    {
+        pollfd ready = { reader.ReadyEvent(), POLLIN, 0 };
+        ASSERT_EQ(1, poll(&ready, 1, 10000));
+
+        if (!reader.Consume(handler))
+        {
+            return;
+        }
+    }
+}
+
+typedef chrono::steady_clock Clock;
+
+int ElapsedMilliseconds(Clock::time_point start)
+{
+    return (int)chrono::duration_cast<chrono::milliseconds>(Clock::now() - start).count();
+}
+
+sockaddr_in LoopbackAddress(int port)
+{
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    return address;
+}
+
+// A port that nothing is listening on
+int UnusedPort()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = LoopbackAddress(0);
+    socklen_t length = sizeof(address);
+    EXPECT_EQ(0, ::bind(sock, (sockaddr*)&address, sizeof(address)));
+    EXPECT_EQ(0, getsockname(sock, (sockaddr*)&address, &length));
+    close(sock);
+    return ntohs(address.sin_port);
+}
+
+string ReadyLine(int port)
+{
+    return "Established listening socket on port " + to_string(port) + ".";
+}
+
+// Run in a ChildWriter, standing in for Polipo: it takes `startupMilliseconds`
+// to start listening, then says so, as Polipo logs it, and keeps running.
+void StandInProxy(int fd, int port, int startupMilliseconds)
+{
+    usleep(startupMilliseconds * 1000);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = LoopbackAddress(port);
+    if (0 != ::bind(listener, (sockaddr*)&address, sizeof(address)) || 0 != listen(listener, 1))
+    {
+        _exit(1);
+    }
+
+    string output = "PSIPHON-BYTES-TRANSFERRED:>>0<<" + ReadyLine(port) + "\n";
+    WriteAll(fd, output.data(), output.length());
+    sleep(60);
+}
+
+// How Subprocess::WaitForReady waits with a ready line: for output, until the
+// line has been read. Returns the milliseconds since `start`.
+int WaitForReadyLine(SubprocessOutputReader& reader, Clock::time_point start)
+{
+    LineCollector collector;
+    while (!reader.WatchedTextSeen())
+    {
+        pollfd ready = { reader.ReadyEvent(), POLLIN, 0 };
+        EXPECT_EQ(1, poll(&ready, 1, 10000));
+        if (!reader.Consume(collector))
+        {
+            ADD_FAILURE() << "output closed before the ready line";
+            break;
+        }
+    }
+    return ElapsedMilliseconds(start);
+}
+
+// How WaitForConnectability waits without one. On Windows, a connection to a
+// loopback port that isn't listening isn't refused straight away, so every
+// failed attempt takes the whole 100ms it's given.
+int WaitForConnectability(int port, Clock::time_point start)
+{
+    const auto ATTEMPT_TIME = chrono::milliseconds(100);
+    while (ElapsedMilliseconds(start) < 10000)
+    {
+        Clock::time_point attemptStart = Clock::now();
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = LoopbackAddress(port);
+        bool connected = (0 == connect(sock, (sockaddr*)&address, sizeof(address)));
+        close(sock);
+        if (connected)
+        {
+            break;
+        }
+        this_thread::sleep_until(attemptStart + ATTEMPT_TIME);
+    }
+    return ElapsedMilliseconds(start);
+}
+
+int Median(vector<int> values)
+{
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+}  // namespace
+
+
+TEST(SubprocessOutputReaderTest, LinesSplitAcrossWritesAreReassembled)
+{
+    mt19937 rng(1);
+    vector<string> lines;
+    string output;
+    for (int i = 0; i < 20000; i++)
+    {
+        string line(rng() % 200, (char)('a' + i % 26));
+        if (i == 10000)
+        {
+            // Longer than the initial buffer, so the buffer has to grow
+            line.assign(300 * 1024, 'x');
+        }
+        lines.push_back(line);
+        output += line + '\n';
+    }
+
+    const size_t chunkSizes[] = { 1, 7, 4096, 65536 };
+    for (size_t chunkSize : chunkSizes)
+    {
+        ChildWriter child([&](int fd) {
+            for (size_t offset = 0; offset < output.length(); offset += chunkSize)
+            {
+                WriteAll(fd, output.data() + offset, min(chunkSize, output.length() - offset));
+            }
+        });
+
+        SubprocessOutputReader reader;
+        ASSERT_TRUE(reader.Attach(child.Pipe()));
+        LineCollector collector;
+        ConsumeUntilClosed(reader, collector);
+        reader.Detach();
+
+        EXPECT_TRUE(collector.lines == lines) << "chunk size " << chunkSize;
+    }
+}
+
+TEST(SubprocessOutputReaderTest, LinesLongerThanTheLimitAreDropped)
+{
+    string longest(MAX_LINE_LENGTH - 1, 'k');
+    string tooLong(MAX_LINE_LENGTH + 1024 * 1024, 'd');
+
+    ChildWriter child([&](int fd) {
+        string output = "before\n" + longest + "\n" + tooLong + "\nafter\n";
+        WriteAll(fd, output.data(), output.length());
+    });
+
+    SubprocessOutputReader reader;
+    ASSERT_TRUE(reader.Attach(child.Pipe()));
+    LineCollector collector;
+    ConsumeUntilClosed(reader, collector);
+
+    // The longest line that fits in the buffer with its newline is kept;
+    // the one after it is dropped, without losing the line that follows.
+    ASSERT_EQ(3u, collector.lines.size());
+    EXPECT_EQ("before", collector.lines[0]);
+    EXPECT_TRUE(collector.lines[1] == longest);
+    EXPECT_EQ("after", collector.lines[2]);
+}
+
+TEST(SubprocessOutputReaderTest, PartialLineAtEndOfOutputIsDiscarded)
+{
+    ChildWriter child([](int fd) {
+        WriteAll(fd, "one\ntwo\nthr", 11);
+    });
+
+    SubprocessOutputReader reader;
+    ASSERT_TRUE(reader.Attach(child.Pipe()));
+    LineCollector collector;
+    ConsumeUntilClosed(reader, collector);
+
+    EXPECT_EQ((vector<string>{ "one", "two" }), collector.lines);
+
+    // Once closed, it stays closed
+    EXPECT_FALSE(reader.Consume(collector));
+    EXPECT_EQ(2u, collector.lines.size());
+}
+
+TEST(SubprocessOutputReaderTest, ConsumeReturnsWhileTheChildKeepsWriting)
+{
+    // Writes until it's killed
+    ChildWriter child([](int fd) {
+        string line(99, 'f');
+        line += '\n';
+        string burst;
+        for (int i = 0; i < 1000; i++)
+        {
+            burst += line;
+        }
+        while (true)
+        {
+            WriteAll(fd, burst.data(), burst.length());
+        }
+    });
+
+    SubprocessOutputReader reader;
+    ASSERT_TRUE(reader.Attach(child.Pipe()));
+
+    // With lines this short the buffer never grows, so a call can't handle
+    // more than MAX_READS_PER_CONSUME buffers' worth.
+    for (int call = 0; call < 200; call++)
+    {
+        pollfd ready = { reader.ReadyEvent(), POLLIN, 0 };
+        ASSERT_EQ(1, poll(&ready, 1, 10000));
+
+        LineCollector collector;
+        ASSERT_TRUE(reader.Consume(collector));
+        EXPECT_LE(collector.bytes, MAX_READS_PER_CONSUME * INITIAL_BUFFER_SIZE);
+        for (const string& line : collector.lines)
+        {
+            ASSERT_EQ(99u, line.length());
+        }
+    }
+}
+
+TEST(SubprocessOutputReaderTest, DelimiterSplitAcrossWritesIsFound)
+{
+    // As Polipo writes its stats: entries end with "<<", not a newline, and
+    // other output may come between them
+    const string output =
+        "PSIPHON-PAGE-VIEW-HTTP:>>example.com/a<<"
+        "PSIPHON-BYTES-TRANSFERRED:>>123<<\n"
+        "a log line\n"
+        "PSIPHON-PAGE-VIEW-HTTPS:>>example.org:443<<<"
+        "PSIPHON-UNPROXIED:>>example.net<<";
+    const vector<string> entries = {
+        "PSIPHON-PAGE-VIEW-HTTP:>>example.com/a",
+        "PSIPHON-BYTES-TRANSFERRED:>>123",
+        "\na log line\nPSIPHON-PAGE-VIEW-HTTPS:>>example.org:443",
+        "<PSIPHON-UNPROXIED:>>example.net",
+    };
+
+    for (size_t chunkSize = 1; chunkSize <= output.length(); chunkSize++)
+    {
+        ChildWriter child([&](int fd) {
+            for (size_t offset = 0; offset < output.length(); offset += chunkSize)
+            {
+                WriteAll(fd, output.data() + offset, min(chunkSize, output.length() - offset));
+                // So that each chunk is a separate read
+                usleep(100);
+            }
+        });
+
+        SubprocessOutputReader reader("<<");
+        ASSERT_TRUE(reader.Attach(child.Pipe()));
+        LineCollector collector;
+        ConsumeUntilClosed(reader, collector);
+
+        EXPECT_EQ(entries, collector.lines) << "chunk size " << chunkSize;
+    }
+}
+
+TEST(SubprocessOutputReaderTest, EntriesAreHandledWithoutAWaitingNewline)
+{
+    // A stand-in for Polipo that writes more stats entries than the line
+    // length limit, with no newline after any of them, and then stays
+    // running. Every entry must be handled while it runs, as the last stats
+    // are collected just before it's stopped.
+    const int ENTRIES = 200000;
+    const string entry = "PSIPHON-BYTES-TRANSFERRED:>>1<<";
+    ASSERT_GT(ENTRIES * entry.length(), MAX_LINE_LENGTH);
+
+    ChildWriter child([&](int fd) {
+        string output;
+        for (int i = 0; i < ENTRIES; i++)
+        {
+            output += entry;
+        }
+        WriteAll(fd, output.data(), output.length());
+        sleep(60);
+    });
+
+    SubprocessOutputReader reader("<<");
+    ASSERT_TRUE(reader.Attach(child.Pipe()));
+    LineCollector collector;
+    while (collector.lines.size() < (size_t)ENTRIES)
+    {
+        pollfd ready = { reader.ReadyEvent(), POLLIN, 0 };
+        ASSERT_EQ(1, poll(&ready, 1, 10000)) << collector.lines.size();
+        ASSERT_TRUE(reader.Consume(collector));
+    }
+
+    EXPECT_EQ((size_t)ENTRIES, collector.lines.size());
+    for (const string& line : collector.lines)
+    {
+        ASSERT_EQ("PSIPHON-BYTES-TRANSFERRED:>>1", line);
+    }
+}
+
+TEST(SubprocessOutputReaderTest, WatchedTextIsSeenAcrossReads)
+{
+    const string watched = "Established listening socket on port 8080.";
+    // The text is split by the stats delimiter, and preceded by a near miss
+    const string output =
+        "PSIPHON-BYTES-TRANSFERRED:>>1<<"
+        "Established listening socket on port 808.\n"
+        "Established listening<<socket on port 8080.\n"
+        "Established listening socket on port 8080.\n"
+        "PSIPHON-BYTES-TRANSFERRED:>>2<<";
+
+    for (size_t chunkSize = 1; chunkSize <= output.length(); chunkSize++)
+    {
+        // Up to, and then including, the last character of the text
+        size_t textEnd = output.find(watched) + watched.length();
+        for (size_t cut : { textEnd - 1, textEnd })
+        {
+            ChildWriter child([&](int fd) {
+                for (size_t offset = 0; offset < cut; offset += chunkSize)
+                {
+                    WriteAll(fd, output.data() + offset, min(chunkSize, cut - offset));
+                    usleep(100);
+                }
+            });
+
+            SubprocessOutputReader reader("<<");
+            reader.SetWatchedText(watched);
+            ASSERT_TRUE(reader.Attach(child.Pipe()));
+            LineCollector collector;
+            ConsumeUntilClosed(reader, collector);
+
+            EXPECT_EQ(cut == textEnd, reader.WatchedTextSeen()) << "chunk size " << chunkSize;
+
+            // Watching doesn't change what's handled
+            EXPECT_EQ("PSIPHON-BYTES-TRANSFERRED:>>1", collector.lines.at(0));
+        }
+    }
+}
+
+TEST(SubprocessOutputReaderTest, WatchedTextIsResetOnAttach)
+{
+    SubprocessOutputReader reader;
+    reader.SetWatchedText("ready");
+    LineCollector collector;
+
+    {
+        ChildWriter child([](int fd) { WriteAll(fd, "ready\n", 6); });
+        ASSERT_TRUE(reader.Attach(child.Pipe()));
+        ConsumeUntilClosed(reader, collector);
+        EXPECT_TRUE(reader.WatchedTextSeen());
+    }
+
+    // A second child that never gets ready, and whose output starts with
+    // the end of the text
+    ChildWriter child([](int fd) { WriteAll(fd, "dy\n", 3); });
+    ASSERT_TRUE(reader.Attach(child.Pipe()));
+    EXPECT_FALSE(reader.WatchedTextSeen());
+    ConsumeUntilClosed(reader, collector);
+    EXPECT_FALSE(reader.WatchedTextSeen());
+}
+
+TEST(SubprocessOutputReaderTest, ReadyLineIsSoonerThanProbingThePort)
+{
+    // The time from starting a stand-in Polipo to knowing that it's
+    // listening, with the ready line and with WaitForConnectability's probe.
+    // subprocess_ready_benchmark measures this over more runs and startup
+    // times.
+    const int STARTUP_MILLISECONDS = 150;
+    const int RUNS = 5;
+
+    vector<int> readyLine, probe;
+    for (int run = 0; run < RUNS; run++)
+    {
+        int port = UnusedPort();
+        Clock::time_point start = Clock::now();
+        ChildWriter child([&](int fd) { StandInProxy(fd, port, STARTUP_MILLISECONDS); });
+        SubprocessOutputReader reader("<<");
+        reader.SetWatchedText(ReadyLine(port));
+        ASSERT_TRUE(reader.Attach(child.Pipe()));
+        readyLine.push_back(WaitForReadyLine(reader, start));
+    }
+    for (int run = 0; run < RUNS; run++)
+    {
+        int port = UnusedPort();
+        Clock::time_point start = Clock::now();
+        ChildWriter child([&](int fd) { StandInProxy(fd, port, STARTUP_MILLISECONDS); });
+        probe.push_back(WaitForConnectability(port, start));
+    }
+
+    // The probe finds the port at the first attempt after the child starts
+    // listening, 200ms in
+    EXPECT_GE(Median(readyLine), STARTUP_MILLISECONDS);
+    EXPECT_LT(Median(readyLine), Median(probe));
+    EXPECT_GE(Median(probe), 200);
+}
+
+TEST(SubprocessOutputReaderTest, NotAttached)
+{
+    SubprocessOutputReader reader;
+    LineCollector collector;
+    EXPECT_FALSE(reader.Consume(collector));
+    EXPECT_FALSE(reader.Attach(-1));
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures the time from starting a stand-in Polipo to knowing that it's
+listening, as LocalProxy::StartPolipo waits for it:
+- with the ready protocol: Subprocess::WaitForReady waits for output, until
+  the child's "Established listening socket" line has been read;
+- without it: WaitForConnectability tries to connect to the port every 100ms.
+  On Windows, a connection to a loopback port that isn't listening isn't
+  refused straight away, so every failed attempt takes the whole 100ms; that's
+  emulated here.
+
+The stand-in is a forked child that takes a given time to start listening,
+then says so on its stdout, after a stats entry, as Polipo does.
+
+    subprocess_ready_benchmark [runs]
+*/
+
+#include "stdafx.h"
+#include "subprocess_output_reader.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <numeric>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const int STARTUP_MILLISECONDS[] = { 0, 20, 50, 150, 250, 500 };
+const auto PROBE_ATTEMPT_TIME = chrono::milliseconds(100);
+
+double ElapsedMilliseconds(Clock::time_point start)
+{
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+sockaddr_in LoopbackAddress(int port)
+{
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    return address;
+}
+
+int UnusedPort()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = LoopbackAddress(0);
+    socklen_t length = sizeof(address);
+    ::bind(sock, (sockaddr*)&address, sizeof(address));
+    getsockname(sock, (sockaddr*)&address, &length);
+    close(sock);
+    return ntohs(address.sin_port);
+}
+
+string ReadyLine(int port)
+{
+    return "Established listening socket on port " + to_string(port) + ".";
+}
+
+class NullHandler : public ISubprocessOutputHandler
+{
+public:
+    virtual void HandleSubprocessOutputLine(const char*, size_t) {}
+};
+
+// A forked stand-in for Polipo, killed when this goes out of scope
+class StandInProxy
+{
+public:
+    StandInProxy(int port, int startupMilliseconds)
+    {
+        int fds[2];
+        if (0 != pipe(fds))
+        {
+            exit(1);
+        }
+
+        m_pid = fork();
+        if (m_pid == 0)
+        {
+            close(fds[0]);
+            usleep(startupMilliseconds * 1000);
+
+            int listener = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address = LoopbackAddress(port);
+            if (0 != ::bind(listener, (sockaddr*)&address, sizeof(address)) || 0 != listen(listener, 1))
+            {
+                _exit(1);
+            }
+
+            string output = "PSIPHON-BYTES-TRANSFERRED:>>0<<" + ReadyLine(port) + "\n";
+            if (write(fds[1], output.data(), output.length()) != (ssize_t)output.length())
+            {
+                _exit(1);
+            }
+            sleep(60);
+            _exit(0);
+        }
+
+        close(fds[1]);
+        m_pipe = fds[0];
+    }
+
+    ~StandInProxy()
+    {
+        kill(m_pid, SIGKILL);
+        waitpid(m_pid, NULL, 0);
+        close(m_pipe);
+    }
+
+    int Pipe() const { return m_pipe; }
+
+private:
+    pid_t m_pid;
+    int m_pipe;
+};
+
+double WithReadyLine(int startupMilliseconds)
+{
+    int port = UnusedPort();
+    Clock::time_point start = Clock::now();
+    StandInProxy child(port, startupMilliseconds);
+
+    SubprocessOutputReader reader("<<");
+    reader.SetWatchedText(ReadyLine(port));
+    reader.Attach(child.Pipe());
+    NullHandler handler;
+    while (!reader.WatchedTextSeen())
+    {
+        pollfd ready = { reader.ReadyEvent(), POLLIN, 0 };
+        if (1 != poll(&ready, 1, 10000) || !reader.Consume(handler))
+        {
+            fprintf(stderr, "no ready line\n");
+            exit(1);
+        }
+    }
+    return ElapsedMilliseconds(start);
+}
+
+double WithProbe(int startupMilliseconds)
+{
+    int port = UnusedPort();
+    Clock::time_point start = Clock::now();
+    StandInProxy child(port, startupMilliseconds);
+
+    while (true)
+    {
+        Clock::time_point attemptStart = Clock::now();
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = LoopbackAddress(port);
+        bool connected = (0 == connect(sock, (sockaddr*)&address, sizeof(address)));
+        close(sock);
+        if (connected)
+        {
+            return ElapsedMilliseconds(start);
+        }
+        this_thread::sleep_until(attemptStart + PROBE_ATTEMPT_TIME);
+    }
+}
+
+void Print(const char* name, vector<double> times)
+{
+    sort(times.begin(), times.end());
+    double mean = accumulate(times.begin(), times.end(), 0.0) / times.size();
+    printf("  %-12s mean %6.1f ms  median %6.1f ms  p90 %6.1f ms\n",
+           name, mean, times[times.size() / 2], times[times.size() * 9 / 10]);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int runs = (argc > 1) ? atoi(argv[1]) : 20;
+
+    for (int startupMilliseconds : STARTUP_MILLISECONDS)
+    {
+        vector<double> readyLine, probe;
+        for (int run = 0; run < runs; run++)
+        {
+            readyLine.push_back(WithReadyLine(startupMilliseconds));
+            probe.push_back(WithProbe(startupMilliseconds));
+        }
+
+        printf("startup %d ms, %d runs\n", startupMilliseconds, runs);
+        Print("ready line", readyLine);
+        Print("probe", probe);
+    }
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures what it costs to start a piece of background work:
+- thread: a std::thread per job, as each job had its own thread before (a
+  CreateThread on Windows). The job is joined when it's done.
+- executor: TaskExecutor::Submit, as jobs are started now, on a pool of
+  four workers. The job is waited on through its TaskHandle.
+
+For each, 1,000 jobs that do nothing are started:
+- one at a time, each waited on before the next is started, giving the time
+  from starting the job to it running, and to having waited for it;
+- all at once, then all waited on, giving the time per job.
+
+    task_executor_benchmark [jobs]
+*/
+
+#include "stdafx.h"
+#include "task_executor.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const size_t WORKERS = 4;
+
+double Microseconds(Clock::time_point start, Clock::time_point end)
+{
+    return chrono::duration<double, micro>(end - start).count();
+}
+
+void PrintTimes(const char* name, vector<double> times)
+{
+    sort(times.begin(), times.end());
+    printf("    %-14s median %8.1f us  p90 %8.1f us  p99 %8.1f us\n", name,
+           times[times.size() / 2], times[times.size() * 9 / 10], times[times.size() * 99 / 100]);
+}
+
+// Starts a job that sets `started` once it's running, and returns a
+// function that waits for it.
+typedef function<function<void()>(Clock::time_point& started)> Starter;
+
+void OneAtATime(const char* name, int jobs, const Starter& start)
+{
+    vector<double> toRunning, toDone;
+    for (int i = 0; i < jobs; i++)
+    {
+        Clock::time_point started;
+        Clock::time_point submitted = Clock::now();
+        function<void()> wait = start(started);
+        wait();
+        Clock::time_point done = Clock::now();
+
+        toRunning.push_back(Microseconds(submitted, started));
+        toDone.push_back(Microseconds(submitted, done));
+    }
+
+    printf("  %s\n", name);
+    PrintTimes("to running", toRunning);
+    PrintTimes("to waited for", toDone);
+}
+
+void AllAtOnce(const char* name, int jobs, const Starter& start)
+{
+    vector<Clock::time_point> started(jobs);
+    vector<function<void()>> waits;
+
+    Clock::time_point begin = Clock::now();
+    for (int i = 0; i < jobs; i++)
+    {
+        waits.push_back(start(started[i]));
+    }
+    for (const function<void()>& wait : waits)
+    {
+        wait();
+    }
+    double total = Microseconds(begin, Clock::now());
+
+    printf("  %-8s %8.1f us per job\n", name, total / jobs);
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int jobs = (argc > 1) ? atoi(argv[1]) : 1000;
+
+    TaskExecutor executor(WORKERS);
+
+    Starter startThread = [](Clock::time_point& started) -> function<void()> {
+        shared_ptr<std::thread> job = make_shared<std::thread>([&started]() { started = Clock::now(); });
+        return [job]() { job->join(); };
+    };
+    Starter submitTask = [&executor](Clock::time_point& started) -> function<void()> {
+        TaskHandle handle = executor.Submit(TASK_PRIORITY_BACKGROUND, [&started](const CancellationToken&) {
+            started = Clock::now();
+        });
+        return [handle]() { handle.Wait(); };
+    };
+
+    printf("%d jobs, one at a time\n", jobs);
+    OneAtATime("thread", jobs, startThread);
+    OneAtATime("executor", jobs, submitTask);
+
+    printf("%d jobs, all at once\n", jobs);
+    AllAtOnce("thread", jobs, startThread);
+    AllAtOnce("executor", jobs, submitTask);
+
+    return 0;
+}
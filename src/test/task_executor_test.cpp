@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "task_executor.h"
+#include "dispatch_queue.h"
+#include <gtest/gtest.h>
+#include <chrono>
+#include <future>
+
+
+namespace {
+
+// Holds tasks until it's opened
+class Gate
+{
+public:
+    Gate() : m_opened(m_promise.get_future().share()) {}
+
+    void Open() { m_promise.set_value(); }
+    void Wait() const { m_opened.wait(); }
+
+private:
+    promise<void> m_promise;
+    shared_future<void> m_opened;
+};
+
+// Waits for `condition`, for up to 10 seconds
+bool Eventually(const function<bool()>& condition)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        if (condition())
+        {
+            return true;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return condition();
+}
+
+// Keeps the greatest value that `current` reaches
+void UpdateMax(atomic<int>& max, int current)
+{
+    int seen = max;
+    while (current > seen && !max.compare_exchange_weak(seen, current))
+    {
+    }
+}
+
+}  // namespace
+
+
+TEST(TaskExecutorTest, TasksRunAndCanBeWaitedFor)
+{
+    TaskExecutor executor(4);
+    atomic<int> ran(0);
+
+    vector<TaskHandle> handles;
+    for (int i = 0; i < 1000; i++)
+    {
+        TaskPriority priority = (i % 2) ? TASK_PRIORITY_UI : TASK_PRIORITY_BACKGROUND;
+        handles.push_back(executor.Submit(priority, [&ran](const CancellationToken&) { ran++; }));
+    }
+    for (const TaskHandle& handle : handles)
+    {
+        ASSERT_TRUE(handle.Wait(10000));
+        EXPECT_TRUE(handle.IsDone());
+    }
+    EXPECT_EQ(1000, ran.load());
+
+    TaskExecutorMetrics metrics = executor.GetMetrics();
+    EXPECT_EQ(4u, metrics.workers);
+    for (int p = 0; p < TASK_PRIORITY_COUNT; p++)
+    {
+        EXPECT_EQ(500u, metrics.priorities[p].submitted);
+        EXPECT_EQ(500u, metrics.priorities[p].completed);
+        EXPECT_EQ(0u, metrics.priorities[p].queueDepth);
+    }
+
+    // A handle to no task is done
+    TaskHandle none;
+    EXPECT_FALSE(none.IsValid());
+    EXPECT_TRUE(none.IsDone());
+    EXPECT_TRUE(none.Wait(0));
+}
+
+TEST(TaskExecutorTest, BackgroundTasksLeaveAWorkerForUITasks)
+{
+    const size_t WORKERS = 4;
+    TaskExecutor executor(WORKERS);
+    Gate gate;
+    atomic<int> backgroundRunning(0);
+
+    vector<TaskHandle> background;
+    for (int i = 0; i < 10; i++)
+    {
+        background.push_back(executor.Submit(TASK_PRIORITY_BACKGROUND, [&](const CancellationToken&) {
+            backgroundRunning++;
+            gate.Wait();
+        }));
+    }
+
+    // All but one worker take a background task; the rest wait
+    ASSERT_TRUE(Eventually([&] { return backgroundRunning == (int)WORKERS - 1; }));
+    this_thread::sleep_for(chrono::milliseconds(100));
+    EXPECT_EQ((int)WORKERS - 1, backgroundRunning.load());
+    EXPECT_EQ(10u - (WORKERS - 1), executor.GetMetrics().priorities[TASK_PRIORITY_BACKGROUND].queueDepth);
+
+    // So a UI task still starts at once
+    TaskHandle ui = executor.Submit(TASK_PRIORITY_UI, [](const CancellationToken&) {});
+    EXPECT_TRUE(ui.Wait(5000));
+
+    gate.Open();
+    for (const TaskHandle& handle : background)
+    {
+        ASSERT_TRUE(handle.Wait(10000));
+    }
+    EXPECT_EQ(10, backgroundRunning.load());
+}
+
+TEST(TaskExecutorTest, HigherPriorityTasksStartFirst)
+{
+    TaskExecutor executor(1);
+    Gate gate;
+    mutex orderMutex;
+    vector<string> order;
+    auto record = [&](const string& name) {
+        return [&, name](const CancellationToken&) {
+            lock_guard<mutex> lock(orderMutex);
+            order.push_back(name);
+        };
+    };
+
+    // Occupies the only worker while the others are queued
+    TaskHandle blocker = executor.Submit(TASK_PRIORITY_UI, [&](const CancellationToken&) { gate.Wait(); });
+    ASSERT_TRUE(Eventually([&] { return executor.GetMetrics().priorities[TASK_PRIORITY_UI].queueDepth == 0; }));
+
+    vector<TaskHandle> handles;
+    handles.push_back(executor.Submit(TASK_PRIORITY_BACKGROUND, record("background 1")));
+    handles.push_back(executor.Submit(TASK_PRIORITY_UI, record("UI 1")));
+    handles.push_back(executor.Submit(TASK_PRIORITY_BACKGROUND, record("background 2")));
+    handles.push_back(executor.Submit(TASK_PRIORITY_UI, record("UI 2")));
+
+    gate.Open();
+    for (const TaskHandle& handle : handles)
+    {
+        ASSERT_TRUE(handle.Wait(10000));
+    }
+
+    EXPECT_EQ((vector<string>{ "UI 1", "UI 2", "background 1", "background 2" }), order);
+}
+
+TEST(TaskExecutorTest, CancelledTasksNeverStart)
+{
+    TaskExecutor executor(1);
+    Gate gate;
+    TaskHandle blocker = executor.Submit(TASK_PRIORITY_UI, [&](const CancellationToken&) { gate.Wait(); });
+
+    bool ran = false;
+    TaskHandle cancelled = executor.Submit(TASK_PRIORITY_BACKGROUND, [&ran](const CancellationToken&) { ran = true; });
+    EXPECT_FALSE(cancelled.IsDone());
+    cancelled.Cancel();
+    // Done at once, without waiting for a worker
+    EXPECT_TRUE(cancelled.IsDone());
+    EXPECT_TRUE(cancelled.Wait(0));
+
+    // Cancelled by the stop signal it was submitted with
+    StopSignal stopSignal;
+    bool stoppedRan = false;
+    TaskHandle stopped = executor.Submit(
+        TASK_PRIORITY_BACKGROUND,
+        [&stoppedRan](const CancellationToken&) { stoppedRan = true; },
+        StopInfo(&stopSignal, STOP_REASON_CANCEL));
+    stopSignal.SignalStop(STOP_REASON_CANCEL);
+    EXPECT_TRUE(stopped.Wait(1000));
+
+    gate.Open();
+    TaskHandle after = executor.Submit(TASK_PRIORITY_BACKGROUND, [](const CancellationToken&) {});
+    ASSERT_TRUE(after.Wait(10000));
+
+    EXPECT_FALSE(ran);
+    EXPECT_FALSE(stoppedRan);
+    EXPECT_EQ(2u, executor.GetMetrics().priorities[TASK_PRIORITY_BACKGROUND].cancelled);
+}
+
+TEST(TaskExecutorTest, RunningTasksSeeCancellation)
+{
+    TaskExecutor executor(2);
+    StopSignal stopSignal;
+    atomic<bool> started(false);
+
+    auto waitForCancel = [&started](const CancellationToken& token) {
+        started = true;
+        while (!token.IsCancelled())
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    };
+
+    TaskHandle byHandle = executor.Submit(TASK_PRIORITY_UI, waitForCancel);
+    ASSERT_TRUE(Eventually([&] { return started.load(); }));
+    EXPECT_FALSE(byHandle.Wait(100));
+    byHandle.Cancel();
+    EXPECT_TRUE(byHandle.Wait(10000));
+
+    started = false;
+    TaskHandle bySignal = executor.Submit(TASK_PRIORITY_UI, waitForCancel, StopInfo(&stopSignal, STOP_REASON_EXIT));
+    ASSERT_TRUE(Eventually([&] { return started.load(); }));
+    // Not one of its reasons
+    stopSignal.SignalStop(STOP_REASON_CANCEL);
+    EXPECT_FALSE(bySignal.Wait(100));
+    stopSignal.SignalStop(STOP_REASON_EXIT);
+    EXPECT_TRUE(bySignal.Wait(10000));
+}
+
+TEST(TaskExecutorTest, ExceptionsDontStopTheWorker)
+{
+    TaskExecutor executor(1);
+    TaskHandle throws = executor.Submit(TASK_PRIORITY_UI, [](const CancellationToken&) {
+        throw std::runtime_error("task failed");
+    });
+    EXPECT_TRUE(throws.Wait(10000));
+
+    bool ran = false;
+    TaskHandle after = executor.Submit(TASK_PRIORITY_UI, [&ran](const CancellationToken&) { ran = true; });
+    EXPECT_TRUE(after.Wait(10000));
+    EXPECT_TRUE(ran);
+}
+
+TEST(TaskExecutorTest, IdleWorkersStealFromABusyOne)
+{
+    TaskExecutor executor(4);
+    mutex handlesMutex;
+    vector<TaskHandle> handles;
+    atomic<int> ran(0);
+
+    // Tasks submitted from a worker go on its own queue, so the others can
+    // only get them by stealing
+    TaskHandle parent = executor.Submit(TASK_PRIORITY_UI, [&](const CancellationToken&) {
+        for (int i = 0; i < 100; i++)
+        {
+            TaskHandle child = executor.Submit(TASK_PRIORITY_UI, [&ran](const CancellationToken&) {
+                this_thread::sleep_for(chrono::milliseconds(2));
+                ran++;
+            });
+            lock_guard<mutex> lock(handlesMutex);
+            handles.push_back(child);
+        }
+    });
+    ASSERT_TRUE(parent.Wait(10000));
+
+    lock_guard<mutex> lock(handlesMutex);
+    for (const TaskHandle& handle : handles)
+    {
+        ASSERT_TRUE(handle.Wait(10000));
+    }
+    EXPECT_EQ(100, ran.load());
+    EXPECT_GT(executor.GetMetrics().stolen, 0u);
+}
+
+
+TEST(DispatchQueueTest, OpsRunInOrderOneAtATime)
+{
+    vector<int> order;
+    atomic<int> running(0), maxRunning(0);
+    promise<void> finished;
+    {
+        dispatch_queue queue("serial");
+        for (int i = 0; i < 200; i++)
+        {
+            ASSERT_TRUE(queue.dispatch(0, {}, [&, i] {
+                UpdateMax(maxRunning, ++running);
+                order.push_back(i);
+                running--;
+            }));
+        }
+        queue.dispatch(0, {}, [&finished] { finished.set_value(); });
+        ASSERT_EQ(future_status::ready, finished.get_future().wait_for(chrono::seconds(10)));
+    }
+
+    ASSERT_EQ(200u, order.size());
+    for (int i = 0; i < 200; i++)
+    {
+        EXPECT_EQ(i, order[i]);
+    }
+    EXPECT_EQ(1, maxRunning.load());
+}
+
+TEST(DispatchQueueTest, ConcurrencyIsLimited)
+{
+    const size_t CONCURRENCY = 3;
+    atomic<int> running(0), maxRunning(0), ran(0);
+    {
+        dispatch_queue queue("concurrent", CONCURRENCY);
+        for (int i = 0; i < 60; i++)
+        {
+            queue.dispatch(0, {}, [&] {
+                UpdateMax(maxRunning, ++running);
+                this_thread::sleep_for(chrono::milliseconds(2));
+                running--;
+                ran++;
+            });
+        }
+        ASSERT_TRUE(Eventually([&] { return ran == 60; }));
+    }
+
+    EXPECT_LE(maxRunning.load(), (int)CONCURRENCY);
+    EXPECT_GE(maxRunning.load(), 1);
+}
+
+TEST(DispatchQueueTest, OpsAreSkippedIfAGivenTypeIsQueued)
+{
+    enum { RUNNING, REFRESH, OTHER };
+    Gate gate;
+    atomic<bool> started(false);
+    atomic<int> refreshes(0);
+
+    dispatch_queue queue("skipping");
+    queue.dispatch(RUNNING, {}, [&] {
+        started = true;
+        gate.Wait();
+    });
+    ASSERT_TRUE(Eventually([&] { return started.load(); }));
+
+    // The running op is no longer queued, so doesn't cause a skip
+    EXPECT_TRUE(queue.dispatch(REFRESH, { RUNNING }, [&refreshes] { refreshes++; }));
+    // But now a refresh is queued
+    EXPECT_FALSE(queue.dispatch(REFRESH, { REFRESH }, [&refreshes] { refreshes++; }));
+    EXPECT_TRUE(queue.dispatch(OTHER, { OTHER }, [] {}));
+
+    gate.Open();
+    ASSERT_TRUE(Eventually([&] { return refreshes == 1; }));
+    this_thread::sleep_for(chrono::milliseconds(50));
+    EXPECT_EQ(1, refreshes.load());
+}
+
+TEST(DispatchQueueTest, DestructorWaitsForTheRunningOp)
+{
+    atomic<bool> started(false), finished(false), queuedRan(false);
+    {
+        dispatch_queue queue("destroyed");
+        queue.dispatch(0, {}, [&] {
+            started = true;
+            this_thread::sleep_for(chrono::milliseconds(200));
+            finished = true;
+        });
+        queue.dispatch(0, {}, [&queuedRan] { queuedRan = true; });
+        ASSERT_TRUE(Eventually([&] { return started.load(); }));
+    }
+
+    // The running op was finished; the queued one was abandoned
+    EXPECT_TRUE(finished);
+    EXPECT_FALSE(queuedRan);
+}
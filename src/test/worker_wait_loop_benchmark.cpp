@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+Measures how long a worker takes to act on a stop, and on output from its
+subprocess:
+- event: RunWorkerWaitLoop, as IWorkerThread runs it now. The loop waits on
+  its wake event, which the stop signal sets, and on the output event.
+- sleep: as it was. The loop sleeps for 100 ms between checks.
+
+Each run signals at a random time after the loop has started waiting.
+
+    worker_wait_loop_benchmark [runs]
+*/
+
+#include "stdafx.h"
+#include "worker_wait_loop.h"
+#include "stopsignal.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+const DWORD OLD_SLEEP_MILLISECONDS = 100;
+
+void SetEventFd(int fd)
+{
+    uint64_t one = 1;
+    (void)!write(fd, &one, sizeof(one));
+}
+
+bool ResetEventFd(int fd)
+{
+    uint64_t count;
+    return read(fd, &count, sizeof(count)) == sizeof(count);
+}
+
+// As IWorkerThread::Thread was
+void RunSleepingLoop(const function<bool()>& stopping, const function<bool()>& check)
+{
+    while (!stopping() && check())
+    {
+        this_thread::sleep_for(chrono::milliseconds(OLD_SLEEP_MILLISECONDS));
+    }
+}
+
+enum Signal { OUTPUT, STOP };
+
+// Returns the milliseconds from the signal to the loop acting on it
+double Run(bool event, Signal signal, mt19937& rng)
+{
+    StopSignal stopSignal;
+    int wakeEvent = eventfd(0, EFD_NONBLOCK);
+    int outputEvent = eventfd(0, EFD_NONBLOCK);
+    int subscriptionID = stopSignal.Subscribe(STOP_REASON_CANCEL, [wakeEvent](DWORD) { SetEventFd(wakeEvent); });
+
+    atomic<bool> output(false);
+    atomic<bool> checkRunning(true);
+    Clock::time_point signalled;
+    Clock::time_point acted;
+
+    function<bool()> stopping = [&]() {
+        return stopSignal.CheckSignal(STOP_REASON_CANCEL) != 0;
+    };
+    function<bool()> check = [&]() {
+        // The output has been written once the event is set
+        if (ResetEventFd(outputEvent) || output)
+        {
+            acted = Clock::now();
+            return false;
+        }
+        checkRunning = false;
+        return true;
+    };
+
+    thread worker([&]() {
+        if (event)
+        {
+            RunWorkerWaitLoop(wakeEvent, vector<WorkerWaitHandle>(1, outputEvent), INFINITE, stopping, check);
+        }
+        else
+        {
+            RunSleepingLoop(stopping, check);
+        }
+        if (signal == STOP)
+        {
+            acted = Clock::now();
+        }
+    });
+
+    while (checkRunning)
+    {
+        this_thread::yield();
+    }
+    this_thread::sleep_for(chrono::microseconds(rng() % (OLD_SLEEP_MILLISECONDS * 1000)));
+
+    signalled = Clock::now();
+    if (signal == STOP)
+    {
+        stopSignal.SignalStop(STOP_REASON_CANCEL);
+    }
+    else
+    {
+        output = true;
+        SetEventFd(outputEvent);
+    }
+    worker.join();
+
+    stopSignal.Unsubscribe(subscriptionID);
+    close(wakeEvent);
+    close(outputEvent);
+
+    return chrono::duration<double, milli>(acted - signalled).count();
+}
+
+void Print(const char* name, vector<double> times)
+{
+    sort(times.begin(), times.end());
+    printf("  %-6s median %7.2f ms  p90 %7.2f ms  max %7.2f ms\n",
+           name, times[times.size() / 2], times[times.size() * 9 / 10], times.back());
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[])
+{
+    int runs = (argc > 1) ? atoi(argv[1]) : 40;
+    mt19937 rng(1);
+
+    const pair<Signal, const char*> SIGNALS[] = { { OUTPUT, "output -> check" }, { STOP, "stop -> exit" } };
+    for (const auto& signal : SIGNALS)
+    {
+        vector<double> event, sleeping;
+        for (int run = 0; run < runs; run++)
+        {
+            event.push_back(Run(true, signal.first, rng));
+            sleeping.push_back(Run(false, signal.first, rng));
+        }
+
+        printf("%s, %d runs\n", signal.second, runs);
+        Print("event", event);
+        Print("sleep", sleeping);
+    }
+
+    return 0;
+}
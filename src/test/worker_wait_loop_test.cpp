@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "worker_wait_loop.h"
+#include "stopsignal.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+// Far longer than any of the tests should take
+const DWORD LONG_INTERVAL_MILLISECONDS = 60 * 1000;
+
+// What counts as straight away
+const double PROMPT_MILLISECONDS = 500;
+
+double ElapsedMilliseconds(Clock::time_point start)
+{
+    return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+class EventFd
+{
+public:
+    EventFd() : m_fd(eventfd(0, EFD_NONBLOCK)) {}
+    ~EventFd() { close(m_fd); }
+
+    int Fd() const { return m_fd; }
+
+    void Set()
+    {
+        uint64_t one = 1;
+        (void)!write(m_fd, &one, sizeof(one));
+    }
+
+    bool Reset()
+    {
+        uint64_t count;
+        return read(m_fd, &count, sizeof(count)) == sizeof(count);
+    }
+
+private:
+    int m_fd;
+};
+
+// Runs the loop on its own thread, as IWorkerThread::Thread does: the stop
+// signal sets the wake event, and check counts its calls and resets the
+// handle it's given.
+class LoopThread
+{
+public:
+    LoopThread(DWORD intervalMilliseconds, bool checkSucceeds = true)
+        : m_checks(0),
+          m_checkSucceeds(checkSucceeds),
+          m_finished(false)
+    {
+        m_subscriptionID = m_stopSignal.Subscribe(
+                                STOP_REASON_CANCEL,
+                                [this](DWORD) { m_wakeEvent.Set(); });
+
+        m_thread = thread([this, intervalMilliseconds]() {
+            m_result = RunWorkerWaitLoop(
+                m_wakeEvent.Fd(),
+                vector<WorkerWaitHandle>(1, m_handle.Fd()),
+                intervalMilliseconds,
+                [this]() { return m_stopSignal.CheckSignal(STOP_REASON_CANCEL) != 0; },
+                [this]() {
+                    m_handle.Reset();
+                    m_checks++;
+                    return m_checkSucceeds.load();
+                });
+            m_finished = true;
+        });
+    }
+
+    ~LoopThread()
+    {
+        m_stopSignal.SignalStop(STOP_REASON_CANCEL);
+        m_thread.join();
+        m_stopSignal.Unsubscribe(m_subscriptionID);
+    }
+
+    // Waits for check to have been called this many times. Returns false if
+    // it isn't within PROMPT_MILLISECONDS.
+    bool WaitForChecks(int checks)
+    {
+        Clock::time_point start = Clock::now();
+        while (m_checks < checks)
+        {
+            if (ElapsedMilliseconds(start) > PROMPT_MILLISECONDS)
+            {
+                return false;
+            }
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+        return true;
+    }
+
+    // Waits for the loop to return. Returns false if it doesn't within
+    // PROMPT_MILLISECONDS.
+    bool WaitForFinish()
+    {
+        Clock::time_point start = Clock::now();
+        while (!m_finished)
+        {
+            if (ElapsedMilliseconds(start) > PROMPT_MILLISECONDS)
+            {
+                return false;
+            }
+            this_thread::sleep_for(chrono::microseconds(100));
+        }
+        return true;
+    }
+
+    StopSignal m_stopSignal;
+    EventFd m_wakeEvent;
+    EventFd m_handle;
+    atomic<int> m_checks;
+    atomic<bool> m_checkSucceeds;
+    atomic<bool> m_finished;
+    WorkerWaitLoopResult m_result;
+
+private:
+    int m_subscriptionID;
+    thread m_thread;
+};
+
+}  // namespace
+
+
+TEST(WorkerWaitLoopTest, StopSignalEndsTheWaitStraightAway)
+{
+    LoopThread loop(LONG_INTERVAL_MILLISECONDS);
+    ASSERT_TRUE(loop.WaitForChecks(1));
+
+    Clock::time_point start = Clock::now();
+    loop.m_stopSignal.SignalStop(STOP_REASON_CANCEL);
+    ASSERT_TRUE(loop.WaitForFinish());
+
+    EXPECT_LT(ElapsedMilliseconds(start), PROMPT_MILLISECONDS);
+    EXPECT_EQ(WORKER_WAIT_LOOP_STOPPING, loop.m_result);
+    EXPECT_EQ(1, loop.m_checks);
+}
+
+TEST(WorkerWaitLoopTest, OtherStopReasonsDoNotWakeTheLoop)
+{
+    LoopThread loop(LONG_INTERVAL_MILLISECONDS);
+    ASSERT_TRUE(loop.WaitForChecks(1));
+
+    loop.m_stopSignal.SignalStop(STOP_REASON_CONNECTED);
+    this_thread::sleep_for(chrono::milliseconds(100));
+    EXPECT_EQ(1, loop.m_checks);
+    EXPECT_FALSE(loop.m_finished);
+}
+
+TEST(WorkerWaitLoopTest, WakeEventRunsTheCheckStraightAway)
+{
+    LoopThread loop(LONG_INTERVAL_MILLISECONDS);
+    ASSERT_TRUE(loop.WaitForChecks(1));
+
+    for (int i = 2; i <= 5; i++)
+    {
+        loop.m_wakeEvent.Set();
+        ASSERT_TRUE(loop.WaitForChecks(i));
+    }
+
+    // The wake event was reset each time, so the loop waits again rather
+    // than spinning
+    this_thread::sleep_for(chrono::milliseconds(100));
+    EXPECT_EQ(5, loop.m_checks);
+    EXPECT_FALSE(loop.m_finished);
+}
+
+TEST(WorkerWaitLoopTest, HandleRunsTheCheckStraightAway)
+{
+    LoopThread loop(LONG_INTERVAL_MILLISECONDS);
+    ASSERT_TRUE(loop.WaitForChecks(1));
+
+    for (int i = 2; i <= 5; i++)
+    {
+        loop.m_handle.Set();
+        ASSERT_TRUE(loop.WaitForChecks(i));
+    }
+
+    this_thread::sleep_for(chrono::milliseconds(100));
+    EXPECT_EQ(5, loop.m_checks);
+}
+
+TEST(WorkerWaitLoopTest, CheckRunsEveryIntervalWithoutEvents)
+{
+    LoopThread loop(20);
+    this_thread::sleep_for(chrono::milliseconds(300));
+
+    // About 15, allowing for a slow machine
+    EXPECT_GE(loop.m_checks, 5);
+    EXPECT_LE(loop.m_checks, 20);
+}
+
+TEST(WorkerWaitLoopTest, FailedCheckEndsTheLoop)
+{
+    LoopThread loop(LONG_INTERVAL_MILLISECONDS);
+    ASSERT_TRUE(loop.WaitForChecks(1));
+
+    loop.m_checkSucceeds = false;
+    loop.m_handle.Set();
+    ASSERT_TRUE(loop.WaitForFinish());
+
+    EXPECT_EQ(WORKER_WAIT_LOOP_CHECK_FAILED, loop.m_result);
+    EXPECT_EQ(2, loop.m_checks);
+}
+
+TEST(WorkerWaitLoopTest, StopSignalledBeforeTheLoopEndsItBeforeAnyCheck)
+{
+    StopSignal stopSignal;
+    stopSignal.SignalStop(STOP_REASON_CANCEL);
+    EventFd wakeEvent;
+    int checks = 0;
+
+    WorkerWaitLoopResult result = RunWorkerWaitLoop(
+        wakeEvent.Fd(),
+        vector<WorkerWaitHandle>(),
+        INFINITE,
+        [&]() { return stopSignal.CheckSignal(STOP_REASON_CANCEL) != 0; },
+        [&]() { checks++; return true; });
+
+    EXPECT_EQ(WORKER_WAIT_LOOP_STOPPING, result);
+    EXPECT_EQ(0, checks);
+}
@@ -28,6 +28,7 @@
 #include "config.h"
 #include "transport_registry.h"
 #include "systemproxysettings.h"
+#include "utilities.h"
 
 
 /******************************************************************************
@@ -101,6 +102,14 @@ SessionInfo ITransport::GetSessionInfo() const
 
 bool ITransport::DoStart()
 {
+    // Log how much server list work this connection attempt caused
+    ServerList::ResetStats();
+    auto logServerListStats = finally([]() {
+        ServerListStats stats = ServerList::GetStats();
+        my_print(NOT_SENSITIVE, true, _T("%s: server list parses: %u, writes: %u, journal appends: %u, cache hits: %u"),
+            __TFUNCTION__, stats.parses, stats.writes, stats.journalAppends, stats.cacheHits);
+    });
+
     try
     {
         TransportConnect();
@@ -168,7 +177,7 @@ void ITransport::MarkServerSucceeded(const ServerEntry& serverEntry)
     }
 
     // Force the serverEntry to be at the very front of the server list.
-    m_serverList.MoveEntryToFront(serverEntry, true);
+    m_serverList.MarkServerSucceeded(serverEntry);
 }
 
 
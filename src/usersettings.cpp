@@ -23,6 +23,7 @@
 #include "psiclient.h"
 #include "usersettings.h"
 #include "utilities.h"
+#include "config.h"
 #include "coretransport.h"
 #include "vpntransport.h"
 
@@ -63,6 +64,12 @@
 #define SKIP_AUTO_CONNECT_NAME          "SkipAutoConnect"
 #define SKIP_AUTO_CONNECT_DEFAULT       FALSE
 
+#define COMPRESS_FEEDBACK_NAME          "CompressFeedback"
+#define COMPRESS_FEEDBACK_DEFAULT       COMPRESS_FEEDBACK
+
+#define RANK_SERVERS_NAME               "RankServers"
+#define RANK_SERVERS_DEFAULT            RANK_SERVERS
+
 #define SKIP_UPSTREAM_PROXY_NAME        "SSHParentProxySkip"
 #define SKIP_UPSTREAM_PROXY_DEFAULT     FALSE
 
@@ -589,6 +596,19 @@ bool Settings::SkipAutoConnect()
     return !!GetSettingDword(SKIP_AUTO_CONNECT_NAME, SKIP_AUTO_CONNECT_DEFAULT);
 }
 
+// Not written out by Initialize, so that the default can change in a later
+// release without being overridden by a value written by this one.
+bool Settings::CompressFeedback()
+{
+    return !!GetSettingDword(COMPRESS_FEEDBACK_NAME, COMPRESS_FEEDBACK_DEFAULT);
+}
+
+// Not written out by Initialize, for the same reason as CompressFeedback.
+bool Settings::RankServers()
+{
+    return !!GetSettingDword(RANK_SERVERS_NAME, RANK_SERVERS_DEFAULT);
+}
+
 /*
 For internal use only
 TODO: Probably shouldn't be in the "usersettings" file
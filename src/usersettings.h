@@ -61,6 +61,10 @@ namespace Settings
 
     bool SkipProxySettings();
     bool SkipAutoConnect();
+    // Whether feedback uploads are gzip compressed (see FeedbackData).
+    bool CompressFeedback();
+    // Whether servers are ordered by the ranking model (see ReorderServerList).
+    bool RankServers();
 
     // These are used by the web UI
     void SetCookies(const string& value);
@@ -22,11 +22,12 @@
 #include "psiclient.h"
 #include "logging.h"
 #include "config.h"
+#include "hex_codec.h"
+#include "base64_codec.h"
 #include <Shlwapi.h>
 #include <ShlObj.h>
 #include <WinSock2.h>
 #include <TlHelp32.h>
-#include <WinCrypt.h>
 #include <WinInet.h>
 #include "utilities.h"
 #include "stopsignal.h"
@@ -545,29 +546,6 @@ DWORD WaitForConnectability(
 }
 
 
-bool TestForOpenPort(int& targetPort, int maxIncrement, const StopInfo& stopInfo)
-{
-    int maxPort = targetPort + maxIncrement;
-    do
-    {
-        if (targetPort > 0 && targetPort <= 0xFFFF)
-        {
-            if (ERROR_SUCCESS != WaitForConnectability(
-                (USHORT)targetPort,
-                100,
-                0,
-                stopInfo))
-            {
-                return true;
-            }
-            my_print(NOT_SENSITIVE, false, _T("Localhost port %d is already in use."), targetPort);
-        }
-    } while (++targetPort <= maxPort);
-
-    return false;
-}
-
-
 void StopProcess(DWORD processID, HANDLE process)
 {
     // TODO: AttachConsole/FreeConsole sequence not threadsafe?
@@ -588,6 +566,59 @@ void StopProcess(DWORD processID, HANDLE process)
 }
 
 
+// Like CreatePipe, but the parent's end is opened for overlapped I/O, which
+// anonymous pipes don't support. It's a named pipe with a name unique to
+// this process and call, that only the child's end is ever connected to.
+// The parent's end reads from the pipe if parentReads, otherwise it writes.
+static BOOL CreateOverlappedPipe(
+    bool parentReads,
+    HANDLE* o_parentPipe,
+    HANDLE* o_childPipe,
+    SECURITY_ATTRIBUTES* childPipeAttributes)
+{
+    static volatile LONG pipeSerialNumber = 0;
+
+    tstringstream pipeName;
+    pipeName << _T("\\\\.\\pipe\\psiphon-subprocess-")
+             << GetCurrentProcessId() << _T("-")
+             << InterlockedIncrement(&pipeSerialNumber);
+
+    HANDLE parentPipe = CreateNamedPipe(
+        pipeName.str().c_str(),
+        (parentReads ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND) | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, // max instances
+        parentReads ? 0 : 64 * 1024, // out buffer size
+        parentReads ? 64 * 1024 : 0, // in buffer size
+        0, // default timeout
+        NULL); // not inheritable
+    if (parentPipe == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    HANDLE childPipe = CreateFile(
+        pipeName.str().c_str(),
+        parentReads ? GENERIC_WRITE : GENERIC_READ,
+        0,
+        childPipeAttributes,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+    if (childPipe == INVALID_HANDLE_VALUE)
+    {
+        DWORD error = GetLastError();
+        CloseHandle(parentPipe);
+        SetLastError(error);
+        return FALSE;
+    }
+
+    *o_parentPipe = parentPipe;
+    *o_childPipe = childPipe;
+    return TRUE;
+}
+
+
 // Create the pipe that will be used to communicate between the child process
 // process and this process.
 // Note that this function effectively causes the subprocess's stdout and stderr
@@ -598,7 +629,9 @@ bool CreateSubprocessPipes(
     HANDLE& o_parentInputPipe,  // Parent writes to the child's stdin with this
     HANDLE& o_childStdinPipe,   // Child's stdin pipe
     HANDLE& o_childStdoutPipe,  // Child's stdout pipe
-    HANDLE& o_childStderrPipe)  // Child's stderr pipe (dup of stdout)
+    HANDLE& o_childStderrPipe,  // Child's stderr pipe (dup of stdout)
+    bool overlappedOutput,      // Open o_parentOutputPipe for overlapped I/O
+    bool overlappedInput)       // Open o_parentInputPipe for overlapped I/O
 {
     o_parentOutputPipe = INVALID_HANDLE_VALUE;
     o_parentInputPipe = INVALID_HANDLE_VALUE;
@@ -625,7 +658,10 @@ bool CreateSubprocessPipes(
         hParentInputWrite = INVALID_HANDLE_VALUE;
 
     // Create the child output pipe.
-    if (!CreatePipe(&hParentOutputReadTmp, &hChildStdoutWrite, &sa, 0))
+    BOOL outputPipeCreated = overlappedOutput ?
+        CreateOverlappedPipe(true, &hParentOutputReadTmp, &hChildStdoutWrite, &sa) :
+        CreatePipe(&hParentOutputReadTmp, &hChildStdoutWrite, &sa, 0);
+    if (!outputPipeCreated)
     {
         if (hParentOutputReadTmp != INVALID_HANDLE_VALUE) CloseHandle(hParentOutputReadTmp);
         if (hParentOutputRead != INVALID_HANDLE_VALUE) CloseHandle(hParentOutputRead);
@@ -696,7 +732,10 @@ bool CreateSubprocessPipes(
     hParentOutputReadTmp = INVALID_HANDLE_VALUE;
 
     // Create the pipe the parent can use to write to the child's stdin
-    if (!CreatePipe(&hChildStdinRead, &hParentInputWriteTmp, &sa, 0))
+    BOOL inputPipeCreated = overlappedInput ?
+        CreateOverlappedPipe(false, &hParentInputWriteTmp, &hChildStdinRead, &sa) :
+        CreatePipe(&hChildStdinRead, &hParentInputWriteTmp, &sa, 0);
+    if (!inputPipeCreated)
     {
         if (hParentOutputReadTmp != INVALID_HANDLE_VALUE) CloseHandle(hParentOutputReadTmp);
         if (hParentOutputRead != INVALID_HANDLE_VALUE) CloseHandle(hParentOutputRead);
@@ -1121,6 +1160,122 @@ bool ReadRegistryStringValue(LPCSTR name, wstring& value)
 }
 
 
+bool WriteRegistryBinaryValue(const string& name, const string& value, RegistryFailureReason& reason)
+{
+    HKEY key = 0;
+    reason = REGISTRY_FAILURE_NO_REASON;
+
+    LONG returnCode = RegCreateKeyEx(
+                        HKEY_CURRENT_USER,
+                        LOCAL_SETTINGS_REGISTRY_KEY,
+                        0,
+                        0,
+                        0,
+                        KEY_WRITE,
+                        0,
+                        &key,
+                        0);
+    if (returnCode != ERROR_SUCCESS)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: RegCreateKeyEx failed for '%hs' with code %ld"), __TFUNCTION__, name.c_str(), returnCode);
+        return false;
+    }
+
+    auto closeKey = finally([=]() {
+        auto lastError = GetLastError();
+        RegCloseKey(key);
+        SetLastError(lastError); // restore the previous error code
+    });
+
+    returnCode = RegSetValueExA(
+        key,
+        name.c_str(),
+        0,
+        REG_BINARY,
+        (LPBYTE)value.data(),
+        value.length());
+    if (returnCode != ERROR_SUCCESS)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: RegSetValueExA failed for '%hs' with code %ld"), __TFUNCTION__, name.c_str(), returnCode);
+
+        if (ERROR_NO_SYSTEM_RESOURCES == returnCode)
+        {
+            reason = REGISTRY_FAILURE_WRITE_TOO_LONG;
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+bool ReadRegistryBinaryValue(LPCSTR name, string& value)
+{
+    value.clear();
+
+    HKEY key = 0;
+    LONG returnCode = RegOpenKeyEx(
+                        HKEY_CURRENT_USER,
+                        LOCAL_SETTINGS_REGISTRY_KEY,
+                        0,
+                        KEY_READ,
+                        &key);
+    if (returnCode != ERROR_SUCCESS)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: RegOpenKeyEx failed for '%hs' with code %ld"), __TFUNCTION__, name, returnCode);
+        return false;
+    }
+
+    auto closeKey = finally([=]() {
+        auto lastError = GetLastError();
+        RegCloseKey(key);
+        SetLastError(lastError); // restore the previous error code
+    });
+
+    DWORD type;
+    DWORD bufferLength = 0;
+    returnCode = RegQueryValueExA(
+                    key,
+                    name,
+                    0,
+                    &type,
+                    NULL,
+                    &bufferLength);
+    if (returnCode != ERROR_SUCCESS)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: RegQueryValueExA(1) failed for '%hs' with code %ld"), __TFUNCTION__, name, returnCode);
+        return false;
+    }
+
+    // Don't bother reading the data if it's the wrong type (e.g., a legacy REG_SZ value)
+    if (type != REG_BINARY)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: RegQueryValueExA says type of '%hs' is %ld, not REG_BINARY"), __TFUNCTION__, name, type);
+        return false;
+    }
+
+    value.resize(bufferLength);
+
+    returnCode = RegQueryValueExA(
+                    key,
+                    name,
+                    0,
+                    &type,
+                    bufferLength > 0 ? (LPBYTE)&value[0] : NULL,
+                    &bufferLength);
+    if (returnCode != ERROR_SUCCESS)
+    {
+        my_print(NOT_SENSITIVE, true, _T("%s: RegQueryValueExA(2) failed for '%hs' with code %ld"), __TFUNCTION__, name, returnCode);
+        value.clear();
+        return false;
+    }
+
+    value.resize(bufferLength);
+
+    return true;
+}
+
+
 bool WriteRegistryProtocolHandler(const tstring& scheme)
 {
     /* We're creating a structure that looks like this:
@@ -1251,132 +1406,52 @@ bool TestBoolArray(const vector<const bool*>& boolArray)
 }
 
 
-// Note that this does not work for hex encoding. Its output is stupid.
-string CryptBinaryToStringWrapper(const unsigned char* input, size_t length, DWORD flags)
+string Base64Encode(const unsigned char* input, size_t length)
 {
-    DWORD outsize = 0;
-
-    // Get the required size
-    if (!CryptBinaryToStringA(
-        input,
-        length,
-        flags | CRYPT_STRING_NOCR,
-        NULL,
-        &outsize))
+    string output(Base64EncodedLength(length), '\0');
+    if (length > 0)
     {
-        return "";
-    }
-
-    string output;
-    output.resize(outsize + 1);
-
-    if (!CryptBinaryToStringA(
-        input,
-        length,
-        flags | CRYPT_STRING_NOCR,
-        (LPSTR)output.c_str(),
-        &outsize))
-    {
-        return "";
+        Base64EncodeInto(input, length, &output[0]);
     }
-
-    ((LPSTR)output.c_str())[outsize] = '\0';
-
     return output;
 }
 
-string CryptStringToBinaryWrapper(const string& input, DWORD flags)
+string Base64Decode(const string& input)
 {
-    DWORD outsize = 0;
-
-    // Get the required size
-    if (!CryptStringToBinaryA(
-        input.c_str(),
-        input.length(),
-        flags,
-        NULL,
-        &outsize,
-        NULL,
-        NULL))
-    {
-        return "";
-    }
-
+    Base64Decoder decoder;
     string output;
-    output.resize(outsize);
-
-    if (!CryptStringToBinaryA(
-        input.c_str(),
-        input.length(),
-        flags,
-        (BYTE*)output.c_str(),
-        &outsize,
-        NULL,
-        NULL))
+    if (!decoder.Update(input.data(), input.length(), output) || !decoder.Final(output))
     {
         return "";
     }
-
     return output;
 }
 
 
-string Base64Encode(const unsigned char* input, size_t length)
-{
-    return CryptBinaryToStringWrapper(input, length, CRYPT_STRING_BASE64);
-}
-
-string Base64Decode(const string& input)
-{
-    return CryptStringToBinaryWrapper(input, CRYPT_STRING_BASE64);
-}
-
-
 // Adapted from here:
 // http://stackoverflow.com/questions/3381614/c-convert-string-to-hexadecimal-and-vice-versa
 string Hexlify(const unsigned char* input, size_t length)
 {
-    static const char* const lut = "0123456789ABCDEF";
-
-    string output;
-    output.reserve(2 * length);
-    for (size_t i = 0; i < length; ++i)
+    string output(2 * length, '\0');
+    if (length > 0)
     {
-        const unsigned char c = input[i];
-        output.push_back(lut[c >> 4]);
-        output.push_back(lut[c & 15]);
+        HexEncode(input, length, &output[0]);
     }
     return output;
 }
 
 string Dehexlify(const string& input)
 {
-    static const char* const lut = "0123456789ABCDEF";
     size_t len = input.length();
     if (len & 1)
     {
         throw std::invalid_argument("Dehexlify: odd length");
     }
 
-    string output;
-    output.reserve(len / 2);
-    for (size_t i = 0; i < len; i += 2)
+    string output(len / 2, '\0');
+    if (len > 0 && !HexDecode(input.data(), len, (unsigned char*)&output[0]))
     {
-        char a = (char)toupper(input[i]);
-        const char* p = std::lower_bound(lut, lut + 16, a);
-        if (*p != a)
-        {
-            throw std::invalid_argument("Dehexlify: not a hex digit");
-        }
-
-        char b = (char)toupper(input[i + 1]);
-        const char* q = std::lower_bound(lut, lut + 16, b);
-        if (*q != b)
-        {
-            throw std::invalid_argument("Dehexlify: not a hex digit");
-        }
-
-        output.push_back((char)(((p - lut) << 4) | (q - lut)));
+        throw std::invalid_argument("Dehexlify: not a hex digit");
     }
 
     return output;
@@ -84,9 +84,6 @@ DWORD WaitForConnectability(
         HANDLE process,
         const StopInfo& stopInfo);
 
-// NOTE: targetPort is inout, outputing the first available port
-bool TestForOpenPort(int& targetPort, int maxIncrement, const StopInfo& stopInfo);
-
 void StopProcess(DWORD processID, HANDLE process);
 
 bool CreateSubprocessPipes(
@@ -94,7 +91,9 @@ bool CreateSubprocessPipes(
         HANDLE& o_parentInputPipe,  // Parent writes to the child's stdin with this
         HANDLE& o_childStdinPipe,   // Child's stdin pipe
         HANDLE& o_childStdoutPipe,  // Child's stdout pipe
-        HANDLE& o_childStderrPipe);  // Child's stderr pipe (dup of stdout)
+        HANDLE& o_childStderrPipe,  // Child's stderr pipe (dup of stdout)
+        bool overlappedOutput = false, // Open o_parentOutputPipe for overlapped I/O
+        bool overlappedInput = false); // Open o_parentInputPipe for overlapped I/O
 
 
 /*
@@ -114,6 +113,8 @@ bool WriteRegistryStringValue(const string& name, const string& value, RegistryF
 bool WriteRegistryStringValue(const string& name, const wstring& value, RegistryFailureReason& reason);
 bool ReadRegistryStringValue(LPCSTR name, string& value);
 bool ReadRegistryStringValue(LPCSTR name, wstring& value);
+bool WriteRegistryBinaryValue(const string& name, const string& value, RegistryFailureReason& reason);
+bool ReadRegistryBinaryValue(LPCSTR name, string& value);
 
 /// Registers a protocol handler with the given scheme for our application
 bool WriteRegistryProtocolHandler(const tstring& scheme);
@@ -138,11 +139,14 @@ bool TestBoolArray(const vector<const bool*>& boolArray);
  * Data Encoding Utilities
  */
 
+// (See hex_codec.h for versions that don't allocate.)
 string Hexlify(const unsigned char* input, size_t length);
 
 string Dehexlify(const string& input);
 
+// (See base64_codec.h for the format details and a streaming decoder.)
 string Base64Encode(const unsigned char* input, size_t length);
+// Returns an empty string if the input is invalid.
 string Base64Decode(const string& input);
 
 tstring UrlEncode(const tstring& input);
@@ -542,6 +542,17 @@ bool VPNTransport::DoPeriodicCheck()
     return GetConnectionState() == CONNECTION_STATE_CONNECTED;
 }
 
+void VPNTransport::GetPeriodicCheckHandles(vector<HANDLE>& handles)
+{
+    handles.push_back(GetStateChangeEvent());
+}
+
+DWORD VPNTransport::GetPeriodicCheckInterval() const
+{
+    // Every connection state change sets the state change event
+    return INFINITE;
+}
+
 bool VPNTransport::WaitForConnectionStateToChangeFrom(ConnectionState state, DWORD timeout)
 {
     DWORD totalWaitMilliseconds = 0;
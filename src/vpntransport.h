@@ -66,6 +66,8 @@ protected:
     // ITransport implementation
     virtual void TransportConnect();
     virtual bool DoPeriodicCheck();
+    virtual void GetPeriodicCheckHandles(vector<HANDLE>& handles);
+    virtual DWORD GetPeriodicCheckInterval() const;
     
     void TransportConnectHelper();
     bool GetConnectionServerEntry(ServerEntry& o_serverEntry);
@@ -18,11 +18,13 @@
  */
 
 #include "stdafx.h"
+#include <algorithm>
 #include "worker_thread.h"
 #include "logging.h"
 #include "utilities.h"
 #include "psiclient.h"
 #include "stopsignal.h"
+#include "worker_wait_loop.h"
 
 /*****************
  * WorkerThreadStopSignal
@@ -41,6 +43,13 @@ public:
     virtual DWORD CheckSignal(DWORD reasons, bool throwIfTrue=false) const;
     virtual void SignalStop(DWORD reason);
     virtual void ClearStopSignal(DWORD reason);
+    virtual DWORD WaitForSignal(DWORD reasons, DWORD timeoutMilliseconds) const;
+    virtual int Subscribe(DWORD reasons, const Callback& callback);
+    virtual void Unsubscribe(int subscriptionID);
+
+    // Called after the additional stop flag is set, to wake WaitForSignal
+    // callers.
+    void NotifyAdditionalStop() const;
 
 private:
     StopSignal* m_parentStopSignal;
@@ -78,6 +87,38 @@ void WorkerThreadStopSignal::ClearStopSignal(DWORD reason)
     m_parentStopSignal->ClearStopSignal(reason);
 }
 
+DWORD WorkerThreadStopSignal::WaitForSignal(DWORD reasons, DWORD timeoutMilliseconds) const
+{
+    // Our CheckSignal also covers the parent, so wake our waiters when the
+    // parent is signalled.
+    int subscriptionID = m_parentStopSignal->Subscribe(
+                            reasons,
+                            [this](DWORD) { NotifyWaiters(); });
+
+    DWORD matched = StopSignal::WaitForSignal(reasons, timeoutMilliseconds);
+
+    m_parentStopSignal->Unsubscribe(subscriptionID);
+
+    return matched;
+}
+
+// The additional stop flag is only set by IWorkerThread::Stop, which sets the
+// worker's wake event itself, so subscriptions only need the parent.
+int WorkerThreadStopSignal::Subscribe(DWORD reasons, const Callback& callback)
+{
+    return m_parentStopSignal->Subscribe(reasons, callback);
+}
+
+void WorkerThreadStopSignal::Unsubscribe(int subscriptionID)
+{
+    m_parentStopSignal->Unsubscribe(subscriptionID);
+}
+
+void WorkerThreadStopSignal::NotifyAdditionalStop() const
+{
+    NotifyWaiters();
+}
+
 
 /*****************
  * IWorkerThread
@@ -100,7 +141,13 @@ IWorkerThread::IWorkerThread()
                         TRUE,  // initial state should be SET
                         0);
 
-    if (m_startedEvent == NULL || m_stoppedEvent == NULL)
+    m_wakeEvent = CreateEvent(
+                        NULL, 
+                        FALSE, // auto reset
+                        FALSE, // initial state
+                        0);
+
+    if (m_startedEvent == NULL || m_stoppedEvent == NULL || m_wakeEvent == NULL)
     {
         throw std::exception(__FUNCTION__ ":" STRINGIZE(__LINE__) " CreateEvent failed");
     }
@@ -119,6 +166,7 @@ IWorkerThread::~IWorkerThread()
 
     CloseHandle(m_startedEvent);
     CloseHandle(m_stoppedEvent);
+    CloseHandle(m_wakeEvent);
 }
 
 HANDLE IWorkerThread::GetStoppedEvent() const
@@ -134,6 +182,7 @@ bool IWorkerThread::Start(
 
     ResetEvent(m_startedEvent);
     ResetEvent(m_stoppedEvent);
+    ResetEvent(m_wakeEvent);
     
     m_internalSignalStopFlag = false;
     m_workerThreadSynch = workerThreadSynch;
@@ -192,6 +241,12 @@ bool IWorkerThread::Start(
 void IWorkerThread::Stop()
 {
     m_internalSignalStopFlag = true;
+    SetEvent(m_wakeEvent);
+    if (m_stopInfo.stopSignal)
+    {
+        // Start() only ever creates a WorkerThreadStopSignal
+        static_cast<WorkerThreadStopSignal*>(m_stopInfo.stopSignal)->NotifyAdditionalStop();
+    }
 
     if (m_thread != INVALID_HANDLE_VALUE && m_thread != 0)
     {
@@ -233,9 +288,14 @@ DWORD WINAPI IWorkerThread::Thread(void* object)
 
     if (_this->m_workerThreadSynch)
     {
-        _this->m_workerThreadSynch->ThreadStarting();
+        _this->m_workerThreadSynch->ThreadStarting(_this->m_wakeEvent);
     }
 
+    HANDLE wakeEvent = _this->m_wakeEvent;
+    int stopSubscriptionID = _this->m_stopInfo.stopSignal->Subscribe(
+                                _this->m_stopInfo.stopReasons,
+                                [wakeEvent](DWORD) { SetEvent(wakeEvent); });
+
     bool stoppingCleanly = false;
 
     // Not allowed to throw out of the thread without cleaning up.
@@ -247,33 +307,34 @@ DWORD WINAPI IWorkerThread::Thread(void* object)
             throw Abort();
         }
 
-        bool success = _this->DoStart();
-
-        if (success)
+        if (_this->DoStart())
         {
+            vector<HANDLE> periodicCheckHandles;
+            _this->GetPeriodicCheckHandles(periodicCheckHandles);
+            DWORD periodicCheckInterval = _this->GetPeriodicCheckInterval();
+
             SetEvent(_this->m_startedEvent);
-        }    
-    
-        while (success)
-        {
-            Sleep(100);
 
-            if (_this->m_stopInfo.stopSignal->CheckSignal(_this->m_stopInfo.stopReasons, false)
-                || (_this->m_workerThreadSynch && _this->m_workerThreadSynch->IsThreadStopping()))
+            WorkerWaitLoopResult result = RunWorkerWaitLoop(
+                _this->m_wakeEvent,
+                periodicCheckHandles,
+                periodicCheckInterval,
+                [_this]() {
+                    return _this->m_stopInfo.stopSignal->CheckSignal(_this->m_stopInfo.stopReasons, false)
+                           || (_this->m_workerThreadSynch && _this->m_workerThreadSynch->IsThreadStopping());
+                },
+                [_this]() { return _this->DoPeriodicCheck(); });
+
+            if (result == WORKER_WAIT_LOOP_STOPPING)
             {
                 // Stop request signalled. Need to stop now.
                 stoppingCleanly = true;
                 my_print(NOT_SENSITIVE, true, _T("%S::%s: CheckSignal or IsThreadStopping returned true"), typeid(*_this).name(), __TFUNCTION__);
-                break;
             }
             else
             {
-                if (!_this->DoPeriodicCheck())
-                {
-                    // Implementation indicates that we need to stop.
-                    my_print(NOT_SENSITIVE, true, _T("%S::%s: DoPeriodicCheck returned false"), typeid(*_this).name(), __TFUNCTION__);
-                    break;
-                }
+                // Implementation indicates that we need to stop.
+                my_print(NOT_SENSITIVE, true, _T("%S::%s: DoPeriodicCheck returned false"), typeid(*_this).name(), __TFUNCTION__);
             }
         }
     }
@@ -292,7 +353,7 @@ DWORD WINAPI IWorkerThread::Thread(void* object)
         if (stoppingCleanly)
         {
             my_print(NOT_SENSITIVE, true, _T("%S::%s: Waiting for all threads to indicate clean stop"), typeid(*_this).name(), __TFUNCTION__);
-            if (_this->m_workerThreadSynch->BlockUntil_AllThreadsStoppingCleanly())
+            if (_this->m_workerThreadSynch->BlockUntil_AllThreadsStoppingCleanly(_this->m_wakeEvent))
             {
                 my_print(NOT_SENSITIVE, true, _T("%S::%s: All threads indicated clean stop"), typeid(*_this).name(), __TFUNCTION__);
                 
@@ -300,13 +361,20 @@ DWORD WINAPI IWorkerThread::Thread(void* object)
 
                 my_print(NOT_SENSITIVE, true, _T("%S::%s: Waiting for all threads to indicate ready to stop"), typeid(*_this).name(), __TFUNCTION__);
                 _this->m_workerThreadSynch->ThreadReadyForStop();
-                _this->m_workerThreadSynch->BlockUntil_AllThreadsReadyToStop();
+                _this->m_workerThreadSynch->BlockUntil_AllThreadsReadyToStop(_this->m_wakeEvent);
             }
             // If some other thread has an un-clean stop, we need to bail ASAP.
         }
     }
 
     _this->DoStop(stoppingCleanly);
+
+    _this->m_stopInfo.stopSignal->Unsubscribe(stopSubscriptionID);
+    if (_this->m_workerThreadSynch)
+    {
+        _this->m_workerThreadSynch->ThreadExiting(_this->m_wakeEvent);
+    }
+
     SetEvent(_this->m_stoppedEvent);
 
     return 0;
@@ -320,7 +388,7 @@ class WorkerThreadSynch
 /*
 With respect to synchronization between worker threads, this is the flow:
 - Threads indicate to the synch object that they have started.
-- When a thread leaves the busy-wait loop, it indicates if it's stopping 
+- When a thread leaves the wait loop, it indicates if it's stopping 
   cleanly (i.e., due to user-cancel) or not.
 - Then each thread waits until the other synched threads have set their 
   clean-flags.
@@ -328,6 +396,9 @@ With respect to synchronization between worker threads, this is the flow:
   graceful-stop work is done, threads will indicate.
 - When all threads have indicated graceful-stop work is done (or if the 
   clean-flags weren't set in the first place), then threads will stop.
+Each of these steps sets the wake events of all the synched threads, so that
+threads in the wait loop notice IsThreadStopping, and threads blocked in
+BlockUntil_* re-check their condition, without polling.
 */
 
 WorkerThreadSynch::WorkerThreadSynch()
@@ -346,12 +417,32 @@ void WorkerThreadSynch::Reset()
     m_threadsStartedCounter = 0;
     m_threadsReadyToStopCounter = 0;
     m_threadCleanStops.clear();
+    m_wakeEvents.clear();
 }
 
-void WorkerThreadSynch::ThreadStarting()
+void WorkerThreadSynch::ThreadStarting(HANDLE wakeEvent)
 {
     AutoMUTEX lock(m_mutex);
     m_threadsStartedCounter++;
+    m_wakeEvents.push_back(wakeEvent);
+}
+
+void WorkerThreadSynch::ThreadExiting(HANDLE wakeEvent)
+{
+    AutoMUTEX lock(m_mutex);
+    m_wakeEvents.erase(
+        std::remove(m_wakeEvents.begin(), m_wakeEvents.end(), wakeEvent),
+        m_wakeEvents.end());
+}
+
+// Must be called with m_mutex held
+void WorkerThreadSynch::WakeThreads()
+{
+    vector<HANDLE>::const_iterator it;
+    for (it = m_wakeEvents.begin(); it != m_wakeEvents.end(); it++)
+    {
+        SetEvent(*it);
+    }
 }
 
 void WorkerThreadSynch::ThreadStoppingCleanly(bool clean)
@@ -359,6 +450,7 @@ void WorkerThreadSynch::ThreadStoppingCleanly(bool clean)
     AutoMUTEX lock(m_mutex);
     assert(m_threadCleanStops.size() < m_threadsStartedCounter);
     m_threadCleanStops.push_back(clean);
+    WakeThreads();
 }
 
 bool WorkerThreadSynch::IsThreadStopping() const
@@ -367,12 +459,12 @@ bool WorkerThreadSynch::IsThreadStopping() const
 }
 
 // Does an early return if there's a single unclean stop indicated.
-bool WorkerThreadSynch::BlockUntil_AllThreadsStoppingCleanly()
+bool WorkerThreadSynch::BlockUntil_AllThreadsStoppingCleanly(HANDLE wakeEvent)
 {
     bool allThreadsReporting = false;
     while (!allThreadsReporting)
     {
-        // Keep the mutex lock in a different scope than the sleep.
+        // Keep the mutex lock in a different scope than the wait.
         {
             AutoMUTEX lock(m_mutex);
             allThreadsReporting = 
@@ -388,7 +480,9 @@ bool WorkerThreadSynch::BlockUntil_AllThreadsStoppingCleanly()
             }
         }
 
-        if (!allThreadsReporting) Sleep(100);
+        // Every change to the stop state sets wakeEvent; the timeout is
+        // only a backstop.
+        if (!allThreadsReporting) (void)WaitForSingleObject(wakeEvent, 1000);
     }
 
     return true;
@@ -399,14 +493,15 @@ void WorkerThreadSynch::ThreadReadyForStop()
     AutoMUTEX lock(m_mutex);
     assert(m_threadsReadyToStopCounter < m_threadsStartedCounter);
     m_threadsReadyToStopCounter++;
+    WakeThreads();
 }
 
-void WorkerThreadSynch::BlockUntil_AllThreadsReadyToStop()
+void WorkerThreadSynch::BlockUntil_AllThreadsReadyToStop(HANDLE wakeEvent)
 {
     bool allThreadsReporting = false;
     while (!allThreadsReporting)
     {
-        // Keep the mutex lock in a different scope than the sleep.
+        // Keep the mutex lock in a different scope than the wait.
         {
             AutoMUTEX lock(m_mutex);
             allThreadsReporting = 
@@ -415,7 +510,7 @@ void WorkerThreadSynch::BlockUntil_AllThreadsReadyToStop()
 
         if (!allThreadsReporting)
         {
-            Sleep(100);
+            (void)WaitForSingleObject(wakeEvent, 1000);
         }
     }
 
@@ -33,20 +33,26 @@ public:
 protected:
     friend class IWorkerThread;
 
-    void ThreadStarting();
-    
+    // `wakeEvent` is set whenever another thread changes its stop state,
+    // until ThreadExiting is called.
+    void ThreadStarting(HANDLE wakeEvent);
+    void ThreadExiting(HANDLE wakeEvent);
+
     void ThreadStoppingCleanly(bool clean);
     bool IsThreadStopping() const;
-    bool BlockUntil_AllThreadsStoppingCleanly();
+    bool BlockUntil_AllThreadsStoppingCleanly(HANDLE wakeEvent);
 
     void ThreadReadyForStop();
-    void BlockUntil_AllThreadsReadyToStop();
+    void BlockUntil_AllThreadsReadyToStop(HANDLE wakeEvent);
 
 private:
+    void WakeThreads();
+
     HANDLE m_mutex;
     unsigned int m_threadsStartedCounter;
     unsigned int m_threadsReadyToStopCounter;
     vector<bool> m_threadCleanStops;
+    vector<HANDLE> m_wakeEvents;
 };
 
 
@@ -94,12 +100,25 @@ public:
     };
 
 protected:
-    // Called to do worker set-up before going into busy-wait loop
+    // Called to do worker set-up before going into the wait loop
     virtual bool DoStart() = 0;
 
-    // Called from the busy-wait loop every so often.
+    // Called from the wait loop when one of the handles given by
+    // GetPeriodicCheckHandles is signalled, and otherwise every
+    // GetPeriodicCheckInterval milliseconds.
     virtual bool DoPeriodicCheck() = 0;
 
+    // Adds the handles that should wake the wait loop to call DoPeriodicCheck,
+    // such as a subprocess's output event and process handle. Called once,
+    // after DoStart succeeds. A handle that stays signalled must lead to
+    // DoPeriodicCheck returning false, or the loop will spin.
+    virtual void GetPeriodicCheckHandles(vector<HANDLE>& handles) {}
+
+    // The longest the wait loop waits between calls to DoPeriodicCheck when
+    // none of its handles are signalled. May be INFINITE, if the handles
+    // cover everything that DoPeriodicCheck checks for.
+    virtual DWORD GetPeriodicCheckInterval() const { return 100; }
+
     // Called before stop is full processed. Must not take any destructive
     // actions.
     virtual void StopImminent() = 0;
@@ -117,6 +136,12 @@ protected:
     HANDLE m_startedEvent;
     HANDLE m_stoppedEvent;
 
+    // Auto-reset. Set by the stop signal, by Stop(), and by other synched
+    // threads stopping, so that the thread can wait for any of them. Code
+    // running on the thread (such as DoStart) may also wait on it, but must
+    // check for a stop whenever it's woken.
+    HANDLE m_wakeEvent;
+
     bool m_internalSignalStopFlag;
     StopInfo m_stopInfo;
 
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stdafx.h"
+#include "worker_wait_loop.h"
+#include "logging.h"
+
+#ifndef _WIN32
+#include <chrono>
+#include <climits>
+#include <thread>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+
+static const DWORD FALLBACK_INTERVAL_MILLISECONDS = 100;
+
+
+WorkerWaitLoopResult RunWorkerWaitLoop(
+    WorkerWaitHandle wakeEvent,
+    const vector<WorkerWaitHandle>& handles,
+    DWORD intervalMilliseconds,
+    const function<bool()>& stopping,
+    const function<bool()>& check)
+{
+#ifdef _WIN32
+    vector<HANDLE> waitHandles(1, wakeEvent);
+    waitHandles.insert(waitHandles.end(), handles.begin(), handles.end());
+#else
+    vector<pollfd> waitHandles(1 + handles.size());
+    waitHandles[0].fd = wakeEvent;
+    for (size_t i = 0; i < handles.size(); i++)
+    {
+        waitHandles[i + 1].fd = handles[i];
+    }
+    for (pollfd& waitHandle : waitHandles)
+    {
+        waitHandle.events = POLLIN;
+    }
+#endif
+
+    bool polling = false;
+
+    while (true)
+    {
+        if (stopping())
+        {
+            return WORKER_WAIT_LOOP_STOPPING;
+        }
+
+        if (!check())
+        {
+            return WORKER_WAIT_LOOP_CHECK_FAILED;
+        }
+
+        if (polling)
+        {
+#ifdef _WIN32
+            Sleep(FALLBACK_INTERVAL_MILLISECONDS);
+#else
+            this_thread::sleep_for(chrono::milliseconds(FALLBACK_INTERVAL_MILLISECONDS));
+#endif
+            continue;
+        }
+
+        // Sleep until there's a stop, something for check to handle, or the
+        // interval has elapsed.
+#ifdef _WIN32
+        DWORD waitResult = WaitForMultipleObjects(
+                                (DWORD)waitHandles.size(),
+                                &waitHandles[0],
+                                FALSE, // wait for any handle
+                                intervalMilliseconds);
+
+        if (waitResult == WAIT_FAILED)
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: WaitForMultipleObjects failed (%d)"), __TFUNCTION__, GetLastError());
+            polling = true;
+        }
+#else
+        int timeout = (intervalMilliseconds == INFINITE || intervalMilliseconds > INT_MAX) ? -1 : (int)intervalMilliseconds;
+        int pollResult = poll(&waitHandles[0], waitHandles.size(), timeout);
+
+        if (pollResult < 0 && errno != EINTR)
+        {
+            my_print(NOT_SENSITIVE, true, _T("%s: poll failed (%d)"), __TFUNCTION__, errno);
+            polling = true;
+        }
+        else if (pollResult > 0 && (waitHandles[0].revents & POLLIN))
+        {
+            // Reset the wake event
+            uint64_t count;
+            (void)!read(wakeEvent, &count, sizeof(count));
+        }
+#endif
+    }
+}
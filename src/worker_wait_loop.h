@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2021, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+
+#ifdef _WIN32
+// An event, or other handle, that can be waited on with WaitForMultipleObjects.
+typedef HANDLE WorkerWaitHandle;
+#else
+// A file descriptor that can be waited on with poll, such as an eventfd.
+typedef int WorkerWaitHandle;
+#endif
+
+enum WorkerWaitLoopResult
+{
+    // stopping returned true
+    WORKER_WAIT_LOOP_STOPPING,
+    // check returned false
+    WORKER_WAIT_LOOP_CHECK_FAILED
+};
+
+/*
+IWorkerThread's wait loop.
+
+Until stopping returns true or check returns false, calls check and then
+waits until wakeEvent or one of handles is signalled, or until
+intervalMilliseconds (which may be INFINITE) has elapsed. So a stop, or
+anything else that check handles, is acted on as soon as it's signalled,
+without polling for it.
+
+wakeEvent is auto-reset: on Windows it's an auto-reset event, and elsewhere
+an eventfd that the loop reads when it's woken by it. handles are left for
+check to reset. If waiting fails, the loop falls back to checking every
+100 ms.
+
+Exceptions thrown by stopping or check are passed on.
+*/
+WorkerWaitLoopResult RunWorkerWaitLoop(
+    WorkerWaitHandle wakeEvent,
+    const vector<WorkerWaitHandle>& handles,
+    DWORD intervalMilliseconds,
+    const function<bool()>& stopping,
+    const function<bool()>& check);